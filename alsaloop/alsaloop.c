@@ -32,9 +32,14 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <signal.h>
+#include <stdint.h>
 #include "alsaloop.h"
 #include "os_compat.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 struct loopback_thread {
 	int threaded;
 	pthread_t thread;
@@ -202,6 +207,7 @@ void help(void)
 "-w,--workaround use workaround (serialopen)\n"
 "-U,--xrun      xrun profiling\n"
 "-W,--wake      process wake timeout in ms\n"
+"-k,--split     capture and playback on separate threads\n"
 "-z,--syslog    use syslog for errors\n"
 );
 	printf("\nRecognized sample formats are:");
@@ -386,6 +392,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"workaround", 1, NULL, 'w'},
 		{"xrun", 0, NULL, 'U'},
 		{"syslog", 0, NULL, 'z'},
+		{"split", 0, NULL, 'k'},
 		{NULL, 0, NULL, 0},
 	};
 	int err, morehelp;
@@ -419,12 +426,13 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	int arg_ossmixers_count = 0;
 	int arg_xrun = arg_default_xrun;
 	int arg_wake = arg_default_wake;
+	int arg_split = 0;
 
 	morehelp = 0;
 	while (1) {
 		int c;
 		if ((c = getopt_long(argc, argv,
-				"hdg:P:C:X:Y:x:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:z",
+				"hdg:P:C:X:Y:x:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:zk",
 				long_option, NULL)) < 0)
 			break;
 		switch (c) {
@@ -587,6 +595,9 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'z':
 			enable_syslog();
 			break;
+		case 'k':
+			arg_split = 1;
+			break;
 		}
 	}
 
@@ -626,6 +637,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		loop->thread = arg_thread;
 		loop->xrun = arg_xrun;
 		loop->wake = arg_wake;
+		loop->split = arg_split;
 		err = add_mixers(loop, arg_mixers, arg_mixers_count);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to add mixer controls.\n");
@@ -669,7 +681,7 @@ static int parse_config_file(const char *file, snd_output_t *output)
 		if (fgets(line, sizeof(line)-1, fp) == NULL)
 			break;
 		line[sizeof(line)-1] = '\0';
-		my_argv = realloc(my_argv, my_argc + MAX_ARGS * sizeof(char *));
+		my_argv = realloc(my_argv, (my_argc + MAX_ARGS) * sizeof(char *));
 		if (my_argv == NULL)
 			return -ENOMEM;
 		argv = my_argv + my_argc;
@@ -722,38 +734,193 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	return err;
 }
 
-static void thread_job1(void *_data)
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Descriptors of all loopbacks of the thread are kept in one epoll set.
+ * Each event refers to its loopback and to the slot in the layout of
+ * pcmjob_pollfds_init(), so only ready loopbacks are handled. The set of
+ * a loopback is rebuilt only when its streams were stopped or started.
+ * A loopback with the wake timeout is handled also when it was not ready
+ * for the timeout, regardless of the other loopbacks of the thread.
+ */
+struct loopback_pollfds {
+	struct pollfd *fds;
+	int size;		/* allocated slots */
+	int count;		/* slots registered in the epoll set */
+	unsigned int gen;	/* pollfd_gen of the registered slots */
+	int ready;
+	struct timeval last;	/* the last time of handling */
+};
+
+static int pollfds_update(int epfd, struct loopback *loop,
+			  struct loopback_pollfds *pfds, int index)
 {
-	struct loopback_thread *thread = _data;
-	snd_output_t *output = thread->output;
-	struct pollfd *pfds = NULL;
-	int pfds_count = 0;
-	int i, j, err, wake = 1000000;
+	struct epoll_event ev;
+	struct pollfd *fds;
+	int i, err;
 
-	setscheduler();
+	for (i = 0; i < pfds->count; i++)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, pfds->fds[i].fd, NULL);
+	pfds->count = 0;
+	pfds->gen = loop->pollfd_gen;
+	if (loop->pollfd_count > pfds->size) {
+		fds = realloc(pfds->fds, loop->pollfd_count * sizeof(*fds));
+		if (fds == NULL)
+			return -ENOMEM;
+		pfds->fds = fds;
+		pfds->size = loop->pollfd_count;
+	}
+	err = pcmjob_pollfds_init(loop, pfds->fds);
+	if (err < 0)
+		return err;
+	for (i = 0; i < err; i++) {
+		pfds->fds[i].revents = 0;
+		ev.events = pfds->fds[i].events;
+		ev.data.u64 = ((uint64_t)index << 32) | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pfds->fds[i].fd, &ev) < 0)
+			return -errno;
+		pfds->count++;
+	}
+	return 0;
+}
+
+/* milliseconds till the first wake timeout of loopbacks, or -1 */
+static int thread_wake_timeout(struct loopback_thread *thread,
+			       struct loopback_pollfds *pfds,
+			       struct timeval *now)
+{
+	struct loopback *loop;
+	long timeout = -1, t;
+	int i;
 
 	for (i = 0; i < thread->loopbacks_count; i++) {
-		err = pcmjob_init(thread->loopbacks[i]);
+		loop = thread->loopbacks[i];
+		if (loop->wake == 0 || pfds[i].count == 0)
+			continue;
+		t = (long)loop->wake - timediff(*now, pfds[i].last) / 1000;
+		if (t < 0)
+			t = 0;
+		if (timeout < 0 || t < timeout)
+			timeout = t;
+	}
+	return timeout;
+}
+
+static void thread_loop(struct loopback_thread *thread, int wake)
+{
+	snd_output_t *output = thread->output;
+	struct loopback_pollfds *pfds;
+	struct epoll_event *events = NULL;
+	struct loopback *loop;
+	struct timeval now;
+	int *ready;
+	int epfd, i, j, k, l, n, size, err, events_size = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	pfds = calloc(thread->loopbacks_count, sizeof(*pfds));
+	ready = calloc(thread->loopbacks_count, sizeof(*ready));
+	if (epfd < 0 || pfds == NULL || ready == NULL) {
+		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
+		my_exit(thread, EXIT_FAILURE);
+	}
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		err = pollfds_update(epfd, thread->loopbacks[i], &pfds[i], i);
 		if (err < 0) {
-			logit(LOG_CRIT, "Loopback initialization failure.\n");
+			logit(LOG_CRIT, "Poll FD initialization failed.\n");
 			my_exit(thread, EXIT_FAILURE);
 		}
 	}
-	for (i = 0; i < thread->loopbacks_count; i++) {
-		err = pcmjob_start(thread->loopbacks[i]);
-		if (err < 0) {
-			logit(LOG_CRIT, "Loopback start failure.\n");
+	gettimeofday(&now, NULL);
+	for (i = 0; i < thread->loopbacks_count; i++)
+		pfds[i].last = now;
+	while (!quit) {
+		struct timeval tv1, tv2;
+		for (i = size = 0; i < thread->loopbacks_count; i++)
+			size += pfds[i].count;
+		if (size > events_size) {
+			free(events);
+			events = calloc(size, sizeof(*events));
+			if (events == NULL) {
+				logit(LOG_CRIT, "Poll FDs allocation failed.\n");
+				my_exit(thread, EXIT_FAILURE);
+			}
+			events_size = size;
+		}
+		gettimeofday(&now, NULL);
+		wake = thread_wake_timeout(thread, pfds, &now);
+		if (verbose > 10)
+			gettimeofday(&tv1, NULL);
+		n = epoll_wait(epfd, events, events_size > 0 ? events_size : 1,
+			       wake);
+		if (n < 0)
+			n = -errno;
+		if (verbose > 10) {
+			gettimeofday(&tv2, NULL);
+			snd_output_printf(output, "pool took %lius\n", timediff(tv2, tv1));
+		}
+		if (n < 0) {
+			if (n == -EINTR || n == -ERESTART)
+				continue;
+			logit(LOG_CRIT, "Poll failed: %s\n", strerror(-n));
 			my_exit(thread, EXIT_FAILURE);
 		}
-		pfds_count += thread->loopbacks[i]->pollfd_count;
-		j = thread->loopbacks[i]->wake;
-		if (j > 0 && j < wake)
-			wake = j;
+		j = 0;
+		for (k = 0; k < n; k++) {
+			i = events[k].data.u64 >> 32;
+			pfds[i].fds[(uint32_t)events[k].data.u64].revents =
+							events[k].events;
+			if (!pfds[i].ready) {
+				pfds[i].ready = 1;
+				ready[j++] = i;
+			}
+		}
+		/* loopbacks not handled for their wake timeout */
+		gettimeofday(&now, NULL);
+		for (i = 0; i < thread->loopbacks_count; i++) {
+			loop = thread->loopbacks[i];
+			if (pfds[i].ready || loop->wake == 0 ||
+			    pfds[i].count == 0)
+				continue;
+			if (timediff(now, pfds[i].last) >= (long)loop->wake * 1000) {
+				pfds[i].ready = 1;
+				ready[j++] = i;
+			}
+		}
+		for (k = 0; k < j; k++) {
+			i = ready[k];
+			loop = thread->loopbacks[i];
+			pfds[i].last = now;
+			err = pcmjob_pollfds_handle(loop, pfds[i].fds);
+			if (err < 0) {
+				logit(LOG_CRIT, "pcmjob failed.\n");
+				exit(EXIT_FAILURE);
+			}
+			pfds[i].ready = 0;
+			if (pfds[i].gen != loop->pollfd_gen) {
+				err = pollfds_update(epfd, loop, &pfds[i], i);
+				if (err < 0) {
+					logit(LOG_CRIT, "Poll FD initialization failed.\n");
+					my_exit(thread, EXIT_FAILURE);
+				}
+				continue;
+			}
+			for (l = 0; l < pfds[i].count; l++)
+				pfds[i].fds[l].revents = 0;
+		}
 	}
-	if (wake >= 1000000)
-		wake = -1;
+}
+#else
+static void thread_loop(struct loopback_thread *thread, int wake)
+{
+	snd_output_t *output = thread->output;
+	struct pollfd *pfds = NULL;
+	int pfds_count = 0;
+	int i, j, err;
+
+	for (i = 0; i < thread->loopbacks_count; i++)
+		pfds_count += thread->loopbacks[i]->pollfd_count;
 	pfds = calloc(pfds_count, sizeof(struct pollfd));
-	if (pfds == NULL || pfds_count <= 0) {
+	if (pfds == NULL) {
 		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
 		my_exit(thread, EXIT_FAILURE);
 	}
@@ -784,7 +951,7 @@ static void thread_job1(void *_data)
 		}
 		for (i = j = 0; i < thread->loopbacks_count; i++) {
 			struct loopback *loop = thread->loopbacks[i];
-			if (j < loop->active_pollfd_count) {
+			if (loop->active_pollfd_count > 0) {
 				err = pcmjob_pollfds_handle(loop, &pfds[j]);
 				if (err < 0) {
 					logit(LOG_CRIT, "pcmjob failed.\n");
@@ -794,6 +961,42 @@ static void thread_job1(void *_data)
 			j += loop->active_pollfd_count;
 		}
 	}
+}
+#endif
+
+static void thread_job1(void *_data)
+{
+	struct loopback_thread *thread = _data;
+	int pfds_count = 0;
+	int i, j, err, wake = 1000000;
+
+	setscheduler();
+
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		err = pcmjob_init(thread->loopbacks[i]);
+		if (err < 0) {
+			logit(LOG_CRIT, "Loopback initialization failure.\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		err = pcmjob_start(thread->loopbacks[i]);
+		if (err < 0) {
+			logit(LOG_CRIT, "Loopback start failure.\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
+		pfds_count += thread->loopbacks[i]->pollfd_count;
+		j = thread->loopbacks[i]->wake;
+		if (j > 0 && j < wake)
+			wake = j;
+	}
+	if (wake >= 1000000)
+		wake = -1;
+	if (pfds_count <= 0) {
+		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
+		my_exit(thread, EXIT_FAILURE);
+	}
+	thread_loop(thread, wake);
 
 	my_exit(thread, EXIT_SUCCESS);
 }
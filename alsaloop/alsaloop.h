@@ -19,6 +19,7 @@
  */
 
 #include "aconfig.h"
+#include <pthread.h>
 #ifdef HAVE_SAMPLERATE_H
 #define USE_SAMPLERATE
 #include <samplerate.h>
@@ -130,6 +131,46 @@ struct loopback_handle {
 	char *prateshift_name; /* ascii name for the playback rate shift ctl elem */
 };
 
+/*
+ * Single producer (capture thread), single consumer (playback thread) ring
+ * for the split mode. The frames are stored in the I/O buffer shared by
+ * both handles, head and tail are free running counters in frames.
+ */
+struct loopback_ring {
+	snd_pcm_uframes_t size;		/* in frames, power of two */
+	/* capture thread */
+	snd_pcm_uframes_t head __attribute__((aligned(64)));
+	unsigned long overflows;	/* times the ring got full */
+	unsigned long capt_xruns;
+	/* playback thread */
+	snd_pcm_uframes_t tail __attribute__((aligned(64)));
+	unsigned long waits;		/* waits for an empty ring */
+	unsigned long dropped;		/* frames dropped to restore latency */
+	unsigned long play_xruns;
+	snd_pcm_uframes_t fill_last;
+	snd_pcm_uframes_t fill_min;	/* fill level since the last report */
+	snd_pcm_uframes_t fill_max;
+	unsigned long long fill_sum;
+	unsigned long long fill_count;
+	snd_pcm_uframes_t report;	/* frames played since the last report */
+};
+
+struct loopback_split {
+	unsigned int initialized:1;
+	unsigned int started:1;
+	pthread_t capt_thread;
+	pthread_t play_thread;
+	int quit;
+	int err;			/* the first error of threads */
+	int waiting;			/* playback thread waits for data */
+	int wakefd[2];			/* wakes the job thread */
+	int datafd[2];			/* wakes the playback thread */
+	snd_pcm_sframes_t cdelay;	/* capture delay for sync */
+	pthread_mutex_t ctl_lock;	/* ctl handles used by both threads */
+	char *silence;			/* one playback period of silence */
+	struct loopback_ring ring;
+};
+
 struct loopback {
 	char *id;
 	struct loopback_handle *capt;
@@ -143,15 +184,18 @@ struct loopback {
 	snd_output_t *state;
 	int pollfd_count;
 	int active_pollfd_count;
+	unsigned int pollfd_gen;	/* changed with poll descriptors */
 	unsigned int linked:1;		/* linked streams */
-	unsigned int reinit:1;
 	unsigned int running:1;
-	unsigned int stop_pending:1;
+	unsigned int split:1;		/* capture and playback threads */
+	unsigned int reinit;		/* set by split threads, too */
+	unsigned int stop_pending;
 	snd_pcm_uframes_t stop_count;
 	sync_type_t sync;		/* type of sync */
 	slave_type_t slave;
 	int thread;			/* thread number */
 	unsigned int wake;
+	struct loopback_split splitter;
 	/* statistics */
 	double pitch;
 	double pitch_delta;
@@ -26,6 +26,9 @@
 #include <string.h>
 #include <sched.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <getopt.h>
 #include <alsa/asoundlib.h>
 #include <sys/time.h>
@@ -36,6 +39,7 @@
 #include "os_compat.h"
 
 #define XRUN_PROFILE_UNKNOWN (-10000000)
+#define SPLIT_POLL_TIMEOUT	100	/* in ms */
 
 static int set_rate_shift(struct loopback_handle *lhandle, double pitch);
 static int get_rate(struct loopback_handle *lhandle);
@@ -641,6 +645,30 @@ static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 	}
 }
 
+static void split_wake(int fd)
+{
+	char c = 0;
+
+	/* a full pipe wakes the reader anyway */
+	if (write(fd, &c, 1) < 0 && errno != EAGAIN)
+		logit(LOG_WARNING, "split wake failed: %s\n", strerror(errno));
+}
+
+static void split_drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void reinit_request(struct loopback *loop)
+{
+	__atomic_store_n(&loop->reinit, 1, __ATOMIC_RELEASE);
+	if (loop->split)
+		split_wake(loop->splitter.wakefd[1]);
+}
+
 static int xrun(struct loopback_handle *lhandle)
 {
 	int err;
@@ -690,7 +718,7 @@ static int readit(struct loopback_handle *lhandle)
 		avail = buf_avail(lhandle);
 	} else if (avail == 0) {
 		if (snd_pcm_state(lhandle->handle) == SND_PCM_STATE_DRAINING) {
-			lhandle->loopback->reinit = 1;
+			reinit_request(lhandle->loopback);
 			return 0;
 		}
 	}
@@ -787,7 +815,7 @@ static int writeit(struct loopback_handle *lhandle)
 			if (lhandle->loopback->stop_count * lhandle->pitch >
 			    lhandle->loopback->latency * 3) {
 				lhandle->loopback->stop_pending = 0;
-				lhandle->loopback->reinit = 1;
+				reinit_request(lhandle->loopback);
 				break;
 			}
 		}
@@ -1373,6 +1401,522 @@ static int init_handle(struct loopback_handle *lhandle, int alloc)
 	return 0;
 }
 
+static void sync_pitch(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_sframes_t diff, lat = get_whole_latency(loop);
+
+	diff = ((double)(((double)play->total_queued * play->pitch) +
+			 ((double)capt->total_queued * capt->pitch)) /
+		(double)loop->total_queued_count) - lat;
+	/* FIXME: this algorithm may be slightly better */
+	if (verbose > 3)
+		snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
+	if (diff > 0) {
+		if (diff == loop->pitch_diff)
+			loop->pitch += loop->pitch_delta;
+		else if (diff > loop->pitch_diff)
+			loop->pitch += loop->pitch_delta*2;
+	} else if (diff < 0) {
+		if (diff == loop->pitch_diff)
+			loop->pitch -= loop->pitch_delta;
+		else if (diff < loop->pitch_diff)
+			loop->pitch -= loop->pitch_delta*2;
+	}
+	loop->pitch_diff = diff;
+	if (loop->pitch_diff_min > diff)
+		loop->pitch_diff_min = diff;
+	if (loop->pitch_diff_max < diff)
+		loop->pitch_diff_max = diff;
+	update_pitch(loop);
+	play->total_queued = 0;
+	capt->total_queued = 0;
+	loop->total_queued_count = 0;
+}
+
+static void sync_queued(struct loopback *loop,
+			snd_pcm_sframes_t pqueued,
+			snd_pcm_sframes_t cqueued)
+{
+	if (verbose > 4)
+		snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
+	if (pqueued > 0)
+		loop->play->total_queued += pqueued;
+	if (cqueued > 0)
+		loop->capt->total_queued += cqueued;
+	if (pqueued > 0 || cqueued > 0)
+		loop->total_queued_count += 1;
+}
+
+/*
+ * Split mode: capture and playback of one loopback run on own threads,
+ * so a playback device blocking in the write does not overrun the capture
+ * device. The I/O buffer shared by both handles is a lock-free ring, the
+ * capture thread moves only its head and the playback thread only its
+ * tail. The job thread keeps handling ctl events and restarts the streams
+ * when a thread requests it.
+ */
+
+static inline snd_pcm_uframes_t ring_fill(struct loopback_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static void ring_stats(struct loopback_ring *ring, snd_pcm_uframes_t fill)
+{
+	if (ring->fill_count == 0 || ring->fill_min > fill)
+		ring->fill_min = fill;
+	if (ring->fill_max < fill)
+		ring->fill_max = fill;
+	ring->fill_sum += fill;
+	ring->fill_count++;
+	ring->fill_last = fill;
+}
+
+static void split_show(struct loopback *loop, snd_output_t *out)
+{
+	struct loopback_ring *ring = &loop->splitter.ring;
+	unsigned long avg = 0;
+
+	if (ring->fill_count > 0)
+		avg = ring->fill_sum / ring->fill_count;
+	snd_output_printf(out, "%s: ring size = %li, fill = %li, min = %li, avg = %lu, max = %li\n",
+			  loop->id, ring->size, ring->fill_last,
+			  ring->fill_min, avg, ring->fill_max);
+	snd_output_printf(out, "%s: ring overflows = %lu, waits = %lu, dropped = %lu, xruns = %lu/%lu\n",
+			  loop->id, ring->overflows,
+			  ring->waits, ring->dropped,
+			  ring->capt_xruns, ring->play_xruns);
+}
+
+static void split_fail(struct loopback *loop, int err)
+{
+	int none = 0;
+
+	__atomic_compare_exchange_n(&loop->splitter.err, &none, err, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	split_wake(loop->splitter.wakefd[1]);
+}
+
+static inline int split_running(struct loopback *loop)
+{
+	return !__atomic_load_n(&loop->splitter.quit, __ATOMIC_ACQUIRE) &&
+	       !__atomic_load_n(&loop->reinit, __ATOMIC_ACQUIRE);
+}
+
+static void split_thread_init(struct loopback *loop, const char *name)
+{
+	struct sched_param sched_param;
+	sigset_t mask;
+	int err;
+
+	/* signals are handled by the job threads */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	sched_param.sched_priority = sched_get_priority_max(SCHED_RR);
+	err = pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
+	if (err && verbose)
+		logit(LOG_INFO, "%s: %s thread priority %i FAILED: %s\n", loop->id, name, sched_param.sched_priority, strerror(err));
+}
+
+static int split_poll(struct loopback_handle *lhandle, struct pollfd *pfds)
+{
+	unsigned short revents;
+	int err;
+
+	err = poll(pfds, lhandle->pollfd_count, SPLIT_POLL_TIMEOUT);
+	if (err < 0)
+		return errno == EINTR ? 0 : -errno;
+	err = snd_pcm_poll_descriptors_revents(lhandle->handle, pfds,
+					       lhandle->pollfd_count, &revents);
+	if (err < 0)
+		return err;
+	return revents;
+}
+
+static void *split_capture_thread(void *arg)
+{
+	struct loopback *loop = arg;
+	struct loopback_split *split = &loop->splitter;
+	struct loopback_ring *ring = &split->ring;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_uframes_t head, over;
+	snd_pcm_sframes_t delay;
+	struct pollfd *pfds;
+	struct timespec ts;
+	int full = 0;
+	int err;
+
+	split_thread_init(loop, "capture");
+	pfds = alloca(sizeof(*pfds) * capt->pollfd_count);
+	err = snd_pcm_poll_descriptors(capt->handle, pfds, capt->pollfd_count);
+	if (err < 0)
+		goto __error;
+	while (split_running(loop)) {
+		err = split_poll(capt, pfds);
+		if (err < 0)
+			goto __error;
+		head = ring->head;
+		capt->buf_pos = head & (ring->size - 1);
+		capt->buf_count = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		over = capt->buf_over;
+		err = readit(capt);
+		if (err < 0)
+			goto __error;
+		if (err > 0) {
+			__atomic_store_n(&ring->head, head + err, __ATOMIC_RELEASE);
+			/* pairs with the fence in split_wait() */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_exchange_n(&split->waiting, 0, __ATOMIC_ACQ_REL))
+				split_wake(split->datafd[1]);
+		}
+		if (capt->xrun_pending) {
+			capt->xrun_pending = 0;
+			ring->capt_xruns++;
+			if ((err = snd_pcm_prepare(capt->handle)) < 0)
+				goto __error;
+			if ((err = snd_pcm_start(capt->handle)) < 0)
+				goto __error;
+		} else if (capt->buf_over != over) {
+			/*
+			 * The frames left in the capture buffer are read later,
+			 * so count the overflow once till the ring drains.
+			 */
+			capt->buf_over = over;
+			if (!full)
+				ring->overflows++;
+			full = 1;
+			/* the playback thread is late, give it a period */
+			ts.tv_sec = 0;
+			ts.tv_nsec = (long long)capt->period_size * 1000000000LL / capt->rate;
+			nanosleep(&ts, NULL);
+		} else {
+			full = 0;
+		}
+		if (loop->sync != SYNC_TYPE_NONE &&
+		    snd_pcm_delay(capt->handle, &delay) >= 0)
+			__atomic_store_n(&split->cdelay, delay, __ATOMIC_RELAXED);
+	}
+	return NULL;
+      __error:
+	logit(LOG_CRIT, "%s: capture thread failed: %s\n", capt->id, snd_strerror(err));
+	split_fail(loop, err);
+	return NULL;
+}
+
+static void split_wait(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+	struct pollfd pfd;
+
+	split->ring.waits++;
+	__atomic_store_n(&split->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ring_fill(&split->ring) == 0 && split_running(loop)) {
+		pfd.fd = split->datafd[0];
+		pfd.events = POLLIN;
+		poll(&pfd, 1, SPLIT_POLL_TIMEOUT);
+	}
+	__atomic_store_n(&split->waiting, 0, __ATOMIC_RELAXED);
+	split_drain(split->datafd[0]);
+}
+
+static int split_write(struct loopback *loop)
+{
+	struct loopback_ring *ring = &loop->splitter.ring;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t tail = ring->tail;
+	int res;
+
+	play->buf_pos = tail & (ring->size - 1);
+	play->buf_count = ring_fill(ring);
+	res = writeit(play);
+	if (res > 0) {
+		__atomic_store_n(&ring->tail, tail + res, __ATOMIC_RELEASE);
+		ring->report += res;
+	}
+	return res;
+}
+
+static int split_playback_xrun(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+	struct loopback_ring *ring = &split->ring;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_sframes_t fill, target, r;
+	int err;
+
+	play->xrun_pending = 0;
+	ring->play_xruns++;
+	if ((err = snd_pcm_prepare(play->handle)) < 0) {
+		logit(LOG_CRIT, "%s prepare failed: %s\n", play->id, snd_strerror(err));
+		return err;
+	}
+	/* queue the requested latency again, drop the oldest frames or
+	   fill silence ahead of them */
+	target = get_whole_latency(loop) / play->pitch -
+		 __atomic_load_n(&split->cdelay, __ATOMIC_RELAXED);
+	if (target > play->buffer_size)
+		target = play->buffer_size;
+	if (target < 0)
+		target = 0;
+	fill = ring_fill(ring);
+	if (fill > target) {
+		__atomic_store_n(&ring->tail, ring->tail + fill - target,
+				 __ATOMIC_RELEASE);
+		ring->dropped += fill - target;
+		fill = target;
+	}
+	if (verbose > 6)
+		snd_output_printf(loop->output,
+			"%s: split xrun, silence filling %li / ring fill=%li\n",
+			play->id, (long)(target - fill), (long)fill);
+	for (target -= fill; target > 0; target -= r) {
+		r = target;
+		if (r > play->period_size)
+			r = play->period_size;
+		r = snd_pcm_writei(play->handle, split->silence, r);
+		if (r == -EAGAIN)
+			break;
+		if (r < 0)
+			return r;
+	}
+	r = split_write(loop);
+	if (r < 0)
+		return r;
+	if ((err = snd_pcm_start(play->handle)) < 0) {
+		logit(LOG_CRIT, "%s start failed: %s\n", play->id, snd_strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+static void split_sync(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_sframes_t pqueued, cqueued;
+
+	if (snd_pcm_delay(play->handle, &pqueued) < 0)
+		return;
+	play->last_delay = pqueued;
+	pqueued += ring_fill(&split->ring);
+	cqueued = __atomic_load_n(&split->cdelay, __ATOMIC_RELAXED);
+	loop->capt->last_delay = cqueued;
+	sync_queued(loop, pqueued, cqueued);
+	if (play->counter < play->sync_point || loop->total_queued_count == 0)
+		return;
+	/* the rate shift ctl may be just used by the job thread */
+	if (pthread_mutex_trylock(&split->ctl_lock))
+		return;
+	sync_pitch(loop);
+	pthread_mutex_unlock(&split->ctl_lock);
+	play->counter -= play->sync_point;
+}
+
+static void *split_playback_thread(void *arg)
+{
+	struct loopback *loop = arg;
+	struct loopback_ring *ring = &loop->splitter.ring;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t fill;
+	struct pollfd *pfds;
+	int err;
+
+	split_thread_init(loop, "playback");
+	pfds = alloca(sizeof(*pfds) * play->pollfd_count);
+	err = snd_pcm_poll_descriptors(play->handle, pfds, play->pollfd_count);
+	if (err < 0)
+		goto __error;
+	while (split_running(loop)) {
+		if (play->xrun_pending) {
+			err = split_playback_xrun(loop);
+			if (err < 0)
+				goto __error;
+		}
+		fill = ring_fill(ring);
+		ring_stats(ring, fill);
+		if (fill == 0) {
+			split_wait(loop);
+			continue;
+		}
+		err = split_poll(play, pfds);
+		if (err < 0)
+			goto __error;
+		err = split_write(loop);
+		if (err < 0)
+			goto __error;
+		if (loop->sync != SYNC_TYPE_NONE)
+			split_sync(loop);
+		if (ring->report >= play->sync_point) {
+			if (verbose > 1)
+				split_show(loop, loop->output);
+			ring->report = 0;
+			ring->fill_count = 0;
+			ring->fill_sum = 0;
+			ring->fill_max = 0;
+		}
+	}
+	return NULL;
+      __error:
+	logit(LOG_CRIT, "%s: playback thread failed: %s\n", play->id, snd_strerror(err));
+	split_fail(loop, err);
+	return NULL;
+}
+
+static int split_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+		return -errno;
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	return 0;
+}
+
+static int split_init(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+	int err;
+
+	if (!loop->split || split->initialized)
+		return 0;
+	if ((err = split_pipe(split->wakefd)) < 0)
+		return err;
+	if ((err = split_pipe(split->datafd)) < 0) {
+		close(split->wakefd[0]);
+		close(split->wakefd[1]);
+		return err;
+	}
+	pthread_mutex_init(&split->ctl_lock, NULL);
+	split->initialized = 1;
+	return 0;
+}
+
+static void split_done(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+
+	if (!split->initialized)
+		return;
+	pthread_mutex_destroy(&split->ctl_lock);
+	close(split->wakefd[0]);
+	close(split->wakefd[1]);
+	close(split->datafd[0]);
+	close(split->datafd[1]);
+	split->initialized = 0;
+}
+
+/* both handles use one ring large enough for both I/O buffers */
+static int split_init_buffer(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_uframes_t size;
+	int err;
+
+	if (play->format != capt->format ||
+	    play->channels != capt->channels ||
+	    play->rate != capt->rate ||
+	    loop->sync == SYNC_TYPE_SAMPLERATE) {
+		logit(LOG_CRIT, "%s: split mode requires the same format, rate and channels without samplerate conversion\n", loop->id);
+		return -EINVAL;
+	}
+	if ((err = init_handle(play, 0)) < 0)
+		return err;
+	if ((err = init_handle(capt, 0)) < 0)
+		return err;
+	for (size = 1; size < play->buf_size + capt->buf_size; size <<= 1)
+		;
+	play->buf = calloc(size, play->frame_size);
+	if (play->buf == NULL)
+		return -ENOMEM;
+	capt->buf = play->buf;
+	play->buf_size = capt->buf_size = size;
+	memset(&loop->splitter.ring, 0, sizeof(loop->splitter.ring));
+	loop->splitter.ring.size = size;
+	return 0;
+}
+
+static void split_stop(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+
+	if (!split->started)
+		return;
+	__atomic_store_n(&split->quit, 1, __ATOMIC_RELEASE);
+	split_wake(split->datafd[1]);
+	pthread_join(split->capt_thread, NULL);
+	pthread_join(split->play_thread, NULL);
+	split->started = 0;
+	free(split->silence);
+	split->silence = NULL;
+	split_drain(split->datafd[0]);
+	split_drain(split->wakefd[0]);
+}
+
+static int split_start(struct loopback *loop)
+{
+	struct loopback_split *split = &loop->splitter;
+	struct loopback_handle *play = loop->play;
+	int err;
+
+	split->quit = 0;
+	split->err = 0;
+	split->waiting = 0;
+	split->cdelay = 0;
+	split->silence = malloc(play->period_size * play->frame_size);
+	if (split->silence == NULL)
+		return -ENOMEM;
+	err = snd_pcm_format_set_silence(play->format, split->silence,
+					 play->period_size * play->channels);
+	if (err < 0)
+		goto __error;
+	err = -pthread_create(&split->capt_thread, NULL,
+			      split_capture_thread, loop);
+	if (err < 0)
+		goto __error;
+	err = -pthread_create(&split->play_thread, NULL,
+			      split_playback_thread, loop);
+	if (err < 0) {
+		__atomic_store_n(&split->quit, 1, __ATOMIC_RELEASE);
+		pthread_join(split->capt_thread, NULL);
+		goto __error;
+	}
+	split->started = 1;
+	return 0;
+      __error:
+	free(split->silence);
+	split->silence = NULL;
+	return err;
+}
+
+static int split_handle(struct loopback *loop, unsigned short revents)
+{
+	int err;
+
+	if ((revents & POLLIN) == 0)
+		return 0;
+	split_drain(loop->splitter.wakefd[0]);
+	err = __atomic_load_n(&loop->splitter.err, __ATOMIC_ACQUIRE);
+	if (err < 0)
+		return err;
+	if (loop->reinit) {
+		err = pcmjob_stop(loop);
+		if (err < 0)
+			return err;
+		err = pcmjob_start(loop);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
 int pcmjob_init(struct loopback *loop)
 {
 	int err;
@@ -1384,6 +1928,8 @@ int pcmjob_init(struct loopback *loop)
 #ifdef FILE_PWRITE
 	loop->pfile = fopen(FILE_PWRITE, "w+");
 #endif
+	if ((err = split_init(loop)) < 0)
+		goto __error;
 	if ((err = openit(loop->play)) < 0)
 		goto __error;
 	if ((err = openit(loop->capt)) < 0)
@@ -1396,11 +1942,15 @@ int pcmjob_init(struct loopback *loop)
 	if (loop->sync == SYNC_TYPE_AUTO && (loop->play->ctl_rate_shift || loop->play->ctl_pitch))
 		loop->sync = SYNC_TYPE_PLAYRATESHIFT;
 #ifdef USE_SAMPLERATE
-	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable)
+	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable && !loop->split)
 		loop->sync = SYNC_TYPE_SAMPLERATE;
 #endif
 	if (loop->sync == SYNC_TYPE_AUTO)
 		loop->sync = SYNC_TYPE_SIMPLE;
+	if (loop->split && loop->xrun) {
+		logit(LOG_WARNING, "%s: xrun profiling is not supported in split mode\n", loop->id);
+		loop->xrun = 0;
+	}
 	if (loop->slave == SLAVE_TYPE_AUTO &&
 	    loop->capt->ctl_notify &&
 	    loop->capt->ctl_active &&
@@ -1449,10 +1999,12 @@ static void freeloop(struct loopback *loop)
 
 int pcmjob_done(struct loopback *loop)
 {
+	split_stop(loop);
 	control_done(loop);
 	closeit(loop->play);
 	closeit(loop->capt);
 	freeloop(loop);
+	split_done(loop);
 	free(loop->id);
 	loop->id = NULL;
 #ifdef FILE_PWRITE
@@ -1500,6 +2052,7 @@ int pcmjob_start(struct loopback *loop)
 	snd_pcm_uframes_t count;
 	int err;
 
+	loop->pollfd_gen++;
 	loop->pollfd_count = loop->play->ctl_pollfd_count +
 			     loop->capt->ctl_pollfd_count;
 	if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
@@ -1510,6 +2063,11 @@ int pcmjob_start(struct loopback *loop)
 		goto __error;
 	loop->capt->pollfd_count = err;
 	loop->pollfd_count += err;
+	/* PCM descriptors are polled by split threads, the job thread
+	   waits for their requests only */
+	if (loop->split)
+		loop->pollfd_count = loop->play->ctl_pollfd_count +
+				     loop->capt->ctl_pollfd_count + 1;
 	if (loop->slave == SLAVE_TYPE_ON) {
 		err = get_active(loop->capt);
 		if (err < 0)
@@ -1543,11 +2101,14 @@ __again:
 		goto __error;
 	if (verbose)
 		showlatency(loop->output, loop->latency, loop->play->rate_req, "Latency");
-	if (loop->play->access == loop->capt->access &&
-	    loop->play->format == loop->capt->format &&
-	    loop->play->rate == loop->capt->rate &&
-	    loop->play->channels == loop->capt->channels &&
-	    loop->sync != SYNC_TYPE_SAMPLERATE) {
+	if (loop->split) {
+		if ((err = split_init_buffer(loop)) < 0)
+			goto __error;
+	} else if (loop->play->access == loop->capt->access &&
+		   loop->play->format == loop->capt->format &&
+		   loop->play->rate == loop->capt->rate &&
+		   loop->play->channels == loop->capt->channels &&
+		   loop->sync != SYNC_TYPE_SAMPLERATE) {
 		if (verbose > 1)
 			snd_output_printf(loop->output, "shared buffer!!!\n");
 		if ((err = init_handle(loop->play, 1)) < 0)
@@ -1695,6 +2256,10 @@ __again:
 			goto __error;
 		}
 	}
+	if (loop->split && (err = split_start(loop)) < 0) {
+		logit(LOG_CRIT, "%s: split threads start error: %s\n", loop->id, snd_strerror(err));
+		goto __error;
+	}
 	return 0;
       __error:
 	pcmjob_stop(loop);
@@ -1705,6 +2270,8 @@ int pcmjob_stop(struct loopback *loop)
 {
 	int err;
 
+	split_stop(loop);
+	loop->pollfd_gen++;
 	if (loop->running) {
 		if ((err = snd_pcm_drop(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->capt->id, snd_strerror(err));
@@ -1724,7 +2291,12 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 {
 	int err, idx = 0;
 
-	if (loop->running) {
+	if (loop->running && loop->split) {
+		fds[idx].fd = loop->splitter.wakefd[0];
+		fds[idx].events = POLLIN;
+		fds[idx].revents = 0;
+		idx++;
+	} else if (loop->running) {
 		err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
 		if (err < 0)
 			return err;
@@ -1800,6 +2372,8 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 	int err, restart = 0;
 
 	snd_ctl_event_alloca(&ev);
+	if (loop->split)
+		pthread_mutex_lock(&loop->splitter.ctl_lock);
 	while ((err = snd_ctl_read(lhandle->ctl, ev)) != 0 && err != -EAGAIN) {
 		if (err < 0)
 			break;
@@ -1843,6 +2417,8 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 		if (loop->running == 0)
 			restart = 1;
 	}
+	if (loop->split)
+		pthread_mutex_unlock(&loop->splitter.ctl_lock);
 	if (restart) {
 		pcmjob_stop(loop);
 		err = pcmjob_start(loop);
@@ -1856,7 +2432,7 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 {
 	struct loopback_handle *play = loop->play;
 	struct loopback_handle *capt = loop->capt;
-	unsigned short prevents, crevents, events;
+	unsigned short prevents, crevents, wrevents = 0, events;
 	snd_pcm_uframes_t ccount, pcount;
 	int err, loopcount = 0, idx;
 
@@ -1864,7 +2440,7 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		snd_output_printf(loop->output, "%s: pollfds handle\n", loop->id);
 	if (verbose > 13 || loop->xrun)
 		getcurtimestamp(&loop->tstamp_start);
-	if (verbose > 12) {
+	if (verbose > 12 && !loop->split) {
 		snd_pcm_sframes_t pdelay, cdelay;
 		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
 			snd_output_printf(loop->output, "%s: delay error: %s / %li / %li\n", play->id, snd_strerror(err), play->buf_size, play->buf_count);
@@ -1876,7 +2452,10 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 			snd_output_printf(loop->output, "%s: delay %li / %li / %li\n", capt->id, cdelay, capt->buf_size, capt->buf_count);
 	}
 	idx = 0;
-	if (loop->running) {
+	if (loop->running && loop->split) {
+		wrevents = fds[idx++].revents;
+		prevents = crevents = 0;
+	} else if (loop->running) {
 		err = snd_pcm_poll_descriptors_revents(play->handle, fds,
 						       play->pollfd_count,
 						       &prevents);
@@ -1936,6 +2515,12 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		snd_output_printf(loop->output, "%s: prevents = 0x%x, crevents = 0x%x\n", loop->id, prevents, crevents);
 	if (!loop->running)
 		goto __pcm_end;
+	if (loop->split) {
+		err = split_handle(loop, wrevents);
+		if (err < 0)
+			return err;
+		goto __pcm_end;
+	}
 	do {
 		ccount = readit(capt);
 		if (prevents != 0 && crevents == 0 &&
@@ -1978,35 +2563,9 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	if (loop->sync != SYNC_TYPE_NONE &&
 	    play->counter >= play->sync_point &&
 	    capt->counter >= play->sync_point) {
-		snd_pcm_sframes_t diff, lat = get_whole_latency(loop);
-		diff = ((double)(((double)play->total_queued * play->pitch) +
-				 ((double)capt->total_queued * capt->pitch)) /
-			(double)loop->total_queued_count) - lat;
-		/* FIXME: this algorithm may be slightly better */
-		if (verbose > 3)
-			snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
-		if (diff > 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch += loop->pitch_delta;
-			else if (diff > loop->pitch_diff)
-				loop->pitch += loop->pitch_delta*2;
-		} else if (diff < 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta;
-			else if (diff < loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta*2;
-		}
-		loop->pitch_diff = diff;
-		if (loop->pitch_diff_min > diff)
-			loop->pitch_diff_min = diff;
-		if (loop->pitch_diff_max < diff)
-			loop->pitch_diff_max = diff;
-		update_pitch(loop);
+		sync_pitch(loop);
 		play->counter -= play->sync_point;
 		capt->counter -= play->sync_point;
-		play->total_queued = 0;
-		capt->total_queued = 0;
-		loop->total_queued_count = 0;
 	}
 	if (loop->sync != SYNC_TYPE_NONE) {
 		snd_pcm_sframes_t pqueued, cqueued;
@@ -2019,15 +2578,7 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 			cqueued = get_queued_capture_samples(loop);
 			pqueued = get_queued_playback_samples(loop);
 		}
-
-		if (verbose > 4)
-			snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
-		if (pqueued > 0)
-			play->total_queued += pqueued;
-		if (cqueued > 0)
-			capt->total_queued += cqueued;
-		if (pqueued > 0 || cqueued > 0)
-			loop->total_queued_count += 1;
+		sync_queued(loop, pqueued, cqueued);
 	}
 	if (verbose > 12) {
 		snd_pcm_sframes_t pdelay, cdelay;
@@ -2087,6 +2638,8 @@ void pcmjob_state(struct loopback *loop)
 	OUT("  pollfd_count = %i\n", loop->pollfd_count);
 	OUT("  pitch = %.8f, delta = %.8f, diff = %li, min = %li, max = %li\n", loop->pitch, loop->pitch_delta, loop->pitch_diff, loop->pitch_diff_min, loop->pitch_diff_max);
 	OUT("  use_samplerate = %i\n", loop->use_samplerate);
+	if (loop->split)
+		split_show(loop, loop->state);
       __skip:
 	show_handle(loop->play, "playback");
 	show_handle(loop->capt, "capture");
@@ -40,6 +40,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <locale.h>
 #include <alsa/asoundlib.h>
@@ -47,6 +48,7 @@
 #include <termios.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -94,7 +96,8 @@ static snd_pcm_sframes_t (*writen_func)(snd_pcm_t *handle, void **bufs, snd_pcm_
 enum {
 	VUMETER_NONE,
 	VUMETER_MONO,
-	VUMETER_STEREO
+	VUMETER_STEREO,
+	VUMETER_MULTI
 };
 
 static char *command;
@@ -127,6 +130,12 @@ static int monotonic = 0;
 static int interactive = 0;
 static int can_pause = 0;
 static int fatal_errors = 0;
+static unsigned int read_ahead = 0;
+static unsigned int write_behind = 0;
+static int gapless = 0;
+static int mmap_direct = 0;
+static char *xrun_log_name = NULL;
+static unsigned int xrun_log_size = 64;
 static int verbose = 0;
 static int vumeter = VUMETER_NONE;
 static int buffer_pos = 0;
@@ -165,18 +174,26 @@ static void capture(char *filename);
 static void playbackv(char **filenames, unsigned int count);
 static void capturev(char **filenames, unsigned int count);
 
-static void begin_voc(int fd, size_t count);
-static void end_voc(int fd);
-static void begin_wave(int fd, size_t count);
-static void end_wave(int fd);
-static void begin_au(int fd, size_t count);
-static void end_au(int fd);
+static int begin_voc(int fd, size_t count);
+static int end_voc(int fd, off_t count);
+static int begin_wave(int fd, size_t count);
+static int end_wave(int fd, off_t count);
+static int begin_au(int fd, size_t count);
+static int end_au(int fd, off_t count);
 
 static void suspend(void);
+static void gapless_prefetch(const char *name);
+static void gapless_finish(void);
+static void xrun_log_init(void);
+static void xrun_log_dump(void);
+static void setup_vu_meter(void);
+#ifdef CONFIG_SUPPORT_CHMAP
+static void setup_remap(void);
+#endif
 
 static const struct fmt_capture {
-	void (*start) (int fd, size_t count);
-	void (*end) (int fd);
+	int (*start) (int fd, size_t count);
+	int (*end) (int fd, off_t count);
 	char *what;
 	long long max_filesize;
 } fmt_rec_table[] = {
@@ -230,7 +247,7 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "                        (relative to buffer size if <= 0)\n"
 "-T, --stop-delay=#      delay for automatic PCM stop is # microseconds from xrun\n"
 "-v, --verbose           show PCM structure and setup (accumulative)\n"
-"-V, --vumeter=TYPE      enable VU meter (TYPE: mono or stereo)\n"
+"-V, --vumeter=TYPE      enable VU meter (TYPE: mono, stereo or multi)\n"
 "-I, --separate-channels one file for each channel\n"
 "-i, --interactive       allow interactive operation from stdin\n"
 "-m, --chmap=ch1,ch2,..  Give the channel map to override or follow\n"
@@ -248,6 +265,12 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "    --use-strftime      apply the strftime facility to the output file name\n"
 "    --dump-hw-params    dump hw_params of the device\n"
 "    --fatal-errors      treat all errors as fatal\n"
+"    --read-ahead=#      read the file by a thread with a ring of # chunks\n"
+"    --write-behind=#    write files by a thread with a ring of # chunks\n"
+"    --gapless           keep the stream running across files\n"
+"    --mmap-direct       transfer between file and mmap area directly\n"
+"    --xrun-log=FILE     dump the log of XRUNs as JSON at exit and SIGUSR2\n"
+"    --xrun-log-size=#   number of the last XRUNs in the log (default 64)\n"
   )
 		, command);
 	printf(_("Recognized sample formats are:"));
@@ -383,6 +406,8 @@ static void version(void)
  */
 static void prg_exit(int code) 
 {
+	if (xrun_log_name)
+		xrun_log_dump();
 	done_stdin();
 	if (handle)
 		snd_pcm_close(handle);
@@ -406,6 +431,8 @@ static void signal_handler(int sig)
 	if (sig == SIGABRT) {
 		/* do not call snd_pcm_close() and abort immediately */
 		handle = NULL;
+		/* stdio is not async-signal-safe, thus no dump of XRUN log */
+		xrun_log_name = NULL;
 		prg_exit(EXIT_FAILURE);
 	}
 	signal(sig, SIG_DFL);
@@ -434,6 +461,12 @@ enum {
 	OPT_USE_STRFTIME,
 	OPT_DUMP_HWPARAMS,
 	OPT_FATAL_ERRORS,
+	OPT_READ_AHEAD,
+	OPT_WRITE_BEHIND,
+	OPT_GAPLESS,
+	OPT_MMAP_DIRECT,
+	OPT_XRUN_LOG,
+	OPT_XRUN_LOG_SIZE,
 };
 
 /*
@@ -521,6 +554,12 @@ int main(int argc, char *argv[])
 		{"interactive", 0, 0, 'i'},
 		{"dump-hw-params", 0, 0, OPT_DUMP_HWPARAMS},
 		{"fatal-errors", 0, 0, OPT_FATAL_ERRORS},
+		{"read-ahead", 1, 0, OPT_READ_AHEAD},
+		{"write-behind", 1, 0, OPT_WRITE_BEHIND},
+		{"gapless", 0, 0, OPT_GAPLESS},
+		{"mmap-direct", 0, 0, OPT_MMAP_DIRECT},
+		{"xrun-log", 1, 0, OPT_XRUN_LOG},
+		{"xrun-log-size", 1, 0, OPT_XRUN_LOG_SIZE},
 #ifdef CONFIG_SUPPORT_CHMAP
 		{"chmap", 1, 0, 'm'},
 #endif
@@ -734,6 +773,8 @@ int main(int argc, char *argv[])
 		case 'V':
 			if (*optarg == 's')
 				vumeter = VUMETER_STEREO;
+			else if (strcmp(optarg, "multi") == 0)
+				vumeter = VUMETER_MULTI;
 			else if (*optarg == 'm')
 				vumeter = VUMETER_MONO;
 			else
@@ -805,6 +846,37 @@ int main(int argc, char *argv[])
 		case OPT_FATAL_ERRORS:
 			fatal_errors = 1;
 			break;
+		case OPT_READ_AHEAD:
+			read_ahead = parse_long(optarg, &err);
+			if (err < 0 || read_ahead > 1024) {
+				error(_("invalid read-ahead argument '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_WRITE_BEHIND:
+			write_behind = parse_long(optarg, &err);
+			if (err < 0 || write_behind > 1024) {
+				error(_("invalid write-behind argument '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_GAPLESS:
+			gapless = 1;
+			break;
+		case OPT_MMAP_DIRECT:
+			mmap_flag = 1;
+			mmap_direct = 1;
+			break;
+		case OPT_XRUN_LOG:
+			xrun_log_name = optarg;
+			break;
+		case OPT_XRUN_LOG_SIZE:
+			xrun_log_size = parse_long(optarg, &err);
+			if (err < 0 || xrun_log_size < 1 || xrun_log_size > 65536) {
+				error(_("invalid xrun log size argument '%s'"), optarg);
+				return 1;
+			}
+			break;
 #ifdef CONFIG_SUPPORT_CHMAP
 		case 'm':
 			channel_map = snd_pcm_chmap_parse_string(optarg);
@@ -820,6 +892,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (mmap_direct && !interleaved) {
+		error(_("--mmap-direct is not available with separate channels"));
+		return 1;
+	}
+
+	if (mmap_direct && write_behind > 0) {
+		error(_("--mmap-direct is not available with --write-behind"));
+		return 1;
+	}
+
 	if (do_device_list) {
 		if (do_pcm_list) pcm_list();
 		device_list();
@@ -895,6 +977,8 @@ int main(int argc, char *argv[])
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGUSR1, signal_handler_recycle);
+	if (xrun_log_name)
+		xrun_log_init();
 	if (interleaved) {
 		if (optind > argc - 1) {
 			if (stream == SND_PCM_STREAM_PLAYBACK)
@@ -903,12 +987,16 @@ int main(int argc, char *argv[])
 				capture(NULL);
 		} else {
 			while (optind <= argc - 1) {
-				if (stream == SND_PCM_STREAM_PLAYBACK)
+				if (stream == SND_PCM_STREAM_PLAYBACK) {
+					if (optind < argc - 1)
+						gapless_prefetch(argv[optind + 1]);
 					playback(argv[optind++]);
-				else
+				} else
 					capture(argv[optind++]);
 			}
 		}
+		if (stream == SND_PCM_STREAM_PLAYBACK)
+			gapless_finish();
 	} else {
 		if (stream == SND_PCM_STREAM_PLAYBACK)
 			playbackv(&argv[optind], argc - optind);
@@ -1324,6 +1412,7 @@ static int setup_chmap(void)
 }
 #else
 #define setup_chmap()	0
+#define setup_remap()
 #endif
 
 static void set_params(void)
@@ -1349,7 +1438,11 @@ static void set_params(void)
 		snd_pcm_hw_params_dump(params, log);
 		fprintf(stderr, "--------------------\n");
 	}
-	if (mmap_flag) {
+	if (mmap_direct) {
+		/* the layout of mmap area is known */
+		err = snd_pcm_hw_params_set_access(handle, params,
+						   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	} else if (mmap_flag) {
 		snd_pcm_access_mask_t *mask = alloca(snd_pcm_access_mask_sizeof());
 		snd_pcm_access_mask_none(mask);
 		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_INTERLEAVED);
@@ -1498,9 +1591,18 @@ static void set_params(void)
 
 	/* stereo VU-meter isn't always available... */
 	if (vumeter == VUMETER_STEREO) {
-		if (hwparams.channels != 2 || !interleaved || verbose > 2)
+		if (hwparams.channels != 2 || verbose > 2)
+			vumeter = VUMETER_MONO;
+	}
+	/* multi-channel VU-meter requires two columns per channel at least */
+	if (vumeter == VUMETER_MULTI) {
+		if (hwparams.channels > 26 || verbose > 2)
 			vumeter = VUMETER_MONO;
 	}
+	if (vumeter)
+		setup_vu_meter();
+
+	setup_remap();
 
 	/* show mmap buffer arragment */
 	if (mmap_flag && verbose) {
@@ -1644,6 +1746,203 @@ do { \
 } while (0)
 #endif
 
+/*
+ * Log of XRUNs
+ *
+ * The status of PCM and the timing of transfers at the last XRUNs are kept
+ * in a ring of records, then dumped as JSON at exit and at SIGUSR2. The
+ * file is replaced by rename(2) so that readers never see partial content.
+ */
+struct xrun_record {
+	unsigned long long seq;
+	snd_pcm_state_t state;
+	struct timespec now;		/* CLOCK_MONOTONIC */
+	struct timespec realtime;
+	snd_htimestamp_t trigger_htstamp;
+	snd_htimestamp_t htstamp;
+	snd_htimestamp_t audio_htstamp;
+	snd_pcm_uframes_t avail;
+	snd_pcm_uframes_t avail_max;
+	snd_pcm_sframes_t delay;
+	snd_pcm_uframes_t overrange;
+	long long since_transfer_ns;	/* from the last transfer */
+	long long last_interval_ns;	/* between the last two transfers */
+	long long max_interval_ns;	/* since the previous XRUN */
+};
+
+static struct {
+	struct xrun_record *records;
+	char *pcm_name;
+	pthread_t thread;		/* the main thread to dump */
+	unsigned int size;
+	unsigned long long count;
+	unsigned long long transfers;
+	long long max_interval_ns;
+	long long worst_interval_ns;
+	struct timespec last_transfer;
+	long long last_interval_ns;
+} xlog;
+
+static volatile sig_atomic_t xrun_log_requested = 0;
+
+static long long timespec_ns(const struct timespec *ts)
+{
+	return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void signal_handler_xrun_log(int sig)
+{
+	xrun_log_requested = 1;
+}
+
+static void xrun_log_init(void)
+{
+	xlog.records = calloc(xrun_log_size, sizeof(*xlog.records));
+	if (xlog.records == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	xlog.pcm_name = strdup(snd_pcm_name(handle));
+	xlog.size = xrun_log_size;
+	xlog.thread = pthread_self();
+	signal(SIGUSR2, signal_handler_xrun_log);
+}
+
+static void xrun_log_record(snd_pcm_status_t *status)
+{
+	struct xrun_record *rec;
+	long long now;
+
+	if (xlog.records == NULL)
+		return;
+
+	rec = &xlog.records[xlog.count % xlog.size];
+	memset(rec, 0, sizeof(*rec));
+	rec->seq = xlog.count++;
+	rec->state = snd_pcm_status_get_state(status);
+	clock_gettime(CLOCK_MONOTONIC, &rec->now);
+	clock_gettime(CLOCK_REALTIME, &rec->realtime);
+	snd_pcm_status_get_trigger_htstamp(status, &rec->trigger_htstamp);
+	snd_pcm_status_get_htstamp(status, &rec->htstamp);
+	snd_pcm_status_get_audio_htstamp(status, &rec->audio_htstamp);
+	rec->avail = snd_pcm_status_get_avail(status);
+	rec->avail_max = snd_pcm_status_get_avail_max(status);
+	rec->delay = snd_pcm_status_get_delay(status);
+	rec->overrange = snd_pcm_status_get_overrange(status);
+
+	now = timespec_ns(&rec->now);
+	if (xlog.transfers > 0)
+		rec->since_transfer_ns = now - timespec_ns(&xlog.last_transfer);
+	rec->last_interval_ns = xlog.last_interval_ns;
+	rec->max_interval_ns = xlog.max_interval_ns;
+	xlog.max_interval_ns = 0;
+}
+
+static void xrun_log_print_ts(FILE *fp, const char *key,
+			      const struct timespec *ts)
+{
+	fprintf(fp, "\"%s\":%lld.%09ld", key, (long long)ts->tv_sec,
+		ts->tv_nsec);
+}
+
+static void xrun_log_print_str(FILE *fp, const char *key, const char *str)
+{
+	fprintf(fp, "\"%s\":\"", key);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', fp);
+		if ((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+static void xrun_log_dump(void)
+{
+	char tmp[PATH_MAX];
+	unsigned long long seq, first;
+	FILE *fp;
+
+	/* the records are updated by the main thread only */
+	if (xlog.records == NULL || !pthread_equal(pthread_self(), xlog.thread))
+		return;
+	xrun_log_requested = 0;
+
+	if (!strcmp(xrun_log_name, "-")) {
+		fp = stderr;
+	} else {
+		snprintf(tmp, sizeof(tmp), "%s.tmp", xrun_log_name);
+		fp = fopen(tmp, "w");
+		if (fp == NULL) {
+			perror(tmp);
+			return;
+		}
+	}
+
+	fprintf(fp, "{\"pid\":%d,", getpid());
+	xrun_log_print_str(fp, "pcm", xlog.pcm_name ? xlog.pcm_name : "");
+	fprintf(fp, ",\"stream\":\"%s\","
+		"\"xruns\":%llu,\"transfers\":%llu,"
+		"\"worst_interval_ns\":%lld,\"records\":[",
+		stream == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture",
+		xlog.count, xlog.transfers, xlog.worst_interval_ns);
+	seq = xlog.count > xlog.size ? xlog.count - xlog.size : 0;
+	for (first = seq; seq < xlog.count; seq++) {
+		const struct xrun_record *rec = &xlog.records[seq % xlog.size];
+
+		fprintf(fp, "%s\n{\"seq\":%llu,\"state\":\"%s\",",
+			seq > first ? "," : "", rec->seq,
+			snd_pcm_state_name(rec->state));
+		xrun_log_print_ts(fp, "monotonic", &rec->now);
+		fputc(',', fp);
+		xrun_log_print_ts(fp, "realtime", &rec->realtime);
+		fputc(',', fp);
+		xrun_log_print_ts(fp, "trigger_htstamp", &rec->trigger_htstamp);
+		fputc(',', fp);
+		xrun_log_print_ts(fp, "htstamp", &rec->htstamp);
+		fputc(',', fp);
+		xrun_log_print_ts(fp, "audio_htstamp", &rec->audio_htstamp);
+		fprintf(fp, ",\"avail\":%lu,\"avail_max\":%lu,\"delay\":%ld,"
+			"\"overrange\":%lu,\"since_transfer_ns\":%lld,"
+			"\"last_interval_ns\":%lld,\"max_interval_ns\":%lld}",
+			rec->avail, rec->avail_max, rec->delay, rec->overrange,
+			rec->since_transfer_ns, rec->last_interval_ns,
+			rec->max_interval_ns);
+	}
+	fprintf(fp, "]}\n");
+
+	if (fp != stderr) {
+		if (fclose(fp) != 0 || rename(tmp, xrun_log_name) < 0)
+			perror(xrun_log_name);
+	}
+}
+
+/* called after each transfer to measure the interval of chunks */
+static void xrun_log_transfer(void)
+{
+	struct timespec now;
+	long long interval;
+
+	if (xlog.records == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (xlog.transfers++ > 0) {
+		interval = timespec_ns(&now) - timespec_ns(&xlog.last_transfer);
+		xlog.last_interval_ns = interval;
+		if (interval > xlog.max_interval_ns)
+			xlog.max_interval_ns = interval;
+		if (interval > xlog.worst_interval_ns)
+			xlog.worst_interval_ns = interval;
+	}
+	xlog.last_transfer = now;
+
+	if (xrun_log_requested)
+		xrun_log_dump();
+}
+
 /* I/O error handler */
 static void xrun(void)
 {
@@ -1655,6 +1954,7 @@ static void xrun(void)
 		error(_("status error: %s"), snd_strerror(res));
 		prg_exit(EXIT_FAILURE);
 	}
+	xrun_log_record(status);
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN) {
 		if (fatal_errors) {
 			error(_("fatal %s: %s"),
@@ -1800,162 +2100,374 @@ static void print_vu_meter_stereo(int *perc, int *maxperc)
 	fputs(line, stderr);
 }
 
+static void print_vu_meter_multi(int *perc, int *maxperc)
+{
+	const int bar_length = 78 / hwparams.channels - 1;
+	char line[80];
+	int c, p;
+
+	for (c = 0; c < hwparams.channels; c++) {
+		char *bar = line + c * (bar_length + 1);
+
+		p = perc[c] * bar_length / 100;
+		if (p > bar_length)
+			p = bar_length;
+		memset(bar, '#', p);
+		memset(bar + p, ' ', bar_length - p);
+		p = maxperc[c] * bar_length / 100 - 1;
+		if (p < 0)
+			p = 0;
+		else if (p >= bar_length)
+			p = bar_length - 1;
+		bar[p] = '+';
+		bar[bar_length] = '|';
+	}
+	line[hwparams.channels * (bar_length + 1)] = 0;
+	fputs(line, stderr);
+}
+
 static void print_vu_meter(signed int *perc, signed int *maxperc)
 {
 	if (vumeter == VUMETER_STEREO)
 		print_vu_meter_stereo(perc, maxperc);
+	else if (vumeter == VUMETER_MULTI)
+		print_vu_meter_multi(perc, maxperc);
 	else
 		print_vu_meter_mono(*perc, *maxperc);
 }
 
-/* peak handler */
-static void compute_max_peak(u_char *data, size_t samples)
+/*
+ * peak handler
+ *
+ * Samples are decoded to signed 32 bit aligned to MSB in chunks, then peaks
+ * and sums of squares are accumulated in lanes. The number of lanes is a
+ * multiple of the number of channels, thus lane % channels is the channel of
+ * interleaved samples. The loops have no branches per sample so that
+ * compilers can vectorize them.
+ */
+#define VU_LANES	64
+#define VU_CHUNK	1024
+
+static struct {
+	void (*decode)(int32_t *dst, const u_char *src, size_t count);
+	size_t bytes;
+	u_char silence[4];
+	unsigned int shift;
+	uint32_t *peaks;
+	double *squares;
+	int *perc;
+	int *maxperc;
+} vu;
+
+static void vu_decode_8(int32_t *dst, const u_char *src, size_t count)
 {
-	signed int val, max, perc[2], max_peak[2];
-	static int run = 0;
-	size_t osamples = samples;
-	int format_little_endian = snd_pcm_format_little_endian(hwparams.format);
-	int ichans, c;
+	const uint8_t mask = vu.silence[0];
+	size_t i;
 
-	if (vumeter == VUMETER_STEREO)
-		ichans = 2;
-	else
-		ichans = 1;
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)((uint32_t)(src[i] ^ mask) << 24);
+}
 
-	memset(max_peak, 0, sizeof(max_peak));
-	switch (bits_per_sample) {
-	case 8: {
-		signed char *valp = (signed char *)data;
-		signed char mask = snd_pcm_format_silence(hwparams.format);
-		c = 0;
-		while (samples-- > 0) {
-			val = *valp++ ^ mask;
-			val = abs(val);
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
+static void vu_decode_16le(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint16_t *s = (const uint16_t *)src;
+	uint16_t mask;
+	size_t i;
+
+	memcpy(&mask, vu.silence, sizeof(mask));
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)((uint32_t)le16toh(s[i] ^ mask) << 16);
+}
+
+static void vu_decode_16be(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint16_t *s = (const uint16_t *)src;
+	uint16_t mask;
+	size_t i;
+
+	memcpy(&mask, vu.silence, sizeof(mask));
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)((uint32_t)be16toh(s[i] ^ mask) << 16);
+}
+
+/*
+ * S24_3LE, S20_3LE and so on have valid bits in LSB of 3 bytes. The shift
+ * moves the sign bit to MSB and drops the padding bits above it.
+ */
+static inline uint32_t vu_get_24le(const u_char *s)
+{
+	return (uint32_t)s[0] | ((uint32_t)s[1] << 8) | ((uint32_t)s[2] << 16);
+}
+
+static inline uint32_t vu_get_24be(const u_char *s)
+{
+	return ((uint32_t)s[0] << 16) | ((uint32_t)s[1] << 8) | (uint32_t)s[2];
+}
+
+static void vu_decode_24le(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint32_t mask = vu_get_24le(vu.silence);
+	const unsigned int shift = vu.shift;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)((vu_get_24le(src + i * 3) ^ mask) << shift);
+}
+
+static void vu_decode_24be(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint32_t mask = vu_get_24be(vu.silence);
+	const unsigned int shift = vu.shift;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)((vu_get_24be(src + i * 3) ^ mask) << shift);
+}
+
+/* S24_LE and so on have valid bits in LSB, then they're shifted to MSB. */
+static void vu_decode_32le(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	const unsigned int shift = vu.shift;
+	uint32_t mask;
+	size_t i;
+
+	memcpy(&mask, vu.silence, sizeof(mask));
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)(le32toh(s[i] ^ mask) << shift);
+}
+
+static void vu_decode_32be(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	const unsigned int shift = vu.shift;
+	uint32_t mask;
+	size_t i;
+
+	memcpy(&mask, vu.silence, sizeof(mask));
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)(be32toh(s[i] ^ mask) << shift);
+}
+
+static inline int32_t vu_float_to_s32(uint32_t bits)
+{
+	union {
+		uint32_t i;
+		float f;
+	} val = { .i = bits };
+	float f = val.f * 2147483648.0f;
+
+	f = f < 2147483520.0f ? f : 2147483520.0f;
+	f = f > -2147483648.0f ? f : -2147483648.0f;
+	return (int32_t)f;
+}
+
+static void vu_decode_float_le(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = vu_float_to_s32(le32toh(s[i]));
+}
+
+static void vu_decode_float_be(int32_t *dst, const u_char *src, size_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = vu_float_to_s32(be32toh(s[i]));
+}
+
+static void vu_accumulate(const int32_t *restrict samples, size_t count,
+			  uint32_t *restrict peaks, float *restrict squares)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		int32_t val = samples[i];
+		uint32_t mag = val < 0 ? 0u - (uint32_t)val : (uint32_t)val;
+		float f = (float)val;
+
+		peaks[i] = peaks[i] > mag ? peaks[i] : mag;
+		squares[i] += f * f;
 	}
-	case 16: {
-		signed short *valp = (signed short *)data;
-		signed short mask = snd_pcm_format_silence_16(hwparams.format);
-		signed short sval;
+}
 
-		c = 0;
-		while (samples-- > 0) {
-			if (format_little_endian)
-				sval = le16toh(*valp);
-			else
-				sval = be16toh(*valp);
-			sval ^= mask;
-			val = abs(sval);
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp++;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
+static uint32_t vu_sqrt(double val)
+{
+	uint64_t sq = val < 18446744073709551615.0 ? (uint64_t)val : UINT64_MAX;
+	uint64_t bit = 1ULL << 62;
+	uint64_t root = 0;
+
+	while (bit > sq)
+		bit >>= 2;
+	while (bit > 0) {
+		if (sq >= root + bit) {
+			sq -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
 		}
-		break;
+		bit >>= 2;
 	}
-	case 24: {
-		unsigned char *valp = data;
-		signed int mask = snd_pcm_format_silence_32(hwparams.format);
 
-		c = 0;
-		while (samples-- > 0) {
-			if (format_little_endian) {
-				val = valp[0] | (valp[1]<<8) | (valp[2]<<16);
-			} else {
-				val = (valp[0]<<16) | (valp[1]<<8) | valp[2];
-			}
-			val ^= mask;
-			/* Correct signed bit in 32-bit value */
-			if (val & (1<<(bits_per_sample-1))) {
-				val |= 0xff<<24;	/* Negate upper bits too */
-			}
-			val = abs(val);
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp += 3;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
+	return root;
+}
+
+/* Fold peaks and sums of squares for the given samples into each channel. */
+static void vu_measure(const u_char *data, size_t samples,
+		       unsigned int channels, uint32_t *peaks, double *squares)
+{
+	const size_t lanes = channels * ((VU_LANES + channels - 1) / channels);
+	const size_t chunk = lanes * (VU_CHUNK > lanes ? VU_CHUNK / lanes : 1);
+	uint32_t lane_peaks[lanes];
+	float lane_squares[lanes];
+	int32_t buf[chunk];
+	size_t i, count;
+
+	memset(lane_peaks, 0, sizeof(lane_peaks));
+	memset(lane_squares, 0, sizeof(lane_squares));
+
+	while (samples > 0) {
+		count = samples < chunk ? samples : chunk;
+		vu.decode(buf, data, count);
+		for (i = 0; i < count; i += lanes)
+			vu_accumulate(buf + i, count - i < lanes ? count - i : lanes,
+				      lane_peaks, lane_squares);
+		data += count * vu.bytes;
+		samples -= count;
+	}
+
+	for (i = 0; i < lanes; i++) {
+		unsigned int c = i % channels;
+		if (peaks[c] < lane_peaks[i])
+			peaks[c] = lane_peaks[i];
+		squares[c] += lane_squares[i];
 	}
-	case 32: {
-		signed int *valp = (signed int *)data;
-		signed int mask = snd_pcm_format_silence_32(hwparams.format);
+}
 
-		c = 0;
-		while (samples-- > 0) {
-			if (format_little_endian)
-				val = le32toh(*valp);
-			else
-				val = be32toh(*valp);
-			val ^= mask;
-			if (val == 0x80000000U)
-				val = 0x7fffffff;
-			else
-				val = abs(val);
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp++;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
+static void setup_vu_meter(void)
+{
+	int little_endian = snd_pcm_format_little_endian(hwparams.format);
+
+	vu.bytes = bits_per_sample / 8;
+	vu.shift = 32 - significant_bits_per_sample;
+	switch (bits_per_sample) {
+	case 8:
+		vu.decode = vu_decode_8;
+		break;
+	case 16:
+		vu.decode = little_endian ? vu_decode_16le : vu_decode_16be;
+		break;
+	case 24:
+		vu.decode = little_endian ? vu_decode_24le : vu_decode_24be;
+		break;
+	case 32:
+		if (hwparams.format == SND_PCM_FORMAT_FLOAT_LE ||
+		    hwparams.format == SND_PCM_FORMAT_FLOAT_BE)
+			vu.decode = little_endian ? vu_decode_float_le :
+						    vu_decode_float_be;
+		else
+			vu.decode = little_endian ? vu_decode_32le :
+						    vu_decode_32be;
 		break;
-	}
 	default:
-		if (run == 0) {
-			fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
-			run = 1;
-		}
+		fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
+		vumeter = VUMETER_NONE;
 		return;
 	}
-	max = 1 << (significant_bits_per_sample-1);
-	if (max <= 0)
-		max = 0x7fffffff;
+	/* the pattern of silence in memory, to be XORed before byte swap */
+	memset(vu.silence, 0, sizeof(vu.silence));
+	snd_pcm_format_set_silence(hwparams.format, vu.silence, 1);
 
-	for (c = 0; c < ichans; c++) {
-		if (max_peak[c] > max)
-			max_peak[c] = max;
-		if (bits_per_sample > 16)
-			perc[c] = max_peak[c] / (max / 100);
-		else
-			perc[c] = max_peak[c] * 100 / max;
+	vu.peaks = realloc(vu.peaks, hwparams.channels * sizeof(*vu.peaks));
+	vu.squares = realloc(vu.squares, hwparams.channels * sizeof(*vu.squares));
+	vu.perc = realloc(vu.perc, hwparams.channels * sizeof(*vu.perc));
+	vu.maxperc = realloc(vu.maxperc, hwparams.channels * sizeof(*vu.maxperc));
+	if (vu.peaks == NULL || vu.squares == NULL || vu.perc == NULL ||
+	    vu.maxperc == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	memset(vu.maxperc, 0, hwparams.channels * sizeof(*vu.maxperc));
+}
+
+static void show_max_peak(size_t frames)
+{
+	unsigned int channels = hwparams.channels;
+	size_t samples = frames * channels;
+	unsigned int c;
+	int val;
+
+	/* the mono VU-meter shows the maximum in all channels */
+	if (vumeter == VUMETER_MONO) {
+		for (c = 1; c < channels; c++) {
+			if (vu.peaks[0] < vu.peaks[c])
+				vu.peaks[0] = vu.peaks[c];
+			vu.squares[0] += vu.squares[c];
+		}
+		frames *= channels;
+		channels = 1;
 	}
 
-	if (interleaved && verbose <= 2) {
-		static int maxperc[2];
+	for (c = 0; c < channels; c++) {
+		if (vu.peaks[c] > 0x80000000U)
+			vu.peaks[c] = 0x80000000U;
+		vu.perc[c] = (uint64_t)vu.peaks[c] * 100 / 0x80000000U;
+	}
+
+	if (verbose <= 2) {
 		static time_t t=0;
 		const time_t tt=time(NULL);
 		if(tt>t) {
 			t=tt;
-			maxperc[0] = 0;
-			maxperc[1] = 0;
+			memset(vu.maxperc, 0, channels * sizeof(*vu.maxperc));
 		}
-		for (c = 0; c < ichans; c++)
-			if (perc[c] > maxperc[c])
-				maxperc[c] = perc[c];
+		for (c = 0; c < channels; c++)
+			if (vu.perc[c] > vu.maxperc[c])
+				vu.maxperc[c] = vu.perc[c];
 
 		putc('\r', stderr);
-		print_vu_meter(perc, maxperc);
+		print_vu_meter(vu.perc, vu.maxperc);
 		fflush(stderr);
 	}
 	else if (verbose==3) {
-		fprintf(stderr, _("Max peak (%li samples): 0x%08x "), (long)osamples, max_peak[0]);
+		uint32_t rms = frames > 0 ? vu_sqrt(vu.squares[0] / frames) : 0;
+
+		fprintf(stderr, _("Max peak (%li samples): 0x%08x "), (long)samples,
+			vu.peaks[0] >> vu.shift);
 		for (val = 0; val < 20; val++)
-			if (val <= perc[0] / 5)
+			if (val <= vu.perc[0] / 5)
 				putc('#', stderr);
 			else
 				putc(' ', stderr);
-		fprintf(stderr, " %i%%\n", perc[0]);
+		fprintf(stderr, _(" %i%% RMS: 0x%08x\n"), vu.perc[0],
+			rms >> vu.shift);
 		fflush(stderr);
 	}
 }
 
+static void compute_max_peak(u_char *data, size_t samples)
+{
+	memset(vu.peaks, 0, hwparams.channels * sizeof(*vu.peaks));
+	memset(vu.squares, 0, hwparams.channels * sizeof(*vu.squares));
+	vu_measure(data, samples, hwparams.channels, vu.peaks, vu.squares);
+	show_max_peak(samples / hwparams.channels);
+}
+
+static void compute_max_peak_noninterleaved(void **bufs, size_t frames)
+{
+	unsigned int c;
+
+	memset(vu.peaks, 0, hwparams.channels * sizeof(*vu.peaks));
+	memset(vu.squares, 0, hwparams.channels * sizeof(*vu.squares));
+	for (c = 0; c < hwparams.channels; c++)
+		vu_measure(bufs[c], frames, 1, vu.peaks + c, vu.squares + c);
+	show_max_peak(frames);
+}
+
 static void do_test_position(void)
 {
 	static long counter = 0;
@@ -2052,65 +2564,168 @@ static void do_test_position(void)
 }
 
 /*
+ * Kernels to reorder samples in interleaved frames. Each of them copies the
+ * sample of source channel in the map to each destination channel. The ones
+ * for popular numbers of channels have the map in local array so that the
+ * loop over channels is unrolled and the map is kept in registers.
  */
 #ifdef CONFIG_SUPPORT_CHMAP
-static u_char *remap_data(u_char *data, size_t count)
+typedef void (*remap_func_t)(u_char *dst, const u_char *src, size_t frames);
+
+static struct {
+	remap_func_t func;
+	unsigned int *map;	/* source channel for each destination channel */
+	unsigned int *hw_order;	/* channel of file for each hardware channel */
+	u_char *buf;
+	u_char **bufs;
+} remap;
+
+typedef struct {
+	u_char b[3];
+} remap_s24_3_t;
+
+#define REMAP_KERNEL(suffix, type)					\
+static inline void remap_kernel_##suffix(u_char *dst, const u_char *src,\
+					 size_t frames,			\
+					 const unsigned int *map,	\
+					 unsigned int channels)		\
+{									\
+	const type *s = (const type *)src;				\
+	type *d = (type *)dst;						\
+	unsigned int ch;						\
+									\
+	while (frames-- > 0) {						\
+		for (ch = 0; ch < channels; ch++)			\
+			d[ch] = s[map[ch]];				\
+		d += channels;						\
+		s += channels;						\
+	}								\
+}									\
+static void remap_##suffix(u_char *dst, const u_char *src, size_t frames) \
+{									\
+	remap_kernel_##suffix(dst, src, frames, remap.map,		\
+			      hwparams.channels);			\
+}
+
+#define REMAP_FIXED(suffix, channels)					\
+static void remap_##suffix##_##channels(u_char *dst, const u_char *src,\
+					size_t frames)			\
+{									\
+	unsigned int map[channels];					\
+									\
+	memcpy(map, remap.map, sizeof(map));				\
+	remap_kernel_##suffix(dst, src, frames, map, channels);		\
+}
+
+#define REMAP_FUNCS(suffix, type)					\
+REMAP_KERNEL(suffix, type)						\
+REMAP_FIXED(suffix, 2)							\
+REMAP_FIXED(suffix, 4)							\
+REMAP_FIXED(suffix, 6)							\
+REMAP_FIXED(suffix, 8)							\
+static const remap_func_t remap_##suffix##_funcs[] = {			\
+	[0] = remap_##suffix,						\
+	[2] = remap_##suffix##_2,					\
+	[4] = remap_##suffix##_4,					\
+	[6] = remap_##suffix##_6,					\
+	[8] = remap_##suffix##_8,					\
+};
+
+REMAP_FUNCS(8, uint8_t)
+REMAP_FUNCS(16, uint16_t)
+REMAP_FUNCS(24_3, remap_s24_3_t)
+REMAP_FUNCS(32, uint32_t)
+REMAP_FUNCS(64, uint64_t)
+
+static void setup_remap(void)
 {
-	static u_char *tmp, *src, *dst;
-	static size_t tmp_size;
-	size_t sample_bytes = bits_per_sample / 8;
-	size_t step = bits_per_frame / 8;
-	size_t chunk_bytes;
-	unsigned int ch, i;
+	const remap_func_t *funcs;
+	unsigned int ch;
 
 	if (!hw_map)
-		return data;
+		return;
 
-	chunk_bytes = count * bits_per_frame / 8;
-	if (tmp_size < chunk_bytes) {
-		free(tmp);
-		tmp = malloc(chunk_bytes);
-		if (!tmp) {
-			error(_("not enough memory"));
-			exit(1);
-		}
-		tmp_size = count;
+	switch (bits_per_sample) {
+	case 8:
+		funcs = remap_8_funcs;
+		break;
+	case 16:
+		funcs = remap_16_funcs;
+		break;
+	case 24:
+		funcs = remap_24_3_funcs;
+		break;
+	case 32:
+		funcs = remap_32_funcs;
+		break;
+	case 64:
+		funcs = remap_64_funcs;
+		break;
+	default:
+		error(_("unsupported sample width for channel map: %d"),
+		      (int)bits_per_sample);
+		prg_exit(EXIT_FAILURE);
 	}
+	if (hwparams.channels < sizeof(remap_8_funcs) / sizeof(*funcs) &&
+	    funcs[hwparams.channels])
+		remap.func = funcs[hwparams.channels];
+	else
+		remap.func = funcs[0];
 
-	src = data;
-	dst = tmp;
-	for (i = 0; i < count; i++) {
-		for (ch = 0; ch < hwparams.channels; ch++) {
-			memcpy(dst, src + sample_bytes * hw_map[ch],
-			       sample_bytes);
-			dst += sample_bytes;
-		}
-		src += step;
+	remap.hw_order = realloc(remap.hw_order,
+				 hwparams.channels * sizeof(*remap.hw_order));
+	remap.bufs = realloc(remap.bufs, hwparams.channels * sizeof(*remap.bufs));
+	remap.buf = realloc(remap.buf, chunk_bytes);
+	if (!remap.hw_order || !remap.bufs || !remap.buf) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
 	}
-	return tmp;
+	/* the data of file for the channel is at the channel in hw_map */
+	for (ch = 0; ch < hwparams.channels; ch++)
+		remap.hw_order[hw_map[ch]] = ch;
+
+	if (stream == SND_PCM_STREAM_PLAYBACK)
+		remap.map = remap.hw_order;
+	else
+		remap.map = hw_map;
+}
+
+static u_char *remap_data(u_char *data, size_t count)
+{
+	if (!hw_map)
+		return data;
+
+	remap.func(remap.buf, data, count);
+	return remap.buf;
+}
+
+/* The buffer to read samples into before reordering. */
+static u_char *remap_buffer(u_char *data)
+{
+	return hw_map ? remap.buf : data;
+}
+
+static void remap_copy(u_char *dst, u_char *src, size_t count)
+{
+	if (src != dst)
+		remap.func(dst, src, count);
 }
 
 static u_char **remap_datav(u_char **data, size_t count)
 {
-	static u_char **tmp;
 	unsigned int ch;
 
 	if (!hw_map)
 		return data;
 
-	if (!tmp) {
-		tmp = malloc(sizeof(*tmp) * hwparams.channels);
-		if (!tmp) {
-			error(_("not enough memory"));
-			exit(1);
-		}
-		for (ch = 0; ch < hwparams.channels; ch++)
-			tmp[ch] = data[hw_map[ch]];
-	}
-	return tmp;
+	for (ch = 0; ch < hwparams.channels; ch++)
+		remap.bufs[ch] = data[remap.hw_order[ch]];
+	return remap.bufs;
 }
 #else
 #define remap_data(data, count)		(data)
+#define remap_buffer(data)		(data)
+#define remap_copy(dst, src, count)
 #define remap_datav(data, count)	(data)
 #endif
 
@@ -2147,6 +2762,7 @@ static ssize_t pcm_write(u_char *data, size_t count)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
+			xrun_log_transfer();
 			if (vumeter)
 				compute_max_peak(data, r * hwparams.channels);
 			result += r;
@@ -2195,10 +2811,9 @@ static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
-			if (vumeter) {
-				for (channel = 0; channel < channels; channel++)
-					compute_max_peak(data[channel], r);
-			}
+			xrun_log_transfer();
+			if (vumeter)
+				compute_max_peak_noninterleaved(bufs, r);
 			result += r;
 			count -= r;
 		}
@@ -2215,6 +2830,8 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 	ssize_t r;
 	size_t result = 0;
 	size_t count = rcount;
+	u_char *buf = remap_buffer(data);
+	u_char *ptr = buf;
 
 	if (count != chunk_size) {
 		count = chunk_size;
@@ -2226,7 +2843,7 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 		if (test_position)
 			do_test_position();
 		check_stdin();
-		r = readi_func(handle, data, count);
+		r = readi_func(handle, ptr, count);
 		if (test_position)
 			do_test_position();
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
@@ -2241,14 +2858,16 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
+			xrun_log_transfer();
 			if (vumeter)
-				compute_max_peak(data, r * hwparams.channels);
+				compute_max_peak(ptr, r * hwparams.channels);
 			result += r;
 			count -= r;
-			data += r * bits_per_frame / 8;
+			ptr += r * bits_per_frame / 8;
 		}
 	}
 abort:
+	remap_copy(data, buf, result);
 	return result > rcount ? rcount : result;
 }
 
@@ -2261,6 +2880,7 @@ static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 	if (count != chunk_size) {
 		count = chunk_size;
 	}
+	data = remap_datav(data, count);
 
 	while (count > 0) {
 		if (in_aborting)
@@ -2288,10 +2908,9 @@ static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
-			if (vumeter) {
-				for (channel = 0; channel < channels; channel++)
-					compute_max_peak(data[channel], r);
-			}
+			xrun_log_transfer();
+			if (vumeter)
+				compute_max_peak_noninterleaved(bufs, r);
 			result += r;
 			count -= r;
 		}
@@ -2403,6 +3022,7 @@ static void voc_play(int fd, int ofs, char *name)
 			prg_exit(EXIT_FAILURE);
 		}
 	}
+	gapless_finish();
 	hwparams.format = DEFAULT_FORMAT;
 	hwparams.channels = 1;
 	hwparams.rate = DEFAULT_SPEED;
@@ -2613,8 +3233,13 @@ static off_t calc_count(void)
 	return count < pbrec_count ? count : pbrec_count;
 }
 
-/* write a .VOC-header */
-static void begin_voc(int fd, size_t cnt)
+/*
+ * write a .VOC-header
+ *
+ * The functions to write headers are called by the thread for write-behind
+ * as well, thus they return an error instead of exiting.
+ */
+static int begin_voc(int fd, size_t cnt)
 {
 	VocHeader vh;
 	VocBlockType bt;
@@ -2628,7 +3253,7 @@ static void begin_voc(int fd, size_t cnt)
 
 	if (xwrite(fd, &vh, sizeof(VocHeader)) != sizeof(VocHeader)) {
 		error(_("write error"));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
 	if (hwparams.channels > 1) {
 		/* write an extended block */
@@ -2637,14 +3262,14 @@ static void begin_voc(int fd, size_t cnt)
 		bt.datalen_m = bt.datalen_h = 0;
 		if (xwrite(fd, &bt, sizeof(VocBlockType)) != sizeof(VocBlockType)) {
 			error(_("write error"));
-			prg_exit(EXIT_FAILURE);
+			return -1;
 		}
 		eb.tc = LE_SHORT(65536 - 256000000L / (hwparams.rate << 1));
 		eb.pack = 0;
 		eb.mode = 1;
 		if (xwrite(fd, &eb, sizeof(VocExtBlock)) != sizeof(VocExtBlock)) {
 			error(_("write error"));
-			prg_exit(EXIT_FAILURE);
+			return -1;
 		}
 	}
 	bt.type = 1;
@@ -2654,18 +3279,19 @@ static void begin_voc(int fd, size_t cnt)
 	bt.datalen_h = (u_char) ((cnt & 0xFF0000) >> 16);
 	if (xwrite(fd, &bt, sizeof(VocBlockType)) != sizeof(VocBlockType)) {
 		error(_("write error"));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
 	vd.tc = (u_char) (256 - (1000000 / hwparams.rate));
 	vd.pack = 0;
 	if (xwrite(fd, &vd, sizeof(VocVoiceData)) != sizeof(VocVoiceData)) {
 		error(_("write error"));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
+	return 0;
 }
 
 /* write a WAVE-header */
-static void begin_wave(int fd, size_t cnt)
+static int begin_wave(int fd, size_t cnt)
 {
 	WaveHeader h;
 	WaveFmtBody f;
@@ -2696,7 +3322,7 @@ static void begin_wave(int fd, size_t cnt)
 		break;
 	default:
 		error(_("Wave doesn't support %s format..."), snd_pcm_format_name(hwparams.format));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
 	h.magic = WAV_RIFF;
 	tmp = cnt + sizeof(WaveHeader) + sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + sizeof(WaveChunkHeader) - 8;
@@ -2732,12 +3358,13 @@ static void begin_wave(int fd, size_t cnt)
 	    xwrite(fd, &f, sizeof(WaveFmtBody)) != sizeof(WaveFmtBody) ||
 	    xwrite(fd, &cd, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader)) {
 		error(_("write error"));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
+	return 0;
 }
 
 /* write a Au-header */
-static void begin_au(int fd, size_t cnt)
+static int begin_au(int fd, size_t cnt)
 {
 	AuHeader ah;
 
@@ -2756,33 +3383,37 @@ static void begin_au(int fd, size_t cnt)
 		break;
 	default:
 		error(_("Sparc Audio doesn't support %s format..."), snd_pcm_format_name(hwparams.format));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
 	ah.sample_rate = BE_INT(hwparams.rate);
 	ah.channels = BE_INT(hwparams.channels);
 	if (xwrite(fd, &ah, sizeof(AuHeader)) != sizeof(AuHeader)) {
 		error(_("write error"));
-		prg_exit(EXIT_FAILURE);
+		return -1;
 	}
+	return 0;
 }
 
-/* closing .VOC */
-static void end_voc(int fd)
+/*
+ * closing .VOC
+ *
+ * The functions to close files are called by the thread for write-behind as
+ * well, thus they take the count of written bytes and return an error.
+ */
+static int end_voc(int fd, off_t count)
 {
 	off_t length_seek;
 	VocBlockType bt;
 	size_t cnt;
 	char dummy = 0;		/* Write a Terminator */
 
-	if (xwrite(fd, &dummy, 1) != 1) {
-		error(_("write error"));
-		prg_exit(EXIT_FAILURE);
-	}
+	if (xwrite(fd, &dummy, 1) != 1)
+		return -1;
 	length_seek = sizeof(VocHeader);
 	if (hwparams.channels > 1)
 		length_seek += sizeof(VocBlockType) + sizeof(VocExtBlock);
 	bt.type = 1;
-	cnt = fdcount;
+	cnt = count;
 	cnt += sizeof(VocVoiceData);	/* Channel_data block follows */
 	if (cnt > 0x00ffffff)
 		cnt = 0x00ffffff;
@@ -2791,9 +3422,10 @@ static void end_voc(int fd)
 	bt.datalen_h = (u_char) ((cnt & 0xFF0000) >> 16);
 	if (lseek(fd, length_seek, SEEK_SET) == length_seek)
 		xwrite(fd, &bt, sizeof(VocBlockType));
+	return 0;
 }
 
-static void end_wave(int fd)
+static int end_wave(int fd, off_t count)
 {				/* only close output */
 	WaveChunkHeader cd;
 	off_t length_seek;
@@ -2804,24 +3436,26 @@ static void end_wave(int fd)
 		      sizeof(WaveChunkHeader) +
 		      sizeof(WaveFmtBody);
 	cd.type = WAV_DATA;
-	cd.length = fdcount > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(fdcount);
-	filelen = fdcount + 2*sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + 4;
+	cd.length = count > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(count);
+	filelen = count + 2*sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + 4;
 	rifflen = filelen > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(filelen);
 	if (lseek(fd, 4, SEEK_SET) == 4)
 		xwrite(fd, &rifflen, 4);
 	if (lseek(fd, length_seek, SEEK_SET) == length_seek)
 		xwrite(fd, &cd, sizeof(WaveChunkHeader));
+	return 0;
 }
 
-static void end_au(int fd)
+static int end_au(int fd, off_t count)
 {				/* only close output */
 	AuHeader ah;
 	off_t length_seek;
 	
 	length_seek = (char *)&ah.data_size - (char *)&ah;
-	ah.data_size = fdcount > 0xffffffff ? 0xffffffff : BE_INT(fdcount);
+	ah.data_size = count > 0xffffffff ? 0xffffffff : BE_INT(count);
 	if (lseek(fd, length_seek, SEEK_SET) == length_seek)
 		xwrite(fd, &ah.data_size, sizeof(ah.data_size));
+	return 0;
 }
 
 static void header(int rtype, char *name)
@@ -2845,6 +3479,503 @@ static void header(int rtype, char *name)
 	}
 }
 
+/*
+ * Direct access to mmap area
+ *
+ * File data is read into the mmap area for playback, and written out from
+ * it for capture, without the chunk buffer in between. When channels are
+ * reordered, the kernel for it copies between the area and the scratch
+ * buffer instead.
+ */
+static void direct_recover(int err)
+{
+	if (err == -EPIPE) {
+		xrun();
+	} else if (err == -ESTRPIPE) {
+		suspend();
+	} else if (err < 0) {
+		error(_("mmap access error: %s"), snd_strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+static u_char *direct_area(const snd_pcm_channel_area_t *areas,
+			   snd_pcm_uframes_t offset)
+{
+	/* the layout of MMAP_INTERLEAVED access */
+	return (u_char *)areas[0].addr +
+	       (areas[0].first + offset * areas[0].step) / 8;
+}
+
+static off_t playback_direct(int fd, size_t loaded, off_t count, char *name)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, r;
+	off_t written = 0;
+	size_t pos = 0;
+	int eof = 0;
+
+	while (!eof && written < count && !in_aborting) {
+		u_char *dst, *buf;
+		size_t bytes, len;
+		ssize_t res;
+		int err;
+
+		check_stdin();
+		avail = snd_pcm_avail_update(handle);
+		if (avail < 0) {
+			direct_recover(avail);
+			continue;
+		}
+		if ((snd_pcm_uframes_t)avail < chunk_size) {
+			/* the buffer is filled */
+			if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+				err = snd_pcm_start(handle);
+				if (err < 0)
+					direct_recover(err);
+			} else if (!test_nowait) {
+				snd_pcm_wait(handle, 100);
+			}
+			continue;
+		}
+
+		frames = chunk_size;
+		err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+		if (err < 0) {
+			direct_recover(err);
+			continue;
+		}
+		dst = direct_area(areas, offset);
+		buf = remap_buffer(dst);
+
+		bytes = frames * bits_per_frame / 8;
+		if ((off_t)bytes > count - written)
+			bytes = count - written;
+
+		/* data loaded with the header at first */
+		len = loaded - pos < bytes ? loaded - pos : bytes;
+		memcpy(buf, audiobuf + pos, len);
+		pos += len;
+		if (len < bytes) {
+			res = safe_read(fd, buf + len, bytes - len);
+			if (res < 0) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			fdcount += res;
+			len += res;
+			if (len < bytes)
+				eof = 1;
+		}
+		written += len;
+
+		frames = len * 8 / bits_per_frame;
+		if (buf != dst)
+			remap_copy(dst, buf, frames);
+		if (vumeter && frames > 0)
+			compute_max_peak(dst, frames * hwparams.channels);
+		r = snd_pcm_mmap_commit(handle, offset, frames);
+		if (r < 0)
+			direct_recover(r);
+		else
+			xrun_log_transfer();
+	}
+
+	/* the file is shorter than the buffer */
+	if (!in_aborting && snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(handle);
+
+	return written;
+}
+
+/*
+ * Gapless playback
+ *
+ * The PCM keeps running across files with identical parameters. The last
+ * partial chunk of a file is held and prepended to the next file instead of
+ * being padded with silence. The next file is opened in advance and the
+ * kernel is advised to read its head while the current file is played.
+ */
+#define GAPLESS_PREFETCH_SIZE	(64 * 1024)
+
+static struct {
+	int configured;
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate;
+	u_char *carry;
+	size_t carry_bytes;
+	const char *next_name;
+	int next_fd;
+} gap = {
+	.next_fd = -1,
+};
+
+static void gapless_prefetch(const char *name)
+{
+	if (!gapless || gap.next_fd >= 0 || !strcmp(name, "-"))
+		return;
+
+	/* errors are reported when the file is played */
+	gap.next_fd = open(name, O_RDONLY, 0);
+	if (gap.next_fd < 0)
+		return;
+	gap.next_name = name;
+	posix_fadvise(gap.next_fd, 0, GAPLESS_PREFETCH_SIZE,
+		      POSIX_FADV_WILLNEED);
+}
+
+static int gapless_open(const char *name)
+{
+	int fd;
+
+	if (gap.next_fd >= 0 && !strcmp(name, gap.next_name)) {
+		fd = gap.next_fd;
+		gap.next_fd = -1;
+		return fd;
+	}
+	return open(name, O_RDONLY, 0);
+}
+
+/* write the held frames, then drain the PCM */
+static void gapless_finish(void)
+{
+	snd_pcm_format_t format = hwparams.format;
+	unsigned int channels = hwparams.channels;
+
+	if (!gap.configured)
+		return;
+	gap.configured = 0;
+
+	if (in_aborting)
+		return;
+	if (gap.carry_bytes > 0) {
+		/* the header of next file may have changed them */
+		hwparams.format = gap.format;
+		hwparams.channels = gap.channels;
+		pcm_write(gap.carry, gap.carry_bytes * 8 / bits_per_frame);
+		hwparams.format = format;
+		hwparams.channels = channels;
+	}
+	gap.carry_bytes = 0;
+
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+}
+
+/* keep the PCM running when parameters are not changed */
+static int gapless_continue(void)
+{
+	if (gap.configured && gap.format == hwparams.format &&
+	    gap.channels == hwparams.channels && gap.rate == hwparams.rate)
+		return 1;
+	gapless_finish();
+	return 0;
+}
+
+static void gapless_configure(void)
+{
+	if (!gapless)
+		return;
+
+	gap.carry = realloc(gap.carry, chunk_bytes);
+	if (gap.carry == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	gap.format = hwparams.format;
+	gap.channels = hwparams.channels;
+	gap.rate = hwparams.rate;
+	gap.carry_bytes = 0;
+	gap.configured = 1;
+}
+
+/* hold the last partial chunk to be followed by the next file */
+static int gapless_hold(u_char *data, size_t frames)
+{
+	if (!gap.configured || frames >= chunk_size)
+		return 0;
+	gap.carry_bytes = frames * bits_per_frame / 8;
+	memcpy(gap.carry, data, gap.carry_bytes);
+	return 1;
+}
+
+/* prepend the frames held at the end of the previous file */
+static void gapless_prepend(size_t *loaded, off_t *count)
+{
+	size_t size = *loaded + gap.carry_bytes;
+
+	if (gap.carry_bytes == 0)
+		return;
+
+	audiobuf = realloc(audiobuf, size > chunk_bytes ? size : chunk_bytes);
+	if (audiobuf == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	memmove(audiobuf + gap.carry_bytes, audiobuf, *loaded);
+	memcpy(audiobuf, gap.carry, gap.carry_bytes);
+	*loaded = size;
+	if (*count < LLONG_MAX - (off_t)gap.carry_bytes)
+		*count += gap.carry_bytes;
+	gap.carry_bytes = 0;
+}
+
+/*
+ * Ring of chunks between the PCM and a thread for the file
+ *
+ * A thread reads or writes the file through a ring of chunks so that a
+ * stall on the file doesn't stall the PCM. The ring has a single producer
+ * and a single consumer, thus the indexes are shared without lock. The lock
+ * is used just to sleep when the ring is empty or full.
+ */
+#define CHUNK_FILE_START	(1 << 0)
+#define CHUNK_FILE_END		(1 << 1)
+#define CHUNK_LAST		(1 << 2)
+
+struct ring_chunk {
+	size_t len;
+	off_t size;		/* for CHUNK_FILE_START */
+	time_t time;		/* for CHUNK_FILE_START */
+	unsigned int flags;
+};
+
+struct chunk_ring {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int depth;
+	u_char *buf;
+	struct ring_chunk *chunks;
+	unsigned int head;	/* chunks consumed */
+	unsigned int tail;	/* chunks produced */
+	unsigned int head_waiting;	/* the producer waits for the consumer */
+	unsigned int tail_waiting;	/* the consumer waits for the producer */
+	int err;
+	unsigned int eof;
+	unsigned int stalls;	/* the PCM side waited for the thread */
+};
+
+static void ring_init(struct chunk_ring *ring, unsigned int depth)
+{
+	ring->buf = realloc(ring->buf, depth * chunk_bytes);
+	ring->chunks = realloc(ring->chunks, depth * sizeof(*ring->chunks));
+	if (ring->buf == NULL || ring->chunks == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	memset(ring->chunks, 0, depth * sizeof(*ring->chunks));
+
+	ring->depth = depth;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->head_waiting = 0;
+	ring->tail_waiting = 0;
+	ring->err = 0;
+	ring->eof = 0;
+	ring->stalls = 0;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+}
+
+static void ring_start(struct chunk_ring *ring, void *(*func)(void *))
+{
+	sigset_t mask, orig_mask;
+	int err;
+
+	/* signals are handled by the main thread only */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
+	err = pthread_create(&ring->thread, NULL, func, ring);
+	pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+	if (err) {
+		error(_("unable to start thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+static void ring_destroy(struct chunk_ring *ring)
+{
+	pthread_join(ring->thread, NULL);
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+}
+
+static void ring_unlock(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+static unsigned int ring_load(unsigned int *index)
+{
+	return __atomic_load_n(index, __ATOMIC_SEQ_CST);
+}
+
+/* each side has its own flag so that it's not cleared by the other side */
+static unsigned int *ring_waiting(struct chunk_ring *ring, unsigned int *index)
+{
+	return index == &ring->head ? &ring->head_waiting : &ring->tail_waiting;
+}
+
+/* sleep till the index is changed from the value */
+static void ring_wait(struct chunk_ring *ring, unsigned int *index,
+		      unsigned int value, int abortable)
+{
+	unsigned int *waiting = ring_waiting(ring, index);
+	struct timespec ts;
+
+	pthread_mutex_lock(&ring->lock);
+	pthread_cleanup_push(ring_unlock, &ring->lock);
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	while (ring_load(index) == value && !(abortable && in_aborting)) {
+		/* wake up sometimes to check abort by signal */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec++;
+		}
+		pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+	}
+	__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_cleanup_pop(1);
+}
+
+static void ring_advance(struct chunk_ring *ring, unsigned int *index)
+{
+	__atomic_add_fetch(index, 1, __ATOMIC_SEQ_CST);
+	if (ring_load(ring_waiting(ring, index))) {
+		/* the condition is shared by both sides */
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+static u_char *ring_chunk_buf(struct chunk_ring *ring, unsigned int index)
+{
+	return ring->buf + (index % ring->depth) * chunk_bytes;
+}
+
+static struct ring_chunk *ring_chunk(struct chunk_ring *ring,
+				     unsigned int index)
+{
+	return ring->chunks + index % ring->depth;
+}
+
+/*
+ * Read-ahead for playback
+ */
+static struct chunk_ring read_ring;
+static int read_ahead_fd;
+static off_t read_ahead_count;
+
+static void *read_ahead_thread(void *arg)
+{
+	struct chunk_ring *ring = arg;
+	unsigned int tail = 0;
+
+	while (!in_aborting) {
+		unsigned int head = ring_load(&ring->head);
+		struct ring_chunk *chunk = ring_chunk(ring, tail);
+		size_t len = chunk->len;
+		size_t c;
+		ssize_t r;
+
+		if (tail - head == ring->depth) {
+			ring_wait(ring, &ring->head, head, 1);
+			continue;
+		}
+
+		/* the first chunk may have data loaded with the header */
+		c = chunk_bytes - len;
+		if ((off_t)c > read_ahead_count)
+			c = read_ahead_count;
+		r = safe_read(read_ahead_fd, ring_chunk_buf(ring, tail) + len, c);
+		if (r < 0) {
+			ring->err = errno;
+			r = 0;
+		}
+		read_ahead_count -= r;
+		len += r;
+		chunk->len = len;
+
+		if (len < chunk_bytes || read_ahead_count == 0)
+			ring->eof = 1;
+		tail++;
+		ring_advance(ring, &ring->tail);
+		if (ring->eof)
+			break;
+	}
+
+	return NULL;
+}
+
+static off_t playback_read_ahead(int fd, size_t loaded, off_t count, char *name)
+{
+	struct chunk_ring *ring = &read_ring;
+	off_t written = 0;
+	unsigned int head = 0;
+
+	ring_init(ring, read_ahead);
+
+	if ((off_t)loaded > count)
+		loaded = count;
+	memcpy(ring->buf, audiobuf, loaded);
+	ring->chunks[0].len = loaded;
+	read_ahead_fd = fd;
+	read_ahead_count = count - loaded;
+
+	ring_start(ring, read_ahead_thread);
+
+	/* fill the ring before starting the stream */
+	while (!in_aborting && ring_load(&ring->tail) < ring->depth &&
+	       !ring_load(&ring->eof))
+		ring_wait(ring, &ring->tail, ring_load(&ring->tail), 1);
+
+	while (!in_aborting) {
+		struct ring_chunk *chunk = ring_chunk(ring, head);
+		int l, r;
+
+		if (ring_load(&ring->tail) == head) {
+			if (ring_load(&ring->eof) &&
+			    ring_load(&ring->tail) == head)
+				break;
+			ring->stalls++;
+			ring_wait(ring, &ring->tail, head, 1);
+			continue;
+		}
+
+		if (ring->err && chunk->len < chunk_bytes) {
+			errno = ring->err;
+			perror(name);
+			prg_exit(EXIT_FAILURE);
+		}
+		fdcount += chunk->len;
+		l = chunk->len * 8 / bits_per_frame;
+		if (l > 0 && !gapless_hold(ring_chunk_buf(ring, head), l)) {
+			r = pcm_write(ring_chunk_buf(ring, head), l);
+			if (r != l)
+				break;
+			written += r * bits_per_frame / 8;
+		}
+		chunk->len = 0;
+		head++;
+		ring_advance(ring, &ring->head);
+	}
+
+	pthread_cancel(ring->thread);
+	ring_destroy(ring);
+
+	if (verbose)
+		fprintf(stderr, _("Read-ahead: %u underflows in %u chunks\n"),
+			ring->stalls, head);
+
+	return written;
+}
+
 /* playing raw data */
 
 static void playback_go(int fd, size_t loaded, off_t count, int rtype, char *name)
@@ -2854,7 +3985,11 @@ static void playback_go(int fd, size_t loaded, off_t count, int rtype, char *nam
 	off_t c;
 
 	header(rtype, name);
-	set_params();
+	if (!gapless_continue()) {
+		set_params();
+		gapless_configure();
+	}
+	gapless_prepend(&loaded, &count);
 
 	while (loaded > chunk_bytes && written < count && !in_aborting) {
 		if (pcm_write(audiobuf + written, chunk_size) <= 0)
@@ -2865,8 +4000,14 @@ static void playback_go(int fd, size_t loaded, off_t count, int rtype, char *nam
 	if (written > 0 && loaded > 0)
 		memmove(audiobuf, audiobuf + written, loaded);
 
+	if (read_ahead > 0 && written < count && !in_aborting)
+		written += playback_read_ahead(fd, loaded, count - written, name);
+	else if (mmap_direct && written < count && !in_aborting)
+		written += playback_direct(fd, loaded, count - written, name);
+
 	l = loaded;
-	while (written < count && !in_aborting) {
+	while (read_ahead == 0 && !mmap_direct && written < count &&
+	       !in_aborting) {
 		do {
 			c = count - written;
 			if (c > chunk_bytes)
@@ -2893,6 +4034,8 @@ static void playback_go(int fd, size_t loaded, off_t count, int rtype, char *nam
 			l += r;
 		} while ((size_t)l < chunk_bytes);
 		l = l * 8 / bits_per_frame;
+		if (gapless_hold(audiobuf, l))
+			break;
 		r = pcm_write(audiobuf, l);
 		if (r != l)
 			break;
@@ -2900,7 +4043,7 @@ static void playback_go(int fd, size_t loaded, off_t count, int rtype, char *nam
 		written += r;
 		l = 0;
 	}
-	if (!in_aborting) {
+	if (!in_aborting && !gap.configured) {
 		snd_pcm_nonblock(handle, 0);
 		snd_pcm_drain(handle);
 		snd_pcm_nonblock(handle, nonblock);
@@ -3007,7 +4150,7 @@ static void playback(char *name)
 		name = "stdin";
 	} else {
 		init_stdin();
-		if ((fd = open(name, O_RDONLY, 0)) == -1) {
+		if ((fd = gapless_open(name)) == -1) {
 			perror(name);
 			prg_exit(EXIT_FAILURE);
 		}
@@ -3109,23 +4252,20 @@ size_t mystrftime(char *s, size_t max, const char *userformat,
 }
 
 static int new_capture_file(char *name, char *namebuf, size_t namelen,
-			    int filecount)
+			    int filecount, time_t t)
 {
 	char *s;
 	char buf[PATH_MAX-10];
-	time_t t;
-	struct tm *tmp;
+	struct tm tm;
 
 	if (use_strftime) {
-		t = time(NULL);
-		tmp = localtime(&t);
-		if (tmp == NULL) {
+		if (localtime_r(&t, &tm) == NULL) {
 			perror("localtime");
-			prg_exit(EXIT_FAILURE);
+			return -1;
 		}
-		if (mystrftime(namebuf, namelen, name, tmp, filecount+1) == 0) {
+		if (mystrftime(namebuf, namelen, name, &tm, filecount+1) == 0) {
 			fprintf(stderr, "mystrftime returned 0");
-			prg_exit(EXIT_FAILURE);
+			return -1;
 		}
 		return filecount;
 	}
@@ -3215,14 +4355,308 @@ static int safe_open(const char *name)
 	return fd;
 }
 
+/* the file being captured, shared with the thread for write-behind */
+static struct {
+	char *orig_name;
+	char *name;
+	char namebuf[PATH_MAX+2];
+	int filecount;
+	int tostdout;
+} cap;
+
+static off_t capture_file_size(off_t count)
+{
+	off_t rest = count;
+
+	if (rest > fmt_rec_table[file_type].max_filesize)
+		rest = fmt_rec_table[file_type].max_filesize;
+	if (max_file_size && (rest > max_file_size))
+		rest = max_file_size;
+	return rest;
+}
+
+/* the time is given for the name of file by strftime */
+static int open_capture_file(off_t rest, time_t t)
+{
+	struct stat statbuf;
+
+	/* open a file to write */
+	if (!cap.tostdout) {
+		/* upon the second file we start the numbering scheme */
+		if (cap.filecount || use_strftime) {
+			cap.filecount = new_capture_file(cap.orig_name,
+							 cap.namebuf,
+							 sizeof(cap.namebuf),
+							 cap.filecount, t);
+			if (cap.filecount < 0)
+				return -1;
+			cap.name = cap.namebuf;
+		}
+
+		/* open a new file */
+		if (!lstat(cap.name, &statbuf)) {
+			if (S_ISREG(statbuf.st_mode))
+				remove(cap.name);
+		}
+		fd = safe_open(cap.name);
+		if (fd < 0) {
+			perror(cap.name);
+			return -1;
+		}
+		cap.filecount++;
+	}
+
+	/* setup sample header */
+	fdcount = 0;
+	if (fmt_rec_table[file_type].start &&
+	    fmt_rec_table[file_type].start(fd, rest) < 0)
+		return -1;
+	return 0;
+}
+
+static int close_capture_file(void)
+{
+	int err = 0;
+
+	/* finish sample container */
+	if (!cap.tostdout) {
+		if (fmt_rec_table[file_type].end &&
+		    fmt_rec_table[file_type].end(fd, fdcount) < 0)
+			err = -1;
+		close(fd);
+		fd = -1;
+	}
+	return err;
+}
+
+static int capture_continues(off_t count)
+{
+	/* repeat the loop when format is raw without timelimit or
+	 * requested counts of data are recorded
+	 */
+	return (file_type == FORMAT_RAW && !timelimit && !sampleslimit) ||
+	       count > 0;
+}
+
+/* capture with direct access to mmap area */
+static void capture_direct(off_t *count, off_t *rest)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, r;
+
+	while (*rest > 0 && recycle_capture_file == 0 && !in_aborting) {
+		snd_pcm_uframes_t f = chunk_size;
+		u_char *src, *buf;
+		size_t save;
+		int err;
+
+		if (*rest < (off_t)chunk_bytes)
+			f = *rest * 8 / bits_per_frame;
+		if (f == 0) {
+			*count -= *rest;
+			*rest = 0;
+			break;
+		}
+
+		check_stdin();
+		if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+			err = snd_pcm_start(handle);
+			if (err < 0) {
+				direct_recover(err);
+				continue;
+			}
+		}
+		avail = snd_pcm_avail_update(handle);
+		if (avail < 0) {
+			direct_recover(avail);
+			continue;
+		}
+		if ((snd_pcm_uframes_t)avail < f) {
+			if (!test_nowait)
+				snd_pcm_wait(handle, 100);
+			continue;
+		}
+
+		frames = f;
+		err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+		if (err < 0) {
+			direct_recover(err);
+			continue;
+		}
+		src = direct_area(areas, offset);
+		if (vumeter)
+			compute_max_peak(src, frames * hwparams.channels);
+		buf = remap_buffer(src);
+		if (buf != src)
+			remap_copy(buf, src, frames);
+
+		save = frames * bits_per_frame / 8;
+		if (xwrite(fd, buf, save) != save) {
+			perror(cap.name);
+			in_aborting = 1;
+			break;
+		}
+		fdcount += save;
+		*count -= save;
+		*rest -= save;
+
+		r = snd_pcm_mmap_commit(handle, offset, frames);
+		if (r < 0)
+			direct_recover(r);
+		else
+			xrun_log_transfer();
+	}
+}
+
+/*
+ * Write-behind for capture
+ *
+ * The main thread puts markers in the ring at the boundaries of files. The
+ * thread opens the files and writes their headers at the markers, writes
+ * chunks to the file, then finishes and closes it, so that disk I/O and the
+ * rotation of files never delay the PCM. The state of the files is owned by
+ * the thread, and the errors are reported by the status of the ring.
+ */
+static struct chunk_ring write_ring;
+
+static void *write_behind_thread(void *arg)
+{
+	struct chunk_ring *ring = arg;
+	unsigned int head = 0;
+
+	while (1) {
+		struct ring_chunk *chunk = ring_chunk(ring, head);
+		unsigned int flags;
+
+		if (ring_load(&ring->tail) == head) {
+			ring_wait(ring, &ring->tail, head, 0);
+			continue;
+		}
+
+		/* keep consuming chunks after an error till the end */
+		flags = chunk->flags;
+		if ((flags & CHUNK_FILE_START) && !ring->err &&
+		    open_capture_file(chunk->size, chunk->time) < 0)
+			ring->err = errno ? errno : EIO;
+		if (!ring->err && chunk->len > 0) {
+			if (xwrite(fd, ring_chunk_buf(ring, head), chunk->len) !=
+			    chunk->len) {
+				ring->err = errno;
+				perror(cap.name);
+			} else {
+				fdcount += chunk->len;
+			}
+		}
+		if ((flags & CHUNK_FILE_END) && fd >= 0 && !cap.tostdout) {
+			if (ring->err) {
+				close(fd);
+				fd = -1;
+			} else if (close_capture_file() < 0) {
+				ring->err = errno ? errno : EIO;
+				perror(cap.name);
+			}
+		}
+		if (ring->err)
+			in_aborting = 1;
+
+		head++;
+		ring_advance(ring, &ring->head);
+		if (flags & CHUNK_LAST)
+			break;
+	}
+
+	return NULL;
+}
+
+static struct ring_chunk *write_behind_chunk(struct chunk_ring *ring,
+					     unsigned int tail)
+{
+	unsigned int head = ring_load(&ring->head);
+
+	if (tail - head == ring->depth) {
+		ring->stalls++;
+		do {
+			ring_wait(ring, &ring->head, head, 0);
+			head = ring_load(&ring->head);
+		} while (tail - head == ring->depth);
+	}
+	return ring_chunk(ring, tail);
+}
+
+/* the size is given for the header of the next file */
+static void write_behind_marker(struct chunk_ring *ring, unsigned int *tail,
+				unsigned int flags, off_t size)
+{
+	struct ring_chunk *chunk = write_behind_chunk(ring, *tail);
+
+	chunk->len = 0;
+	chunk->flags = flags;
+	if (flags & CHUNK_FILE_START) {
+		chunk->size = size;
+		chunk->time = time(NULL);
+	}
+	++*tail;
+	ring_advance(ring, &ring->tail);
+}
+
+static void capture_write_behind(off_t count)
+{
+	struct chunk_ring *ring = &write_ring;
+	unsigned int tail = 0;
+	off_t rest;
+
+	ring_init(ring, write_behind);
+	ring_start(ring, write_behind_thread);
+
+	while (1) {
+		rest = capture_file_size(count);
+		write_behind_marker(ring, &tail, CHUNK_FILE_START, rest);
+
+		/* capture */
+		while (rest > 0 && recycle_capture_file == 0 && !in_aborting) {
+			size_t c = (rest <= (off_t)chunk_bytes) ?
+				(size_t)rest : chunk_bytes;
+			size_t f = c * 8 / bits_per_frame;
+			struct ring_chunk *chunk = write_behind_chunk(ring, tail);
+			size_t read = pcm_read(ring_chunk_buf(ring, tail), f);
+			if (read != f)
+				in_aborting = 1;
+			chunk->len = read * bits_per_frame / 8;
+			chunk->flags = 0;
+			tail++;
+			ring_advance(ring, &ring->tail);
+			count -= c;
+			rest -= c;
+		}
+
+		/* re-enable SIGUSR1 signal */
+		if (recycle_capture_file) {
+			recycle_capture_file = 0;
+			signal(SIGUSR1, signal_handler_recycle);
+		}
+
+		if (in_aborting || !capture_continues(count)) {
+			write_behind_marker(ring, &tail,
+					    CHUNK_FILE_END | CHUNK_LAST, 0);
+			break;
+		}
+		write_behind_marker(ring, &tail, CHUNK_FILE_END, 0);
+	}
+
+	ring_destroy(ring);
+
+	if (verbose)
+		fprintf(stderr, _("Write-behind: %u overflows in %u chunks\n"),
+			ring->stalls, tail);
+
+	if (in_aborting || ring->err)
+		prg_exit(EXIT_FAILURE);
+}
+
 static void capture(char *orig_name)
 {
-	int tostdout=0;		/* boolean which describes output stream */
-	int filecount=0;	/* number of files written */
-	char *name = orig_name;	/* current filename */
-	char namebuf[PATH_MAX+2];
 	off_t count, rest;		/* number of bytes to capture */
-	struct stat statbuf;
 
 	/* setup sound hardware */
 	set_params();
@@ -3243,54 +4677,36 @@ static void capture(char *orig_name)
 		count -= count % 2;
 
 	/* display verbose output to console */
-	header(file_type, name);
+	header(file_type, orig_name);
+
+	cap.orig_name = orig_name;
+	cap.name = orig_name;
+	cap.filecount = 0;
+	cap.tostdout = 0;
 
 	/* write to stdout? */
-	if (!name || !strcmp(name, "-")) {
+	if (!orig_name || !strcmp(orig_name, "-")) {
 		fd = fileno(stdout);
-		name = "stdout";
-		tostdout = 1;
+		cap.name = "stdout";
+		cap.tostdout = 1;
 		if (count > fmt_rec_table[file_type].max_filesize)
 			count = fmt_rec_table[file_type].max_filesize;
 	}
 	init_stdin();
 
-	do {
-		/* open a file to write */
-		if (!tostdout) {
-			/* upon the second file we start the numbering scheme */
-			if (filecount || use_strftime) {
-				filecount = new_capture_file(orig_name, namebuf,
-							     sizeof(namebuf),
-							     filecount);
-				name = namebuf;
-			}
-			
-			/* open a new file */
-			if (!lstat(name, &statbuf)) {
-				if (S_ISREG(statbuf.st_mode))
-					remove(name);
-			}
-			fd = safe_open(name);
-			if (fd < 0) {
-				perror(name);
-				prg_exit(EXIT_FAILURE);
-			}
-			filecount++;
-		}
-
-		rest = count;
-		if (rest > fmt_rec_table[file_type].max_filesize)
-			rest = fmt_rec_table[file_type].max_filesize;
-		if (max_file_size && (rest > max_file_size)) 
-			rest = max_file_size;
+	if (write_behind > 0) {
+		capture_write_behind(count);
+		return;
+	}
 
-		/* setup sample header */
-		if (fmt_rec_table[file_type].start)
-			fmt_rec_table[file_type].start(fd, rest);
+	do {
+		rest = capture_file_size(count);
+		if (open_capture_file(rest, time(NULL)) < 0)
+			prg_exit(EXIT_FAILURE);
 
 		/* capture */
-		fdcount = 0;
+		if (mmap_direct)
+			capture_direct(&count, &rest);
 		while (rest > 0 && recycle_capture_file == 0 && !in_aborting) {
 			size_t c = (rest <= (off_t)chunk_bytes) ?
 				(size_t)rest : chunk_bytes;
@@ -3301,7 +4717,7 @@ static void capture(char *orig_name)
 				in_aborting = 1;
 			save = read * bits_per_frame / 8;
 			if (xwrite(fd, audiobuf, save) != save) {
-				perror(name);
+				perror(cap.name);
 				in_aborting = 1;
 				break;
 			}
@@ -3316,21 +4732,14 @@ static void capture(char *orig_name)
 			signal(SIGUSR1, signal_handler_recycle);
 		}
 
-		/* finish sample container */
-		if (!tostdout) {
-			if (fmt_rec_table[file_type].end)
-				fmt_rec_table[file_type].end(fd);
-			close(fd);
-			fd = -1;
+		if (close_capture_file() < 0) {
+			error(_("write error"));
+			prg_exit(EXIT_FAILURE);
 		}
 
 		if (in_aborting)
 			prg_exit(EXIT_FAILURE);
-
-		/* repeat the loop when format is raw without timelimit or
-		 * requested counts of data are recorded
-		 */
-	} while ((file_type == FORMAT_RAW && !timelimit && !sampleslimit) || count > 0);
+	} while (capture_continues(count));
 }
 
 static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off_t count, int rtype, char **names)
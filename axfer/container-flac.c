@@ -0,0 +1,1425 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// container-flac.c - a parser/builder for a container of FLAC.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include "container.h"
+#include "misc.h"
+
+// Reference:
+//  * https://xiph.org/flac/format.html
+//  * RFC 9639 Free Lossless Audio Codec (FLAC)
+//
+// In this file, 'frame' means a set of samples for all channels as the other
+// parts of axfer, while 'block' means the unit to be encoded which is called
+// as 'frame' in the specification.
+
+#define FLAC_MAGIC		"fLaC"
+
+#define STREAMINFO_SIZE		34
+#define MAX_CHANNELS		8
+#define MAX_FIXED_ORDER		4
+#define MAX_LPC_ORDER		32
+#define MAX_PARTITION_ORDER	8
+
+// The number of frames in a block encoded by the builder.
+#define FRAMES_PER_BLOCK	4096
+
+// The size of buffer to read encoded blocks.
+#define READ_BUFFER_SIZE	4096
+
+enum metadata_type {
+	METADATA_TYPE_STREAMINFO = 0,
+	METADATA_TYPE_PADDING,
+	METADATA_TYPE_APPLICATION,
+	METADATA_TYPE_SEEKTABLE,
+	METADATA_TYPE_VORBIS_COMMENT,
+	METADATA_TYPE_CUESHEET,
+	METADATA_TYPE_PICTURE,
+};
+
+enum channel_assignment {
+	// 0-7 for independent channels.
+	CHANNEL_ASSIGNMENT_LEFT_SIDE = 8,
+	CHANNEL_ASSIGNMENT_SIDE_RIGHT,
+	CHANNEL_ASSIGNMENT_MID_SIDE,
+};
+
+enum subframe_type {
+	SUBFRAME_TYPE_CONSTANT = 0x00,
+	SUBFRAME_TYPE_VERBATIM = 0x01,
+	SUBFRAME_TYPE_FIXED = 0x08,	// 0x08-0x0c.
+	SUBFRAME_TYPE_LPC = 0x20,	// 0x20-0x3f.
+};
+
+struct format_map {
+	snd_pcm_format_t format;
+	unsigned int bits_per_sample;
+};
+
+// The first entry for the width of sample is used by parser.
+static const struct format_map format_maps[] = {
+	{SND_PCM_FORMAT_S8,		8},
+	{SND_PCM_FORMAT_S16_LE,		16},
+	{SND_PCM_FORMAT_S20_3LE,	20},
+	{SND_PCM_FORMAT_S24_3LE,	24},
+	{SND_PCM_FORMAT_S32_LE,		32},
+	{SND_PCM_FORMAT_S24_LE,		24},
+};
+
+// Codes in header of block for commonly-used parameters.
+static const unsigned int rate_codes[] = {
+	[1] = 88200,
+	[2] = 176400,
+	[3] = 192000,
+	[4] = 8000,
+	[5] = 16000,
+	[6] = 22050,
+	[7] = 24000,
+	[8] = 32000,
+	[9] = 44100,
+	[10] = 48000,
+	[11] = 96000,
+};
+
+static const unsigned int bits_per_sample_codes[] = {
+	[1] = 8,
+	[2] = 12,
+	[4] = 16,
+	[5] = 20,
+	[6] = 24,
+	[7] = 32,
+};
+
+struct streaminfo {
+	unsigned int min_block_size;
+	unsigned int max_block_size;
+	unsigned int min_encoded_size;
+	unsigned int max_encoded_size;
+	unsigned int frames_per_second;
+	unsigned int samples_per_frame;
+	unsigned int bits_per_sample;
+	uint64_t frame_count;
+};
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+static void prepare_crc_tables(void)
+{
+	unsigned int i, j;
+	uint8_t crc8;
+	uint16_t crc16;
+
+	if (crc16_table[1] != 0)
+		return;
+
+	for (i = 0; i < 256; ++i) {
+		crc8 = i;
+		crc16 = i << 8;
+		for (j = 0; j < 8; ++j) {
+			crc8 = (crc8 << 1) ^ ((crc8 & 0x80) ? 0x07 : 0);
+			crc16 = (crc16 << 1) ^ ((crc16 & 0x8000) ? 0x8005 : 0);
+		}
+		crc8_table[i] = crc8;
+		crc16_table[i] = crc16;
+	}
+}
+
+static uint8_t calculate_crc8(const uint8_t *buf, unsigned int size)
+{
+	uint8_t crc = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; ++i)
+		crc = crc8_table[crc ^ buf[i]];
+
+	return crc;
+}
+
+static uint16_t calculate_crc16(const uint8_t *buf, unsigned int size)
+{
+	uint16_t crc = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; ++i)
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ buf[i]];
+
+	return crc;
+}
+
+static void build_streaminfo(uint8_t *buf, const struct streaminfo *info)
+{
+	buf[0] = info->min_block_size >> 8;
+	buf[1] = info->min_block_size;
+	buf[2] = info->max_block_size >> 8;
+	buf[3] = info->max_block_size;
+	buf[4] = info->min_encoded_size >> 16;
+	buf[5] = info->min_encoded_size >> 8;
+	buf[6] = info->min_encoded_size;
+	buf[7] = info->max_encoded_size >> 16;
+	buf[8] = info->max_encoded_size >> 8;
+	buf[9] = info->max_encoded_size;
+	// 20 bits for rate, 3 bits for channels, 5 bits for sample width and
+	// 36 bits for the number of frames.
+	buf[10] = info->frames_per_second >> 12;
+	buf[11] = info->frames_per_second >> 4;
+	buf[12] = ((info->frames_per_second & 0x0f) << 4) |
+		  ((info->samples_per_frame - 1) << 1) |
+		  ((info->bits_per_sample - 1) >> 4);
+	buf[13] = (((info->bits_per_sample - 1) & 0x0f) << 4) |
+		  ((info->frame_count >> 32) & 0x0f);
+	buf[14] = info->frame_count >> 24;
+	buf[15] = info->frame_count >> 16;
+	buf[16] = info->frame_count >> 8;
+	buf[17] = info->frame_count;
+	// MD5 signature is not calculated.
+	memset(buf + 18, 0, 16);
+}
+
+static void parse_streaminfo(const uint8_t *buf, struct streaminfo *info)
+{
+	info->min_block_size = (buf[0] << 8) | buf[1];
+	info->max_block_size = (buf[2] << 8) | buf[3];
+	info->min_encoded_size = (buf[4] << 16) | (buf[5] << 8) | buf[6];
+	info->max_encoded_size = (buf[7] << 16) | (buf[8] << 8) | buf[9];
+	info->frames_per_second = (buf[10] << 12) | (buf[11] << 4) |
+				  (buf[12] >> 4);
+	info->samples_per_frame = ((buf[12] >> 1) & 0x07) + 1;
+	info->bits_per_sample = (((buf[12] & 0x01) << 4) | (buf[13] >> 4)) + 1;
+	info->frame_count = ((uint64_t)(buf[13] & 0x0f) << 32) |
+			    ((uint64_t)buf[14] << 24) | (buf[15] << 16) |
+			    (buf[16] << 8) | buf[17];
+}
+
+// Little-endian samples in ALSA formats.
+static int32_t unpack_sample(const uint8_t *src, unsigned int bytes_per_sample,
+			     unsigned int bits_per_sample)
+{
+	uint32_t val = 0;
+	unsigned int shift;
+	int i;
+
+	for (i = bytes_per_sample - 1; i >= 0; --i)
+		val = (val << 8) | src[i];
+
+	// Sign extension.
+	shift = 32 - bits_per_sample;
+	return (int32_t)(val << shift) >> shift;
+}
+
+static void pack_sample(uint8_t *dst, int32_t sample,
+			unsigned int bytes_per_sample)
+{
+	uint32_t val = sample;
+	int i;
+
+	for (i = 0; i < bytes_per_sample; ++i) {
+		dst[i] = val;
+		val >>= 8;
+	}
+}
+
+struct bit_writer {
+	uint8_t *buf;
+	unsigned int pos;
+	uint64_t acc;
+	unsigned int bits;
+};
+
+static void put_bits(struct bit_writer *writer, unsigned int count,
+		     uint32_t val)
+{
+	if (count == 0)
+		return;
+
+	writer->acc = (writer->acc << count) |
+		      (val & (uint32_t)(((uint64_t)1 << count) - 1));
+	writer->bits += count;
+	while (writer->bits >= 8) {
+		writer->bits -= 8;
+		writer->buf[writer->pos++] = writer->acc >> writer->bits;
+	}
+}
+
+static void put_unary(struct bit_writer *writer, uint64_t count)
+{
+	while (count >= 32) {
+		put_bits(writer, 32, 0);
+		count -= 32;
+	}
+	put_bits(writer, count + 1, 1);
+}
+
+static void align_to_byte(struct bit_writer *writer)
+{
+	if (writer->bits > 0)
+		put_bits(writer, 8 - writer->bits, 0);
+}
+
+static void put_utf8_number(struct bit_writer *writer, uint32_t val)
+{
+	unsigned int count;
+	int i;
+
+	if (val < 0x80) {
+		put_bits(writer, 8, val);
+		return;
+	}
+
+	// The number of following bytes.
+	if (val < 0x800)
+		count = 1;
+	else if (val < 0x10000)
+		count = 2;
+	else if (val < 0x200000)
+		count = 3;
+	else if (val < 0x4000000)
+		count = 4;
+	else
+		count = 5;
+
+	put_bits(writer, 8, ((0xff00 >> (count + 1)) & 0xff) |
+			    (val >> (6 * count)));
+	for (i = count - 1; i >= 0; --i)
+		put_bits(writer, 8, 0x80 | ((val >> (6 * i)) & 0x3f));
+}
+
+static inline uint64_t fold_residual(int64_t residual)
+{
+	return ((uint64_t)residual << 1) ^ (uint64_t)(residual >> 63);
+}
+
+// Residuals should be represented in 32 bit signed integer.
+static int calculate_fixed_residuals(const int32_t *samples,
+				     unsigned int count, unsigned int order,
+				     int64_t *residuals)
+{
+	const int32_t *x = samples;
+	int i;
+
+	for (i = order; i < count; ++i) {
+		switch (order) {
+		case 0:
+			residuals[i] = x[i];
+			break;
+		case 1:
+			residuals[i] = (int64_t)x[i] - x[i - 1];
+			break;
+		case 2:
+			residuals[i] = (int64_t)x[i] - 2ll * x[i - 1] +
+				       x[i - 2];
+			break;
+		case 3:
+			residuals[i] = (int64_t)x[i] - 3ll * x[i - 1] +
+				       3ll * x[i - 2] - x[i - 3];
+			break;
+		default:
+			residuals[i] = (int64_t)x[i] - 4ll * x[i - 1] +
+				       6ll * x[i - 2] - 4ll * x[i - 3] +
+				       x[i - 4];
+			break;
+		}
+
+		if (residuals[i] < INT32_MIN || residuals[i] > INT32_MAX)
+			return -ERANGE;
+	}
+
+	return 0;
+}
+
+struct rice_coding {
+	unsigned int partition_order;
+	unsigned int params[1 << MAX_PARTITION_ORDER];
+	unsigned int param_bits;
+	uint64_t bit_count;
+};
+
+static unsigned int estimate_rice_param(uint64_t sum, unsigned int count)
+{
+	unsigned int param = 0;
+
+	while (param < 30 && ((uint64_t)count << (param + 1)) < sum)
+		++param;
+
+	return param;
+}
+
+// Select the order of partitions and Rice parameters with the least bits.
+static void select_rice_coding(const int64_t *residuals, unsigned int count,
+			       unsigned int order, struct rice_coding *rice)
+{
+	struct rice_coding candidate;
+	unsigned int partition_order;
+	unsigned int partition_count;
+	unsigned int begin, end;
+	unsigned int max_param;
+	uint64_t sum;
+	int i, j;
+
+	rice->bit_count = UINT64_MAX;
+
+	for (partition_order = 0; partition_order <= MAX_PARTITION_ORDER;
+	     ++partition_order) {
+		partition_count = 1 << partition_order;
+		if (count % partition_count != 0 ||
+		    count / partition_count <= order)
+			break;
+
+		candidate.partition_order = partition_order;
+		candidate.bit_count = 2 + 4;
+		max_param = 0;
+
+		for (i = 0; i < partition_count; ++i) {
+			begin = i * (count / partition_count);
+			end = begin + count / partition_count;
+			if (i == 0)
+				begin = order;
+
+			sum = 0;
+			for (j = begin; j < end; ++j)
+				sum += fold_residual(residuals[j]);
+
+			candidate.params[i] = estimate_rice_param(sum,
+								  end - begin);
+			if (candidate.params[i] > max_param)
+				max_param = candidate.params[i];
+
+			candidate.bit_count += (uint64_t)(end - begin) *
+					       (candidate.params[i] + 1) +
+					       (sum >> candidate.params[i]);
+		}
+
+		// Parameters larger than 14 require 5 bits.
+		candidate.param_bits = (max_param > 14) ? 5 : 4;
+		candidate.bit_count += candidate.param_bits * partition_count;
+
+		if (candidate.bit_count < rice->bit_count)
+			*rice = candidate;
+	}
+}
+
+static void put_residuals(struct bit_writer *writer, const int64_t *residuals,
+			  unsigned int count, unsigned int order,
+			  const struct rice_coding *rice)
+{
+	unsigned int partition_count = 1 << rice->partition_order;
+	unsigned int begin, end;
+	unsigned int param;
+	uint64_t val;
+	int i, j;
+
+	put_bits(writer, 2, rice->param_bits == 5 ? 1 : 0);
+	put_bits(writer, 4, rice->partition_order);
+
+	for (i = 0; i < partition_count; ++i) {
+		begin = i * (count / partition_count);
+		end = begin + count / partition_count;
+		if (i == 0)
+			begin = order;
+
+		param = rice->params[i];
+		put_bits(writer, rice->param_bits, param);
+
+		for (j = begin; j < end; ++j) {
+			val = fold_residual(residuals[j]);
+			put_unary(writer, val >> param);
+			put_bits(writer, param, (uint32_t)val);
+		}
+	}
+}
+
+struct builder_state {
+	struct streaminfo info;
+	unsigned int bytes_per_sample;
+	unsigned int rate_code;
+	unsigned int bits_per_sample_code;
+
+	// Frames to be encoded.
+	uint8_t *frame_buf;
+	unsigned int frame_count;
+
+	int32_t *samples[MAX_CHANNELS];
+	int64_t *residuals;
+	uint8_t *block_buf;
+	uint32_t block_index;
+};
+
+static void encode_subframe(struct builder_state *state,
+			    struct bit_writer *writer, const int32_t *samples,
+			    unsigned int count)
+{
+	unsigned int bits_per_sample = state->info.bits_per_sample;
+	struct rice_coding rice;
+	struct rice_coding best_rice;
+	unsigned int best_order;
+	uint64_t best_bit_count;
+	unsigned int order;
+	int i;
+
+	for (i = 1; i < count; ++i) {
+		if (samples[i] != samples[0])
+			break;
+	}
+	if (i == count) {
+		put_bits(writer, 8, SUBFRAME_TYPE_CONSTANT << 1);
+		put_bits(writer, bits_per_sample, samples[0]);
+		return;
+	}
+
+	// Verbatim is used unless any predictor is better.
+	best_bit_count = (uint64_t)count * bits_per_sample;
+	best_order = MAX_FIXED_ORDER + 1;
+
+	for (order = 0; order <= MAX_FIXED_ORDER && order < count; ++order) {
+		if (calculate_fixed_residuals(samples, count, order,
+					      state->residuals) < 0)
+			continue;
+		select_rice_coding(state->residuals, count, order, &rice);
+		if (rice.bit_count == UINT64_MAX)
+			continue;
+		rice.bit_count += (uint64_t)order * bits_per_sample;
+
+		if (rice.bit_count < best_bit_count) {
+			best_bit_count = rice.bit_count;
+			best_order = order;
+			best_rice = rice;
+		}
+	}
+
+	if (best_order > MAX_FIXED_ORDER) {
+		put_bits(writer, 8, SUBFRAME_TYPE_VERBATIM << 1);
+		for (i = 0; i < count; ++i)
+			put_bits(writer, bits_per_sample, samples[i]);
+		return;
+	}
+
+	put_bits(writer, 8, (SUBFRAME_TYPE_FIXED + best_order) << 1);
+	for (i = 0; i < best_order; ++i)
+		put_bits(writer, bits_per_sample, samples[i]);
+
+	calculate_fixed_residuals(samples, count, best_order, state->residuals);
+	put_residuals(writer, state->residuals, count, best_order, &best_rice);
+}
+
+static int encode_block(struct container_context *cntr)
+{
+	struct builder_state *state = cntr->private_data;
+	unsigned int samples_per_frame = state->info.samples_per_frame;
+	unsigned int bytes_per_frame = state->bytes_per_sample *
+				       samples_per_frame;
+	unsigned int count = state->frame_count;
+	struct bit_writer writer = {0};
+	const uint8_t *src;
+	int i, j;
+
+	// Deinterleave samples.
+	for (i = 0; i < count; ++i) {
+		src = state->frame_buf + bytes_per_frame * i;
+		for (j = 0; j < samples_per_frame; ++j) {
+			state->samples[j][i] = unpack_sample(src,
+						state->bytes_per_sample,
+						state->info.bits_per_sample);
+			src += state->bytes_per_sample;
+		}
+	}
+
+	writer.buf = state->block_buf;
+
+	// Header of block with fixed block size.
+	put_bits(&writer, 14, 0x3ffe);
+	put_bits(&writer, 1, 0);
+	put_bits(&writer, 1, 0);
+	put_bits(&writer, 4, 0x07);	// 16 bits at the end of header.
+	put_bits(&writer, 4, state->rate_code);
+	put_bits(&writer, 4, samples_per_frame - 1);
+	put_bits(&writer, 3, state->bits_per_sample_code);
+	put_bits(&writer, 1, 0);
+	put_utf8_number(&writer, state->block_index);
+	put_bits(&writer, 16, count - 1);
+	put_bits(&writer, 8, calculate_crc8(writer.buf, writer.pos));
+
+	// Channels are encoded independently.
+	for (i = 0; i < samples_per_frame; ++i)
+		encode_subframe(state, &writer, state->samples[i], count);
+
+	align_to_byte(&writer);
+	put_bits(&writer, 16, calculate_crc16(writer.buf, writer.pos));
+
+	if (state->info.min_encoded_size == 0 ||
+	    writer.pos < state->info.min_encoded_size)
+		state->info.min_encoded_size = writer.pos;
+	if (writer.pos > state->info.max_encoded_size)
+		state->info.max_encoded_size = writer.pos;
+	state->info.frame_count += count;
+	++state->block_index;
+	state->frame_count = 0;
+
+	return container_recursive_write(cntr, state->block_buf, writer.pos);
+}
+
+static int flac_builder_process_bytes(struct container_context *cntr,
+				      void *buffer, unsigned int byte_count)
+{
+	struct builder_state *state = cntr->private_data;
+	unsigned int bytes_per_frame = state->bytes_per_sample *
+				       state->info.samples_per_frame;
+	const uint8_t *src = buffer;
+	unsigned int frame_count = byte_count / bytes_per_frame;
+	unsigned int count;
+	int err;
+
+	while (frame_count > 0) {
+		count = FRAMES_PER_BLOCK - state->frame_count;
+		if (count > frame_count)
+			count = frame_count;
+
+		memcpy(state->frame_buf + state->frame_count * bytes_per_frame,
+		       src, count * bytes_per_frame);
+		state->frame_count += count;
+		src += count * bytes_per_frame;
+		frame_count -= count;
+
+		if (state->frame_count == FRAMES_PER_BLOCK) {
+			err = encode_block(cntr);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+static int write_stream_header(struct container_context *cntr)
+{
+	struct builder_state *state = cntr->private_data;
+	uint8_t buf[4 + 4 + STREAMINFO_SIZE];
+
+	memcpy(buf, FLAC_MAGIC, 4);
+	// The last metadata block.
+	buf[4] = 0x80 | METADATA_TYPE_STREAMINFO;
+	buf[5] = 0;
+	buf[6] = 0;
+	buf[7] = STREAMINFO_SIZE;
+	build_streaminfo(buf + 8, &state->info);
+
+	return container_recursive_write(cntr, buf, sizeof(buf));
+}
+
+static int flac_builder_pre_process(struct container_context *cntr,
+				    snd_pcm_format_t *format,
+				    unsigned int *samples_per_frame,
+				    unsigned int *frames_per_second,
+				    uint64_t *byte_count)
+{
+	struct builder_state *state = cntr->private_data;
+	unsigned int bytes_per_frame;
+	unsigned int block_size;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(format_maps); ++i) {
+		if (format_maps[i].format == *format)
+			break;
+	}
+	if (i == ARRAY_SIZE(format_maps))
+		return -EINVAL;
+
+	if (*samples_per_frame == 0 || *samples_per_frame > MAX_CHANNELS)
+		return -EINVAL;
+	if (*frames_per_second == 0 || *frames_per_second >= (1 << 20))
+		return -EINVAL;
+
+	state->bytes_per_sample = snd_pcm_format_physical_width(*format) / 8;
+	state->info.min_block_size = FRAMES_PER_BLOCK;
+	state->info.max_block_size = FRAMES_PER_BLOCK;
+	state->info.frames_per_second = *frames_per_second;
+	state->info.samples_per_frame = *samples_per_frame;
+	state->info.bits_per_sample = format_maps[i].bits_per_sample;
+
+	for (i = 0; i < ARRAY_SIZE(rate_codes); ++i) {
+		if (rate_codes[i] == *frames_per_second)
+			break;
+	}
+	state->rate_code = (i < ARRAY_SIZE(rate_codes)) ? i : 0;
+
+	for (i = 0; i < ARRAY_SIZE(bits_per_sample_codes); ++i) {
+		if (bits_per_sample_codes[i] == state->info.bits_per_sample)
+			break;
+	}
+	state->bits_per_sample_code = i;
+
+	bytes_per_frame = state->bytes_per_sample * *samples_per_frame;
+	state->frame_buf = malloc(FRAMES_PER_BLOCK * bytes_per_frame);
+	if (state->frame_buf == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < *samples_per_frame; ++i) {
+		state->samples[i] = malloc(FRAMES_PER_BLOCK *
+					   sizeof(*state->samples[i]));
+		if (state->samples[i] == NULL)
+			return -ENOMEM;
+	}
+
+	state->residuals = malloc(FRAMES_PER_BLOCK * sizeof(*state->residuals));
+	if (state->residuals == NULL)
+		return -ENOMEM;
+
+	// Verbatim subframes and Rice coding which is at most one bit larger
+	// than its estimation in each partition.
+	block_size = 32 + *samples_per_frame *
+		     (1 + (FRAMES_PER_BLOCK * 32 + 64 +
+			   (6 << MAX_PARTITION_ORDER)) / 8);
+	state->block_buf = malloc(block_size);
+	if (state->block_buf == NULL)
+		return -ENOMEM;
+
+	prepare_crc_tables();
+
+	cntr->process_bytes = flac_builder_process_bytes;
+
+	*byte_count = UINT64_MAX;
+
+	return write_stream_header(cntr);
+}
+
+static int flac_builder_flush(struct container_context *cntr)
+{
+	struct builder_state *state = cntr->private_data;
+
+	if (state->frame_count == 0)
+		return 0;
+
+	return encode_block(cntr);
+}
+
+static void flac_builder_release(struct container_context *cntr)
+{
+	struct builder_state *state = cntr->private_data;
+	int i;
+
+	free(state->frame_buf);
+	for (i = 0; i < MAX_CHANNELS; ++i)
+		free(state->samples[i]);
+	free(state->residuals);
+	free(state->block_buf);
+	memset(state, 0, sizeof(*state));
+}
+
+static int flac_builder_post_process(struct container_context *cntr,
+				     uint64_t handled_byte_count)
+{
+	int err;
+
+	err = container_seek_offset(cntr, 0);
+	if (err < 0)
+		return err;
+
+	return write_stream_header(cntr);
+}
+
+struct bit_reader {
+	struct container_context *cntr;
+	uint8_t buf[READ_BUFFER_SIZE];
+	unsigned int len;
+	unsigned int pos;
+	uint64_t acc;
+	unsigned int bits;
+
+	// CRCs of bytes loaded to the accumulator.
+	uint8_t crc8;
+	uint16_t crc16;
+};
+
+static int fill_byte(struct bit_reader *reader)
+{
+	uint8_t byte;
+	int len;
+
+	if (reader->pos == reader->len) {
+		len = container_partial_read(reader->cntr, reader->buf,
+					     sizeof(reader->buf));
+		if (len < 0)
+			return len;
+		if (len == 0)
+			return -ENODATA;
+		reader->len = len;
+		reader->pos = 0;
+	}
+
+	byte = reader->buf[reader->pos++];
+	reader->acc = (reader->acc << 8) | byte;
+	reader->bits += 8;
+
+	reader->crc8 = crc8_table[reader->crc8 ^ byte];
+	reader->crc16 = (reader->crc16 << 8) ^
+			crc16_table[(reader->crc16 >> 8) ^ byte];
+
+	return 0;
+}
+
+static int get_bits(struct bit_reader *reader, unsigned int count,
+		    uint32_t *val)
+{
+	int err;
+
+	if (count == 0) {
+		*val = 0;
+		return 0;
+	}
+
+	while (reader->bits < count) {
+		err = fill_byte(reader);
+		if (err < 0)
+			return err;
+	}
+
+	reader->bits -= count;
+	*val = (reader->acc >> reader->bits) &
+	       (uint32_t)(((uint64_t)1 << count) - 1);
+
+	return 0;
+}
+
+static int get_signed_bits(struct bit_reader *reader, unsigned int count,
+			   int32_t *val)
+{
+	uint32_t raw;
+	int err;
+
+	err = get_bits(reader, count, &raw);
+	if (err < 0)
+		return err;
+
+	if (count == 0)
+		*val = 0;
+	else if (count == 32)
+		*val = (int32_t)raw;
+	else
+		*val = (int32_t)(raw << (32 - count)) >> (32 - count);
+
+	return 0;
+}
+
+static int get_unary(struct bit_reader *reader, uint32_t *count)
+{
+	uint32_t bit;
+	int err;
+
+	*count = 0;
+	while (1) {
+		err = get_bits(reader, 1, &bit);
+		if (err < 0)
+			return err;
+		if (bit)
+			break;
+		++*count;
+	}
+
+	return 0;
+}
+
+static void skip_to_byte(struct bit_reader *reader)
+{
+	reader->bits -= reader->bits % 8;
+}
+
+// Any byte is not left in the accumulator at the boundary of byte, thus the
+// CRCs cover the bytes up to the current position.
+static void reset_crcs(struct bit_reader *reader)
+{
+	reader->crc8 = 0;
+	reader->crc16 = 0;
+}
+
+struct parser_state {
+	struct streaminfo info;
+	unsigned int bytes_per_sample;
+
+	struct bit_reader reader;
+	int32_t *samples[MAX_CHANNELS];
+	unsigned int max_block_size;
+
+	// Decoded frames.
+	uint8_t *frame_buf;
+	unsigned int frame_count;
+	unsigned int frame_pos;
+};
+
+static int get_residuals(struct bit_reader *reader, int32_t *residuals,
+			 unsigned int count, unsigned int order)
+{
+	unsigned int partition_count;
+	unsigned int param_bits;
+	unsigned int escape;
+	unsigned int begin, end;
+	uint32_t method;
+	uint32_t partition_order;
+	uint32_t param;
+	uint32_t quotient;
+	uint32_t remainder;
+	uint32_t val;
+	int i, j;
+	int err;
+
+	err = get_bits(reader, 2, &method);
+	if (err < 0)
+		return err;
+	if (method > 1)
+		return -EINVAL;
+	param_bits = (method == 0) ? 4 : 5;
+	escape = (1 << param_bits) - 1;
+
+	err = get_bits(reader, 4, &partition_order);
+	if (err < 0)
+		return err;
+	partition_count = 1 << partition_order;
+	if (count % partition_count != 0 || count / partition_count < order)
+		return -EINVAL;
+
+	for (i = 0; i < partition_count; ++i) {
+		begin = i * (count / partition_count);
+		end = begin + count / partition_count;
+		if (i == 0)
+			begin = order;
+
+		err = get_bits(reader, param_bits, &param);
+		if (err < 0)
+			return err;
+
+		if (param == escape) {
+			// Unencoded residuals.
+			err = get_bits(reader, 5, &param);
+			if (err < 0)
+				return err;
+			for (j = begin; j < end; ++j) {
+				err = get_signed_bits(reader, param,
+						      &residuals[j]);
+				if (err < 0)
+					return err;
+			}
+			continue;
+		}
+
+		for (j = begin; j < end; ++j) {
+			err = get_unary(reader, &quotient);
+			if (err < 0)
+				return err;
+			err = get_bits(reader, param, &remainder);
+			if (err < 0)
+				return err;
+			val = (quotient << param) | remainder;
+			residuals[j] = (int32_t)(val >> 1) ^ -(int32_t)(val & 1);
+		}
+	}
+
+	return 0;
+}
+
+static void restore_fixed(int32_t *x, unsigned int count, unsigned int order)
+{
+	int64_t prediction;
+	int i;
+
+	for (i = order; i < count; ++i) {
+		switch (order) {
+		case 0:
+			prediction = 0;
+			break;
+		case 1:
+			prediction = x[i - 1];
+			break;
+		case 2:
+			prediction = 2ll * x[i - 1] - x[i - 2];
+			break;
+		case 3:
+			prediction = 3ll * x[i - 1] - 3ll * x[i - 2] + x[i - 3];
+			break;
+		default:
+			prediction = 4ll * x[i - 1] - 6ll * x[i - 2] +
+				     4ll * x[i - 3] - x[i - 4];
+			break;
+		}
+		x[i] = (int32_t)(x[i] + prediction);
+	}
+}
+
+static void restore_lpc(int32_t *x, unsigned int count, unsigned int order,
+			const int32_t *coefs, unsigned int shift)
+{
+	int64_t sum;
+	int i, j;
+
+	for (i = order; i < count; ++i) {
+		sum = 0;
+		for (j = 0; j < order; ++j)
+			sum += (int64_t)coefs[j] * x[i - j - 1];
+		x[i] = (int32_t)(x[i] + (sum >> shift));
+	}
+}
+
+static int decode_subframe(struct bit_reader *reader, int32_t *samples,
+			   unsigned int count, unsigned int bits_per_sample)
+{
+	int32_t coefs[MAX_LPC_ORDER];
+	uint32_t header;
+	uint32_t type;
+	uint32_t wasted;
+	uint32_t precision;
+	int32_t shift;
+	unsigned int order;
+	int i;
+	int err;
+
+	err = get_bits(reader, 8, &header);
+	if (err < 0)
+		return err;
+	if (header & 0x80)
+		return -EINVAL;
+	type = (header >> 1) & 0x3f;
+
+	wasted = 0;
+	if (header & 0x01) {
+		err = get_unary(reader, &wasted);
+		if (err < 0)
+			return err;
+		++wasted;
+		if (wasted >= bits_per_sample)
+			return -EINVAL;
+		bits_per_sample -= wasted;
+	}
+
+	if (type == SUBFRAME_TYPE_CONSTANT) {
+		err = get_signed_bits(reader, bits_per_sample, &samples[0]);
+		if (err < 0)
+			return err;
+		for (i = 1; i < count; ++i)
+			samples[i] = samples[0];
+	} else if (type == SUBFRAME_TYPE_VERBATIM) {
+		for (i = 0; i < count; ++i) {
+			err = get_signed_bits(reader, bits_per_sample,
+					      &samples[i]);
+			if (err < 0)
+				return err;
+		}
+	} else if (type >= SUBFRAME_TYPE_FIXED &&
+		   type <= SUBFRAME_TYPE_FIXED + MAX_FIXED_ORDER) {
+		order = type - SUBFRAME_TYPE_FIXED;
+		if (order > count)
+			return -EINVAL;
+		for (i = 0; i < order; ++i) {
+			err = get_signed_bits(reader, bits_per_sample,
+					      &samples[i]);
+			if (err < 0)
+				return err;
+		}
+		err = get_residuals(reader, samples, count, order);
+		if (err < 0)
+			return err;
+		restore_fixed(samples, count, order);
+	} else if (type >= SUBFRAME_TYPE_LPC) {
+		order = type - SUBFRAME_TYPE_LPC + 1;
+		if (order > count)
+			return -EINVAL;
+		for (i = 0; i < order; ++i) {
+			err = get_signed_bits(reader, bits_per_sample,
+					      &samples[i]);
+			if (err < 0)
+				return err;
+		}
+		err = get_bits(reader, 4, &precision);
+		if (err < 0)
+			return err;
+		if (precision == 0x0f)
+			return -EINVAL;
+		++precision;
+		err = get_signed_bits(reader, 5, &shift);
+		if (err < 0)
+			return err;
+		if (shift < 0)
+			return -EINVAL;
+		for (i = 0; i < order; ++i) {
+			err = get_signed_bits(reader, precision, &coefs[i]);
+			if (err < 0)
+				return err;
+		}
+		err = get_residuals(reader, samples, count, order);
+		if (err < 0)
+			return err;
+		restore_lpc(samples, count, order, coefs, shift);
+	} else {
+		return -EINVAL;
+	}
+
+	if (wasted > 0) {
+		for (i = 0; i < count; ++i)
+			samples[i] = (uint32_t)samples[i] << wasted;
+	}
+
+	return 0;
+}
+
+static int decode_block(struct container_context *cntr)
+{
+	struct parser_state *state = cntr->private_data;
+	struct bit_reader *reader = &state->reader;
+	unsigned int samples_per_frame = state->info.samples_per_frame;
+	unsigned int count;
+	unsigned int channels;
+	unsigned int bits_per_sample;
+	uint32_t val;
+	uint32_t code;
+	uint32_t block_size_code;
+	uint32_t rate_code;
+	uint32_t assignment;
+	int32_t *left, *right;
+	uint8_t crc8;
+	uint16_t crc16;
+	uint8_t *dst;
+	int i, j;
+	int err;
+
+	skip_to_byte(reader);
+	reset_crcs(reader);
+
+	err = get_bits(reader, 15, &val);
+	if (err == -ENODATA) {
+		// No more blocks.
+		cntr->eof = true;
+		return 0;
+	}
+	if (err < 0)
+		return err;
+	if (val != 0x7ffc)
+		return -EINVAL;
+
+	// Blocking strategy is not used.
+	err = get_bits(reader, 1, &val);
+	if (err < 0)
+		return err;
+
+	err = get_bits(reader, 4, &block_size_code);
+	if (err < 0)
+		return err;
+	if (block_size_code == 0)
+		return -EINVAL;
+	else if (block_size_code == 1)
+		count = 192;
+	else if (block_size_code <= 5)
+		count = 576 << (block_size_code - 2);
+	else if (block_size_code <= 7)
+		count = 0;	// At the end of header.
+	else
+		count = 256 << (block_size_code - 8);
+
+	// Sampling rate is not used except for the size of the field.
+	err = get_bits(reader, 4, &rate_code);
+	if (err < 0)
+		return err;
+	if (rate_code == 0x0f)
+		return -EINVAL;
+
+	err = get_bits(reader, 4, &assignment);
+	if (err < 0)
+		return err;
+	if (assignment > CHANNEL_ASSIGNMENT_MID_SIDE)
+		return -EINVAL;
+	channels = (assignment < CHANNEL_ASSIGNMENT_LEFT_SIDE) ?
+		   assignment + 1 : 2;
+	if (channels != samples_per_frame)
+		return -EINVAL;
+
+	err = get_bits(reader, 3, &code);
+	if (err < 0)
+		return err;
+	if (code == 0)
+		bits_per_sample = state->info.bits_per_sample;
+	else
+		bits_per_sample = bits_per_sample_codes[code];
+	if (bits_per_sample != state->info.bits_per_sample)
+		return -EINVAL;
+
+	err = get_bits(reader, 1, &val);
+	if (err < 0)
+		return err;
+
+	// Skip the number of block or sample coded as UTF-8.
+	err = get_bits(reader, 8, &val);
+	if (err < 0)
+		return err;
+	for (i = 0; i < 7 && (val & (0x80 >> i)); ++i)
+		;
+	for (j = 1; j < i; ++j) {
+		err = get_bits(reader, 8, &val);
+		if (err < 0)
+			return err;
+	}
+
+	if (count == 0) {
+		err = get_bits(reader, block_size_code == 6 ? 8 : 16, &val);
+		if (err < 0)
+			return err;
+		count = val + 1;
+	}
+	if (count > state->max_block_size)
+		return -EINVAL;
+
+	// Skip the field for sampling rate at the end of header.
+	if (rate_code >= 12) {
+		err = get_bits(reader, rate_code == 12 ? 8 : 16, &val);
+		if (err < 0)
+			return err;
+	}
+
+	// CRC-8 of header.
+	crc8 = reader->crc8;
+	err = get_bits(reader, 8, &val);
+	if (err < 0)
+		return err;
+	if (val != crc8)
+		return -EINVAL;
+
+	for (i = 0; i < channels; ++i) {
+		unsigned int width = bits_per_sample;
+
+		// Side channel has one more bit.
+		if ((assignment == CHANNEL_ASSIGNMENT_LEFT_SIDE && i == 1) ||
+		    (assignment == CHANNEL_ASSIGNMENT_SIDE_RIGHT && i == 0) ||
+		    (assignment == CHANNEL_ASSIGNMENT_MID_SIDE && i == 1))
+			++width;
+
+		// Samples are decoded in 32 bits, thus the side channel of
+		// 32 bit samples is not supported.
+		if (width > 32)
+			return -EINVAL;
+
+		err = decode_subframe(reader, state->samples[i], count, width);
+		if (err < 0)
+			return err;
+	}
+
+	// CRC-16 of block.
+	skip_to_byte(reader);
+	crc16 = reader->crc16;
+	err = get_bits(reader, 16, &val);
+	if (err < 0)
+		return err;
+	if (val != crc16)
+		return -EINVAL;
+
+	left = state->samples[0];
+	right = state->samples[1];
+	if (assignment == CHANNEL_ASSIGNMENT_LEFT_SIDE) {
+		for (i = 0; i < count; ++i)
+			right[i] = left[i] - right[i];
+	} else if (assignment == CHANNEL_ASSIGNMENT_SIDE_RIGHT) {
+		for (i = 0; i < count; ++i)
+			left[i] += right[i];
+	} else if (assignment == CHANNEL_ASSIGNMENT_MID_SIDE) {
+		for (i = 0; i < count; ++i) {
+			int32_t mid = ((uint32_t)left[i] << 1) |
+				      (right[i] & 0x01);
+			int32_t side = right[i];
+			left[i] = (mid + side) >> 1;
+			right[i] = (mid - side) >> 1;
+		}
+	}
+
+	// Interleave samples.
+	dst = state->frame_buf;
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < channels; ++j) {
+			pack_sample(dst, state->samples[j][i],
+				    state->bytes_per_sample);
+			dst += state->bytes_per_sample;
+		}
+	}
+	state->frame_count = count;
+	state->frame_pos = 0;
+
+	return 0;
+}
+
+static int flac_parser_process_bytes(struct container_context *cntr,
+				     void *buffer, unsigned int byte_count)
+{
+	struct parser_state *state = cntr->private_data;
+	unsigned int bytes_per_frame = state->bytes_per_sample *
+				       state->info.samples_per_frame;
+	uint8_t *dst = buffer;
+	unsigned int frame_count = byte_count / bytes_per_frame;
+	unsigned int count;
+	int err;
+
+	while (frame_count > 0) {
+		if (state->frame_pos == state->frame_count) {
+			err = decode_block(cntr);
+			if (err < 0)
+				return err;
+			if (cntr->eof)
+				break;
+		}
+
+		count = state->frame_count - state->frame_pos;
+		if (count > frame_count)
+			count = frame_count;
+
+		memcpy(dst, state->frame_buf + state->frame_pos * bytes_per_frame,
+		       count * bytes_per_frame);
+		state->frame_pos += count;
+		dst += count * bytes_per_frame;
+		frame_count -= count;
+	}
+
+	return 0;
+}
+
+static int skip_metadata_block(struct container_context *cntr,
+			       unsigned int size)
+{
+	uint8_t buf[256];
+	unsigned int count;
+	int err;
+
+	while (size > 0) {
+		count = size;
+		if (count > sizeof(buf))
+			count = sizeof(buf);
+		err = container_recursive_read(cntr, buf, count);
+		if (err < 0)
+			return err;
+		if (cntr->eof)
+			return -EINVAL;
+		size -= count;
+	}
+
+	return 0;
+}
+
+static int flac_parser_pre_process(struct container_context *cntr,
+				   snd_pcm_format_t *format,
+				   unsigned int *samples_per_frame,
+				   unsigned int *frames_per_second,
+				   uint64_t *byte_count)
+{
+	struct parser_state *state = cntr->private_data;
+	uint8_t header[4];
+	uint8_t buf[STREAMINFO_SIZE];
+	bool has_streaminfo = false;
+	bool last = false;
+	unsigned int size;
+	int i;
+	int err;
+
+	if (memcmp(cntr->magic, FLAC_MAGIC, sizeof(cntr->magic)) != 0)
+		return -EINVAL;
+
+	while (!last) {
+		err = container_recursive_read(cntr, header, sizeof(header));
+		if (err < 0)
+			return err;
+		if (cntr->eof)
+			return -EINVAL;
+
+		last = !!(header[0] & 0x80);
+		size = (header[1] << 16) | (header[2] << 8) | header[3];
+
+		if ((header[0] & 0x7f) == METADATA_TYPE_STREAMINFO) {
+			if (size != STREAMINFO_SIZE)
+				return -EINVAL;
+			err = container_recursive_read(cntr, buf, sizeof(buf));
+			if (err < 0)
+				return err;
+			if (cntr->eof)
+				return -EINVAL;
+			parse_streaminfo(buf, &state->info);
+			has_streaminfo = true;
+		} else {
+			err = skip_metadata_block(cntr, size);
+			if (err < 0)
+				return err;
+		}
+	}
+	if (!has_streaminfo)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(format_maps); ++i) {
+		if (format_maps[i].bits_per_sample ==
+						state->info.bits_per_sample)
+			break;
+	}
+	if (i == ARRAY_SIZE(format_maps))
+		return -EINVAL;
+
+	*format = format_maps[i].format;
+	*samples_per_frame = state->info.samples_per_frame;
+	*frames_per_second = state->info.frames_per_second;
+
+	state->bytes_per_sample = snd_pcm_format_physical_width(*format) / 8;
+
+	// Some encoders leave it unknown.
+	state->max_block_size = state->info.max_block_size;
+	if (state->max_block_size < 16)
+		state->max_block_size = 65535;
+
+	for (i = 0; i < *samples_per_frame; ++i) {
+		state->samples[i] = malloc(state->max_block_size *
+					   sizeof(*state->samples[i]));
+		if (state->samples[i] == NULL)
+			return -ENOMEM;
+	}
+
+	state->frame_buf = malloc(state->max_block_size *
+				  state->bytes_per_sample * *samples_per_frame);
+	if (state->frame_buf == NULL)
+		return -ENOMEM;
+
+	prepare_crc_tables();
+
+	state->reader.cntr = cntr;
+	cntr->process_bytes = flac_parser_process_bytes;
+
+	if (state->info.frame_count > 0) {
+		*byte_count = state->info.frame_count *
+			      state->bytes_per_sample * *samples_per_frame;
+	} else {
+		*byte_count = UINT64_MAX;
+	}
+
+	return 0;
+}
+
+static void flac_parser_release(struct container_context *cntr)
+{
+	struct parser_state *state = cntr->private_data;
+	int i;
+
+	free(state->frame_buf);
+	for (i = 0; i < MAX_CHANNELS; ++i)
+		free(state->samples[i]);
+	memset(state, 0, sizeof(*state));
+}
+
+const struct container_parser container_parser_flac = {
+	.format = CONTAINER_FORMAT_FLAC,
+	.magic = FLAC_MAGIC,
+	.max_size = UINT64_MAX,
+	.ops = {
+		.pre_process	= flac_parser_pre_process,
+		.release	= flac_parser_release,
+	},
+	.private_size = sizeof(struct parser_state),
+};
+
+const struct container_builder container_builder_flac = {
+	.format = CONTAINER_FORMAT_FLAC,
+	.suffix = ".flac",
+	.max_size = UINT64_MAX,
+	.ops = {
+		.pre_process	= flac_builder_pre_process,
+		.flush		= flac_builder_flush,
+		.post_process	= flac_builder_post_process,
+		.release	= flac_builder_release,
+	},
+	.private_size = sizeof(struct builder_state),
+};
@@ -18,14 +18,24 @@
 // - RFC 2361 'WAVE and AVI Codec Registries' at ietf.org
 // - 'mmreg.h' in Wine project
 // - 'mmreg.h' in ReactOS project
+// - EBU Tech 3306 'RF64: An extended File Format for Audio'
+// - ITU-R BS.2088 'Long-form file format for the international exchange of
+//   audio programme materials with metadata'
 
 #define RIFF_MAGIC		"RIF"	// A common part.
 
 #define RIFF_CHUNK_ID_LE	"RIFF"
 #define RIFF_CHUNK_ID_BE	"RIFX"
+#define RF64_CHUNK_ID		"RF64"
+#define BW64_CHUNK_ID		"BW64"
 #define RIFF_FORM_WAVE		"WAVE"
 #define FMT_SUBCHUNK_ID		"fmt "
 #define DATA_SUBCHUNK_ID	"data"
+#define DS64_SUBCHUNK_ID	"ds64"
+#define JUNK_SUBCHUNK_ID	"JUNK"
+
+// The value of size field in RF64 chunk and data subchunk.
+#define RF64_SIZE_IN_DS64	0xffffffff
 
 // See 'WAVE and AVI Codec Registries (Historic Registry)' in 'iana.org'.
 // https://www.iana.org/assignments/wave-avi-codec-registry/
@@ -113,8 +123,33 @@ struct wave_data_subchunk {
 	uint8_t frames[0];
 };
 
+// The builder reserves this size by JUNK subchunk to replace with ds64
+// subchunk when the size of data exceeds 32 bit.
+struct wave_ds64_subchunk {
+	uint8_t id[4];
+	uint32_t size;
+
+	uint32_t riff_size_low;
+	uint32_t riff_size_high;
+	uint32_t data_size_low;
+	uint32_t data_size_high;
+	uint32_t sample_count_low;
+	uint32_t sample_count_high;
+	uint32_t table_length;
+	uint8_t tables[0];
+};
+
+// The size of subchunks and chunk data header counted in RIFF chunk.
+#define RIFF_HEADER_SIZE					\
+	(sizeof(struct riff_chunk_data) +			\
+	 sizeof(struct wave_ds64_subchunk) +			\
+	 sizeof(struct wave_fmt_subchunk) +			\
+	 sizeof(struct wave_data_subchunk))
+
 struct parser_state {
 	bool be;
+	bool rf64;
+	uint64_t ds64_data_size;
 	enum wave_format format;
 	unsigned int samples_per_frame;
 	unsigned int frames_per_second;
@@ -122,7 +157,7 @@ struct parser_state {
 	unsigned int bytes_per_frame;
 	unsigned int bytes_per_sample;
 	unsigned int avail_bits_in_sample;
-	unsigned int byte_count;
+	uint64_t byte_count;
 };
 
 static int parse_riff_chunk_header(struct parser_state *state,
@@ -133,6 +168,9 @@ static int parse_riff_chunk_header(struct parser_state *state,
 		state->be = true;
 	else if (!memcmp(chunk->id, RIFF_CHUNK_ID_LE, sizeof(chunk->id)))
 		state->be = false;
+	else if (!memcmp(chunk->id, RF64_CHUNK_ID, sizeof(chunk->id)) ||
+		 !memcmp(chunk->id, BW64_CHUNK_ID, sizeof(chunk->id)))
+		state->rf64 = true;
 	else
 		return -EINVAL;
 
@@ -220,6 +258,24 @@ static int parse_wave_data_subchunk(struct parser_state *state,
 	else
 		state->byte_count = le32toh(subchunk->size);
 
+	// The actual size is in ds64 subchunk.
+	if (state->rf64 && state->byte_count == RF64_SIZE_IN_DS64)
+		state->byte_count = state->ds64_data_size;
+
+	return 0;
+}
+
+static int parse_wave_ds64_subchunk(struct parser_state *state,
+				    struct wave_ds64_subchunk *subchunk)
+{
+	// Any RIFX file doesn't have this subchunk.
+	if (!state->rf64)
+		return -EINVAL;
+
+	state->ds64_data_size =
+			((uint64_t)le32toh(subchunk->data_size_high) << 32) |
+			le32toh(subchunk->data_size_low);
+
 	return 0;
 }
 
@@ -229,11 +285,13 @@ static int parse_wave_subchunk(struct container_context *cntr)
 		struct riff_subchunk subchunk;
 		struct wave_fmt_subchunk fmt_subchunk;
 		struct wave_data_subchunk data_subchunk;
+		struct wave_ds64_subchunk ds64_subchunk;
 	} buf = {0};
 	enum {
 		SUBCHUNK_TYPE_UNKNOWN = -1,
 		SUBCHUNK_TYPE_FMT,
 		SUBCHUNK_TYPE_DATA,
+		SUBCHUNK_TYPE_DS64,
 	} subchunk_type;
 	struct parser_state *state = cntr->private_data;
 	unsigned int required_size;
@@ -261,6 +319,9 @@ static int parse_wave_subchunk(struct container_context *cntr)
 		} else if (!memcmp(buf.subchunk.id, DATA_SUBCHUNK_ID,
 				   sizeof(buf.subchunk.id))) {
 			subchunk_type = SUBCHUNK_TYPE_DATA;
+		} else if (!memcmp(buf.subchunk.id, DS64_SUBCHUNK_ID,
+				   sizeof(buf.subchunk.id))) {
+			subchunk_type = SUBCHUNK_TYPE_DS64;
 		} else {
 			subchunk_type = SUBCHUNK_TYPE_UNKNOWN;
 		}
@@ -271,10 +332,14 @@ static int parse_wave_subchunk(struct container_context *cntr)
 				required_size =
 					sizeof(struct wave_fmt_subchunk) -
 					sizeof(struct riff_chunk);
-			} else {
+			} else if (subchunk_type == SUBCHUNK_TYPE_DATA) {
 				required_size =
 					sizeof(struct wave_data_subchunk)-
 					sizeof(struct riff_chunk);
+			} else {
+				required_size =
+					sizeof(struct wave_ds64_subchunk) -
+					sizeof(struct riff_chunk);
 			}
 
 			if (subchunk_data_size < required_size)
@@ -294,6 +359,9 @@ static int parse_wave_subchunk(struct container_context *cntr)
 			} else if (subchunk_type == SUBCHUNK_TYPE_DATA) {
 				err = parse_wave_data_subchunk(state,
 							 &buf.data_subchunk);
+			} else {
+				err = parse_wave_ds64_subchunk(state,
+							 &buf.ds64_subchunk);
 			}
 			if (err < 0)
 				return err;
@@ -396,13 +464,12 @@ struct builder_state {
 };
 
 static void build_riff_chunk_header(struct riff_chunk *chunk,
-				    uint64_t byte_count, bool be)
+				    uint64_t data_size, bool be, bool rf64)
 {
-	uint64_t data_size = sizeof(struct riff_chunk_data) +
-			     sizeof(struct wave_fmt_subchunk) +
-			     sizeof(struct wave_data_subchunk) + byte_count;
-
-	if (be) {
+	if (rf64) {
+		memcpy(chunk->id, RF64_CHUNK_ID, sizeof(chunk->id));
+		chunk->size = htole32(RF64_SIZE_IN_DS64);
+	} else if (be) {
 		memcpy(chunk->id, RIFF_CHUNK_ID_BE, sizeof(chunk->id));
 		chunk->size = htobe32(data_size);
 	} else {
@@ -458,12 +525,47 @@ static void build_wave_format_subchunk(struct wave_fmt_subchunk *subchunk,
 }
 
 static void build_wave_data_subchunk(struct wave_data_subchunk *subchunk,
-				     uint64_t byte_count, bool be)
+				     uint64_t byte_count, bool be, bool rf64)
 {
+	if (rf64)
+		byte_count = RF64_SIZE_IN_DS64;
 	build_subchunk_header((struct riff_subchunk *)subchunk,
 			      DATA_SUBCHUNK_ID, byte_count, be);
 }
 
+static void build_wave_ds64_subchunk(struct wave_ds64_subchunk *subchunk,
+				     struct builder_state *state,
+				     uint64_t data_size, uint64_t byte_count,
+				     bool rf64)
+{
+	uint64_t sample_count;
+	uint64_t size;
+
+	size = sizeof(struct wave_ds64_subchunk) - sizeof(struct riff_subchunk);
+
+	// Reserved for the case that the size of data exceeds 32 bit.
+	if (!rf64) {
+		memset(subchunk, 0, sizeof(*subchunk));
+		build_subchunk_header((struct riff_subchunk *)subchunk,
+				      JUNK_SUBCHUNK_ID, size, state->be);
+		return;
+	}
+
+	build_subchunk_header((struct riff_subchunk *)subchunk,
+			      DS64_SUBCHUNK_ID, size, false);
+
+	sample_count = byte_count / state->bytes_per_sample /
+		       state->samples_per_frame;
+
+	subchunk->riff_size_low = htole32(data_size);
+	subchunk->riff_size_high = htole32(data_size >> 32);
+	subchunk->data_size_low = htole32(byte_count);
+	subchunk->data_size_high = htole32(byte_count >> 32);
+	subchunk->sample_count_low = htole32(sample_count);
+	subchunk->sample_count_high = htole32(sample_count >> 32);
+	subchunk->table_length = 0;
+}
+
 static int write_riff_chunk_for_wave(struct container_context *cntr,
 				     uint64_t byte_count)
 {
@@ -473,19 +575,21 @@ static int write_riff_chunk_for_wave(struct container_context *cntr,
 		struct riff_chunk_data chunk_data;
 		struct wave_fmt_subchunk fmt_subchunk;
 		struct wave_data_subchunk data_subchunk;
+		struct wave_ds64_subchunk ds64_subchunk;
 	} buf = {0};
-	uint64_t total_byte_count;
+	uint64_t data_size;
+	bool rf64;
 	int err;
 
+	if (byte_count > cntr->max_size)
+		byte_count = cntr->max_size;
+	data_size = RIFF_HEADER_SIZE + byte_count;
+
+	// Any field for size in 32 bit is not enough.
+	rf64 = (data_size > UINT32_MAX);
+
 	// Chunk header.
-	total_byte_count = sizeof(struct riff_chunk_data) +
-			   sizeof(struct wave_fmt_subchunk) +
-			   sizeof(struct wave_data_subchunk);
-	if (byte_count > cntr->max_size - total_byte_count)
-		total_byte_count = cntr->max_size;
-	else
-		total_byte_count += byte_count;
-	build_riff_chunk_header(&buf.chunk, total_byte_count, state->be);
+	build_riff_chunk_header(&buf.chunk, data_size, state->be, rf64);
 	err = container_recursive_write(cntr, &buf, sizeof(buf.chunk));
 	if (err < 0)
 		return err;
@@ -496,6 +600,13 @@ static int write_riff_chunk_for_wave(struct container_context *cntr,
 	if (err < 0)
 		return err;
 
+	// A subchunk for the size of data in 64 bit, or junk.
+	build_wave_ds64_subchunk(&buf.ds64_subchunk, state, data_size,
+				 byte_count, rf64);
+	err = container_recursive_write(cntr, &buf, sizeof(buf.ds64_subchunk));
+	if (err < 0)
+		return err;
+
 	// A subchunk in the chunk data for WAVE format.
 	build_wave_format_subchunk(&buf.fmt_subchunk, state);
 	err = container_recursive_write(cntr, &buf, sizeof(buf.fmt_subchunk));
@@ -503,7 +614,8 @@ static int write_riff_chunk_for_wave(struct container_context *cntr,
 		return err;
 
 	// A subchunk in the chunk data for WAVE data.
-	build_wave_data_subchunk(&buf.data_subchunk, byte_count, state->be);
+	build_wave_data_subchunk(&buf.data_subchunk, byte_count, state->be,
+				 rf64);
 	return container_recursive_write(cntr, &buf, sizeof(buf.data_subchunk));
 }
 
@@ -514,6 +626,7 @@ static int wave_builder_pre_process(struct container_context *cntr,
 				    uint64_t *byte_count)
 {
 	struct builder_state *state = cntr->private_data;
+	uint64_t size;
 	int i;
 
 	// Validate parameters.
@@ -532,7 +645,20 @@ static int wave_builder_pre_process(struct container_context *cntr,
 
 	state->be = (snd_pcm_format_big_endian(*format) == 1);
 
-	return write_riff_chunk_for_wave(cntr, *byte_count);
+	// RF64 is defined for little endian only. The header is rewritten at
+	// post-process, thus it's not available for standard output as well.
+	if (state->be || cntr->stdio) {
+		cntr->max_size = UINT32_MAX - RIFF_HEADER_SIZE;
+		if (*byte_count > cntr->max_size)
+			*byte_count = cntr->max_size;
+	}
+
+	// Start as RIFF/Wave, then replace the header at post-process.
+	size = *byte_count;
+	if (size > UINT32_MAX - RIFF_HEADER_SIZE)
+		size = UINT32_MAX - RIFF_HEADER_SIZE;
+
+	return write_riff_chunk_for_wave(cntr, size);
 }
 
 static int wave_builder_post_process(struct container_context *cntr,
@@ -560,12 +686,29 @@ const struct container_parser container_parser_riff_wave = {
 	.private_size = sizeof(struct parser_state),
 };
 
+const struct container_parser container_parser_rf64 = {
+	.format = CONTAINER_FORMAT_RIFF_WAVE,
+	.magic =  RF64_CHUNK_ID,
+	.max_size = UINT64_MAX - RIFF_HEADER_SIZE,
+	.ops = {
+		.pre_process	= wave_parser_pre_process,
+	},
+	.private_size = sizeof(struct parser_state),
+};
+
+const struct container_parser container_parser_bw64 = {
+	.format = CONTAINER_FORMAT_RIFF_WAVE,
+	.magic =  BW64_CHUNK_ID,
+	.max_size = UINT64_MAX - RIFF_HEADER_SIZE,
+	.ops = {
+		.pre_process	= wave_parser_pre_process,
+	},
+	.private_size = sizeof(struct parser_state),
+};
+
 const struct container_builder container_builder_riff_wave = {
 	.format = CONTAINER_FORMAT_RIFF_WAVE,
-	.max_size = UINT32_MAX -
-		    sizeof(struct riff_chunk_data) -
-		    sizeof(struct wave_fmt_subchunk) -
-		    sizeof(struct wave_data_subchunk),
+	.max_size = UINT64_MAX - RIFF_HEADER_SIZE,
 	.ops = {
 		.pre_process	= wave_builder_pre_process,
 		.post_process	= wave_builder_post_process,
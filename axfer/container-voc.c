@@ -677,6 +677,15 @@ static int write_v110_format_block(struct container_context *cntr,
 	return container_recursive_write(cntr, block, sizeof(*block));
 }
 
+// The size field of data block includes the rest of block header.
+static unsigned int get_data_block_offset(struct builder_state *state)
+{
+	if (state->version == VOC_VERSION_1_10)
+		return 2;
+	else
+		return 12;
+}
+
 static int write_data_blocks(struct container_context *cntr,
 			     unsigned int frames_per_second,
 			     uint64_t byte_count)
@@ -761,6 +770,11 @@ static int voc_builder_pre_process(struct container_context *cntr,
 	state->bytes_per_sample = snd_pcm_format_physical_width(*format) / 8;
 	state->samples_per_frame = *samples_per_frame;
 
+	// The size of data block is limited as well as the size field.
+	cntr->max_size -= get_data_block_offset(state);
+	if (*byte_count > cntr->max_size)
+		*byte_count = cntr->max_size;
+
 	return write_data_blocks(cntr, *frames_per_second, *byte_count);
 }
 
@@ -786,16 +800,10 @@ static int write_data_size(struct container_context *cntr, uint64_t byte_count)
 	if (err < 0)
 		return err;
 
-	if (state->version == VOC_VERSION_1_10)
-		offset = 2;
-	else
-		offset = 12;
-
-	if (byte_count > cntr->max_size - offset)
+	if (byte_count > cntr->max_size)
 		byte_count = cntr->max_size;
-	else
-		byte_count += offset;
-	build_block_data_size(size_field, byte_count);
+	build_block_data_size(size_field,
+			      byte_count + get_data_block_offset(state));
 
 	return container_recursive_write(cntr, &size_field, sizeof(size_field));
 }
@@ -6,14 +6,39 @@
 //
 // Licensed under the terms of the GNU General Public License, version 2.
 
+#define _GNU_SOURCE
 #include "container.h"
+#include "histogram.h"
 #include "misc.h"
 
+#include "aconfig.h"
+
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+// The size of region of file mapped at once.
+#define MAP_WINDOW_SIZE		(8 * 1024 * 1024)
+
+// The maximum time to wait for the descriptor at once.
+#define WAIT_FOR_FD_MSEC	100
+
+// The maximum size written by the writer thread at once.
+#define WRITER_CHUNK_SIZE	(64 * 1024)
+
+// The writer is aborted at stop when no bytes are written in this time.
+#define WRITER_DRAIN_MSEC	1000
 
 static const char *const cntr_type_labels[] = {
 	[CONTAINER_TYPE_PARSER] = "parser",
@@ -24,6 +49,7 @@ static const char *const cntr_format_labels[] = {
 	[CONTAINER_FORMAT_RIFF_WAVE] = "riff/wave",
 	[CONTAINER_FORMAT_AU] = "au",
 	[CONTAINER_FORMAT_VOC] = "voc",
+	[CONTAINER_FORMAT_FLAC] = "flac",
 	[CONTAINER_FORMAT_RAW] = "raw",
 };
 
@@ -31,6 +57,7 @@ static const char *const suffixes[] = {
 	[CONTAINER_FORMAT_RIFF_WAVE]	= ".wav",
 	[CONTAINER_FORMAT_AU]		= ".au",
 	[CONTAINER_FORMAT_VOC]		= ".voc",
+	[CONTAINER_FORMAT_FLAC]		= ".flac",
 	[CONTAINER_FORMAT_RAW]		= "",
 };
 
@@ -39,12 +66,39 @@ const char *const container_suffix_from_format(enum container_format format)
 	return suffixes[format];
 }
 
+// The descriptor is in non-blocking mode. Instead of retrying I/O at once,
+// sleep till it's available. Pipes from/to any process are typical cases.
+// The time to sleep is bounded, then the caller retries the I/O as well as
+// a short one, so that the interruption by the other thread is checked even
+// if the peer of pipe stalls. This is just for headers and blocks processed
+// at once. Data frames are transferred without waiting, see
+// transfer_bytes_partially().
+static int wait_for_fd(struct container_context *cntr, short events)
+{
+	struct pollfd pfd = {
+		.fd = cntr->fd,
+		.events = events,
+	};
+
+	++cntr->starve_count;
+
+	if (poll(&pfd, 1, WAIT_FOR_FD_MSEC) < 0) {
+		if (cntr->interrupted)
+			return -EINTR;
+		if (errno != EINTR)
+			return -errno;
+	}
+
+	return 0;
+}
+
 int container_recursive_read(struct container_context *cntr, void *buf,
 			     unsigned int byte_count)
 {
 	char *dst = buf;
 	ssize_t result;
 	size_t consumed = 0;
+	int err;
 
 	while (consumed < byte_count && !cntr->interrupted) {
 		result = read(cntr->fd, dst + consumed, byte_count - consumed);
@@ -53,8 +107,12 @@ int container_recursive_read(struct container_context *cntr, void *buf,
 			// mode. EINTR is not cought when get any interrupts.
 			if (cntr->interrupted)
 				return -EINTR;
-			if (errno == EAGAIN)
+			if (errno == EAGAIN) {
+				err = wait_for_fd(cntr, POLLIN);
+				if (err < 0)
+					return err;
 				continue;
+			}
 			return -errno;
 		}
 		// Reach EOF.
@@ -69,12 +127,43 @@ int container_recursive_read(struct container_context *cntr, void *buf,
 	return 0;
 }
 
+// Read bytes as many as available up to the given count, for data of which
+// size is not known in advance. Return the number of read bytes, or 0 at EOF.
+int container_partial_read(struct container_context *cntr, void *buf,
+			   unsigned int byte_count)
+{
+	ssize_t result;
+	int err;
+
+	while (!cntr->interrupted) {
+		result = read(cntr->fd, buf, byte_count);
+		if (result < 0) {
+			if (cntr->interrupted)
+				return -EINTR;
+			if (errno == EAGAIN) {
+				err = wait_for_fd(cntr, POLLIN);
+				if (err < 0)
+					return err;
+				continue;
+			}
+			return -errno;
+		}
+		if (result == 0)
+			cntr->eof = true;
+
+		return result;
+	}
+
+	return -EINTR;
+}
+
 int container_recursive_write(struct container_context *cntr, void *buf,
 			      unsigned int byte_count)
 {
 	char *src = buf;
 	ssize_t result;
 	size_t consumed = 0;
+	int err;
 
 	while (consumed < byte_count && !cntr->interrupted) {
 		result = write(cntr->fd, src + consumed, byte_count - consumed);
@@ -83,8 +172,12 @@ int container_recursive_write(struct container_context *cntr, void *buf,
 			// mode. EINTR is not cought when get any interrupts.
 			if (cntr->interrupted)
 				return -EINTR;
-			if (errno == EAGAIN)
+			if (errno == EAGAIN) {
+				err = wait_for_fd(cntr, POLLOUT);
+				if (err < 0)
+					return err;
 				continue;
+			}
 			return -errno;
 		}
 
@@ -94,6 +187,366 @@ int container_recursive_write(struct container_context *cntr, void *buf,
 	return 0;
 }
 
+static int map_window(struct container_context *cntr)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t offset;
+	size_t length;
+	void *addr;
+	int prot;
+
+	if (cntr->map_addr) {
+		munmap(cntr->map_addr, cntr->map_length);
+		cntr->map_addr = NULL;
+	}
+
+	offset = cntr->map_pos - cntr->map_pos % page_size;
+	length = MAP_WINDOW_SIZE;
+
+	if (cntr->type == CONTAINER_TYPE_PARSER) {
+		if (offset + length > cntr->file_size)
+			length = cntr->file_size - offset;
+		prot = PROT_READ;
+	} else {
+		// Allocate blocks in advance for the region to be mapped, so
+		// that no SIGBUS is delivered for lack of space.
+		if (offset + length > cntr->file_size) {
+#ifdef HAVE_POSIX_FALLOCATE
+			int err = posix_fallocate(cntr->fd, offset, length);
+			if (err > 0)
+				return -err;
+#else
+			if (ftruncate(cntr->fd, offset + length) < 0)
+				return -errno;
+#endif
+			cntr->file_size = offset + length;
+		}
+		prot = PROT_READ | PROT_WRITE;
+	}
+
+	addr = mmap(NULL, length, prot, MAP_SHARED, cntr->fd, offset);
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	// The pages are read ahead or populated here, instead of being faulted
+	// in each copy of frames, since mlockall(2) with MCL_ONFAULT doesn't
+	// fault the pages mapped later.
+	if (cntr->type == CONTAINER_TYPE_PARSER) {
+		madvise(addr, length, MADV_SEQUENTIAL);
+		madvise(addr, length, MADV_WILLNEED);
+	} else {
+#ifdef MADV_POPULATE_WRITE
+		// Linux kernel v5.14 or later supports it.
+		madvise(addr, length, MADV_POPULATE_WRITE);
+#endif
+	}
+
+	cntr->map_addr = addr;
+	cntr->map_offset = offset;
+	cntr->map_length = length;
+
+	return 0;
+}
+
+// The region is copied once between the given buffer and the mapped pages,
+// instead of between the buffer and page cache in the kernel by read(2) and
+// write(2). With '--mmap' option and one container, the single mapper gives
+// the buffer of PCM substream, thus no intermediate copy is done in user
+// space. The buffer of PCM substream and the file cannot share pages, thus
+// the copy itself is not avoidable.
+static int map_read(struct container_context *cntr, void *buf,
+		    unsigned int byte_count)
+{
+	char *dst = buf;
+	size_t consumed = 0;
+	size_t pos;
+	size_t size;
+	int err;
+
+	while (consumed < byte_count) {
+		// Reach EOF.
+		if (cntr->map_pos >= cntr->file_size) {
+			cntr->eof = true;
+			return 0;
+		}
+
+		if (cntr->map_addr == NULL ||
+		    cntr->map_pos >= cntr->map_offset + cntr->map_length) {
+			err = map_window(cntr);
+			if (err < 0)
+				return err;
+		}
+
+		pos = cntr->map_pos - cntr->map_offset;
+		size = cntr->map_length - pos;
+		if (size > byte_count - consumed)
+			size = byte_count - consumed;
+
+		memcpy(dst + consumed, cntr->map_addr + pos, size);
+		consumed += size;
+		cntr->map_pos += size;
+	}
+
+	return 0;
+}
+
+static int map_write(struct container_context *cntr, void *buf,
+		     unsigned int byte_count)
+{
+	char *src = buf;
+	size_t consumed = 0;
+	size_t pos;
+	size_t size;
+	int err;
+
+	while (consumed < byte_count) {
+		if (cntr->map_addr == NULL ||
+		    cntr->map_pos >= cntr->map_offset + cntr->map_length) {
+			err = map_window(cntr);
+			if (err < 0)
+				return err;
+		}
+
+		pos = cntr->map_pos - cntr->map_offset;
+		size = cntr->map_length - pos;
+		if (size > byte_count - consumed)
+			size = byte_count - consumed;
+
+		memcpy(cntr->map_addr + pos, src + consumed, size);
+		consumed += size;
+		cntr->map_pos += size;
+	}
+
+	return 0;
+}
+
+static void unmap_file(struct container_context *cntr)
+{
+	if (!cntr->mapped)
+		return;
+
+	if (cntr->map_addr)
+		munmap(cntr->map_addr, cntr->map_length);
+	cntr->map_addr = NULL;
+
+	// Release blocks allocated in advance.
+	if (cntr->type == CONTAINER_TYPE_BUILDER) {
+		if (ftruncate(cntr->fd, cntr->map_pos) < 0 && cntr->verbose)
+			fprintf(stderr, "ftruncate(2): %s\n", strerror(errno));
+	}
+
+	// Some builders append trailer blocks by write(2) in post process.
+	if (lseek(cntr->fd, cntr->map_pos, SEEK_SET) < 0 && cntr->verbose)
+		fprintf(stderr, "lseek(2): %s\n", strerror(errno));
+
+	cntr->mapped = false;
+}
+
+// A queue of bytes between the thread to handle PCM frames and the thread to
+// write them into the file.
+struct container_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// The context can be moved while no bytes are processed.
+	struct container_context *cntr;
+	bool busy;
+	int (*process_bytes)(struct container_context *cntr,
+			     void *buffer, unsigned int byte_count);
+
+	char *buf;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	bool closing;
+	int err;
+
+	// Bytes handled before the thread starts, and written by the thread.
+	uint64_t base_byte_count;
+	uint64_t written_byte_count;
+
+	// Statistics.
+	unsigned int max_count;
+	unsigned int stall_count;
+	uint64_t max_latency_ns;
+};
+
+static uint64_t elapsed_ns(const struct timespec *begin,
+			   const struct timespec *end)
+{
+	return (end->tv_sec - begin->tv_sec) * 1000000000ull +
+	       end->tv_nsec - begin->tv_nsec;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct container_writer *writer = arg;
+	struct container_context *cntr;
+	struct timespec begin;
+	struct timespec end;
+	unsigned int head;
+	unsigned int size;
+	uint64_t latency;
+	int err;
+
+	pthread_mutex_lock(&writer->lock);
+	while (1) {
+		while (writer->count == 0 && !writer->closing)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		if (writer->count == 0)
+			break;
+
+		// The region is not touched by the other thread till released.
+		head = writer->head;
+		size = writer->count;
+		if (size > writer->size - head)
+			size = writer->size - head;
+		if (size > WRITER_CHUNK_SIZE)
+			size = WRITER_CHUNK_SIZE;
+		cntr = writer->cntr;
+		writer->busy = true;
+		pthread_mutex_unlock(&writer->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		err = writer->process_bytes(cntr, writer->buf + head, size);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		latency = elapsed_ns(&begin, &end);
+
+		pthread_mutex_lock(&writer->lock);
+		writer->busy = false;
+		if (latency > writer->max_latency_ns)
+			writer->max_latency_ns = latency;
+		writer->head = (head + size) % writer->size;
+		writer->count -= size;
+		if (err >= 0)
+			writer->written_byte_count += size;
+		if (err < 0) {
+			// Discard the rest.
+			writer->err = err;
+			writer->count = 0;
+		}
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+}
+
+static int queue_bytes(struct container_context *cntr, void *buf,
+		       unsigned int byte_count)
+{
+	struct container_writer *writer = cntr->writer;
+	char *src = buf;
+	unsigned int consumed = 0;
+	unsigned int tail;
+	unsigned int size;
+	int err = 0;
+
+	pthread_mutex_lock(&writer->lock);
+	while (consumed < byte_count) {
+		if (writer->err < 0) {
+			err = writer->err;
+			break;
+		}
+
+		// Block only when the queue is full.
+		if (writer->count == writer->size) {
+			++writer->stall_count;
+			while (writer->count == writer->size &&
+			       writer->err == 0)
+				pthread_cond_wait(&writer->cond, &writer->lock);
+			continue;
+		}
+
+		tail = (writer->head + writer->count) % writer->size;
+		size = writer->size - writer->count;
+		if (size > writer->size - tail)
+			size = writer->size - tail;
+		if (size > byte_count - consumed)
+			size = byte_count - consumed;
+		pthread_mutex_unlock(&writer->lock);
+
+		memcpy(writer->buf + tail, src + consumed, size);
+		consumed += size;
+
+		pthread_mutex_lock(&writer->lock);
+		writer->count += size;
+		if (writer->count > writer->max_count)
+			writer->max_count = writer->count;
+		pthread_cond_signal(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return err;
+}
+
+static int stop_writer(struct container_context *cntr)
+{
+	struct container_writer *writer = cntr->writer;
+	struct timespec deadline;
+	unsigned int count;
+	int err;
+
+	if (writer == NULL)
+		return 0;
+
+	// Wait for the thread to write out all of queued bytes, even if this
+	// program is interrupted. When no bytes are written for a while, e.g.
+	// the peer of pipe stalls, abort the thread so that the join returns.
+	cntr->interrupted = false;
+	pthread_mutex_lock(&writer->lock);
+	writer->closing = true;
+	pthread_cond_signal(&writer->cond);
+	count = writer->count;
+	while (writer->count > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += WRITER_DRAIN_MSEC / 1000;
+		deadline.tv_nsec += WRITER_DRAIN_MSEC % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			++deadline.tv_sec;
+		}
+
+		err = pthread_cond_timedwait(&writer->cond, &writer->lock,
+					     &deadline);
+		if (err == ETIMEDOUT && writer->count == count) {
+			cntr->interrupted = true;
+			if (writer->err == 0)
+				writer->err = -ETIMEDOUT;
+			break;
+		}
+		count = writer->count;
+	}
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	if (cntr->verbose) {
+		fprintf(stderr, "  Writer queue: %u/%u bytes at most\n",
+			writer->max_count, writer->size);
+		fprintf(stderr, "  Writer stalls: %u\n", writer->stall_count);
+		fprintf(stderr, "  Writer max latency: %" PRIu64 " usec\n",
+			writer->max_latency_ns / 1000);
+	}
+
+	cntr->process_bytes = writer->process_bytes;
+	err = writer->err;
+
+	// The bytes discarded by the error are not in the file.
+	if (err < 0) {
+		cntr->handled_byte_count = writer->base_byte_count +
+					   writer->written_byte_count;
+	}
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->buf);
+	free(writer);
+	cntr->writer = NULL;
+
+	return err;
+}
+
 enum container_format container_format_from_path(const char *path)
 {
 	const char *suffix;
@@ -147,9 +600,12 @@ int container_parser_init(struct container_context *cntr, int fd,
 			  unsigned int verbose)
 {
 	const struct container_parser *parsers[] = {
-		[CONTAINER_FORMAT_RIFF_WAVE] = &container_parser_riff_wave,
-		[CONTAINER_FORMAT_AU] = &container_parser_au,
-		[CONTAINER_FORMAT_VOC] = &container_parser_voc,
+		&container_parser_riff_wave,
+		&container_parser_rf64,
+		&container_parser_bw64,
+		&container_parser_au,
+		&container_parser_voc,
+		&container_parser_flac,
 	};
 	const struct container_parser *parser;
 	unsigned int size;
@@ -228,6 +684,7 @@ int container_builder_init(struct container_context *cntr, int fd,
 		[CONTAINER_FORMAT_RIFF_WAVE] = &container_builder_riff_wave,
 		[CONTAINER_FORMAT_AU] = &container_builder_au,
 		[CONTAINER_FORMAT_VOC] = &container_builder_voc,
+		[CONTAINER_FORMAT_FLAC] = &container_builder_flac,
 		[CONTAINER_FORMAT_RAW] = &container_builder_raw,
 	};
 	const struct container_builder *builder;
@@ -323,13 +780,14 @@ int container_context_pre_process(struct container_context *cntr,
 	assert(*frames_per_second > 0);
 	assert(byte_count > 0);
 
+	cntr->sample_format = *format;
 	cntr->bytes_per_sample = snd_pcm_format_physical_width(*format) / 8;
 	cntr->samples_per_frame = *samples_per_frame;
 	cntr->frames_per_second = *frames_per_second;
 
 	bytes_per_frame = cntr->bytes_per_sample * *samples_per_frame;
 	*frame_count = byte_count / bytes_per_frame;
-	cntr->max_size -= cntr->max_size / bytes_per_frame;
+	cntr->max_size -= cntr->max_size % bytes_per_frame;
 
 	if (cntr->verbose > 0) {
 		fprintf(stderr, "Container: %s\n",
@@ -356,6 +814,373 @@ int container_context_pre_process(struct container_context *cntr,
 	return 0;
 }
 
+// Transfer data frames by mapping the file instead of read(2)/write(2). This is
+// available for regular files only and should be called after pre-process.
+int container_context_map_file(struct container_context *cntr)
+{
+	struct stat st;
+	off_t pos;
+
+	assert(cntr);
+	assert(!cntr->mapped);
+
+	if (cntr->stdio)
+		return -ENXIO;
+
+	// Encoded data frames are not mapped.
+	if (cntr->process_bytes != container_recursive_read &&
+	    cntr->process_bytes != container_recursive_write)
+		return -ENXIO;
+
+	if (fstat(cntr->fd, &st) < 0)
+		return -errno;
+	if (!S_ISREG(st.st_mode))
+		return -ENXIO;
+
+	// Data frames start at current position.
+	pos = lseek(cntr->fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return -errno;
+
+	cntr->map_addr = NULL;
+	cntr->map_pos = pos;
+	cntr->file_size = st.st_size;
+	cntr->mapped = true;
+
+	if (cntr->type == CONTAINER_TYPE_PARSER)
+		cntr->process_bytes = map_read;
+	else
+		cntr->process_bytes = map_write;
+
+	return 0;
+}
+
+// The helper threads for file I/O run in the default scheduling policy on any
+// CPU, instead of inheriting the realtime policy and the affinity configured
+// for the thread to handle PCM frames. Return a positive error number as
+// pthread_create(3) does.
+int container_thread_attr_init(pthread_attr_t *attr)
+{
+	struct sched_param param = {0};
+	cpu_set_t set;
+	long count;
+	int i;
+	int err;
+
+	err = pthread_attr_init(attr);
+	if (err > 0)
+		return err;
+
+	err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	if (err == 0)
+		err = pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+	if (err == 0)
+		err = pthread_attr_setschedparam(attr, &param);
+	if (err == 0) {
+		count = sysconf(_SC_NPROCESSORS_CONF);
+		if (count <= 0 || count > CPU_SETSIZE)
+			count = CPU_SETSIZE;
+		CPU_ZERO(&set);
+		for (i = 0; i < count; ++i)
+			CPU_SET(i, &set);
+		err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	}
+	if (err > 0)
+		pthread_attr_destroy(attr);
+
+	return err;
+}
+
+// Write data frames by a thread so that the stall of storage does not block
+// the caller. The caller is blocked only when the queue of frames is full.
+// This should be called after pre-process.
+int container_context_start_writer(struct container_context *cntr,
+				   unsigned int queue_msec)
+{
+	struct container_writer *writer;
+	unsigned int bytes_per_frame;
+	pthread_attr_t attr;
+	sigset_t mask;
+	sigset_t orig_mask;
+	uint64_t size;
+	int err;
+
+	assert(cntr);
+	assert(cntr->writer == NULL);
+
+	if (cntr->type != CONTAINER_TYPE_BUILDER)
+		return -ENXIO;
+
+	bytes_per_frame = cntr->bytes_per_sample * cntr->samples_per_frame;
+	size = (uint64_t)cntr->frames_per_second * queue_msec / 1000 *
+	       bytes_per_frame;
+	if (size == 0 || size > UINT_MAX / 2)
+		return -EINVAL;
+
+	writer = calloc(1, sizeof(*writer));
+	if (writer == NULL)
+		return -ENOMEM;
+
+	writer->buf = malloc(size);
+	if (writer->buf == NULL) {
+		free(writer);
+		return -ENOMEM;
+	}
+	// Fault the pages in advance for the case that memory is locked.
+	memset(writer->buf, 0, size);
+	writer->size = size;
+	writer->cntr = cntr;
+	writer->process_bytes = cntr->process_bytes;
+	writer->base_byte_count = cntr->handled_byte_count;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	cntr->writer = writer;
+	cntr->process_bytes = queue_bytes;
+
+	// UNIX signals are delivered to the caller, not to the thread.
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
+	err = container_thread_attr_init(&attr);
+	if (err == 0) {
+		err = pthread_create(&writer->thread, &attr, writer_thread,
+				     writer);
+		pthread_attr_destroy(&attr);
+	}
+	pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+	if (err > 0) {
+		cntr->process_bytes = writer->process_bytes;
+		cntr->writer = NULL;
+		pthread_cond_destroy(&writer->cond);
+		pthread_mutex_destroy(&writer->lock);
+		free(writer->buf);
+		free(writer);
+		return -err;
+	}
+
+	return 0;
+}
+
+// Move the context of builder to the other storage, e.g. to finish it by the
+// other thread. The source is cleared so that it can be initialized again.
+void container_context_move(struct container_context *dst,
+			    struct container_context *src)
+{
+	struct container_writer *writer = src->writer;
+
+	assert(dst);
+	assert(src);
+
+	if (writer == NULL) {
+		*dst = *src;
+		memset(src, 0, sizeof(*src));
+		return;
+	}
+
+	// The thread refers to the context just while writing bytes.
+	pthread_mutex_lock(&writer->lock);
+	while (writer->busy)
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	*dst = *src;
+	memset(src, 0, sizeof(*src));
+	writer->cntr = dst;
+	pthread_mutex_unlock(&writer->lock);
+}
+
+// Data frames are transferred by read(2)/write(2) in the thread to handle PCM
+// frames. The others transfer all of the given frames at once.
+static bool is_partial(struct container_context *cntr)
+{
+	return cntr->process_bytes == container_recursive_read ||
+	       cntr->process_bytes == container_recursive_write;
+}
+
+// Keep the given bytes in the parser before the bytes kept already.
+static int push_pending_bytes(struct container_context *cntr, const char *buf,
+			      unsigned int byte_count)
+{
+	unsigned int size = cntr->pending_byte_count + byte_count;
+	char *ptr;
+
+	if (byte_count == 0)
+		return 0;
+
+	if (size > cntr->pending_buf_size) {
+		ptr = realloc(cntr->pending_buf, size);
+		if (ptr == NULL)
+			return -ENOMEM;
+		cntr->pending_buf = ptr;
+		cntr->pending_buf_size = size;
+	}
+
+	memmove(cntr->pending_buf + byte_count, cntr->pending_buf,
+		cntr->pending_byte_count);
+	memcpy(cntr->pending_buf, buf, byte_count);
+	cntr->pending_byte_count = size;
+
+	return 0;
+}
+
+static int read_bytes_partially(struct container_context *cntr, char *buf,
+				unsigned int byte_count,
+				unsigned int *consumed)
+{
+	unsigned int count;
+	ssize_t result;
+
+	// At first, the bytes read ahead.
+	count = cntr->pending_byte_count;
+	if (count > byte_count)
+		count = byte_count;
+	if (count > 0) {
+		memcpy(buf, cntr->pending_buf, count);
+		cntr->pending_byte_count -= count;
+		memmove(cntr->pending_buf, cntr->pending_buf + count,
+			cntr->pending_byte_count);
+	}
+	*consumed = count;
+
+	while (*consumed < byte_count && !cntr->interrupted) {
+		result = read(cntr->fd, buf + *consumed, byte_count - *consumed);
+		if (result < 0) {
+			if (cntr->interrupted)
+				return -EINTR;
+			if (errno == EAGAIN) {
+				cntr->starved = true;
+				break;
+			}
+			return -errno;
+		}
+		// Reach EOF.
+		if (result == 0) {
+			cntr->eof = true;
+			break;
+		}
+
+		*consumed += result;
+	}
+
+	return 0;
+}
+
+static int write_bytes_partially(struct container_context *cntr, char *buf,
+				 unsigned int byte_count,
+				 unsigned int *consumed)
+{
+	ssize_t result;
+
+	// Skip the bytes written already.
+	*consumed = cntr->pending_byte_count;
+	cntr->pending_byte_count = 0;
+
+	while (*consumed < byte_count && !cntr->interrupted) {
+		result = write(cntr->fd, buf + *consumed,
+			       byte_count - *consumed);
+		if (result < 0) {
+			if (cntr->interrupted)
+				return -EINTR;
+			if (errno == EAGAIN) {
+				cntr->starved = true;
+				break;
+			}
+			return -errno;
+		}
+
+		*consumed += result;
+	}
+
+	return 0;
+}
+
+// Transfer bytes as many as available without waiting for the descriptor,
+// so that the thread to handle PCM frames is not blocked by the peer of pipe.
+// The number of handled bytes is aligned to frame, and the rest of the last
+// frame is processed at next call. When starved, the caller is expected to
+// wait for the descriptor together with PCM substream.
+static int transfer_bytes_partially(struct container_context *cntr,
+				    char *buf, unsigned int byte_count,
+				    unsigned int bytes_per_frame,
+				    unsigned int *handled_byte_count)
+{
+	unsigned int consumed;
+	unsigned int count;
+	int err;
+
+	cntr->starved = false;
+
+	if (cntr->type == CONTAINER_TYPE_PARSER)
+		err = read_bytes_partially(cntr, buf, byte_count, &consumed);
+	else
+		err = write_bytes_partially(cntr, buf, byte_count, &consumed);
+	if (err < 0)
+		return err;
+
+	if (cntr->starved)
+		++cntr->starve_count;
+
+	count = consumed;
+	if (count > byte_count)
+		count = byte_count;
+	count -= count % bytes_per_frame;
+	*handled_byte_count = count;
+
+	if (cntr->type == CONTAINER_TYPE_PARSER)
+		return push_pending_bytes(cntr, buf + count, consumed - count);
+
+	cntr->pending_byte_count = consumed - count;
+	return 0;
+}
+
+static int process_frames_partially(struct container_context *cntr, char *buf,
+				    unsigned int *frame_count)
+{
+	unsigned int bytes_per_frame;
+	unsigned int byte_count;
+	uint64_t begin = 0;
+	int err;
+
+	bytes_per_frame = cntr->bytes_per_sample * cntr->samples_per_frame;
+
+	// The first 4 bytes already read to detect format are delivered at
+	// first, since they are PCM frames for raw container.
+	if (cntr->format == CONTAINER_FORMAT_RAW &&
+	    cntr->type == CONTAINER_TYPE_PARSER && !cntr->magic_handled) {
+		err = push_pending_bytes(cntr, cntr->magic,
+					 sizeof(cntr->magic));
+		if (err < 0)
+			return err;
+		cntr->magic_handled = true;
+	}
+
+	// Each container has limitation for its volume for sample data.
+	byte_count = *frame_count * bytes_per_frame;
+	if (cntr->handled_byte_count > cntr->max_size - byte_count)
+		byte_count = cntr->max_size - cntr->handled_byte_count;
+
+	if (cntr->histogram)
+		begin = histogram_get_nsec();
+
+	err = transfer_bytes_partially(cntr, buf, byte_count, bytes_per_frame,
+				       &byte_count);
+
+	if (cntr->histogram) {
+		histogram_context_record(cntr->histogram,
+					 HISTOGRAM_TYPE_CONTAINER_TIME,
+					 histogram_get_nsec() - begin);
+	}
+
+	if (err < 0)
+		return err;
+
+	cntr->handled_byte_count += byte_count;
+	if (cntr->handled_byte_count == cntr->max_size)
+		cntr->eof = true;
+
+	*frame_count = byte_count / bytes_per_frame;
+
+	return 0;
+}
+
 int container_context_process_frames(struct container_context *cntr,
 				     void *frame_buffer,
 				     unsigned int *frame_count)
@@ -364,6 +1189,7 @@ int container_context_process_frames(struct container_context *cntr,
 	unsigned int bytes_per_frame;
 	unsigned int byte_count;
 	unsigned int target_byte_count;
+	uint64_t begin = 0;
 	int err;
 
 	assert(cntr);
@@ -371,6 +1197,13 @@ int container_context_process_frames(struct container_context *cntr,
 	assert(frame_buffer);
 	assert(frame_count);
 
+	if (is_partial(cntr)) {
+		err = process_frames_partially(cntr, buf, frame_count);
+		if (err < 0)
+			*frame_count = 0;
+		return err;
+	}
+
 	bytes_per_frame = cntr->bytes_per_sample * cntr->samples_per_frame;
 	target_byte_count = *frame_count * bytes_per_frame;
 
@@ -390,9 +1223,19 @@ int container_context_process_frames(struct container_context *cntr,
 	if (cntr->handled_byte_count > cntr->max_size - byte_count)
 		byte_count = cntr->max_size - cntr->handled_byte_count;
 
+	if (cntr->histogram)
+		begin = histogram_get_nsec();
+
 	// All of supported containers include interleaved PCM frames.
 	// TODO: process frames for truncate case.
 	err = cntr->process_bytes(cntr, buf, byte_count);
+
+	if (cntr->histogram) {
+		histogram_context_record(cntr->histogram,
+					 HISTOGRAM_TYPE_CONTAINER_TIME,
+					 histogram_get_nsec() - begin);
+	}
+
 	if (err < 0) {
 		*frame_count = 0;
 		return err;
@@ -407,10 +1250,47 @@ int container_context_process_frames(struct container_context *cntr,
 	return 0;
 }
 
+// The last frames processed at previous call are processed again at next
+// call, e.g. when the other containers handled less frames than the one.
+int container_context_rewind_frames(struct container_context *cntr,
+				    void *frame_buffer,
+				    unsigned int frame_count)
+{
+	unsigned int byte_count;
+	int err;
+
+	assert(cntr);
+	assert(frame_buffer);
+
+	byte_count = frame_count * cntr->bytes_per_sample *
+		     cntr->samples_per_frame;
+	if (byte_count == 0)
+		return 0;
+
+	// The others always transfer all of the given frames.
+	if (!is_partial(cntr) || byte_count > cntr->handled_byte_count)
+		return -ENXIO;
+
+	if (cntr->type == CONTAINER_TYPE_PARSER) {
+		err = push_pending_bytes(cntr, frame_buffer, byte_count);
+		if (err < 0)
+			return err;
+	} else {
+		cntr->pending_byte_count += byte_count;
+	}
+
+	// For parser, EOF is detected again after the kept bytes.
+	cntr->handled_byte_count -= byte_count;
+	cntr->eof = false;
+
+	return 0;
+}
+
 int container_context_post_process(struct container_context *cntr,
 				   uint64_t *frame_count)
 {
-	int err = 0;
+	int post_err;
+	int err;
 
 	assert(cntr);
 	assert(frame_count);
@@ -420,13 +1300,32 @@ int container_context_post_process(struct container_context *cntr,
 			cntr->handled_byte_count);
 	}
 
+	if (cntr->verbose && cntr->starve_count > 0) {
+		fprintf(stderr, "  Starvation of file I/O: %u\n",
+			cntr->starve_count);
+	}
+
+	err = stop_writer(cntr);
+
+	unmap_file(cntr);
+
+	// Write out frames left in the builder even if interrupted.
+	if (err >= 0 && cntr->ops && cntr->ops->flush) {
+		cntr->interrupted = false;
+		err = cntr->ops->flush(cntr);
+	}
+
 	// NOTE* we cannot seek when using standard input/output.
 	if (!cntr->stdio && cntr->ops && cntr->ops->post_process) {
 		// Usually, need to write out processed bytes in container
-		// header even it this program is interrupted.
+		// header even it this program is interrupted, or failed to
+		// write the rest of bytes. The first error is reported.
 		cntr->interrupted = false;
 
-		err = cntr->ops->post_process(cntr, cntr->handled_byte_count);
+		post_err = cntr->ops->post_process(cntr,
+						   cntr->handled_byte_count);
+		if (err >= 0)
+			err = post_err;
 	}
 
 	// Ensure to perform write-back from disk cache.
@@ -451,8 +1350,19 @@ void container_context_destroy(struct container_context *cntr)
 {
 	assert(cntr);
 
-	if (cntr->private_data)
+	stop_writer(cntr);
+	unmap_file(cntr);
+
+	if (cntr->private_data) {
+		if (cntr->ops && cntr->ops->release)
+			cntr->ops->release(cntr);
 		free(cntr->private_data);
+	}
+
+	free(cntr->pending_buf);
+	cntr->pending_buf = NULL;
+	cntr->pending_byte_count = 0;
+	cntr->pending_buf_size = 0;
 
 	cntr->fd = 0;
 	cntr->private_data = NULL;
@@ -14,6 +14,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include <alsa/asoundlib.h>
 
@@ -29,11 +30,13 @@ enum container_format {
 	CONTAINER_FORMAT_RIFF_WAVE = 0,
 	CONTAINER_FORMAT_AU,
 	CONTAINER_FORMAT_VOC,
+	CONTAINER_FORMAT_FLAC,
 	CONTAINER_FORMAT_RAW,
 	CONTAINER_FORMAT_COUNT,
 };
 
 struct container_ops;
+struct histogram_context;
 
 struct container_context {
 	enum container_type type;
@@ -52,12 +55,35 @@ struct container_context {
 	void *private_data;
 
 	// Available after pre-process.
+	snd_pcm_format_t sample_format;
 	unsigned int bytes_per_sample;
 	unsigned int samples_per_frame;
 	unsigned int frames_per_second;
 
 	unsigned int verbose;
 	uint64_t handled_byte_count;
+	unsigned int starve_count;
+
+	// Available when data frames are transferred without blocking. The
+	// parser keeps bytes read ahead, and the builder skips bytes already
+	// written at next call.
+	bool starved;
+	char *pending_buf;
+	unsigned int pending_byte_count;
+	unsigned int pending_buf_size;
+
+	// Available when data frames are transferred by mapping the file.
+	bool mapped;
+	char *map_addr;
+	off_t map_offset;
+	size_t map_length;
+	off_t map_pos;
+	off_t file_size;
+
+	// Available when data frames are written by a thread.
+	struct container_writer *writer;
+	// Available to record time to process data frames.
+	struct histogram_context *histogram;
 };
 
 const char *const container_suffix_from_format(enum container_format format);
@@ -72,9 +98,17 @@ int container_context_pre_process(struct container_context *cntr,
 				  unsigned int *samples_per_frame,
 				  unsigned int *frames_per_second,
 				  uint64_t *frame_count);
+int container_context_map_file(struct container_context *cntr);
+int container_context_start_writer(struct container_context *cntr,
+				   unsigned int queue_msec);
 int container_context_process_frames(struct container_context *cntr,
 				     void *frame_buffer,
 				     unsigned int *frame_count);
+int container_context_rewind_frames(struct container_context *cntr,
+				    void *frame_buffer,
+				    unsigned int frame_count);
+void container_context_move(struct container_context *dst,
+			    struct container_context *src);
 int container_context_post_process(struct container_context *cntr,
 				   uint64_t *frame_count);
 
@@ -86,8 +120,13 @@ struct container_ops {
 			   unsigned int *samples_per_frame,
 			   unsigned int *frames_per_second,
 			   uint64_t *byte_count);
+	// Optional, to write out data frames buffered in the builder.
+	int (*flush)(struct container_context *cntr);
 	int (*post_process)(struct container_context *cntr,
 			    uint64_t handled_byte_count);
+	// Optional, to release resources in any case, even for standard
+	// input/output or at failure.
+	void (*release)(struct container_context *cntr);
 };
 struct container_parser {
 	enum container_format format;
@@ -107,11 +146,16 @@ struct container_builder {
 
 int container_recursive_read(struct container_context *cntr, void *buf,
 			     unsigned int byte_count);
+int container_partial_read(struct container_context *cntr, void *buf,
+			   unsigned int byte_count);
 int container_recursive_write(struct container_context *cntr, void *buf,
 			      unsigned int byte_count);
 int container_seek_offset(struct container_context *cntr, off_t offset);
+int container_thread_attr_init(pthread_attr_t *attr);
 
 extern const struct container_parser container_parser_riff_wave;
+extern const struct container_parser container_parser_rf64;
+extern const struct container_parser container_parser_bw64;
 extern const struct container_builder container_builder_riff_wave;
 
 extern const struct container_parser container_parser_au;
@@ -120,6 +164,9 @@ extern const struct container_builder container_builder_au;
 extern const struct container_parser container_parser_voc;
 extern const struct container_builder container_builder_voc;
 
+extern const struct container_parser container_parser_flac;
+extern const struct container_builder container_builder_flac;
+
 extern const struct container_parser container_parser_raw;
 extern const struct container_builder container_builder_raw;
 
@@ -8,41 +8,25 @@
 
 #include "frame-cache.h"
 
-static void align_frames_in_i(struct frame_cache *cache,
-			      unsigned int consumed_count)
+static void *locate_frames_in_i(struct frame_cache *cache, void *ptrs,
+				unsigned int pos)
 {
 	char *buf = cache->buf;
-	unsigned int offset;
-	unsigned int size;
 
-	cache->remained_count -= consumed_count;
-
-	offset = cache->bytes_per_sample * cache->samples_per_frame *
-		 consumed_count;
-	size = cache->bytes_per_sample * cache->samples_per_frame *
-	       cache->remained_count;
-	memmove(buf, buf + offset, size);
-
-	cache->buf_ptr = buf + size;
+	return buf + cache->bytes_per_sample * cache->samples_per_frame * pos;
 }
 
-static void align_frames_in_n(struct frame_cache *cache,
-			      unsigned int consumed_count)
+static void *locate_frames_in_n(struct frame_cache *cache, void *ptrs,
+				unsigned int pos)
 {
 	char **bufs = cache->buf;
-	char **buf_ptrs = cache->buf_ptr;
-	unsigned int offset;
-	unsigned int size;
+	char **buf_ptrs = ptrs;
 	int i;
 
-	cache->remained_count -= consumed_count;
+	for (i = 0; i < cache->samples_per_frame; ++i)
+		buf_ptrs[i] = bufs[i] + cache->bytes_per_sample * pos;
 
-	for (i = 0; i < cache->samples_per_frame; ++i) {
-		offset = cache->bytes_per_sample * consumed_count;
-		size = cache->bytes_per_sample * cache->remained_count;
-		memmove(bufs[i], bufs[i] + offset, size);
-		buf_ptrs[i] = bufs[i] + size;
-	}
+	return buf_ptrs;
 }
 
 int frame_cache_init(struct frame_cache *cache, snd_pcm_access_t access,
@@ -51,15 +35,16 @@ int frame_cache_init(struct frame_cache *cache, snd_pcm_access_t access,
 		     unsigned int frames_per_cache)
 {
 	cache->access = access;
+	cache->head = 0;
 	cache->remained_count = 0;
 	cache->bytes_per_sample = bytes_per_sample;
 	cache->samples_per_frame = samples_per_frame;
 	cache->frames_per_cache = frames_per_cache;
 
 	if (access == SND_PCM_ACCESS_RW_INTERLEAVED)
-		cache->align_frames = align_frames_in_i;
+		cache->locate_frames = locate_frames_in_i;
 	else if (access == SND_PCM_ACCESS_RW_NONINTERLEAVED)
-		cache->align_frames = align_frames_in_n;
+		cache->locate_frames = locate_frames_in_n;
 	else
 		return -EINVAL;
 
@@ -71,21 +56,23 @@ int frame_cache_init(struct frame_cache *cache, snd_pcm_access_t access,
 		if (buf == NULL)
 			goto nomem;
 		cache->buf = buf;
-		cache->buf_ptr = buf;
 	} else {
 		char **bufs = calloc(samples_per_frame, sizeof(*bufs));
-		char **buf_ptrs = calloc(samples_per_frame, sizeof(*buf_ptrs));
+		char **read_ptrs = calloc(samples_per_frame,
+					  sizeof(*read_ptrs));
+		char **write_ptrs = calloc(samples_per_frame,
+					   sizeof(*write_ptrs));
 		int i;
 
 		cache->buf = bufs;
-		cache->buf_ptr = buf_ptrs;
-		if (bufs == NULL || buf_ptrs == NULL)
+		cache->read_ptrs = read_ptrs;
+		cache->write_ptrs = write_ptrs;
+		if (bufs == NULL || read_ptrs == NULL || write_ptrs == NULL)
 			goto nomem;
 		for (i = 0; i < samples_per_frame; ++i) {
 			bufs[i] = calloc(frames_per_cache, bytes_per_sample);
 			if (bufs[i] == NULL)
 				goto nomem;
-			buf_ptrs[i] = bufs[i];
 		}
 	}
 
@@ -106,7 +93,8 @@ void frame_cache_destroy(struct frame_cache *cache)
 			for (i = 0; i < cache->samples_per_frame; ++i)
 				free(bufs[i]);
 		}
-		free(cache->buf_ptr);
+		free(cache->read_ptrs);
+		free(cache->write_ptrs);
 	}
 	free(cache->buf);
 	memset(cache, 0, sizeof(*cache));
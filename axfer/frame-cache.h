@@ -8,10 +8,15 @@
 
 #include <alsa/asoundlib.h>
 
+// The cache is a ring buffer. Cached frames start at 'head' and can wrap
+// around the end of buffer, thus they are accessed by two contiguous spans at
+// most.
 struct frame_cache {
 	void *buf;
-	void *buf_ptr;
+	void *read_ptrs;
+	void *write_ptrs;
 
+	unsigned int head;
 	unsigned int remained_count;
 
 	snd_pcm_access_t access;
@@ -19,8 +24,8 @@ struct frame_cache {
 	unsigned int samples_per_frame;
 	unsigned int frames_per_cache;
 
-	void (*align_frames)(struct frame_cache *cache,
-			     unsigned int consumed_count);
+	void *(*locate_frames)(struct frame_cache *cache, void *ptrs,
+			       unsigned int pos);
 };
 
 int frame_cache_init(struct frame_cache *cache, snd_pcm_access_t access,
@@ -34,6 +39,35 @@ static inline unsigned int frame_cache_get_count(struct frame_cache *cache)
 	return cache->remained_count;
 }
 
+// Retrieve the contiguous span of cached frames from the head.
+static inline void *frame_cache_get_read_span(struct frame_cache *cache,
+					      unsigned int *frame_count)
+{
+	unsigned int count = cache->remained_count;
+
+	if (cache->head + count > cache->frames_per_cache)
+		count = cache->frames_per_cache - cache->head;
+	*frame_count = count;
+
+	return cache->locate_frames(cache, cache->read_ptrs, cache->head);
+}
+
+// Retrieve the contiguous span of free space just after the cached frames.
+static inline void *frame_cache_get_write_span(struct frame_cache *cache,
+					       unsigned int *frame_count)
+{
+	unsigned int tail = cache->head + cache->remained_count;
+	unsigned int count = cache->frames_per_cache - cache->remained_count;
+
+	if (tail >= cache->frames_per_cache)
+		tail -= cache->frames_per_cache;
+	if (tail + count > cache->frames_per_cache)
+		count = cache->frames_per_cache - tail;
+	*frame_count = count;
+
+	return cache->locate_frames(cache, cache->write_ptrs, tail);
+}
+
 static inline void frame_cache_increase_count(struct frame_cache *cache,
 					      unsigned int frame_count)
 {
@@ -43,5 +77,15 @@ static inline void frame_cache_increase_count(struct frame_cache *cache,
 static inline void frame_cache_reduce(struct frame_cache *cache,
 				      unsigned int consumed_count)
 {
-	cache->align_frames(cache, consumed_count);
+	cache->remained_count -= consumed_count;
+
+	// Rewind to the beginning when empty so that the next spans are
+	// as large as possible.
+	if (cache->remained_count == 0) {
+		cache->head = 0;
+	} else {
+		cache->head += consumed_count;
+		if (cache->head >= cache->frames_per_cache)
+			cache->head -= cache->frames_per_cache;
+	}
 }
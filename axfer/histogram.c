@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// histogram.c - histograms of values measured in hot path.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include "histogram.h"
+#include "misc.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+static const char *const histogram_labels[] = {
+	[HISTOGRAM_TYPE_WAKEUP_LATENCY] = "wakeup_latency_nsec",
+	[HISTOGRAM_TYPE_PROCESS_TIME] = "process_time_nsec",
+	[HISTOGRAM_TYPE_CONTAINER_TIME] = "container_time_nsec",
+	[HISTOGRAM_TYPE_AVAIL] = "avail_frames",
+};
+
+static const struct {
+	const char *const label;
+	unsigned int permille;
+} percentiles[] = {
+	{"p50",		500},
+	{"p90",		900},
+	{"p99",		990},
+	{"p999",	999},
+};
+
+static unsigned int bucket_index(uint64_t value)
+{
+	unsigned int exponent;
+
+	if (value < HISTOGRAM_LINEAR_BUCKET_COUNT)
+		return value;
+
+	// At least 4 since the value is larger than 15.
+	exponent = 63 - __builtin_clzll(value);
+
+	return HISTOGRAM_LINEAR_BUCKET_COUNT +
+	       ((exponent - 4) << HISTOGRAM_SUB_BUCKET_BITS) +
+	       ((value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) &
+		((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1));
+}
+
+static uint64_t bucket_lower_value(unsigned int index)
+{
+	unsigned int exponent;
+	unsigned int sub;
+
+	if (index < HISTOGRAM_LINEAR_BUCKET_COUNT)
+		return index;
+
+	index -= HISTOGRAM_LINEAR_BUCKET_COUNT;
+	exponent = (index >> HISTOGRAM_SUB_BUCKET_BITS) + 4;
+	sub = index & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1);
+
+	return (uint64_t)((1 << HISTOGRAM_SUB_BUCKET_BITS) + sub) <<
+	       (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+static uint64_t bucket_upper_value(unsigned int index)
+{
+	if (index + 1 == HISTOGRAM_BUCKET_COUNT)
+		return UINT64_MAX;
+
+	return bucket_lower_value(index + 1) - 1;
+}
+
+void histogram_context_init(struct histogram_context *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
+
+void histogram_context_record(struct histogram_context *hist,
+			      enum histogram_type type, uint64_t value)
+{
+	struct histogram *entry = &hist->entries[type];
+
+	++entry->buckets[bucket_index(value)];
+
+	if (entry->count == 0 || value < entry->min)
+		entry->min = value;
+	if (value > entry->max)
+		entry->max = value;
+	entry->sum += value;
+	++entry->count;
+}
+
+// The upper value in the bucket which includes the given percentile.
+static uint64_t calculate_percentile(const struct histogram *entry,
+				     unsigned int permille)
+{
+	uint64_t threshold;
+	uint64_t accumulated = 0;
+	uint64_t value;
+	int i;
+
+	threshold = (entry->count * permille + 999) / 1000;
+
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+		accumulated += entry->buckets[i];
+		if (accumulated >= threshold)
+			break;
+	}
+
+	value = bucket_upper_value(i);
+	if (value > entry->max)
+		value = entry->max;
+
+	return value;
+}
+
+static void dump_histogram(const struct histogram *entry, FILE *file)
+{
+	bool first;
+	int i;
+
+	fprintf(file, "{\"count\": %" PRIu64, entry->count);
+	if (entry->count == 0) {
+		fprintf(file, "}");
+		return;
+	}
+
+	fprintf(file, ", \"min\": %" PRIu64 ", \"max\": %" PRIu64
+		", \"mean\": %" PRIu64,
+		entry->min, entry->max, entry->sum / entry->count);
+
+	for (i = 0; i < ARRAY_SIZE(percentiles); ++i) {
+		fprintf(file, ", \"%s\": %" PRIu64, percentiles[i].label,
+			calculate_percentile(entry, percentiles[i].permille));
+	}
+
+	// The lower value and the count of each bucket which is not empty.
+	fprintf(file, ",\n    \"buckets\": [");
+	first = true;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+		if (entry->buckets[i] == 0)
+			continue;
+		fprintf(file, "%s[%" PRIu64 ", %" PRIu64 "]",
+			first ? "" : ", ", bucket_lower_value(i),
+			entry->buckets[i]);
+		first = false;
+	}
+	fprintf(file, "]}");
+}
+
+// Write all of histograms as JSON object to the file, or standard error for
+// '-'.
+int histogram_context_dump(struct histogram_context *hist, const char *path)
+{
+	FILE *file;
+	int i;
+
+	if (!strcmp(path, "-")) {
+		file = stderr;
+	} else {
+		file = fopen(path, "w");
+		if (file == NULL)
+			return -errno;
+	}
+
+	fprintf(file, "{\n");
+	for (i = 0; i < HISTOGRAM_TYPE_COUNT; ++i) {
+		fprintf(file, "  \"%s\": ", histogram_labels[i]);
+		dump_histogram(&hist->entries[i], file);
+		fprintf(file, "%s\n", i + 1 < HISTOGRAM_TYPE_COUNT ? "," : "");
+	}
+	fprintf(file, "}\n");
+
+	if (file != stderr) {
+		if (fclose(file) != 0)
+			return -errno;
+	} else {
+		fflush(file);
+	}
+
+	return 0;
+}
+
+uint64_t histogram_get_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
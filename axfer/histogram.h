@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// histogram.h - a header for histograms of values measured in hot path.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#ifndef __ALSA_UTILS_AXFER_HISTOGRAM__H_
+#define __ALSA_UTILS_AXFER_HISTOGRAM__H_
+
+#include <stdint.h>
+
+enum histogram_type {
+	HISTOGRAM_TYPE_WAKEUP_LATENCY = 0,
+	HISTOGRAM_TYPE_PROCESS_TIME,
+	HISTOGRAM_TYPE_CONTAINER_TIME,
+	HISTOGRAM_TYPE_AVAIL,
+	HISTOGRAM_TYPE_COUNT,
+};
+
+// Values less than 16 have own bucket. The other values have 8 buckets for
+// each power of two, thus the error of recorded value is within 12.5 %.
+#define HISTOGRAM_LINEAR_BUCKET_COUNT	16
+#define HISTOGRAM_SUB_BUCKET_BITS	3
+#define HISTOGRAM_BUCKET_COUNT		(HISTOGRAM_LINEAR_BUCKET_COUNT + \
+					 (64 - 4) * (1 << HISTOGRAM_SUB_BUCKET_BITS))
+
+struct histogram {
+	uint64_t buckets[HISTOGRAM_BUCKET_COUNT];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+};
+
+struct histogram_context {
+	struct histogram entries[HISTOGRAM_TYPE_COUNT];
+};
+
+void histogram_context_init(struct histogram_context *hist);
+void histogram_context_record(struct histogram_context *hist,
+			      enum histogram_type type, uint64_t value);
+int histogram_context_dump(struct histogram_context *hist, const char *path);
+
+uint64_t histogram_get_nsec(void);
+
+#endif
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// mapper-convert.c - a converter of sample format between PCM substream and
+//		      containers.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include "mapper.h"
+#include "misc.h"
+
+#include <string.h>
+#include <endian.h>
+
+// Samples are converted via an array of signed 32 bit integer aligned to MSB.
+// The loops are simple enough for compilers to vectorize them.
+#define SAMPLES_PER_CHUNK	256
+
+#define DEFINE_CODEC_16(name, to_cpu, from_cpu)				\
+static void decode_##name(int32_t *dst, const char *src,			\
+			  unsigned int count)				\
+{									\
+	const uint16_t *s = (const uint16_t *)src;			\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i)					\
+		dst[i] = (int32_t)((uint32_t)to_cpu(s[i]) << 16);	\
+}									\
+									\
+static void encode_##name(char *dst, const int32_t *src,			\
+			  unsigned int count)				\
+{									\
+	uint16_t *d = (uint16_t *)dst;					\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i)					\
+		d[i] = from_cpu((uint16_t)((uint32_t)src[i] >> 16));	\
+}
+
+#define DEFINE_CODEC_24(name, to_cpu, from_cpu)				\
+static void decode_##name(int32_t *dst, const char *src,			\
+			  unsigned int count)				\
+{									\
+	const uint32_t *s = (const uint32_t *)src;			\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i)					\
+		dst[i] = (int32_t)(to_cpu(s[i]) << 8);			\
+}									\
+									\
+static void encode_##name(char *dst, const int32_t *src,			\
+			  unsigned int count)				\
+{									\
+	uint32_t *d = (uint32_t *)dst;					\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i)					\
+		d[i] = from_cpu((uint32_t)(src[i] >> 8));		\
+}
+
+#define DEFINE_CODEC_32(name, to_cpu, from_cpu)				\
+static void decode_##name(int32_t *dst, const char *src,			\
+			  unsigned int count)				\
+{									\
+	const uint32_t *s = (const uint32_t *)src;			\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i)					\
+		dst[i] = (int32_t)to_cpu(s[i]);				\
+}									\
+									\
+static void encode_##name(char *dst, const int32_t *src,			\
+			  unsigned int count)				\
+{									\
+	uint32_t *d = (uint32_t *)dst;					\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i)					\
+		d[i] = from_cpu((uint32_t)src[i]);			\
+}
+
+// The range of -1.0 to 1.0 is mapped to the whole range of 32 bit integer.
+static inline int32_t float_to_s32(float val)
+{
+	val *= 2147483648.0f;
+	if (val >= 2147483648.0f)
+		return INT32_MAX;
+	if (val <= -2147483648.0f)
+		return INT32_MIN;
+	return (int32_t)val;
+}
+
+#define DEFINE_CODEC_FLOAT(name, to_cpu, from_cpu)			\
+static void decode_##name(int32_t *dst, const char *src,			\
+			  unsigned int count)				\
+{									\
+	const uint32_t *s = (const uint32_t *)src;			\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i) {					\
+		uint32_t bits = to_cpu(s[i]);				\
+		float val;						\
+		memcpy(&val, &bits, sizeof(val));			\
+		dst[i] = float_to_s32(val);				\
+	}								\
+}									\
+									\
+static void encode_##name(char *dst, const int32_t *src,			\
+			  unsigned int count)				\
+{									\
+	uint32_t *d = (uint32_t *)dst;					\
+	int i;								\
+									\
+	for (i = 0; i < count; ++i) {					\
+		float val = (float)src[i] * (1.0f / 2147483648.0f);	\
+		uint32_t bits;						\
+		memcpy(&bits, &val, sizeof(bits));			\
+		d[i] = from_cpu(bits);					\
+	}								\
+}
+
+DEFINE_CODEC_16(s16_le, le16toh, htole16)
+DEFINE_CODEC_16(s16_be, be16toh, htobe16)
+DEFINE_CODEC_24(s24_le, le32toh, htole32)
+DEFINE_CODEC_24(s24_be, be32toh, htobe32)
+DEFINE_CODEC_32(s32_le, le32toh, htole32)
+DEFINE_CODEC_32(s32_be, be32toh, htobe32)
+DEFINE_CODEC_FLOAT(float_le, le32toh, htole32)
+DEFINE_CODEC_FLOAT(float_be, be32toh, htobe32)
+
+static void decode_s24_3le(int32_t *dst, const char *src, unsigned int count)
+{
+	const uint8_t *s = (const uint8_t *)src;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		dst[i] = (int32_t)(((uint32_t)s[0] << 8) |
+				   ((uint32_t)s[1] << 16) |
+				   ((uint32_t)s[2] << 24));
+		s += 3;
+	}
+}
+
+static void encode_s24_3le(char *dst, const int32_t *src, unsigned int count)
+{
+	uint8_t *d = (uint8_t *)dst;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		d[0] = (uint32_t)src[i] >> 8;
+		d[1] = (uint32_t)src[i] >> 16;
+		d[2] = (uint32_t)src[i] >> 24;
+		d += 3;
+	}
+}
+
+static void decode_s24_3be(int32_t *dst, const char *src, unsigned int count)
+{
+	const uint8_t *s = (const uint8_t *)src;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		dst[i] = (int32_t)(((uint32_t)s[0] << 24) |
+				   ((uint32_t)s[1] << 16) |
+				   ((uint32_t)s[2] << 8));
+		s += 3;
+	}
+}
+
+static void encode_s24_3be(char *dst, const int32_t *src, unsigned int count)
+{
+	uint8_t *d = (uint8_t *)dst;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		d[0] = (uint32_t)src[i] >> 24;
+		d[1] = (uint32_t)src[i] >> 16;
+		d[2] = (uint32_t)src[i] >> 8;
+		d += 3;
+	}
+}
+
+static const struct {
+	snd_pcm_format_t format;
+	// The number of bits with precision, used to decide dithering.
+	unsigned int significant_bits;
+	bool is_float;
+	void (*decode)(int32_t *dst, const char *src, unsigned int count);
+	void (*encode)(char *dst, const int32_t *src, unsigned int count);
+} entries[] = {
+	{SND_PCM_FORMAT_S16_LE,		16, false, decode_s16_le, encode_s16_le},
+	{SND_PCM_FORMAT_S16_BE,		16, false, decode_s16_be, encode_s16_be},
+	{SND_PCM_FORMAT_S24_LE,		24, false, decode_s24_le, encode_s24_le},
+	{SND_PCM_FORMAT_S24_BE,		24, false, decode_s24_be, encode_s24_be},
+	{SND_PCM_FORMAT_S24_3LE,	24, false, decode_s24_3le, encode_s24_3le},
+	{SND_PCM_FORMAT_S24_3BE,	24, false, decode_s24_3be, encode_s24_3be},
+	{SND_PCM_FORMAT_S32_LE,		32, false, decode_s32_le, encode_s32_le},
+	{SND_PCM_FORMAT_S32_BE,		32, false, decode_s32_be, encode_s32_be},
+	{SND_PCM_FORMAT_FLOAT_LE,	24, true, decode_float_le, encode_float_le},
+	{SND_PCM_FORMAT_FLOAT_BE,	24, true, decode_float_be, encode_float_be},
+};
+
+static int find_entry(snd_pcm_format_t format)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); ++i) {
+		if (entries[i].format == format)
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+bool mapper_converter_is_supported(snd_pcm_format_t format)
+{
+	return find_entry(format) >= 0;
+}
+
+int mapper_converter_init(struct mapper_converter *conv,
+			  snd_pcm_format_t src_format,
+			  snd_pcm_format_t dst_format)
+{
+	int src;
+	int dst;
+
+	src = find_entry(src_format);
+	dst = find_entry(dst_format);
+	if (src < 0 || dst < 0)
+		return -EINVAL;
+
+	conv->decode = entries[src].decode;
+	conv->encode = entries[dst].encode;
+	conv->src_bytes = snd_pcm_format_physical_width(src_format) / 8;
+	conv->dst_bytes = snd_pcm_format_physical_width(dst_format) / 8;
+
+	// Dither when losing precision, except for floating point which keeps
+	// precision for small amplitude.
+	if (!entries[dst].is_float &&
+	    entries[src].significant_bits > entries[dst].significant_bits)
+		conv->dither_bits = entries[dst].significant_bits;
+	else
+		conv->dither_bits = 0;
+	conv->random = 0x2545f491;
+
+	return 0;
+}
+
+static inline uint32_t next_random(struct mapper_converter *conv)
+{
+	// Xorshift, enough for noise.
+	conv->random ^= conv->random << 13;
+	conv->random ^= conv->random >> 17;
+	conv->random ^= conv->random << 5;
+
+	return conv->random;
+}
+
+// Add triangular noise of +/- 1 LSB in the destination, and the half of LSB
+// so that truncation in encoder rounds the sample.
+static void apply_dither(struct mapper_converter *conv, int32_t *samples,
+			 unsigned int count)
+{
+	unsigned int bits = conv->dither_bits;
+	int64_t lsb = 1ll << (32 - bits);
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		int64_t val = samples[i];
+
+		val += (next_random(conv) >> bits) + (next_random(conv) >> bits);
+		val -= lsb / 2;
+		if (val > INT32_MAX)
+			val = INT32_MAX;
+		else if (val < INT32_MIN)
+			val = INT32_MIN;
+		samples[i] = (int32_t)val;
+	}
+}
+
+void mapper_converter_process(struct mapper_converter *conv, void *dst,
+			      const void *src, unsigned int sample_count)
+{
+	int32_t samples[SAMPLES_PER_CHUNK];
+	const char *s = src;
+	char *d = dst;
+
+	while (sample_count > 0) {
+		unsigned int count = sample_count;
+
+		if (count > SAMPLES_PER_CHUNK)
+			count = SAMPLES_PER_CHUNK;
+
+		conv->decode(samples, s, count);
+		if (conv->dither_bits > 0)
+			apply_dither(conv, samples, count);
+		conv->encode(d, samples, count);
+
+		s += conv->src_bytes * count;
+		d += conv->dst_bytes * count;
+		sample_count -= count;
+	}
+}
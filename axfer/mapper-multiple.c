@@ -9,65 +9,319 @@
 #include "mapper.h"
 #include "misc.h"
 
+typedef void (*align_frames_t)(void *frame_buf, unsigned int frame_count,
+			       char **buf, unsigned int bytes_per_sample,
+			       struct container_context *cntrs,
+			       unsigned int cntr_count);
+
 struct multiple_state {
-	void (*align_frames)(void *frame_buf, unsigned int frame_count,
-			     char **buf, unsigned int bytes_per_sample,
-			     struct container_context *cntrs,
-			     unsigned int cntr_count);
+	align_frames_t align_frames;
 	char **bufs;
 	unsigned int cntr_count;
+	unsigned int *frame_counts;
 };
 
-static void align_to_i(void *frame_buf, unsigned int frame_count,
-		       char **src_bufs, unsigned int bytes_per_sample,
-		       struct container_context *cntrs, unsigned int cntr_count)
+// Copy samples in order of frames so that the interleaved buffer is accessed
+// sequentially. The size of sample is given as a constant by callers so that
+// compilers can replace the call of memcpy() with a single load/store.
+static inline void interleave_samples(char *dst, char **src_bufs,
+				      unsigned int bytes_per_sample,
+				      unsigned int frame_count,
+				      struct container_context *cntrs,
+				      unsigned int cntr_count)
 {
-	char *dst = frame_buf;
-	char *src;
-	unsigned int dst_pos;
 	unsigned int src_pos;
-	struct container_context *cntr;
 	int i, j;
 
-	// src: first channel in each of interleaved buffers in containers =>
-	// dst:interleaved.
-	for (i = 0; i < cntr_count; ++i) {
-		src = src_bufs[i];
-		cntr = cntrs + i;
-
-		for (j = 0; j < frame_count; ++j) {
+	for (j = 0; j < frame_count; ++j) {
+		for (i = 0; i < cntr_count; ++i) {
 			// Use first src channel for each of dst channel.
-			src_pos = bytes_per_sample * cntr->samples_per_frame * j;
-			dst_pos = bytes_per_sample * (cntr_count * j + i);
+			src_pos = bytes_per_sample *
+				  cntrs[i].samples_per_frame * j;
+
+			memcpy(dst, src_bufs[i] + src_pos, bytes_per_sample);
+			dst += bytes_per_sample;
+		}
+	}
+}
+
+static inline void deinterleave_samples(char *src, char **dst_bufs,
+					unsigned int bytes_per_sample,
+					unsigned int frame_count,
+					unsigned int cntr_count)
+{
+	unsigned int dst_pos;
+	int i, j;
 
-			memcpy(dst + dst_pos, src + src_pos, bytes_per_sample);
+	// In demuxer case, each container has one sample per frame.
+	for (j = 0; j < frame_count; ++j) {
+		dst_pos = bytes_per_sample * j;
+		for (i = 0; i < cntr_count; ++i) {
+			memcpy(dst_bufs[i] + dst_pos, src, bytes_per_sample);
+			src += bytes_per_sample;
 		}
 	}
 }
 
+// Stereo in two containers is the most common case. The number of containers
+// is given as a constant as well so that compilers can unroll the inner loop.
+static inline void interleave_samples_2ch(char *dst, char **src_bufs,
+					  unsigned int bytes_per_sample,
+					  unsigned int frame_count)
+{
+	const char *l = src_bufs[0];
+	const char *r = src_bufs[1];
+	int j;
+
+	for (j = 0; j < frame_count; ++j) {
+		memcpy(dst, l, bytes_per_sample);
+		memcpy(dst + bytes_per_sample, r, bytes_per_sample);
+		dst += bytes_per_sample * 2;
+		l += bytes_per_sample;
+		r += bytes_per_sample;
+	}
+}
+
+static inline void deinterleave_samples_2ch(const char *src, char **dst_bufs,
+					    unsigned int bytes_per_sample,
+					    unsigned int frame_count)
+{
+	char *l = dst_bufs[0];
+	char *r = dst_bufs[1];
+	int j;
+
+	for (j = 0; j < frame_count; ++j) {
+		memcpy(l, src, bytes_per_sample);
+		memcpy(r, src + bytes_per_sample, bytes_per_sample);
+		src += bytes_per_sample * 2;
+		l += bytes_per_sample;
+		r += bytes_per_sample;
+	}
+}
+
+static void align_to_i(void *frame_buf, unsigned int frame_count,
+		       char **src_bufs, unsigned int bytes_per_sample,
+		       struct container_context *cntrs, unsigned int cntr_count)
+{
+	// src: first channel in each of interleaved buffers in containers =>
+	// dst:interleaved.
+	interleave_samples(frame_buf, src_bufs, bytes_per_sample, frame_count,
+			   cntrs, cntr_count);
+}
+
+static void align_to_i_8(void *frame_buf, unsigned int frame_count,
+			 char **src_bufs, unsigned int bytes_per_sample,
+			 struct container_context *cntrs,
+			 unsigned int cntr_count)
+{
+	interleave_samples(frame_buf, src_bufs, 1, frame_count, cntrs,
+			   cntr_count);
+}
+
+static void align_to_i_16(void *frame_buf, unsigned int frame_count,
+			  char **src_bufs, unsigned int bytes_per_sample,
+			  struct container_context *cntrs,
+			  unsigned int cntr_count)
+{
+	interleave_samples(frame_buf, src_bufs, 2, frame_count, cntrs,
+			   cntr_count);
+}
+
+static void align_to_i_24(void *frame_buf, unsigned int frame_count,
+			  char **src_bufs, unsigned int bytes_per_sample,
+			  struct container_context *cntrs,
+			  unsigned int cntr_count)
+{
+	interleave_samples(frame_buf, src_bufs, 3, frame_count, cntrs,
+			   cntr_count);
+}
+
+static void align_to_i_32(void *frame_buf, unsigned int frame_count,
+			  char **src_bufs, unsigned int bytes_per_sample,
+			  struct container_context *cntrs,
+			  unsigned int cntr_count)
+{
+	interleave_samples(frame_buf, src_bufs, 4, frame_count, cntrs,
+			   cntr_count);
+}
+
+static void align_to_i_64(void *frame_buf, unsigned int frame_count,
+			  char **src_bufs, unsigned int bytes_per_sample,
+			  struct container_context *cntrs,
+			  unsigned int cntr_count)
+{
+	interleave_samples(frame_buf, src_bufs, 8, frame_count, cntrs,
+			   cntr_count);
+}
+
+static void align_to_i_16_2ch(void *frame_buf, unsigned int frame_count,
+			      char **src_bufs, unsigned int bytes_per_sample,
+			      struct container_context *cntrs,
+			      unsigned int cntr_count)
+{
+	interleave_samples_2ch(frame_buf, src_bufs, 2, frame_count);
+}
+
+static void align_to_i_24_2ch(void *frame_buf, unsigned int frame_count,
+			      char **src_bufs, unsigned int bytes_per_sample,
+			      struct container_context *cntrs,
+			      unsigned int cntr_count)
+{
+	interleave_samples_2ch(frame_buf, src_bufs, 3, frame_count);
+}
+
+static void align_to_i_32_2ch(void *frame_buf, unsigned int frame_count,
+			      char **src_bufs, unsigned int bytes_per_sample,
+			      struct container_context *cntrs,
+			      unsigned int cntr_count)
+{
+	interleave_samples_2ch(frame_buf, src_bufs, 4, frame_count);
+}
+
 static void align_from_i(void *frame_buf, unsigned int frame_count,
 			 char **dst_bufs, unsigned int bytes_per_sample,
 			 struct container_context *cntrs,
 			 unsigned int cntr_count)
 {
-	char *src = frame_buf;
-	char *dst;
-	unsigned int src_pos;
-	unsigned int dst_pos;
-	struct container_context *cntr;
-	int i, j;
+	deinterleave_samples(frame_buf, dst_bufs, bytes_per_sample,
+			     frame_count, cntr_count);
+}
 
-	for (i = 0; i < cntr_count; ++i) {
-		dst = dst_bufs[i];
-		cntr = cntrs + i;
+static void align_from_i_8(void *frame_buf, unsigned int frame_count,
+			   char **dst_bufs, unsigned int bytes_per_sample,
+			   struct container_context *cntrs,
+			   unsigned int cntr_count)
+{
+	deinterleave_samples(frame_buf, dst_bufs, 1, frame_count, cntr_count);
+}
 
-		for (j = 0; j < frame_count; ++j) {
-			// Use first src channel for each of dst channel.
-			src_pos = bytes_per_sample * (cntr_count * j + i);
-			dst_pos = bytes_per_sample * cntr->samples_per_frame * j;
+static void align_from_i_16(void *frame_buf, unsigned int frame_count,
+			    char **dst_bufs, unsigned int bytes_per_sample,
+			    struct container_context *cntrs,
+			    unsigned int cntr_count)
+{
+	deinterleave_samples(frame_buf, dst_bufs, 2, frame_count, cntr_count);
+}
+
+static void align_from_i_24(void *frame_buf, unsigned int frame_count,
+			    char **dst_bufs, unsigned int bytes_per_sample,
+			    struct container_context *cntrs,
+			    unsigned int cntr_count)
+{
+	deinterleave_samples(frame_buf, dst_bufs, 3, frame_count, cntr_count);
+}
+
+static void align_from_i_32(void *frame_buf, unsigned int frame_count,
+			    char **dst_bufs, unsigned int bytes_per_sample,
+			    struct container_context *cntrs,
+			    unsigned int cntr_count)
+{
+	deinterleave_samples(frame_buf, dst_bufs, 4, frame_count, cntr_count);
+}
+
+static void align_from_i_64(void *frame_buf, unsigned int frame_count,
+			    char **dst_bufs, unsigned int bytes_per_sample,
+			    struct container_context *cntrs,
+			    unsigned int cntr_count)
+{
+	deinterleave_samples(frame_buf, dst_bufs, 8, frame_count, cntr_count);
+}
+
+static void align_from_i_16_2ch(void *frame_buf, unsigned int frame_count,
+				char **dst_bufs, unsigned int bytes_per_sample,
+				struct container_context *cntrs,
+				unsigned int cntr_count)
+{
+	deinterleave_samples_2ch(frame_buf, dst_bufs, 2, frame_count);
+}
+
+static void align_from_i_24_2ch(void *frame_buf, unsigned int frame_count,
+				char **dst_bufs, unsigned int bytes_per_sample,
+				struct container_context *cntrs,
+				unsigned int cntr_count)
+{
+	deinterleave_samples_2ch(frame_buf, dst_bufs, 3, frame_count);
+}
 
-			memcpy(dst + dst_pos, src + src_pos, bytes_per_sample);
+static void align_from_i_32_2ch(void *frame_buf, unsigned int frame_count,
+				char **dst_bufs, unsigned int bytes_per_sample,
+				struct container_context *cntrs,
+				unsigned int cntr_count)
+{
+	deinterleave_samples_2ch(frame_buf, dst_bufs, 4, frame_count);
+}
+
+static align_frames_t select_align_to_i(struct mapper_context *mapper,
+					struct container_context *cntrs,
+					unsigned int cntr_count)
+{
+	int i;
+
+	// The kernels for two containers expect one sample per frame in each.
+	if (cntr_count == 2) {
+		for (i = 0; i < cntr_count; ++i) {
+			if (cntrs[i].samples_per_frame != 1)
+				break;
 		}
+		if (i == cntr_count) {
+			switch (mapper->bytes_per_sample) {
+			case 2:
+				return align_to_i_16_2ch;
+			case 3:
+				return align_to_i_24_2ch;
+			case 4:
+				return align_to_i_32_2ch;
+			default:
+				break;
+			}
+		}
+	}
+
+	switch (mapper->bytes_per_sample) {
+	case 1:
+		return align_to_i_8;
+	case 2:
+		return align_to_i_16;
+	case 3:
+		return align_to_i_24;
+	case 4:
+		return align_to_i_32;
+	case 8:
+		return align_to_i_64;
+	default:
+		return align_to_i;
+	}
+}
+
+static align_frames_t select_align_from_i(struct mapper_context *mapper,
+					  unsigned int cntr_count)
+{
+	if (cntr_count == 2) {
+		switch (mapper->bytes_per_sample) {
+		case 2:
+			return align_from_i_16_2ch;
+		case 3:
+			return align_from_i_24_2ch;
+		case 4:
+			return align_from_i_32_2ch;
+		default:
+			break;
+		}
+	}
+
+	switch (mapper->bytes_per_sample) {
+	case 1:
+		return align_from_i_8;
+	case 2:
+		return align_from_i_16;
+	case 3:
+		return align_from_i_24;
+	case 4:
+		return align_from_i_32;
+	case 8:
+		return align_from_i_64;
+	default:
+		return align_from_i;
 	}
 }
 
@@ -88,11 +342,16 @@ static int multiple_pre_process(struct mapper_context *mapper,
 	}
 	state->cntr_count = cntr_count;
 
+	state->frame_counts = calloc(cntr_count, sizeof(*state->frame_counts));
+	if (state->frame_counts == NULL)
+		return -ENOMEM;
+
 	// Decide method to align frames.
 	if (mapper->type == MAPPER_TYPE_DEMUXER) {
 		if (mapper->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
 		    mapper->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
-			state->align_frames = align_from_i;
+			state->align_frames = select_align_from_i(mapper,
+								  cntr_count);
 		else if (mapper->access == SND_PCM_ACCESS_RW_NONINTERLEAVED ||
 			 mapper->access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED)
 			state->align_frames = NULL;
@@ -101,7 +360,8 @@ static int multiple_pre_process(struct mapper_context *mapper,
 	} else {
 		if (mapper->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
 		    mapper->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
-			state->align_frames = align_to_i;
+			state->align_frames = select_align_to_i(mapper, cntrs,
+								cntr_count);
 		else if (mapper->access == SND_PCM_ACCESS_RW_NONINTERLEAVED ||
 			 mapper->access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED)
 			state->align_frames = NULL;
@@ -145,26 +405,59 @@ static int multiple_pre_process(struct mapper_context *mapper,
 	return 0;
 }
 
-static int process_containers(char **src_bufs, unsigned int *frame_count,
+static int process_containers(struct multiple_state *state, char **src_bufs,
+			      unsigned int *frame_count,
 			      struct container_context *cntrs,
 			      unsigned int cntr_count)
 {
 	struct container_context *cntr;
+	unsigned int bytes_per_frame;
+	unsigned int count;
 	char *src;
 	int i;
 	int err = 0;
 
-	// TODO: arrangement for *frame_count.
+	// The containers can handle less frames than requested when their
+	// descriptors are not available. The next container is requested for
+	// the handled frames.
+	count = *frame_count;
 	for (i = 0; i < cntr_count; ++i) {
 		cntr = &cntrs[i];
 		src = src_bufs[i];
 
-		err = container_context_process_frames(cntr, src, frame_count);
+		state->frame_counts[i] = count;
+		err = container_context_process_frames(cntr, src,
+						       &state->frame_counts[i]);
 		if (err < 0)
 			break;
+		count = state->frame_counts[i];
+	}
+
+	if (err < 0) {
+		*frame_count = 0;
+		return err;
 	}
 
-	return err;
+	// The frames beyond the least are processed again at next call.
+	for (i = 0; i < cntr_count; ++i) {
+		cntr = &cntrs[i];
+		if (state->frame_counts[i] == count)
+			continue;
+
+		bytes_per_frame = cntr->bytes_per_sample *
+				  cntr->samples_per_frame;
+		src = src_bufs[i] + count * bytes_per_frame;
+		err = container_context_rewind_frames(cntr, src,
+					state->frame_counts[i] - count);
+		if (err < 0) {
+			*frame_count = 0;
+			return err;
+		}
+	}
+
+	*frame_count = count;
+
+	return 0;
 }
 
 static int multiple_muxer_process_frames(struct mapper_context *mapper,
@@ -185,7 +478,8 @@ static int multiple_muxer_process_frames(struct mapper_context *mapper,
 	} else {
 		src_bufs = state->bufs;
 	}
-	err = process_containers(src_bufs, frame_count, cntrs, cntr_count);
+	err = process_containers(state, src_bufs, frame_count, cntrs,
+				 cntr_count);
 	if (err < 0)
 		return err;
 
@@ -220,7 +514,8 @@ static int multiple_demuxer_process_frames(struct mapper_context *mapper,
 				    cntr_count);
 	}
 
-	return process_containers(dst_bufs, frame_count, cntrs, cntr_count);
+	return process_containers(state, dst_bufs, frame_count, cntrs,
+				  cntr_count);
 }
 
 static void multiple_post_process(struct mapper_context *mapper)
@@ -238,6 +533,9 @@ static void multiple_post_process(struct mapper_context *mapper)
 
 	state->bufs = NULL;
 	state->align_frames = NULL;
+
+	free(state->frame_counts);
+	state->frame_counts = NULL;
 }
 
 const struct mapper_data mapper_muxer_multiple = {
@@ -68,9 +68,68 @@ int mapper_context_init(struct mapper_context *mapper,
 	return 0;
 }
 
+// Samples in PCM buffer are converted from/to an intermediate buffer with the
+// same layout, then muxer/demuxer processes the intermediate buffer.
+static int prepare_conversion(struct mapper_context *mapper,
+			      snd_pcm_format_t cntr_format)
+{
+	snd_pcm_format_t src_format;
+	snd_pcm_format_t dst_format;
+	unsigned int bytes_per_buffer;
+	int i;
+	int err;
+
+	if (mapper->type == MAPPER_TYPE_DEMUXER) {
+		src_format = mapper->sample_format;
+		dst_format = cntr_format;
+	} else {
+		src_format = cntr_format;
+		dst_format = mapper->sample_format;
+	}
+
+	mapper->converter = malloc(sizeof(*mapper->converter));
+	if (mapper->converter == NULL)
+		return -ENOMEM;
+
+	err = mapper_converter_init(mapper->converter, src_format, dst_format);
+	if (err < 0) {
+		fprintf(stderr,
+			"Conversion from %s to %s is not supported.\n",
+			snd_pcm_format_name(src_format),
+			snd_pcm_format_name(dst_format));
+		return err;
+	}
+
+	mapper->bytes_per_sample =
+			snd_pcm_format_physical_width(cntr_format) / 8;
+	bytes_per_buffer = mapper->bytes_per_sample *
+			   mapper->samples_per_frame *
+			   mapper->frames_per_buffer;
+	mapper->conv_buf = malloc(bytes_per_buffer);
+	if (mapper->conv_buf == NULL)
+		return -ENOMEM;
+	memset(mapper->conv_buf, 0, bytes_per_buffer);
+
+	if (mapper->access == SND_PCM_ACCESS_RW_NONINTERLEAVED ||
+	    mapper->access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED) {
+		mapper->conv_bufs = calloc(mapper->samples_per_frame,
+					   sizeof(*mapper->conv_bufs));
+		if (mapper->conv_bufs == NULL)
+			return -ENOMEM;
+
+		for (i = 0; i < mapper->samples_per_frame; ++i) {
+			mapper->conv_bufs[i] = mapper->conv_buf +
+				mapper->bytes_per_sample *
+				mapper->frames_per_buffer * i;
+		}
+	}
+
+	return 0;
+}
+
 int mapper_context_pre_process(struct mapper_context *mapper,
 			       snd_pcm_access_t access,
-			       unsigned int bytes_per_sample,
+			       snd_pcm_format_t sample_format,
 			       unsigned int samples_per_frame,
 			       unsigned int frames_per_buffer,
 			       struct container_context *cntrs)
@@ -80,7 +139,8 @@ int mapper_context_pre_process(struct mapper_context *mapper,
 	assert(mapper);
 	assert(access >= SND_PCM_ACCESS_MMAP_INTERLEAVED);
 	assert(access <= SND_PCM_ACCESS_RW_NONINTERLEAVED);
-	assert(bytes_per_sample > 0);
+	assert(sample_format >= SND_PCM_FORMAT_S8);
+	assert(sample_format <= SND_PCM_FORMAT_LAST);
 	assert(samples_per_frame > 0);
 	assert(cntrs);
 
@@ -91,10 +151,21 @@ int mapper_context_pre_process(struct mapper_context *mapper,
 		return -EINVAL;
 
 	mapper->access = access;
-	mapper->bytes_per_sample = bytes_per_sample;
+	mapper->sample_format = sample_format;
+	mapper->bytes_per_sample =
+			snd_pcm_format_physical_width(sample_format) / 8;
+	if (mapper->bytes_per_sample == 0)
+		return -ENXIO;
 	mapper->samples_per_frame = samples_per_frame;
 	mapper->frames_per_buffer = frames_per_buffer;
 
+	// All of containers have the same sample format.
+	if (cntrs->sample_format != sample_format) {
+		err = prepare_conversion(mapper, cntrs->sample_format);
+		if (err < 0)
+			return err;
+	}
+
 	err = mapper->ops->pre_process(mapper, cntrs, mapper->cntr_count);
 	if (err < 0)
 		return err;
@@ -106,6 +177,15 @@ int mapper_context_pre_process(struct mapper_context *mapper,
 		       mapper_target_labels[mapper->target]);
 		fprintf(stderr, "  access: %s\n",
 		       snd_pcm_access_name(mapper->access));
+		if (mapper->converter) {
+			fprintf(stderr, "  conversion: %s %s %s%s\n",
+				snd_pcm_format_name(mapper->sample_format),
+				mapper->type == MAPPER_TYPE_DEMUXER ?
+								"=>" : "<=",
+				snd_pcm_format_name(cntrs->sample_format),
+				mapper->converter->dither_bits > 0 ?
+							" (dither)" : "");
+		}
 		fprintf(stderr, "  bytes/sample: %u\n",
 			mapper->bytes_per_sample);
 		fprintf(stderr, "  samples/frame: %u\n",
@@ -117,6 +197,56 @@ int mapper_context_pre_process(struct mapper_context *mapper,
 	return 0;
 }
 
+static void convert_frames(struct mapper_context *mapper, void *dst,
+			   void *src, unsigned int frame_count)
+{
+	int i;
+
+	if (mapper->conv_bufs == NULL) {
+		mapper_converter_process(mapper->converter, dst, src,
+					 frame_count * mapper->samples_per_frame);
+	} else {
+		char **dst_bufs = dst;
+		char **src_bufs = src;
+
+		for (i = 0; i < mapper->samples_per_frame; ++i) {
+			mapper_converter_process(mapper->converter,
+						 dst_bufs[i], src_bufs[i],
+						 frame_count);
+		}
+	}
+}
+
+static int process_converted_frames(struct mapper_context *mapper,
+				    void *frame_buffer,
+				    unsigned int *frame_count,
+				    struct container_context *cntrs)
+{
+	void *buf;
+	int err;
+
+	if (mapper->conv_bufs == NULL)
+		buf = mapper->conv_buf;
+	else
+		buf = mapper->conv_bufs;
+
+	if (mapper->type == MAPPER_TYPE_DEMUXER) {
+		convert_frames(mapper, buf, frame_buffer, *frame_count);
+		return mapper->ops->process_frames(mapper, buf, frame_count,
+						   cntrs, mapper->cntr_count);
+	}
+
+	err = mapper->ops->process_frames(mapper, buf, frame_count, cntrs,
+					  mapper->cntr_count);
+	if (err < 0)
+		return err;
+
+	if (*frame_count > 0)
+		convert_frames(mapper, frame_buffer, buf, *frame_count);
+
+	return 0;
+}
+
 int mapper_context_process_frames(struct mapper_context *mapper,
 				  void *frame_buffer,
 				  unsigned int *frame_count,
@@ -128,8 +258,15 @@ int mapper_context_process_frames(struct mapper_context *mapper,
 	assert(*frame_count <= mapper->frames_per_buffer);
 	assert(cntrs);
 
-	return mapper->ops->process_frames(mapper, frame_buffer, frame_count,
-					    cntrs, mapper->cntr_count);
+	// The most likely.
+	if (mapper->converter == NULL) {
+		return mapper->ops->process_frames(mapper, frame_buffer,
+						   frame_count, cntrs,
+						   mapper->cntr_count);
+	}
+
+	return process_converted_frames(mapper, frame_buffer, frame_count,
+					cntrs);
 }
 
 void mapper_context_post_process(struct mapper_context *mapper)
@@ -138,6 +275,13 @@ void mapper_context_post_process(struct mapper_context *mapper)
 
 	if (mapper->ops && mapper->ops->post_process)
 		mapper->ops->post_process(mapper);
+
+	free(mapper->conv_bufs);
+	mapper->conv_bufs = NULL;
+	free(mapper->conv_buf);
+	mapper->conv_buf = NULL;
+	free(mapper->converter);
+	mapper->converter = NULL;
 }
 
 void mapper_context_destroy(struct mapper_context *mapper)
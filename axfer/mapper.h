@@ -26,6 +26,17 @@ enum mapper_target {
 
 struct mapper_ops;
 
+// For conversion of sample format between PCM substream and containers.
+struct mapper_converter {
+	void (*decode)(int32_t *dst, const char *src, unsigned int count);
+	void (*encode)(char *dst, const int32_t *src, unsigned int count);
+	unsigned int src_bytes;
+	unsigned int dst_bytes;
+	// Non-zero to dither samples to the number of bits.
+	unsigned int dither_bits;
+	uint32_t random;
+};
+
 struct mapper_context {
 	enum mapper_type type;
 	enum mapper_target target;
@@ -37,10 +48,19 @@ struct mapper_context {
 
 	// A part of parameters of PCM substream.
 	snd_pcm_access_t access;
-	unsigned int bytes_per_sample;
+	snd_pcm_format_t sample_format;
 	unsigned int samples_per_frame;
 	snd_pcm_uframes_t frames_per_buffer;
 
+	// The size of sample in containers, processed by muxer/demuxer.
+	unsigned int bytes_per_sample;
+
+	// Available when the sample format of PCM substream differs from the
+	// one of containers. Frames are converted in the intermediate buffer.
+	struct mapper_converter *converter;
+	char *conv_buf;
+	char **conv_bufs;
+
 	unsigned int verbose;
 };
 
@@ -49,7 +69,7 @@ int mapper_context_init(struct mapper_context *mapper,
 			unsigned int verbose);
 int mapper_context_pre_process(struct mapper_context *mapper,
 			       snd_pcm_access_t access,
-			       unsigned int bytes_per_sample,
+			       snd_pcm_format_t sample_format,
 			       unsigned int samples_per_frame,
 			       unsigned int frames_per_buffer,
 			       struct container_context *cntrs);
@@ -60,6 +80,13 @@ int mapper_context_process_frames(struct mapper_context *mapper,
 void mapper_context_post_process(struct mapper_context *mapper);
 void mapper_context_destroy(struct mapper_context *mapper);
 
+bool mapper_converter_is_supported(snd_pcm_format_t format);
+int mapper_converter_init(struct mapper_converter *conv,
+			  snd_pcm_format_t src_format,
+			  snd_pcm_format_t dst_format);
+void mapper_converter_process(struct mapper_converter *conv, void *dst,
+			      const void *src, unsigned int sample_count);
+
 // For internal use in 'mapper' module.
 
 struct mapper_ops {
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// segment.c - a helper of files to store segments of capture.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#define _GNU_SOURCE
+// Included at first since it defines a macro for features of large file.
+#include "container.h"
+#include "segment.h"
+
+#include "aconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+// Allocate blocks in advance without changing the size of file, thus the size
+// is still decided by data frames actually written.
+int segment_preallocate_file(int fd, off_t size)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0) {
+		// Just a hint to filesystem.
+		if (errno != EOPNOTSUPP && errno != ENOSYS)
+			return -errno;
+	}
+#endif
+
+	return 0;
+}
+
+static int create_file(const char *path, off_t size, int *fd)
+{
+	int err;
+
+	*fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (*fd < 0)
+		return -errno;
+
+	err = segment_preallocate_file(*fd, size);
+	if (err < 0) {
+		close(*fd);
+		*fd = -1;
+	}
+
+	return err;
+}
+
+// Release blocks allocated in advance beyond the end of file, then write back
+// the file and drop its pages so that page cache is not occupied by files
+// which are never read by this program.
+static void write_behind(int fd)
+{
+	struct stat st;
+	int err;
+
+	err = fstat(fd, &st);
+	if (err == 0 && S_ISREG(st.st_mode)) {
+		err = ftruncate(fd, st.st_size);
+		if (err == 0)
+			err = fdatasync(fd);
+		if (err == 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	close(fd);
+}
+
+// Write out the header of container, then rename the file if required.
+static int finish_container(struct segment_closed *closed)
+{
+	uint64_t frame_count;
+	int err;
+
+	err = container_context_post_process(closed->cntr, &frame_count);
+	container_context_destroy(closed->cntr);
+	free(closed->cntr);
+	closed->cntr = NULL;
+
+	if (err >= 0 && closed->path != NULL) {
+		if (rename(closed->path, closed->new_path) < 0)
+			err = -errno;
+	}
+	free(closed->path);
+	free(closed->new_path);
+
+	return err;
+}
+
+static bool next_is_requested(struct segment_context *seg)
+{
+	return seg->next_path != NULL && seg->next_fd < 0 && seg->next_err == 0;
+}
+
+static void *segment_thread(void *arg)
+{
+	struct segment_context *seg = arg;
+	struct segment_closed closed;
+	int fd;
+	int err;
+
+	pthread_mutex_lock(&seg->lock);
+	while (1) {
+		while (!next_is_requested(seg) && seg->closed_count == 0 &&
+		       !seg->closing)
+			pthread_cond_wait(&seg->cond, &seg->lock);
+
+		// The next file is required at the next rotation, thus it has
+		// priority. The path is not changed till the file is taken.
+		if (next_is_requested(seg)) {
+			pthread_mutex_unlock(&seg->lock);
+			err = create_file(seg->next_path, seg->next_size, &fd);
+			pthread_mutex_lock(&seg->lock);
+
+			if (err < 0)
+				seg->next_err = err;
+			else
+				seg->next_fd = fd;
+			pthread_cond_broadcast(&seg->cond);
+		} else if (seg->closed_count > 0) {
+			closed = seg->closed[0];
+			--seg->closed_count;
+			memmove(seg->closed, seg->closed + 1,
+				seg->closed_count * sizeof(*seg->closed));
+			pthread_cond_broadcast(&seg->cond);
+
+			pthread_mutex_unlock(&seg->lock);
+			err = 0;
+			if (closed.cntr != NULL)
+				err = finish_container(&closed);
+			write_behind(closed.fd);
+			pthread_mutex_lock(&seg->lock);
+
+			// Reported at the next rotation.
+			if (err < 0 && seg->closed_err == 0)
+				seg->closed_err = err;
+		} else {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&seg->lock);
+
+	return NULL;
+}
+
+int segment_context_init(struct segment_context *seg)
+{
+	pthread_attr_t attr;
+	int err;
+
+	memset(seg, 0, sizeof(*seg));
+	seg->next_fd = -1;
+
+	pthread_mutex_init(&seg->lock, NULL);
+	pthread_cond_init(&seg->cond, NULL);
+
+	err = container_thread_attr_init(&attr);
+	if (err == 0) {
+		err = pthread_create(&seg->thread, &attr, segment_thread, seg);
+		pthread_attr_destroy(&attr);
+	}
+	if (err > 0) {
+		pthread_cond_destroy(&seg->cond);
+		pthread_mutex_destroy(&seg->lock);
+		seg->closing = true;
+		return -err;
+	}
+
+	return 0;
+}
+
+// Create the file for next segment in background.
+int segment_context_request(struct segment_context *seg, const char *path,
+			    off_t size)
+{
+	char *next_path;
+
+	next_path = strdup(path);
+	if (next_path == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&seg->lock);
+	assert(seg->next_path == NULL);
+	seg->next_path = next_path;
+	seg->next_size = size;
+	seg->next_fd = -1;
+	seg->next_err = 0;
+	pthread_cond_broadcast(&seg->cond);
+	pthread_mutex_unlock(&seg->lock);
+
+	return 0;
+}
+
+// Wait for the file requested in advance. Usually it's already available.
+int segment_context_take(struct segment_context *seg, int *fd)
+{
+	int err;
+
+	pthread_mutex_lock(&seg->lock);
+	assert(seg->next_path != NULL);
+	while (seg->next_fd < 0 && seg->next_err == 0)
+		pthread_cond_wait(&seg->cond, &seg->lock);
+
+	*fd = seg->next_fd;
+	err = seg->next_err;
+	if (err == 0 && seg->closed_err < 0) {
+		err = seg->closed_err;
+		if (*fd >= 0) {
+			close(*fd);
+			unlink(seg->next_path);
+		}
+		*fd = -1;
+	}
+	seg->next_fd = -1;
+	seg->next_err = 0;
+	free(seg->next_path);
+	seg->next_path = NULL;
+	pthread_mutex_unlock(&seg->lock);
+
+	return err;
+}
+
+static void queue_closed(struct segment_context *seg,
+			 struct segment_closed *closed)
+{
+	pthread_mutex_lock(&seg->lock);
+	while (seg->closed_count == SEGMENT_CLOSED_QUEUE_SIZE)
+		pthread_cond_wait(&seg->cond, &seg->lock);
+	seg->closed[seg->closed_count++] = *closed;
+	pthread_cond_broadcast(&seg->cond);
+	pthread_mutex_unlock(&seg->lock);
+}
+
+// Write back the file of closed segment in background, then close it.
+void segment_context_release(struct segment_context *seg, int fd)
+{
+	struct segment_closed closed = {
+		.fd = fd,
+	};
+
+	queue_closed(seg, &closed);
+}
+
+// Finish the container of closed segment in background, then write back and
+// close the file. The container should be allocated in heap and moved from
+// the caller, and it's released by the thread. The file is renamed when
+// the new path is given. An error is reported by the later call to take the
+// file for next segment. The container and the file are owned by this function
+// even if it fails, then they're finished without renaming at once.
+int segment_context_close(struct segment_context *seg,
+			  struct container_context *cntr, const char *path,
+			  const char *new_path)
+{
+	struct segment_closed closed = {
+		.fd = cntr->fd,
+		.cntr = cntr,
+	};
+
+	if (new_path != NULL) {
+		closed.path = strdup(path);
+		closed.new_path = strdup(new_path);
+		if (closed.path == NULL || closed.new_path == NULL) {
+			free(closed.path);
+			free(closed.new_path);
+			closed.path = NULL;
+			closed.new_path = NULL;
+			finish_container(&closed);
+			write_behind(closed.fd);
+			return -ENOMEM;
+		}
+	}
+
+	queue_closed(seg, &closed);
+
+	return 0;
+}
+
+void segment_context_destroy(struct segment_context *seg)
+{
+	if (seg->closing)
+		return;
+
+	pthread_mutex_lock(&seg->lock);
+	seg->closing = true;
+	pthread_cond_broadcast(&seg->cond);
+	pthread_mutex_unlock(&seg->lock);
+
+	pthread_join(seg->thread, NULL);
+
+	// The file for next segment is not used anymore.
+	if (seg->next_path != NULL) {
+		if (seg->next_fd >= 0) {
+			close(seg->next_fd);
+			unlink(seg->next_path);
+		}
+		free(seg->next_path);
+		seg->next_path = NULL;
+	}
+
+	pthread_cond_destroy(&seg->cond);
+	pthread_mutex_destroy(&seg->lock);
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// segment.h - a header for helper of files to store segments of capture.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#ifndef __ALSA_UTILS_AXFER_SEGMENT__H_
+#define __ALSA_UTILS_AXFER_SEGMENT__H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define SEGMENT_CLOSED_QUEUE_SIZE	8
+
+struct container_context;
+
+// A closed segment. When the container is given, the thread finishes it and
+// renames the file if required, then writes back the file.
+struct segment_closed {
+	int fd;
+	struct container_context *cntr;
+	char *path;
+	char *new_path;
+};
+
+// A thread creates the file for next segment in advance, and finishes files
+// of closed segments, so that the main loop is not blocked by them.
+struct segment_context {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// The file for next segment.
+	char *next_path;
+	off_t next_size;
+	int next_fd;
+	int next_err;
+
+	// Files of closed segments.
+	struct segment_closed closed[SEGMENT_CLOSED_QUEUE_SIZE];
+	unsigned int closed_count;
+	int closed_err;
+
+	bool closing;
+};
+
+int segment_context_init(struct segment_context *seg);
+void segment_context_destroy(struct segment_context *seg);
+int segment_preallocate_file(int fd, off_t size);
+int segment_context_request(struct segment_context *seg, const char *path,
+			    off_t size);
+int segment_context_take(struct segment_context *seg, int *fd);
+void segment_context_release(struct segment_context *seg, int fd);
+int segment_context_close(struct segment_context *seg,
+			  struct container_context *cntr, const char *path,
+			  const char *new_path);
+
+#endif
@@ -8,10 +8,19 @@
 
 #include "xfer.h"
 #include "subcmd.h"
+#include "segment.h"
 #include "misc.h"
 
 #include <signal.h>
 #include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// The size of queue for the writer thread when encoding by default.
+#define DEFAULT_ENCODER_QUEUE_MSEC	500
+
+// The maximum time to wait for starved containers at once.
+#define STARVED_WAIT_MSEC	100
 
 struct context {
 	struct xfer_context xfer;
@@ -21,32 +30,64 @@ struct context {
 
 	int *cntr_fds;
 
+	// To wait for containers starved by the peer of pipe.
+	struct pollfd *pfds;
+	unsigned int pfd_count;
+	unsigned int starve_count;
+
+	struct histogram_context histogram;
+
+	// Available when capture is split into several files.
+	struct segment_context *segments;
+	unsigned int segment_count;
+	unsigned int segment_index;
+	uint64_t frames_per_segment;
+	uint64_t segment_frame_count;
+	off_t bytes_per_segment;
+
 	// NOTE: To handling Unix signal.
 	bool interrupted;
+	bool dump_requested;
 	int signal;
 };
 
 // NOTE: To handling Unix signal.
 static struct context *ctx_ptr;
+static unsigned int ctx_count;
 
 static void handle_unix_signal_for_finish(int sig)
 {
-	int i;
+	struct context *ctx;
+	int i, j;
+
+	for (i = 0; i < ctx_count; ++i) {
+		ctx = ctx_ptr + i;
 
-	for (i = 0; i < ctx_ptr->cntr_count; ++i)
-		ctx_ptr->cntrs[i].interrupted = true;
+		for (j = 0; j < ctx->cntr_count; ++j)
+			ctx->cntrs[j].interrupted = true;
+
+		ctx->signal = sig;
+		ctx->interrupted = true;
+	}
+}
+
+static void handle_unix_signal_for_dump(int sig)
+{
+	int i;
 
-	ctx_ptr->signal = sig;
-	ctx_ptr->interrupted = true;
+	for (i = 0; i < ctx_count; ++i)
+		ctx_ptr[i].dump_requested = true;
 }
 
 static void handle_unix_signal_for_suspend(int sig)
 {
 	sigset_t curr, prev;
 	struct sigaction sa = {0};
+	int i;
 
 	// 1. suspend substream.
-	xfer_context_pause(&ctx_ptr->xfer, true);
+	for (i = 0; i < ctx_count; ++i)
+		xfer_context_pause(&ctx_ptr[i].xfer, true);
 
 	// 2. Prepare for default handler(SIG_DFL) of SIGTSTP to stop this
 	// process.
@@ -92,10 +133,11 @@ static void handle_unix_signal_for_suspend(int sig)
 	}
 
 	// 4. Continue the PCM substream.
-	xfer_context_pause(&ctx_ptr->xfer, false);
+	for (i = 0; i < ctx_count; ++i)
+		xfer_context_pause(&ctx_ptr[i].xfer, false);
 }
 
-static int prepare_signal_handler(struct context *ctx)
+static int prepare_signal_handler(struct context *ctx, unsigned int count)
 {
 	struct sigaction sa = {0};
 
@@ -115,6 +157,7 @@ static int prepare_signal_handler(struct context *ctx)
 		return -errno;
 
 	ctx_ptr = ctx;
+	ctx_count = count;
 
 	return 0;
 }
@@ -162,23 +205,226 @@ static int allocate_containers(struct context *ctx, unsigned int count)
 	return 0;
 }
 
+static int map_container(struct context *ctx, struct container_context *cntr)
+{
+	int err;
+
+	if (!ctx->xfer.file_mmap)
+		return 0;
+
+	// Pipes and standard input/output fallback to read(2)/write(2).
+	err = container_context_map_file(cntr);
+	if (err == -ENXIO) {
+		if (ctx->xfer.verbose > 1) {
+			fprintf(stderr,
+				"The file is not mapped since it is not a "
+				"regular file.\n");
+		}
+		err = 0;
+	}
+
+	return err;
+}
+
+static int start_container_writer(struct context *ctx,
+				  struct container_context *cntr)
+{
+	unsigned int msec = ctx->xfer.async_write_msec;
+
+	// Encoding is too heavy to run in the thread to handle PCM frames,
+	// thus FLAC builder runs in the writer thread in any case.
+	if (msec == 0 && cntr->type == CONTAINER_TYPE_BUILDER &&
+	    cntr->format == CONTAINER_FORMAT_FLAC)
+		msec = DEFAULT_ENCODER_QUEUE_MSEC;
+
+	if (msec == 0)
+		return 0;
+
+	return container_context_start_writer(cntr, msec);
+}
+
+// Create the file for next segment in advance.
+static int request_segment(struct context *ctx, unsigned int index)
+{
+	char *path;
+	int err;
+
+	path = xfer_options_segment_path(&ctx->xfer, ctx->xfer.paths[index],
+					 ctx->segment_index + 1);
+	if (path == NULL)
+		return -ENOMEM;
+
+	err = segment_context_request(ctx->segments + index, path,
+				      ctx->bytes_per_segment);
+	free(path);
+
+	return err;
+}
+
+static int prepare_segments(struct context *ctx, unsigned int frames_per_second,
+			    uint64_t *total_frame_count)
+{
+	struct container_context *cntr;
+	struct stat st;
+	uint64_t frame_count;
+	int i;
+	int err;
+
+	// The segment is rotated as well when reaching the maximum number of
+	// frames in the container format.
+	frame_count = (uint64_t)ctx->xfer.max_file_seconds * frames_per_second;
+	ctx->frames_per_segment = frame_count;
+	ctx->segment_frame_count = 0;
+	ctx->segment_index = 1;
+
+	// Continue till interrupted unless duration is given.
+	*total_frame_count = UINT64_MAX;
+
+	ctx->segments = calloc(ctx->cntr_count, sizeof(*ctx->segments));
+	if (ctx->segments == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < ctx->cntr_count; ++i) {
+		if (fstat(ctx->cntr_fds[i], &st) < 0)
+			return -errno;
+		if (!S_ISREG(st.st_mode)) {
+			fprintf(stderr,
+				"An option for the time of file is available "
+				"for regular files only.\n");
+			return -EINVAL;
+		}
+
+		err = segment_context_init(ctx->segments + i);
+		if (err < 0)
+			return err;
+		++ctx->segment_count;
+
+		cntr = ctx->cntrs + i;
+		ctx->bytes_per_segment = frame_count * cntr->bytes_per_sample *
+					 cntr->samples_per_frame;
+		if (ctx->bytes_per_segment > cntr->max_size)
+			ctx->bytes_per_segment = cntr->max_size;
+		err = segment_preallocate_file(ctx->cntr_fds[i],
+					       ctx->bytes_per_segment);
+		if (err < 0)
+			return err;
+
+		err = request_segment(ctx, i);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+// Close current files and continue with files created in advance. The closed
+// containers are finished and written back in background.
+static int rotate_segments(struct context *ctx)
+{
+	struct container_context *cntr;
+	struct container_context *closed;
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate;
+	uint64_t frame_count;
+	char *path;
+	int fd;
+	int i;
+	int err;
+
+	for (i = 0; i < ctx->cntr_count; ++i) {
+		cntr = ctx->cntrs + i;
+		format = cntr->sample_format;
+		channels = cntr->samples_per_frame;
+		rate = cntr->frames_per_second;
+
+		closed = malloc(sizeof(*closed));
+		if (closed == NULL)
+			return -ENOMEM;
+		container_context_move(closed, cntr);
+
+		// The first file is renamed with sequential number as well,
+		// as aplay(1) does.
+		path = NULL;
+		if (ctx->segment_index == 1) {
+			path = xfer_options_segment_path(&ctx->xfer,
+							 ctx->xfer.paths[i], 1);
+		}
+
+		// The container and the file are finished by the helper even
+		// if failing.
+		err = segment_context_close(ctx->segments + i, closed,
+					    ctx->xfer.paths[i], path);
+		ctx->cntr_fds[i] = -1;
+		if (err >= 0 && ctx->segment_index == 1 && path == NULL)
+			err = -ENOMEM;
+		free(path);
+		if (err < 0)
+			return err;
+
+		err = segment_context_take(ctx->segments + i, &fd);
+		if (err < 0)
+			return err;
+		ctx->cntr_fds[i] = fd;
+
+		err = container_builder_init(cntr, fd, ctx->xfer.cntr_format,
+					     ctx->xfer.verbose > 1);
+		if (err < 0)
+			return err;
+
+		err = container_context_pre_process(cntr, &format, &channels,
+						    &rate, &frame_count);
+		if (err < 0)
+			return err;
+
+		err = map_container(ctx, cntr);
+		if (err < 0)
+			return err;
+
+		err = start_container_writer(ctx, cntr);
+		if (err < 0)
+			return err;
+
+		cntr->histogram = ctx->xfer.histogram;
+	}
+
+	++ctx->segment_index;
+	ctx->segment_frame_count = 0;
+
+	for (i = 0; i < ctx->cntr_count; ++i) {
+		err = request_segment(ctx, i);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
 static int capture_pre_process(struct context *ctx, snd_pcm_access_t *access,
 			       snd_pcm_uframes_t *frames_per_buffer,
 			       uint64_t *total_frame_count)
 {
 	snd_pcm_format_t sample_format = SND_PCM_FORMAT_UNKNOWN;
+	snd_pcm_format_t cntr_sample_format;
 	unsigned int samples_per_frame = 0;
 	unsigned int frames_per_second = 0;
 	unsigned int channels;
 	int i;
 	int err;
 
+	// Files are built with the sample format in options, while PCM
+	// substream can be configured with the other one for mapper to convert.
+	cntr_sample_format = ctx->xfer.sample_format;
+
 	err = xfer_context_pre_process(&ctx->xfer, &sample_format,
 				       &samples_per_frame, &frames_per_second,
 				       access, frames_per_buffer);
 	if (err < 0)
 		return err;
 
+	if (cntr_sample_format == SND_PCM_FORMAT_UNKNOWN)
+		cntr_sample_format = sample_format;
+
 	// Prepare for containers.
 	err = allocate_containers(ctx, ctx->xfer.path_count);
 	if (err < 0)
@@ -211,18 +457,31 @@ static int capture_pre_process(struct context *ctx, snd_pcm_access_t *access,
 			return err;
 
 		err = container_context_pre_process(ctx->cntrs + i,
-						    &sample_format, &channels,
+						    &cntr_sample_format,
+						    &channels,
 						    &frames_per_second,
 						    &frame_count);
 		if (err < 0)
 			return err;
 
+		err = map_container(ctx, ctx->cntrs + i);
+		if (err < 0)
+			return err;
+
+		err = start_container_writer(ctx, ctx->cntrs + i);
+		if (err < 0)
+			return err;
+
 		if (*total_frame_count == 0)
 			*total_frame_count = frame_count;
 		if (frame_count < *total_frame_count)
 			*total_frame_count = frame_count;
 	}
 
+	if (ctx->xfer.max_file_seconds > 0)
+		return prepare_segments(ctx, frames_per_second,
+					total_frame_count);
+
 	return 0;
 }
 
@@ -280,6 +539,10 @@ static int playback_pre_process(struct context *ctx, snd_pcm_access_t *access,
 		if (err < 0)
 			return err;
 
+		err = map_container(ctx, ctx->cntrs + i);
+		if (err < 0)
+			return err;
+
 		if (format == SND_PCM_FORMAT_UNKNOWN || channels == 0 ||
 		    rate == 0) {
 			fprintf(stderr,
@@ -325,15 +588,50 @@ static int playback_pre_process(struct context *ctx, snd_pcm_access_t *access,
 					access, frames_per_buffer);
 }
 
+static int prepare_histogram(struct context *ctx)
+{
+	struct sigaction sa = {0};
+
+	histogram_context_init(&ctx->histogram);
+	ctx->xfer.histogram = &ctx->histogram;
+
+	// Histograms are dumped at any time by SIGUSR1.
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = handle_unix_signal_for_dump;
+	if (sigaction(SIGUSR1, &sa, NULL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void dump_histogram(struct context *ctx)
+{
+	int err;
+
+	err = histogram_context_dump(ctx->xfer.histogram,
+				     ctx->xfer.histogram_path);
+	if (err < 0) {
+		fprintf(stderr, "Fail to dump histograms to '%s': %s\n",
+			ctx->xfer.histogram_path, strerror(-err));
+	}
+}
+
 static int context_pre_process(struct context *ctx, snd_pcm_stream_t direction,
 			       uint64_t *total_frame_count)
 {
 	snd_pcm_access_t access;
 	snd_pcm_uframes_t frames_per_buffer = 0;
-	unsigned int bytes_per_sample = 0;
 	enum mapper_type mapper_type;
+	int i;
 	int err;
 
+	if (ctx->xfer.histogram_path) {
+		err = prepare_histogram(ctx);
+		if (err < 0)
+			return err;
+	}
+
 	if (direction == SND_PCM_STREAM_CAPTURE) {
 		mapper_type = MAPPER_TYPE_DEMUXER;
 		err = capture_pre_process(ctx, &access, &frames_per_buffer,
@@ -346,37 +644,39 @@ static int context_pre_process(struct context *ctx, snd_pcm_stream_t direction,
 	if (err < 0)
 		return err;
 
+	for (i = 0; i < ctx->cntr_count; ++i)
+		ctx->cntrs[i].histogram = ctx->xfer.histogram;
+
 	// Prepare for mapper.
 	err = mapper_context_init(&ctx->mapper, mapper_type, ctx->cntr_count,
 				  ctx->xfer.verbose > 1);
 	if (err < 0)
 		return err;
 
-	bytes_per_sample =
-		snd_pcm_format_physical_width(ctx->xfer.sample_format) / 8;
-	if (bytes_per_sample <= 0)
-		return -ENXIO;
-	err = mapper_context_pre_process(&ctx->mapper, access, bytes_per_sample,
+	err = mapper_context_pre_process(&ctx->mapper, access,
+					 ctx->xfer.sample_format,
 					 ctx->xfer.samples_per_frame,
 					 frames_per_buffer, ctx->cntrs);
 	if (err < 0)
 		return err;
 
+	// The descriptors of PCM substream are available unless the process is
+	// woken up by hardware interrupt.
+	err = xfer_context_poll_descriptors_count(&ctx->xfer);
+	if (err < 0)
+		err = 0;
+	ctx->pfd_count = ctx->cntr_count + err;
+	ctx->pfds = calloc(ctx->pfd_count, sizeof(*ctx->pfds));
+	if (ctx->pfds == NULL)
+		return -ENOMEM;
+
 	xfer_options_calculate_duration(&ctx->xfer, total_frame_count);
 
 	return 0;
 }
 
-static int context_process_frames(struct context *ctx,
-				  snd_pcm_stream_t direction,
-				  uint64_t expected_frame_count,
-				  uint64_t *actual_frame_count)
+static void print_parameters(struct context *ctx, snd_pcm_stream_t direction)
 {
-	bool verbose = ctx->xfer.verbose > 2;
-	unsigned int frame_count;
-	int i;
-	int err = 0;
-
 	if (!ctx->xfer.quiet) {
 		fprintf(stderr,
 			"%s: Format '%s', Rate %u Hz, Channels ",
@@ -391,6 +691,155 @@ static int context_process_frames(struct context *ctx,
 			fprintf(stderr, "%u", ctx->xfer.samples_per_frame);
 		fprintf(stderr, "\n");
 	}
+}
+
+static int transfer_frames(struct context *ctx, unsigned int *frame_count)
+{
+	uint64_t begin;
+	int err;
+
+	if (ctx->xfer.histogram == NULL) {
+		return xfer_context_process_frames(&ctx->xfer, &ctx->mapper,
+						   ctx->cntrs, frame_count);
+	}
+
+	if (ctx->dump_requested) {
+		ctx->dump_requested = false;
+		dump_histogram(ctx);
+	}
+
+	begin = histogram_get_nsec();
+	err = xfer_context_process_frames(&ctx->xfer, &ctx->mapper, ctx->cntrs,
+					  frame_count);
+	histogram_context_record(ctx->xfer.histogram,
+				 HISTOGRAM_TYPE_PROCESS_TIME,
+				 histogram_get_nsec() - begin);
+
+	return err;
+}
+
+// The number of frames till the boundary of files, or till the maximum size
+// of any container.
+static uint64_t get_segment_remains(struct context *ctx)
+{
+	struct container_context *cntr;
+	uint64_t remained;
+	uint64_t count;
+	unsigned int bytes_per_frame;
+	int i;
+
+	remained = ctx->frames_per_segment - ctx->segment_frame_count;
+	for (i = 0; i < ctx->cntr_count; ++i) {
+		cntr = ctx->cntrs + i;
+		bytes_per_frame = cntr->bytes_per_sample *
+				  cntr->samples_per_frame;
+		count = (cntr->max_size - cntr->handled_byte_count) /
+			bytes_per_frame;
+		if (count < remained)
+			remained = count;
+	}
+
+	return remained;
+}
+
+static int process_frames(struct context *ctx, unsigned int *frame_count)
+{
+	uint64_t remained;
+	int err;
+
+	if (ctx->segments == NULL)
+		return transfer_frames(ctx, frame_count);
+
+	// Rotate just before data frames for next file are available, thus no
+	// empty file is left at the end.
+	remained = get_segment_remains(ctx);
+	if (remained == 0) {
+		err = rotate_segments(ctx);
+		if (err < 0)
+			return err;
+		remained = get_segment_remains(ctx);
+	}
+
+	// Don't cross the boundary of files.
+	if (*frame_count > remained)
+		*frame_count = remained;
+
+	err = transfer_frames(ctx, frame_count);
+	if (err < 0)
+		return err;
+
+	ctx->segment_frame_count += *frame_count;
+
+	return 0;
+}
+
+// The descriptors of containers which were not available for data frames.
+static unsigned int fill_starved_descriptors(struct context *ctx,
+					     struct pollfd *pfds)
+{
+	struct container_context *cntr;
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < ctx->cntr_count; ++i) {
+		cntr = ctx->cntrs + i;
+		if (!cntr->starved)
+			continue;
+
+		pfds[count].fd = cntr->fd;
+		if (cntr->type == CONTAINER_TYPE_PARSER)
+			pfds[count].events = POLLIN;
+		else
+			pfds[count].events = POLLOUT;
+		++count;
+	}
+
+	return count;
+}
+
+// Wait for the starved containers instead of retrying at once. The frames are
+// not handled till any of them is available, thus the descriptors of PCM
+// substream are watched just for error such as XRUN. The time is bounded so
+// that the backend detects XRUN not notified by the descriptors.
+static int wait_for_starved_containers(struct context *ctx)
+{
+	unsigned int count;
+	int i;
+	int err;
+
+	count = fill_starved_descriptors(ctx, ctx->pfds);
+	if (count == 0)
+		return 0;
+	++ctx->starve_count;
+
+	if (ctx->pfd_count > ctx->cntr_count) {
+		err = xfer_context_poll_descriptors(&ctx->xfer,
+					ctx->pfds + count,
+					ctx->pfd_count - ctx->cntr_count);
+		if (err < 0)
+			return err;
+		for (i = 0; i < err; ++i)
+			ctx->pfds[count + i].events = 0;
+		count += err;
+	}
+
+	if (poll(ctx->pfds, count, STARVED_WAIT_MSEC) < 0 && errno != EINTR)
+		return -errno;
+
+	return 0;
+}
+
+static int context_process_frames(struct context *ctx,
+				  snd_pcm_stream_t direction,
+				  uint64_t expected_frame_count,
+				  uint64_t *actual_frame_count)
+{
+	bool verbose = ctx->xfer.verbose > 2;
+	unsigned int frame_count;
+	int i;
+	int err = 0;
+
+	print_parameters(ctx, direction);
 
 	*actual_frame_count = 0;
 	while (!ctx->interrupted) {
@@ -398,8 +847,7 @@ static int context_process_frames(struct context *ctx,
 
 		// Tell remains to expected frame count.
 		frame_count = expected_frame_count - *actual_frame_count;
-		err = xfer_context_process_frames(&ctx->xfer, &ctx->mapper,
-						  ctx->cntrs, &frame_count);
+		err = process_frames(ctx, &frame_count);
 		if (err < 0) {
 			if (err == -EAGAIN || err == -EINTR)
 				continue;
@@ -409,14 +857,21 @@ static int context_process_frames(struct context *ctx,
 			fprintf(stderr,
 				"  handled: %u\n", frame_count);
 		}
+		// The full container is just rotated with segments.
 		for (i = 0; i < ctx->cntr_count; ++i) {
 			cntr = &ctx->cntrs[i];
-			if (cntr->eof)
+			if (cntr->eof && ctx->segments == NULL)
 				break;
 		}
 		if (i < ctx->cntr_count)
 			break;
 
+		if (frame_count == 0) {
+			err = wait_for_starved_containers(ctx);
+			if (err < 0)
+				break;
+		}
+
 		*actual_frame_count += frame_count;
 		if (*actual_frame_count >= expected_frame_count)
 			break;
@@ -428,6 +883,12 @@ static int context_process_frames(struct context *ctx,
 			"Actual %" PRIu64 "frames\n",
 			snd_pcm_stream_name(direction), expected_frame_count,
 			*actual_frame_count);
+		if (ctx->starve_count > 0) {
+			fprintf(stderr,
+				"%s: Starved by files %u times\n",
+				snd_pcm_stream_name(direction),
+				ctx->starve_count);
+		}
 		if (ctx->interrupted) {
 			fprintf(stderr, "Aborted by signal: %s\n",
 			       strsignal(ctx->signal));
@@ -446,6 +907,9 @@ static void context_post_process(struct context *ctx,
 
 	xfer_context_post_process(&ctx->xfer);
 
+	if (ctx->xfer.histogram)
+		dump_histogram(ctx);
+
 	if (ctx->cntrs) {
 		for (i = 0; i < ctx->cntr_count; ++i) {
 			container_context_post_process(ctx->cntrs + i,
@@ -455,12 +919,30 @@ static void context_post_process(struct context *ctx,
 		free(ctx->cntrs);
 	}
 
+	if (ctx->segments) {
+		// The last files are written back as well.
+		for (i = 0; i < ctx->segment_count; ++i) {
+			if (ctx->cntr_fds[i] >= 0) {
+				segment_context_release(ctx->segments + i,
+							ctx->cntr_fds[i]);
+				ctx->cntr_fds[i] = -1;
+			}
+			segment_context_destroy(ctx->segments + i);
+		}
+		free(ctx->segments);
+	}
+
 	if (ctx->cntr_fds) {
-		for (i = 0; i < ctx->cntr_count; ++i)
-			close(ctx->cntr_fds[i]);
+		for (i = 0; i < ctx->cntr_count; ++i) {
+			if (ctx->cntr_fds[i] >= 0)
+				close(ctx->cntr_fds[i]);
+		}
 		free(ctx->cntr_fds);
 	}
 
+	free(ctx->pfds);
+	ctx->pfds = NULL;
+
 	mapper_context_post_process(&ctx->mapper);
 	mapper_context_destroy(&ctx->mapper);
 }
@@ -470,14 +952,505 @@ static void context_destroy(struct context *ctx)
 	xfer_context_destroy(&ctx->xfer);
 }
 
+// Nodes given by '-D' option. The option is parsed by backend later again.
+static int detect_nodes(int argc, char *const *argv, char ***nodes,
+			unsigned int *count)
+{
+	char *node;
+	int i;
+
+	*nodes = calloc(argc, sizeof(**nodes));
+	if (*nodes == NULL)
+		return -ENOMEM;
+	*count = 0;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--"))
+			break;
+
+		if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "--device")) {
+			if (i + 1 == argc)
+				break;
+			node = argv[++i];
+		} else if (strstr(argv[i], "--device=") == argv[i]) {
+			node = argv[i] + strlen("--device=");
+		} else if (strstr(argv[i], "-D") == argv[i]) {
+			node = argv[i] + strlen("-D");
+		} else {
+			continue;
+		}
+
+		(*nodes)[(*count)++] = node;
+	}
+
+	return 0;
+}
+
+// Arguments for one of the nodes. The node is given at the last of options
+// so that it's used instead of the others.
+static char **build_node_args(int argc, char *const *argv, char *option)
+{
+	char **args;
+	int i, j;
+
+	args = calloc(argc + 2, sizeof(*args));
+	if (args == NULL)
+		return NULL;
+
+	for (i = 0, j = 0; i < argc; ++i) {
+		if (!strcmp(argv[i], "--") && j == i)
+			args[j++] = option;
+		args[j++] = argv[i];
+	}
+	if (j == argc)
+		args[j++] = option;
+
+	return args;
+}
+
+// The maximum time to wait for any of devices at once.
+#define LINKED_WAIT_MSEC	1000
+
+// The position of hardware at the timestamp.
+struct linked_point {
+	uint64_t position;
+	struct timespec tstamp;
+};
+
+// Descriptors of all devices to wait for available frames together. NULL is
+// returned when any of the devices doesn't wait for hardware interrupt.
+static struct pollfd *prepare_linked_waiter(struct context *ctxs,
+					    unsigned int count,
+					    unsigned int *pfd_counts,
+					    unsigned int *pfd_total)
+{
+	struct pollfd *pfds;
+	unsigned int cntr_total = 0;
+	int i;
+	int err;
+
+	*pfd_total = 0;
+	for (i = 0; i < count; ++i) {
+		err = xfer_context_poll_descriptors_count(&ctxs[i].xfer);
+		if (err <= 0)
+			return NULL;
+		pfd_counts[i] = err;
+		*pfd_total += err;
+		cntr_total += ctxs[i].cntr_count;
+	}
+
+	// Additionally for starved containers.
+	pfds = calloc(*pfd_total + cntr_total, sizeof(*pfds));
+	if (pfds == NULL)
+		return NULL;
+
+	return pfds;
+}
+
+// Wait for any of devices which have frames to handle. All of them are ready
+// at timeout so that their stall or XRUN is detected by the backend. The
+// device with starved containers is ready when any of them is available.
+static int wait_for_linked_frames(struct context *ctxs, unsigned int count,
+				  uint64_t expected_frame_count,
+				  uint64_t *actual_frame_counts,
+				  struct pollfd *pfds, unsigned int *pfd_counts,
+				  unsigned int pfd_total, bool *ready)
+{
+	struct pollfd *pfd;
+	struct pollfd *starved_pfd;
+	unsigned int starved_count;
+	unsigned short revents;
+	int i, j;
+	int err;
+
+	pfd = pfds;
+	starved_pfd = pfds + pfd_total;
+	for (i = 0; i < count; ++i) {
+		err = xfer_context_poll_descriptors(&ctxs[i].xfer, pfd,
+						    pfd_counts[i]);
+		if (err < 0)
+			return err;
+
+		// The device keeps being readable after handled all of frames.
+		if (actual_frame_counts[i] >= expected_frame_count) {
+			for (j = 0; j < pfd_counts[i]; ++j)
+				pfd[j].fd = -1;
+		} else {
+			starved_count = fill_starved_descriptors(ctxs + i,
+								 starved_pfd);
+			if (starved_count > 0) {
+				for (j = 0; j < pfd_counts[i]; ++j)
+					pfd[j].events = 0;
+				++ctxs[i].starve_count;
+			}
+			starved_pfd += starved_count;
+		}
+		pfd += pfd_counts[i];
+	}
+
+	err = poll(pfds, starved_pfd - pfds, LINKED_WAIT_MSEC);
+	if (err < 0) {
+		if (errno != EINTR)
+			return -errno;
+		memset(ready, 0, count * sizeof(*ready));
+		return 0;
+	}
+	if (err == 0) {
+		for (i = 0; i < count; ++i)
+			ready[i] = true;
+		return 0;
+	}
+
+	pfd = pfds;
+	starved_pfd = pfds + pfd_total;
+	for (i = 0; i < count; ++i) {
+		ready[i] = false;
+		if (actual_frame_counts[i] < expected_frame_count) {
+			err = xfer_context_poll_revents(&ctxs[i].xfer, pfd,
+							pfd_counts[i],
+							&revents);
+			if (err < 0)
+				return err;
+			ready[i] = !!(revents & (POLLIN | POLLERR));
+
+			for (j = 0; j < ctxs[i].cntr_count; ++j) {
+				if (!ctxs[i].cntrs[j].starved)
+					continue;
+				if (starved_pfd->revents)
+					ready[i] = true;
+				++starved_pfd;
+			}
+		}
+		pfd += pfd_counts[i];
+	}
+
+	return 0;
+}
+
+// The position of hardware is the handled frames and the frames between the
+// hardware and containers, with the timestamp of hardware.
+static int get_linked_point(struct context *ctx, uint64_t actual_frame_count,
+			    struct linked_point *point)
+{
+	snd_pcm_uframes_t delay;
+	int err;
+
+	err = xfer_context_get_delay(&ctx->xfer, &delay, &point->tstamp);
+	if (err < 0)
+		return err;
+	point->position = actual_frame_count + delay;
+
+	return 0;
+}
+
+static double linked_point_rate(const struct linked_point *begin,
+				const struct linked_point *end)
+{
+	double elapsed;
+
+	elapsed = (end->tstamp.tv_sec - begin->tstamp.tv_sec) +
+		  (end->tstamp.tv_nsec - begin->tstamp.tv_nsec) / 1000000000.0;
+	if (elapsed <= 0.0 || end->position <= begin->position)
+		return 0.0;
+
+	return (end->position - begin->position) / elapsed;
+}
+
+static void print_linked_rates(struct context *ctxs, unsigned int count,
+			       snd_pcm_stream_t direction,
+			       uint64_t *actual_frame_counts,
+			       struct linked_point *points, bool measured,
+			       double elapsed)
+{
+	double rate;
+	double base = 0.0;
+	int i;
+
+	// The rate of sampling clock is measured by the position of hardware
+	// against its timestamp. The ratio of rates tells the drift between
+	// sampling clocks of devices.
+	if (measured)
+		base = linked_point_rate(&points[0], &points[count]);
+
+	for (i = 0; i < count; ++i) {
+		if (!measured) {
+			rate = 0.0;
+			if (elapsed > 0.0)
+				rate = actual_frame_counts[i] / elapsed;
+
+			fprintf(stderr,
+				"%s: Device %u, Actual %" PRIu64 " frames, "
+				"%.1f Hz handled\n",
+				snd_pcm_stream_name(direction), i,
+				actual_frame_counts[i], rate);
+			continue;
+		}
+
+		rate = linked_point_rate(&points[i], &points[count + i]);
+		fprintf(stderr,
+			"%s: Device %u, Actual %" PRIu64 " frames, "
+			"%.1f Hz measured, %+.1f ppm to device 0\n",
+			snd_pcm_stream_name(direction), i,
+			actual_frame_counts[i], rate,
+			base > 0.0 ? (rate / base - 1.0) * 1000000.0 : 0.0);
+	}
+}
+
+static int context_process_linked_frames(struct context *ctxs,
+					 unsigned int count,
+					 snd_pcm_stream_t direction,
+					 uint64_t expected_frame_count,
+					 uint64_t *actual_frame_counts)
+{
+	struct timespec begin, end;
+	struct linked_point *points;
+	struct pollfd *pfds = NULL;
+	unsigned int *pfd_counts;
+	unsigned int pfd_total;
+	bool *ready;
+	bool started = false;
+	bool measured = false;
+	unsigned int frame_count;
+	unsigned int remained;
+	double elapsed;
+	int i, j;
+	int err = 0;
+
+	// Points at the beginning and the end for each device.
+	points = calloc(count * 2, sizeof(*points));
+	pfd_counts = calloc(count, sizeof(*pfd_counts));
+	ready = calloc(count, sizeof(*ready));
+	if (points == NULL || pfd_counts == NULL || ready == NULL) {
+		err = -ENOMEM;
+		goto end;
+	}
+
+	// Unless available, the devices are serviced in turn with blocking
+	// operation of each.
+	pfds = prepare_linked_waiter(ctxs, count, pfd_counts, &pfd_total);
+
+	print_parameters(ctxs, direction);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	remained = count;
+	while (remained > 0 && !ctxs->interrupted) {
+		// At first, service all of the devices to start them.
+		if (pfds != NULL && started) {
+			err = wait_for_linked_frames(ctxs, count,
+						     expected_frame_count,
+						     actual_frame_counts,
+						     pfds, pfd_counts,
+						     pfd_total, ready);
+			if (err < 0)
+				goto end;
+		}
+
+		for (i = 0; i < count; ++i) {
+			struct context *ctx = ctxs + i;
+
+			if (actual_frame_counts[i] >= expected_frame_count)
+				continue;
+			if (pfds != NULL && started && !ready[i])
+				continue;
+
+			frame_count = expected_frame_count -
+				      actual_frame_counts[i];
+			err = process_frames(ctx, &frame_count);
+			if (err < 0) {
+				if (err == -EAGAIN || err == -EINTR) {
+					err = 0;
+					continue;
+				}
+				goto end;
+			}
+
+			// The full container is just rotated with segments.
+			for (j = 0; j < ctx->cntr_count; ++j) {
+				if (ctx->cntrs[j].eof && ctx->segments == NULL)
+					goto end;
+			}
+
+			// Without the waiter, wait for the device at once.
+			if (pfds == NULL && frame_count == 0) {
+				err = wait_for_starved_containers(ctx);
+				if (err < 0)
+					goto end;
+			}
+
+			actual_frame_counts[i] += frame_count;
+			if (actual_frame_counts[i] >= expected_frame_count)
+				--remained;
+		}
+
+		if (!started) {
+			started = true;
+
+			measured = true;
+			for (i = 0; i < count; ++i) {
+				if (get_linked_point(ctxs + i,
+						     actual_frame_counts[i],
+						     &points[i]) < 0)
+					measured = false;
+			}
+		}
+	}
+end:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - begin.tv_sec) +
+		  (end.tv_nsec - begin.tv_nsec) / 1000000000.0;
+
+	if (points != NULL && measured) {
+		for (i = 0; i < count; ++i) {
+			if (get_linked_point(ctxs + i, actual_frame_counts[i],
+					     &points[count + i]) < 0)
+				measured = false;
+		}
+	}
+
+	if (!ctxs->xfer.quiet && points != NULL) {
+		print_linked_rates(ctxs, count, direction, actual_frame_counts,
+				   points, measured, elapsed);
+		for (i = 0; i < count; ++i) {
+			if (ctxs[i].starve_count == 0)
+				continue;
+			fprintf(stderr,
+				"%s: Device %u, Starved by files %u times\n",
+				snd_pcm_stream_name(direction), i,
+				ctxs[i].starve_count);
+		}
+	}
+
+	free(pfds);
+	free(ready);
+	free(pfd_counts);
+	free(points);
+
+	if (!ctxs->xfer.quiet && ctxs->interrupted) {
+		fprintf(stderr, "Aborted by signal: %s\n",
+			strsignal(ctxs->signal));
+		return 0;
+	}
+
+	return err;
+}
+
+// Capture from several devices in a process. The devices are linked so that
+// they start at the same time, if possible.
+static int transfer_with_nodes(int argc, char *const *argv,
+			       snd_pcm_stream_t direction, char **nodes,
+			       unsigned int node_count)
+{
+	struct context *ctxs;
+	uint64_t *actual_frame_counts;
+	uint64_t expected_frame_count = UINT64_MAX;
+	uint64_t frame_count;
+	char *option;
+	char **args;
+	int i;
+	int err;
+
+	if (direction != SND_PCM_STREAM_CAPTURE) {
+		fprintf(stderr,
+			"Several devices are available for capture only.\n");
+		return -EINVAL;
+	}
+
+	ctxs = calloc(node_count, sizeof(*ctxs));
+	if (ctxs == NULL)
+		return -ENOMEM;
+	actual_frame_counts = calloc(node_count, sizeof(*actual_frame_counts));
+	if (actual_frame_counts == NULL) {
+		free(ctxs);
+		return -ENOMEM;
+	}
+
+	err = prepare_signal_handler(ctxs, node_count);
+	if (err < 0)
+		goto end;
+
+	for (i = 0; i < node_count; ++i) {
+		struct context *ctx = ctxs + i;
+
+		option = malloc(strlen("--device=") + strlen(nodes[i]) + 1);
+		if (option == NULL) {
+			err = -ENOMEM;
+			goto end;
+		}
+		sprintf(option, "--device=%s", nodes[i]);
+
+		args = build_node_args(argc, argv, option);
+		if (args == NULL) {
+			free(option);
+			err = -ENOMEM;
+			goto end;
+		}
+
+		err = context_init(ctx, direction, argc + 1, args);
+		free(args);
+		free(option);
+		if (err < 0)
+			goto end;
+		if (ctx->xfer.help || ctx->xfer.dump_hw_params)
+			goto end;
+
+		err = xfer_options_label_paths(&ctx->xfer, i);
+		if (err < 0)
+			goto end;
+
+		err = context_pre_process(ctx, direction, &frame_count);
+		if (err < 0)
+			goto end;
+
+		if (frame_count < expected_frame_count)
+			expected_frame_count = frame_count;
+	}
+
+	for (i = 1; i < node_count; ++i) {
+		err = xfer_context_link(&ctxs[0].xfer, &ctxs[i].xfer);
+		if (err < 0 && ctxs[0].xfer.verbose > 0) {
+			fprintf(stderr,
+				"The device %u is not linked to device 0: "
+				"%s\n", i, snd_strerror(err));
+		}
+	}
+
+	err = context_process_linked_frames(ctxs, node_count, direction,
+					    expected_frame_count,
+					    actual_frame_counts);
+end:
+	for (i = 0; i < node_count; ++i) {
+		context_post_process(ctxs + i, actual_frame_counts[i]);
+		context_destroy(ctxs + i);
+	}
+
+	free(actual_frame_counts);
+	free(ctxs);
+
+	return err;
+}
+
 int subcmd_transfer(int argc, char *const *argv, snd_pcm_stream_t direction)
 {
 	struct context ctx = {0};
 	uint64_t expected_frame_count = 0;
 	uint64_t actual_frame_count = 0;
+	char **nodes;
+	unsigned int node_count;
 	int err = 0;
 
-	err = prepare_signal_handler(&ctx);
+	err = detect_nodes(argc, argv, &nodes, &node_count);
+	if (err < 0)
+		return err;
+	if (node_count > 1) {
+		err = transfer_with_nodes(argc, argv, direction, nodes,
+					  node_count);
+		free(nodes);
+		return err;
+	}
+	free(nodes);
+
+	err = prepare_signal_handler(&ctx, 1);
 	if (err < 0)
 		return err;
 
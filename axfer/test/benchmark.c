@@ -0,0 +1,493 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// benchmark.c - a benchmark for throughput of muxer/demuxer and parser/builder.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include <aconfig.h>
+#ifdef HAVE_MEMFD_CREATE
+#define _GNU_SOURCE
+#endif
+
+#include "../mapper.h"
+#include "../histogram.h"
+#include "../misc.h"
+
+#include "generator.h"
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+// The number of frames handled in each call, and in each measurement.
+#define FRAMES_PER_BUFFER	1024
+#define FRAMES_PER_MEASUREMENT	(1 << 18)
+#define MAX_SAMPLES_PER_FRAME	8
+#define FRAMES_PER_SECOND	48000
+
+struct bench_trial {
+	bool mapper;
+	bool container;
+
+	struct container_context cntrs[MAX_SAMPLES_PER_FRAME];
+	int fds[MAX_SAMPLES_PER_FRAME];
+	struct mapper_context mapper_ctx;
+};
+
+static const char *const cntr_format_labels[] = {
+	[CONTAINER_FORMAT_RIFF_WAVE] = "riff/wave",
+	[CONTAINER_FORMAT_AU] = "au",
+	[CONTAINER_FORMAT_VOC] = "voc",
+	[CONTAINER_FORMAT_FLAC] = "flac",
+	[CONTAINER_FORMAT_RAW] = "raw",
+};
+
+static int open_files(struct bench_trial *trial, unsigned int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		char path[16];
+
+		snprintf(path, sizeof(path), "bench%d", i);
+#ifdef HAVE_MEMFD_CREATE
+		trial->fds[i] = memfd_create(path, 0);
+#else
+		trial->fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+		if (trial->fds[i] < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static void close_files(struct bench_trial *trial, unsigned int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (trial->fds[i] >= 0)
+			close(trial->fds[i]);
+		trial->fds[i] = -1;
+	}
+}
+
+static int rewind_files(struct bench_trial *trial, unsigned int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (lseek(trial->fds[i], 0, SEEK_SET) != 0)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+// One JSON object per line.
+static void print_result(const char *target, const char *type,
+			 const char *detail, snd_pcm_access_t access,
+			 snd_pcm_format_t sample_format,
+			 unsigned int samples_per_frame, uint64_t frame_count,
+			 uint64_t nsec)
+{
+	printf("{\"target\": \"%s\", \"type\": \"%s\", \"detail\": \"%s\", "
+	       "\"access\": \"%s\", \"sample_format\": \"%s\", "
+	       "\"channels\": %u, \"frames\": %" PRIu64 ", "
+	       "\"nsec\": %" PRIu64 ", \"frames_per_second\": %" PRIu64 "}\n",
+	       target, type, detail, snd_pcm_access_name(access),
+	       snd_pcm_format_name(sample_format), samples_per_frame,
+	       frame_count, nsec,
+	       nsec > 0 ? frame_count * UINT64_C(1000000000) / nsec : 0);
+}
+
+static int bench_builder(struct container_context *cntr, int fd,
+			 enum container_format cntr_format,
+			 snd_pcm_format_t sample_format,
+			 unsigned int samples_per_frame, void *frame_buffer,
+			 unsigned int frame_count, uint64_t *handled_count,
+			 uint64_t *nsec)
+{
+	snd_pcm_format_t format = sample_format;
+	unsigned int channels = samples_per_frame;
+	unsigned int rate = FRAMES_PER_SECOND;
+	uint64_t total_frame_count;
+	uint64_t begin;
+	int err;
+
+	err = container_builder_init(cntr, fd, cntr_format, 0);
+	if (err < 0)
+		return err;
+
+	err = container_context_pre_process(cntr, &format, &channels, &rate,
+					    &total_frame_count);
+	if (err < 0)
+		goto end;
+
+	begin = histogram_get_nsec();
+	total_frame_count = 0;
+	while (total_frame_count < FRAMES_PER_MEASUREMENT) {
+		unsigned int count = frame_count;
+
+		err = container_context_process_frames(cntr, frame_buffer,
+						       &count);
+		if (err < 0)
+			goto end;
+		if (count == 0)
+			break;
+		total_frame_count += count;
+	}
+
+	*handled_count = total_frame_count;
+	err = container_context_post_process(cntr, &total_frame_count);
+	*nsec = histogram_get_nsec() - begin;
+end:
+	container_context_destroy(cntr);
+	return err;
+}
+
+static int bench_parser(struct container_context *cntr, int fd,
+			enum container_format cntr_format,
+			snd_pcm_format_t sample_format,
+			unsigned int samples_per_frame, void *frame_buffer,
+			unsigned int frame_count, uint64_t *handled_count,
+			uint64_t *nsec)
+{
+	snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+	unsigned int channels = 0;
+	unsigned int rate = 0;
+	uint64_t total_frame_count;
+	uint64_t begin;
+	int err;
+
+	err = container_parser_init(cntr, fd, 0);
+	if (err < 0)
+		return err;
+
+	// For a raw container.
+	if (cntr->format == CONTAINER_FORMAT_RAW) {
+		format = sample_format;
+		channels = samples_per_frame;
+		rate = FRAMES_PER_SECOND;
+	}
+
+	err = container_context_pre_process(cntr, &format, &channels, &rate,
+					    &total_frame_count);
+	if (err < 0)
+		goto end;
+
+	begin = histogram_get_nsec();
+	total_frame_count = 0;
+	while (!cntr->eof) {
+		unsigned int count = frame_count;
+
+		err = container_context_process_frames(cntr, frame_buffer,
+						       &count);
+		if (err < 0)
+			goto end;
+		if (count == 0)
+			break;
+		total_frame_count += count;
+	}
+
+	*handled_count = total_frame_count;
+	err = container_context_post_process(cntr, &total_frame_count);
+	*nsec = histogram_get_nsec() - begin;
+end:
+	container_context_destroy(cntr);
+	return err;
+}
+
+static int bench_container(struct bench_trial *trial,
+			   snd_pcm_format_t sample_format,
+			   unsigned int samples_per_frame, void *frame_buffer,
+			   unsigned int frame_count)
+{
+	int i;
+	int err = 0;
+
+	for (i = 0; i < CONTAINER_FORMAT_COUNT; ++i) {
+		uint64_t frame_total;
+		uint64_t nsec;
+
+		err = open_files(trial, 1);
+		if (err < 0)
+			break;
+
+		// Skip sample formats unsupported by the container.
+		err = bench_builder(trial->cntrs, trial->fds[0], i,
+				    sample_format, samples_per_frame,
+				    frame_buffer, frame_count, &frame_total,
+				    &nsec);
+		if (err == -EINVAL) {
+			close_files(trial, 1);
+			err = 0;
+			continue;
+		}
+		if (err < 0)
+			break;
+		print_result("container", "builder", cntr_format_labels[i],
+			     SND_PCM_ACCESS_RW_INTERLEAVED, sample_format,
+			     samples_per_frame, frame_total, nsec);
+
+		err = rewind_files(trial, 1);
+		if (err < 0)
+			break;
+
+		err = bench_parser(trial->cntrs, trial->fds[0], i,
+				   sample_format, samples_per_frame,
+				   frame_buffer, frame_count, &frame_total,
+				   &nsec);
+		if (err < 0)
+			break;
+		print_result("container", "parser", cntr_format_labels[i],
+			     SND_PCM_ACCESS_RW_INTERLEAVED, sample_format,
+			     samples_per_frame, frame_total, nsec);
+
+		close_files(trial, 1);
+	}
+
+	close_files(trial, 1);
+
+	return err;
+}
+
+static int measure_mapper(struct mapper_context *mapper,
+			  void *frame_buffer, unsigned int frame_count,
+			  struct container_context *cntrs, uint64_t *nsec)
+{
+	uint64_t total_frame_count = 0;
+	uint64_t begin;
+	int err;
+
+	begin = histogram_get_nsec();
+	while (total_frame_count < FRAMES_PER_MEASUREMENT) {
+		unsigned int count = frame_count;
+
+		err = mapper_context_process_frames(mapper, frame_buffer,
+						    &count, cntrs);
+		if (err < 0)
+			return err;
+		if (count == 0)
+			break;
+		total_frame_count += count;
+	}
+	*nsec = histogram_get_nsec() - begin;
+
+	if (total_frame_count < FRAMES_PER_MEASUREMENT)
+		return -EIO;
+
+	return 0;
+}
+
+static int bench_mapper_type(struct bench_trial *trial,
+			     enum mapper_type type, snd_pcm_access_t access,
+			     snd_pcm_format_t sample_format,
+			     unsigned int samples_per_frame,
+			     void *frame_buffer, unsigned int frame_count,
+			     unsigned int cntr_count, uint64_t *nsec)
+{
+	struct mapper_context *mapper = &trial->mapper_ctx;
+	uint64_t total_frame_count;
+	int i;
+	int err;
+
+	for (i = 0; i < cntr_count; ++i) {
+		snd_pcm_format_t format = sample_format;
+		unsigned int channels;
+		unsigned int rate = FRAMES_PER_SECOND;
+
+		if (cntr_count > 1)
+			channels = 1;
+		else
+			channels = samples_per_frame;
+
+		if (type == MAPPER_TYPE_DEMUXER) {
+			err = container_builder_init(trial->cntrs + i,
+						     trial->fds[i],
+						     CONTAINER_FORMAT_RAW, 0);
+		} else {
+			err = container_parser_init(trial->cntrs + i,
+						    trial->fds[i], 0);
+		}
+		if (err < 0)
+			goto end;
+
+		err = container_context_pre_process(trial->cntrs + i, &format,
+						    &channels, &rate,
+						    &total_frame_count);
+		if (err < 0)
+			goto end;
+	}
+
+	err = mapper_context_init(mapper, type, cntr_count, 0);
+	if (err < 0)
+		goto end;
+
+	err = mapper_context_pre_process(mapper, access, sample_format,
+					 samples_per_frame, frame_count,
+					 trial->cntrs);
+	if (err >= 0) {
+		err = measure_mapper(mapper, frame_buffer, frame_count,
+				     trial->cntrs, nsec);
+	}
+
+	mapper_context_post_process(mapper);
+	mapper_context_destroy(mapper);
+end:
+	for (i = 0; i < cntr_count; ++i) {
+		container_context_post_process(trial->cntrs + i,
+					       &total_frame_count);
+		container_context_destroy(trial->cntrs + i);
+	}
+
+	return err;
+}
+
+static int bench_mapper(struct bench_trial *trial, snd_pcm_access_t access,
+			snd_pcm_format_t sample_format,
+			unsigned int samples_per_frame, void *frame_buffer,
+			unsigned int frame_count, unsigned int cntr_count)
+{
+	const char *label = cntr_count > 1 ? "multiple" : "single";
+	uint64_t nsec;
+	int err;
+
+	err = open_files(trial, cntr_count);
+	if (err < 0)
+		goto end;
+
+	err = bench_mapper_type(trial, MAPPER_TYPE_DEMUXER, access,
+				sample_format, samples_per_frame, frame_buffer,
+				frame_count, cntr_count, &nsec);
+	if (err < 0)
+		goto end;
+	print_result("mapper", "demuxer", label, access, sample_format,
+		     samples_per_frame, FRAMES_PER_MEASUREMENT, nsec);
+
+	err = rewind_files(trial, cntr_count);
+	if (err < 0)
+		goto end;
+
+	err = bench_mapper_type(trial, MAPPER_TYPE_MUXER, access,
+				sample_format, samples_per_frame, frame_buffer,
+				frame_count, cntr_count, &nsec);
+	if (err < 0)
+		goto end;
+	print_result("mapper", "muxer", label, access, sample_format,
+		     samples_per_frame, FRAMES_PER_MEASUREMENT, nsec);
+end:
+	close_files(trial, cntr_count);
+
+	return err;
+}
+
+static int callback(struct test_generator *gen, snd_pcm_access_t access,
+		    snd_pcm_format_t sample_format,
+		    unsigned int samples_per_frame, void *frame_buffer,
+		    unsigned int frame_count)
+{
+	struct bench_trial *trial = gen->private_data;
+	char *vector[MAX_SAMPLES_PER_FRAME];
+	void *buf = frame_buffer;
+	int err;
+
+	// Containers handle interleaved frames only.
+	if (trial->container && access == SND_PCM_ACCESS_RW_INTERLEAVED) {
+		err = bench_container(trial, sample_format, samples_per_frame,
+				      frame_buffer, frame_count);
+		if (err < 0)
+			return err;
+	}
+
+	if (!trial->mapper)
+		return 0;
+
+	// The generator allocates one buffer for mmap non-interleaved access.
+	if (access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED) {
+		unsigned int size = frame_count *
+			snd_pcm_format_physical_width(sample_format) / 8;
+		int i;
+
+		for (i = 0; i < samples_per_frame; ++i)
+			vector[i] = (char *)frame_buffer + size * i;
+		buf = vector;
+	}
+
+	err = bench_mapper(trial, access, sample_format, samples_per_frame,
+			   buf, frame_count, 1);
+	if (err < 0)
+		return err;
+
+	if (samples_per_frame > 1) {
+		err = bench_mapper(trial, access, sample_format,
+				   samples_per_frame, buf, frame_count,
+				   samples_per_frame);
+	}
+
+	return err;
+}
+
+int main(int argc, const char *argv[])
+{
+	static const uint64_t sample_format_mask =
+			(1ull << SND_PCM_FORMAT_U8) |
+			(1ull << SND_PCM_FORMAT_S16_LE) |
+			(1ull << SND_PCM_FORMAT_S24_3LE) |
+			(1ull << SND_PCM_FORMAT_S32_LE) |
+			(1ull << SND_PCM_FORMAT_FLOAT_LE);
+	static const uint64_t access_mask =
+			(1ull << SND_PCM_ACCESS_MMAP_INTERLEAVED) |
+			(1ull << SND_PCM_ACCESS_MMAP_NONINTERLEAVED) |
+			(1ull << SND_PCM_ACCESS_RW_INTERLEAVED) |
+			(1ull << SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	struct test_generator gen = {0};
+	struct bench_trial *trial;
+	int i;
+	int err;
+
+	err = generator_context_init(&gen, access_mask, sample_format_mask,
+				     1, MAX_SAMPLES_PER_FRAME,
+				     FRAMES_PER_BUFFER, FRAMES_PER_BUFFER, 1,
+				     sizeof(struct bench_trial));
+	if (err < 0)
+		goto end;
+
+	// Both targets are measured unless either is given.
+	trial = gen.private_data;
+	if (argc > 1) {
+		if (!strcmp(argv[1], "mapper")) {
+			trial->mapper = true;
+		} else if (!strcmp(argv[1], "container")) {
+			trial->container = true;
+		} else {
+			fprintf(stderr, "Usage: %s [mapper|container]\n",
+				argv[0]);
+			err = -EINVAL;
+			goto end;
+		}
+	} else {
+		trial->mapper = true;
+		trial->container = true;
+	}
+	for (i = 0; i < MAX_SAMPLES_PER_FRAME; ++i)
+		trial->fds[i] = -1;
+
+	err = generator_context_run(&gen, callback);
+end:
+	generator_context_destroy(&gen);
+
+	if (err < 0) {
+		printf("%s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
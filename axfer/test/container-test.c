@@ -40,7 +40,7 @@ static void test_builder(struct container_context *cntr, int fd,
 			 unsigned int samples_per_frame,
 			 unsigned int frames_per_second,
 			 void *frame_buffer, unsigned int frame_count,
-			 bool verbose)
+			 bool map_file, bool async_write, bool verbose)
 {
 	snd_pcm_format_t sample;
 	unsigned int channels;
@@ -65,6 +65,17 @@ static void test_builder(struct container_context *cntr, int fd,
 	assert(rate == frames_per_second);
 	assert(max_frame_count > 0);
 
+	if (map_file) {
+		err = container_context_map_file(cntr);
+		assert(err == 0);
+	}
+
+	// Use small queue so that the thread writes it around.
+	if (async_write) {
+		err = container_context_start_writer(cntr, 10);
+		assert(err == 0);
+	}
+
 	handled_frame_count = frame_count;
 	err = container_context_process_frames(cntr, frame_buffer,
 					       &handled_frame_count);
@@ -86,7 +97,7 @@ static void test_parser(struct container_context *cntr, int fd,
 		        unsigned int samples_per_frame,
 		        unsigned int frames_per_second,
 		        void *frame_buffer, unsigned int frame_count,
-			bool verbose)
+			bool map_file, bool verbose)
 {
 	snd_pcm_format_t sample;
 	unsigned int channels;
@@ -110,6 +121,11 @@ static void test_parser(struct container_context *cntr, int fd,
 	assert(rate == frames_per_second);
 	assert(total_frame_count == frame_count);
 
+	if (map_file) {
+		err = container_context_map_file(cntr);
+		assert(err == 0);
+	}
+
 	handled_frame_count = total_frame_count;
 	err = container_context_process_frames(cntr, frame_buffer,
 					       &handled_frame_count);
@@ -151,11 +167,17 @@ static int callback(struct test_generator *gen, snd_pcm_access_t access,
 	if (buf == NULL)
 		return -ENOMEM;
 
-	for (i = 0; i < ARRAY_SIZE(entries); ++i) {
+	for (i = 0; i < ARRAY_SIZE(entries) * 2; ++i) {
+		bool map_file;
+		bool async_write;
 		int fd;
 		off_t pos;
 
-		frames_per_second = entries[i];
+		// Test I/O by both of read(2)/write(2) and mmap(2).
+		frames_per_second = entries[i % ARRAY_SIZE(entries)];
+		map_file = i >= ARRAY_SIZE(entries) &&
+			   trial->format != CONTAINER_FORMAT_FLAC;
+		async_write = i % 2;
 
 #ifdef HAVE_MEMFD_CREATE
 		fd = memfd_create(name, 0);
@@ -170,7 +192,7 @@ static int callback(struct test_generator *gen, snd_pcm_access_t access,
 		test_builder(&trial->cntr, fd, trial->format, access,
 			     sample_format, samples_per_frame,
 			     frames_per_second, frame_buffer, frame_count,
-			     trial->verbose);
+			     map_file, async_write, trial->verbose);
 
 		pos = lseek(fd, 0, SEEK_SET);
 		if (pos < 0) {
@@ -180,7 +202,7 @@ static int callback(struct test_generator *gen, snd_pcm_access_t access,
 
 		test_parser(&trial->cntr, fd, trial->format, access,
 			    sample_format, samples_per_frame, frames_per_second,
-			    buf, frame_count, trial->verbose);
+			    buf, frame_count, map_file, trial->verbose);
 
 		err = memcmp(buf, frame_buffer, size);
 		assert(err == 0);
@@ -193,6 +215,263 @@ static int callback(struct test_generator *gen, snd_pcm_access_t access,
 	return err;
 }
 
+// Data frames over 4 GiB are not written actually. The builder is told to have
+// handled them before post-process and the file is extended sparsely.
+static void test_rf64(bool verbose)
+{
+	static const char *const ids[] = {"RF64", "BW64"};
+	const uint64_t byte_count = 5ull * 1024 * 1024 * 1024;
+	const unsigned int frame_count = 256;
+	const char *const name = "hoge";
+	struct container_context cntr = {0};
+	snd_pcm_format_t sample;
+	unsigned int channels;
+	unsigned int rate;
+	uint64_t total_frame_count;
+	unsigned int handled_frame_count;
+	int16_t frame_buffer[256 * 2];
+	int16_t buf[256 * 2];
+	off_t header_size;
+	int fd;
+	int i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(frame_buffer); ++i)
+		frame_buffer[i] = i;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create(name, 0);
+#else
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	assert(fd >= 0);
+
+	err = container_builder_init(&cntr, fd, CONTAINER_FORMAT_RIFF_WAVE,
+				     verbose);
+	assert(err == 0);
+
+	sample = SND_PCM_FORMAT_S16_LE;
+	channels = 2;
+	rate = 48000;
+	total_frame_count = 0;
+	err = container_context_pre_process(&cntr, &sample, &channels, &rate,
+					    &total_frame_count);
+	assert(err == 0);
+	assert(total_frame_count > byte_count / 4);
+
+	handled_frame_count = frame_count;
+	err = container_context_process_frames(&cntr, frame_buffer,
+					       &handled_frame_count);
+	assert(err == 0);
+	assert(handled_frame_count == frame_count);
+
+	header_size = lseek(fd, 0, SEEK_END);
+	assert(header_size > 0);
+	header_size -= sizeof(frame_buffer);
+
+	cntr.handled_byte_count = byte_count;
+	err = container_context_post_process(&cntr, &total_frame_count);
+	assert(err == 0);
+	assert(total_frame_count == byte_count / 4);
+	container_context_destroy(&cntr);
+
+	err = ftruncate(fd, header_size + byte_count);
+	assert(err == 0);
+
+	for (i = 0; i < ARRAY_SIZE(ids); ++i) {
+		// BW64 is the same as RF64 except for its identifier.
+		err = pwrite(fd, ids[i], 4, 0);
+		assert(err == 4);
+		err = lseek(fd, 0, SEEK_SET);
+		assert(err == 0);
+
+		err = container_parser_init(&cntr, fd, verbose);
+		assert(err == 0);
+		assert(cntr.format == CONTAINER_FORMAT_RIFF_WAVE);
+
+		sample = SND_PCM_FORMAT_UNKNOWN;
+		channels = 0;
+		rate = 0;
+		total_frame_count = 0;
+		err = container_context_pre_process(&cntr, &sample, &channels,
+						    &rate, &total_frame_count);
+		assert(err == 0);
+		assert(sample == SND_PCM_FORMAT_S16_LE);
+		assert(channels == 2);
+		assert(rate == 48000);
+		assert(total_frame_count == byte_count / 4);
+
+		handled_frame_count = frame_count;
+		err = container_context_process_frames(&cntr, buf,
+						       &handled_frame_count);
+		assert(err == 0);
+		assert(handled_frame_count == frame_count);
+		assert(!memcmp(buf, frame_buffer, sizeof(buf)));
+
+		err = container_context_post_process(&cntr,
+						     &total_frame_count);
+		assert(err == 0);
+		assert(total_frame_count == frame_count);
+		container_context_destroy(&cntr);
+	}
+
+	close(fd);
+}
+
+struct bit_stream {
+	uint8_t buf[64];
+	unsigned int bits;
+};
+
+static void put_bits(struct bit_stream *stream, unsigned int count,
+		     uint64_t val)
+{
+	unsigned int pos;
+
+	while (count-- > 0) {
+		pos = stream->bits++;
+		if ((val >> count) & 0x01)
+			stream->buf[pos / 8] |= 0x80 >> (pos % 8);
+	}
+}
+
+// CRC-8 and CRC-16 of FLAC, both in MSB-first order.
+static unsigned int calc_crc(const uint8_t *buf, unsigned int len,
+			     unsigned int width, unsigned int poly)
+{
+	unsigned int mask = (1u << width) - 1;
+	unsigned int crc = 0;
+	int i, j;
+
+	for (i = 0; i < len; ++i) {
+		crc ^= buf[i] << (width - 8);
+		for (j = 0; j < 8; ++j) {
+			if (crc & (1u << (width - 1)))
+				crc = ((crc << 1) ^ poly) & mask;
+			else
+				crc = (crc << 1) & mask;
+		}
+	}
+
+	return crc;
+}
+
+// A block of 32 bit samples in stereo, with two subframes of constant.
+static unsigned int build_flac_block(uint8_t *buf, unsigned int assignment,
+				     unsigned int side_width, int32_t left,
+				     int64_t second)
+{
+	struct bit_stream stream = {0};
+	unsigned int len;
+
+	// Header with 16 frames, the rate and the width of STREAMINFO.
+	put_bits(&stream, 16, 0xfff8);
+	put_bits(&stream, 4, 0x06);
+	put_bits(&stream, 4, 0x00);
+	put_bits(&stream, 4, assignment);
+	put_bits(&stream, 3, 0x00);
+	put_bits(&stream, 1, 0x00);
+	put_bits(&stream, 8, 0x00);
+	put_bits(&stream, 8, 16 - 1);
+	put_bits(&stream, 8, calc_crc(stream.buf, stream.bits / 8, 8, 0x07));
+
+	put_bits(&stream, 8, 0x00);
+	put_bits(&stream, 32, (uint32_t)left);
+	put_bits(&stream, 8, 0x00);
+	put_bits(&stream, side_width, second & ((1ull << side_width) - 1));
+
+	stream.bits += (8 - stream.bits % 8) % 8;
+	len = stream.bits / 8;
+	put_bits(&stream, 16, calc_crc(stream.buf, len, 16, 0x8005));
+
+	memcpy(buf, stream.buf, stream.bits / 8);
+	return stream.bits / 8;
+}
+
+// The side channel of 32 bit samples has 33 bits, which is not decoded.
+static void test_flac_side_channel(bool verbose)
+{
+	static const uint8_t header[] = {
+		'f', 'L', 'a', 'C',
+		// The last block of metadata.
+		0x80, 0x00, 0x00, 0x22,
+		// 16 frames in block.
+		0x00, 0x10, 0x00, 0x10,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		// 48000 Hz, 2 channels, 32 bits, 16 frames.
+		0x0b, 0xb8, 0x03, 0xf0, 0x00, 0x00, 0x00, 0x10,
+		// MD5 signature.
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+	static const struct {
+		unsigned int assignment;
+		unsigned int side_width;
+		int64_t second;
+		int result;
+	} entries[] = {
+		// Independent channels.
+		{ 0x01, 32, INT32_MIN, 0 },
+		// Left and side channels.
+		{ 0x08, 33, (int64_t)INT32_MAX - INT32_MIN, -EINVAL },
+	};
+	struct container_context cntr = {0};
+	snd_pcm_format_t sample;
+	unsigned int channels;
+	unsigned int rate;
+	uint64_t total_frame_count;
+	unsigned int frame_count;
+	int32_t frame_buffer[16 * 2];
+	uint8_t block[64];
+	unsigned int len;
+	int fd;
+	int i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(entries); ++i) {
+		fd = open("hoge", O_RDWR | O_CREAT | O_TRUNC, 0644);
+		assert(fd >= 0);
+
+		len = build_flac_block(block, entries[i].assignment,
+				       entries[i].side_width, INT32_MAX,
+				       entries[i].second);
+		err = write(fd, header, sizeof(header));
+		assert(err == sizeof(header));
+		err = write(fd, block, len);
+		assert(err == len);
+		err = lseek(fd, 0, SEEK_SET);
+		assert(err == 0);
+
+		err = container_parser_init(&cntr, fd, verbose);
+		assert(err == 0);
+		assert(cntr.format == CONTAINER_FORMAT_FLAC);
+
+		sample = SND_PCM_FORMAT_UNKNOWN;
+		channels = 0;
+		rate = 0;
+		err = container_context_pre_process(&cntr, &sample, &channels,
+						    &rate, &total_frame_count);
+		assert(err == 0);
+		assert(sample == SND_PCM_FORMAT_S32_LE);
+		assert(channels == 2);
+		assert(total_frame_count == 16);
+
+		frame_count = 16;
+		err = container_context_process_frames(&cntr, frame_buffer,
+						       &frame_count);
+		assert(err == entries[i].result);
+		if (err == 0) {
+			assert(frame_count == 16);
+			assert(frame_buffer[0] == INT32_MAX);
+			assert(frame_buffer[1] == INT32_MIN);
+		}
+
+		container_context_destroy(&cntr);
+		close(fd);
+		unlink("hoge");
+	}
+}
+
 int main(int argc, const char *argv[])
 {
 	static const uint64_t sample_format_masks[] = {
@@ -229,6 +508,11 @@ int main(int argc, const char *argv[])
 			(1ull << SND_PCM_FORMAT_S16_LE) |
 			(1ull << SND_PCM_FORMAT_MU_LAW) |
 			(1ull << SND_PCM_FORMAT_A_LAW),
+		[CONTAINER_FORMAT_FLAC] =
+			(1ull << SND_PCM_FORMAT_S8) |
+			(1ull << SND_PCM_FORMAT_S16_LE) |
+			(1ull << SND_PCM_FORMAT_S32_LE) |
+			(1ull << SND_PCM_FORMAT_S24_3LE),
 		[CONTAINER_FORMAT_RAW] =
 			(1ull << SND_PCM_FORMAT_S8) |
 			(1ull << SND_PCM_FORMAT_U8) |
@@ -279,7 +563,7 @@ int main(int argc, const char *argv[])
 	int begin;
 	int end;
 	bool verbose;
-	int err;
+	int err = 0;
 
 	if (argc > 1) {
 		char *term;
@@ -297,10 +581,19 @@ int main(int argc, const char *argv[])
 		verbose = false;
 	}
 
+	if (begin == CONTAINER_FORMAT_RIFF_WAVE)
+		test_rf64(verbose);
+	if (begin <= CONTAINER_FORMAT_FLAC && end > CONTAINER_FORMAT_FLAC)
+		test_flac_side_channel(verbose);
+
 	for (i = begin; i < end; ++i) {
+		// FLAC supports up to 8 channels.
+		unsigned int max_channels =
+				(i == CONTAINER_FORMAT_FLAC) ? 8 : 32;
+
 		err = generator_context_init(&gen, access_mask,
 					     sample_format_masks[i],
-					     1, 32, 23, 3000, 512,
+					     1, max_channels, 23, 3000, 512,
 					     sizeof(struct container_trial));
 		if (err >= 0) {
 			trial = gen.private_data;
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <endian.h>
 
 #include <assert.h>
 
@@ -37,7 +38,7 @@ struct mapper_trial {
 };
 
 static void test_demuxer(struct mapper_context *mapper, snd_pcm_access_t access,
-			 unsigned int bytes_per_sample,
+			 snd_pcm_format_t sample_format,
 			 unsigned int samples_per_frame,
 			 unsigned int frames_per_buffer,
 			 void *frame_buffer, unsigned int frame_count,
@@ -51,7 +52,7 @@ static void test_demuxer(struct mapper_context *mapper, snd_pcm_access_t access,
 				  verbose);
 	assert(err == 0);
 
-	err = mapper_context_pre_process(mapper, access, bytes_per_sample,
+	err = mapper_context_pre_process(mapper, access, sample_format,
 					 samples_per_frame, frames_per_buffer,
 					 cntrs);
 	assert(err == 0);
@@ -76,7 +77,6 @@ static int test_demux(struct mapper_trial *trial, snd_pcm_access_t access,
 {
 	struct container_context *cntrs = trial->cntrs;
 	enum container_format cntr_format = trial->cntr_format;
-	unsigned int bytes_per_sample;
 	uint64_t total_frame_count;
 	int i;
 	int err = 0;
@@ -111,8 +111,7 @@ static int test_demux(struct mapper_trial *trial, snd_pcm_access_t access,
 			assert(channels == samples_per_frame);
 	}
 
-	bytes_per_sample = snd_pcm_format_physical_width(sample_format) / 8;
-	test_demuxer(&trial->mapper, access, bytes_per_sample,
+	test_demuxer(&trial->mapper, access, sample_format,
 		     samples_per_frame, frames_per_buffer, frame_buffer,
 		     frame_count, cntrs, cntr_count, trial->verbose);
 
@@ -128,7 +127,7 @@ end:
 }
 
 static void test_muxer(struct mapper_context *mapper, snd_pcm_access_t access,
-		       unsigned int bytes_per_sample,
+		       snd_pcm_format_t sample_format,
 		       unsigned int samples_per_frame,
 		       unsigned int frames_per_buffer,
 		       void *frame_buffer, unsigned int frame_count,
@@ -142,7 +141,7 @@ static void test_muxer(struct mapper_context *mapper, snd_pcm_access_t access,
 				  verbose);
 	assert(err == 0);
 
-	err = mapper_context_pre_process(mapper, access, bytes_per_sample,
+	err = mapper_context_pre_process(mapper, access, sample_format,
 					 samples_per_frame, frames_per_buffer,
 					 cntrs);
 	assert(err == 0);
@@ -166,7 +165,6 @@ static int test_mux(struct mapper_trial *trial, snd_pcm_access_t access,
 		    int *cntr_fds, unsigned int cntr_count)
 {
 	struct container_context *cntrs = trial->cntrs;
-	unsigned int bytes_per_sample;
 	uint64_t total_frame_count;
 	int i;
 	int err = 0;
@@ -201,8 +199,7 @@ static int test_mux(struct mapper_trial *trial, snd_pcm_access_t access,
 			assert(channels == samples_per_frame);
 	}
 
-	bytes_per_sample = snd_pcm_format_physical_width(sample_format) / 8;
-	test_muxer(&trial->mapper, access, bytes_per_sample, samples_per_frame,
+	test_muxer(&trial->mapper, access, sample_format, samples_per_frame,
 		   frames_per_buffer, frame_buffer, frame_count, cntrs,
 		   cntr_count, trial->verbose);
 
@@ -427,6 +424,66 @@ static int callback(struct test_generator *gen, snd_pcm_access_t access,
 		       frame_buffer, frame_count, samples_per_frame);
 };
 
+// Samples in S16_LE are converted to the other format and back, then compared.
+// Dithering for down-conversion can change one LSB at most.
+static void test_conversion(void)
+{
+	static const snd_pcm_format_t formats[] = {
+		SND_PCM_FORMAT_S16_LE,
+		SND_PCM_FORMAT_S16_BE,
+		SND_PCM_FORMAT_S24_LE,
+		SND_PCM_FORMAT_S24_BE,
+		SND_PCM_FORMAT_S24_3LE,
+		SND_PCM_FORMAT_S24_3BE,
+		SND_PCM_FORMAT_S32_LE,
+		SND_PCM_FORMAT_S32_BE,
+		SND_PCM_FORMAT_FLOAT_LE,
+		SND_PCM_FORMAT_FLOAT_BE,
+	};
+	struct mapper_converter conv;
+	unsigned int sample_count = 1000;
+	int16_t *src;
+	int16_t *dst;
+	char *buf;
+	int i, j;
+	int err;
+
+	src = malloc(sample_count * sizeof(*src));
+	dst = malloc(sample_count * sizeof(*dst));
+	buf = malloc(sample_count * 4);
+	assert(src != NULL && dst != NULL && buf != NULL);
+
+	for (i = 0; i < sample_count; ++i)
+		src[i] = htole16(random());
+	src[0] = htole16(INT16_MAX);
+	src[1] = htole16(INT16_MIN);
+
+	for (i = 0; i < ARRAY_SIZE(formats); ++i) {
+		err = mapper_converter_init(&conv, SND_PCM_FORMAT_S16_LE,
+					    formats[i]);
+		assert(err == 0);
+		mapper_converter_process(&conv, buf, src, sample_count);
+
+		err = mapper_converter_init(&conv, formats[i],
+					    SND_PCM_FORMAT_S16_LE);
+		assert(err == 0);
+		mapper_converter_process(&conv, dst, buf, sample_count);
+
+		for (j = 0; j < sample_count; ++j) {
+			int diff = (int16_t)le16toh(dst[j]) -
+				   (int16_t)le16toh(src[j]);
+			if (conv.dither_bits == 0)
+				assert(diff == 0);
+			else
+				assert(diff >= -1 && diff <= 1);
+		}
+	}
+
+	free(buf);
+	free(dst);
+	free(src);
+}
+
 int main(int argc, const char *argv[])
 {
 	// Test 8/16/18/20/24/32/64 bytes per sample.
@@ -496,6 +553,8 @@ int main(int argc, const char *argv[])
 		verbose = false;
 	}
 
+	test_conversion();
+
 	err = generator_context_init(&gen, access_mask, sample_format_mask,
 				     1, samples_per_frame,
 				     23, 4500, 1024,
@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// segment-test.c - a unit test for rotation of files in capture.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include "../subcmd.h"
+#include "../container.h"
+#include "../misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <assert.h>
+
+#define FRAMES_PER_SECOND	48000
+#define SAMPLES_PER_FRAME	2
+
+// The subcommand refers to the helpers in main.c to parse its options.
+char *arg_duplicate_string(const char *str, int *err)
+{
+	char *ptr;
+
+	ptr = strdup(str);
+	if (ptr == NULL)
+		*err = -ENOMEM;
+	return ptr;
+}
+
+long arg_parse_decimal_num(const char *str, int *err)
+{
+	long val;
+	char *endptr;
+
+	errno = 0;
+	val = strtol(str, &endptr, 0);
+	if (errno > 0) {
+		*err = -errno;
+		return 0;
+	}
+	if (*endptr != '\0') {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	return val;
+}
+
+static void capture(const char *type, unsigned int seconds_per_file,
+		    unsigned int seconds, const char *path)
+{
+	char file_time[32];
+	char duration[32];
+	char rate[32];
+	char channels[32];
+	char *const argv[] = {
+		"axfer",
+		"--xfer-type=null",
+		"--virtual-clock",
+		"--quiet",
+		"-f", "S16_LE",
+		"-c", channels,
+		"-r", rate,
+		"-t", (char *)type,
+		file_time,
+		"-d", duration,
+		(char *)path,
+		NULL,
+	};
+	int err;
+
+	snprintf(file_time, sizeof(file_time), "--max-file-time=%u",
+		 seconds_per_file);
+	snprintf(duration, sizeof(duration), "%u", seconds);
+	snprintf(rate, sizeof(rate), "%u", FRAMES_PER_SECOND);
+	snprintf(channels, sizeof(channels), "%u", SAMPLES_PER_FRAME);
+
+	optind = 0;
+	err = subcmd_transfer(ARRAY_SIZE(argv) - 1, argv,
+			      SND_PCM_STREAM_CAPTURE);
+	assert(err == 0);
+}
+
+// Parse the file of segment and remove it.
+static uint64_t check_segment(const char *path, unsigned int seq)
+{
+	struct container_context cntr = {0};
+	char name[64];
+	snd_pcm_format_t format;
+	unsigned int samples_per_frame;
+	unsigned int frames_per_second;
+	uint64_t frame_count;
+	int fd;
+	int err;
+
+	snprintf(name, sizeof(name), path, seq);
+	fd = open(name, O_RDONLY);
+	assert(fd >= 0);
+
+	err = container_parser_init(&cntr, fd, 0);
+	assert(err == 0);
+
+	format = SND_PCM_FORMAT_UNKNOWN;
+	samples_per_frame = 0;
+	frames_per_second = 0;
+	err = container_context_pre_process(&cntr, &format, &samples_per_frame,
+					    &frames_per_second, &frame_count);
+	assert(err == 0);
+	assert(format == SND_PCM_FORMAT_S16_LE);
+	assert(samples_per_frame == SAMPLES_PER_FRAME);
+	assert(frames_per_second == FRAMES_PER_SECOND);
+
+	container_context_destroy(&cntr);
+	close(fd);
+	unlink(name);
+
+	return frame_count;
+}
+
+// The files are rotated at the given time.
+static void test_rotation_by_time(void)
+{
+	int i;
+
+	capture("wav", 1, 3, "segment.wav");
+	for (i = 1; i <= 3; ++i) {
+		assert(check_segment("segment-%02u.wav", i) ==
+		       FRAMES_PER_SECOND);
+	}
+	assert(access("segment-04.wav", F_OK) < 0);
+}
+
+// The files are rotated at the maximum size of container as well as at the
+// given time, instead of stopping at the first full file. The maximum size of
+// Creative Voice File is small enough.
+static void test_rotation_by_size(void)
+{
+	unsigned int bytes_per_frame = 2 * SAMPLES_PER_FRAME;
+	uint64_t frames_per_file;
+	uint64_t frame_count;
+	uint64_t total_frame_count;
+	unsigned int seconds;
+	int i;
+
+	// For two full files and the rest.
+	seconds = 0xffffff / bytes_per_frame / FRAMES_PER_SECOND * 5 / 2 + 1;
+	capture("voc", seconds, seconds, "segment.voc");
+
+	frames_per_file = check_segment("segment-%02u.voc", 1);
+	assert(frames_per_file > 0);
+	assert(frames_per_file <= 0xffffff / bytes_per_frame);
+	total_frame_count = frames_per_file;
+	for (i = 2; i <= 3; ++i) {
+		frame_count = check_segment("segment-%02u.voc", i);
+		if (i < 3) {
+			assert(frame_count == frames_per_file);
+		} else {
+			assert(frame_count > 0);
+			assert(frame_count < frames_per_file);
+		}
+		total_frame_count += frame_count;
+	}
+	assert(access("segment-04.voc", F_OK) < 0);
+	assert(total_frame_count == (uint64_t)seconds * FRAMES_PER_SECOND);
+}
+
+int main(int argc, const char *argv[])
+{
+	test_rotation_by_time();
+	test_rotation_by_size();
+
+	return EXIT_SUCCESS;
+}
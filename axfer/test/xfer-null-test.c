@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// xfer-null-test.c - a unit test for the null backend of transmission.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include <aconfig.h>
+#ifdef HAVE_MEMFD_CREATE
+#define _GNU_SOURCE
+#endif
+
+#include "../xfer.h"
+#include "../misc.h"
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <assert.h>
+
+#define FRAMES_PER_SECOND	48000
+#define SAMPLES_PER_FRAME	2
+#define FRAMES_PER_PERIOD	(FRAMES_PER_SECOND / 100)
+#define PERIOD_COUNT		100
+
+// The backend refers to the helper in main.c to parse its options.
+long arg_parse_decimal_num(const char *str, int *err)
+{
+	long val;
+	char *endptr;
+
+	errno = 0;
+	val = strtol(str, &endptr, 0);
+	if (errno > 0) {
+		*err = -errno;
+		return 0;
+	}
+	if (*endptr != '\0') {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	return val;
+}
+
+static void set_option(struct xfer_context *xfer, const char *name,
+		       const char *arg)
+{
+	int i;
+	int err;
+
+	for (i = 0; i < xfer_null.l_opts_count; ++i) {
+		if (!strcmp(xfer_null.l_opts[i].name, name))
+			break;
+	}
+	assert(i < xfer_null.l_opts_count);
+
+	err = xfer->ops->parse_opt(xfer, xfer_null.l_opts[i].val, arg);
+	assert(err == 0);
+}
+
+static int open_file(snd_pcm_stream_t direction, unsigned int frame_count)
+{
+	int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("hoge", 0);
+#else
+	fd = open("hoge", O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (fd < 0)
+		return -errno;
+
+	// Silence for playback, which is detected as raw data.
+	if (direction == SND_PCM_STREAM_PLAYBACK) {
+		if (ftruncate(fd, frame_count * SAMPLES_PER_FRAME * 2) < 0) {
+			close(fd);
+			return -errno;
+		}
+	}
+
+	return fd;
+}
+
+// Transfer all of frames and count XRUNs, which are reported by no frames
+// without error since the backend recovers the stream by itself.
+static void test_transfer(snd_pcm_stream_t direction, bool noninterleaved,
+			  unsigned int xrun_interval)
+{
+	struct xfer_context xfer = {0};
+	struct mapper_context mapper = {0};
+	struct container_context cntr = {0};
+	snd_pcm_format_t format;
+	unsigned int samples_per_frame;
+	unsigned int frames_per_second;
+	snd_pcm_access_t access;
+	snd_pcm_uframes_t frames_per_buffer;
+	uint64_t total_frame_count;
+	unsigned int frame_count;
+	unsigned int handled;
+	unsigned int xrun_count;
+	unsigned int loop_count;
+	char arg[16];
+	int fd;
+	int err;
+
+	xfer.direction = direction;
+	xfer.ops = &xfer_null.ops;
+	xfer.private_data = calloc(1, xfer_null.private_size);
+	assert(xfer.private_data != NULL);
+
+	err = xfer.ops->init(&xfer, direction);
+	assert(err == 0);
+	set_option(&xfer, "virtual-clock", NULL);
+	if (noninterleaved)
+		set_option(&xfer, "noninterleaved", NULL);
+	snprintf(arg, sizeof(arg), "%u", xrun_interval);
+	set_option(&xfer, "xrun-interval", arg);
+	err = xfer.ops->validate_opts(&xfer);
+	assert(err == 0);
+
+	format = SND_PCM_FORMAT_S16_LE;
+	samples_per_frame = SAMPLES_PER_FRAME;
+	frames_per_second = FRAMES_PER_SECOND;
+	access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	frames_per_buffer = 0;
+	err = xfer.ops->pre_process(&xfer, &format, &samples_per_frame,
+				    &frames_per_second, &access,
+				    &frames_per_buffer);
+	assert(err == 0);
+	assert(frames_per_buffer == FRAMES_PER_PERIOD * 4);
+	if (noninterleaved)
+		assert(access == SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	else
+		assert(access == SND_PCM_ACCESS_RW_INTERLEAVED);
+
+	frame_count = FRAMES_PER_PERIOD * PERIOD_COUNT;
+	fd = open_file(direction, frame_count);
+	assert(fd >= 0);
+
+	if (direction == SND_PCM_STREAM_CAPTURE) {
+		err = container_builder_init(&cntr, fd, CONTAINER_FORMAT_RAW,
+					     0);
+		assert(err == 0);
+		err = mapper_context_init(&mapper, MAPPER_TYPE_DEMUXER, 1, 0);
+		assert(err == 0);
+	} else {
+		err = container_parser_init(&cntr, fd, 0);
+		assert(err == 0);
+		assert(cntr.format == CONTAINER_FORMAT_RAW);
+		err = mapper_context_init(&mapper, MAPPER_TYPE_MUXER, 1, 0);
+		assert(err == 0);
+	}
+
+	err = container_context_pre_process(&cntr, &format, &samples_per_frame,
+					    &frames_per_second,
+					    &total_frame_count);
+	assert(err == 0);
+	if (direction == SND_PCM_STREAM_PLAYBACK)
+		assert(total_frame_count == frame_count);
+
+	err = mapper_context_pre_process(&mapper, access, format,
+					 samples_per_frame, frames_per_buffer,
+					 &cntr);
+	assert(err == 0);
+
+	handled = 0;
+	xrun_count = 0;
+	loop_count = 0;
+	while (handled < frame_count) {
+		unsigned int count = frame_count - handled;
+
+		err = xfer.ops->process_frames(&xfer, &count, &mapper, &cntr);
+		assert(err == 0);
+		if (count == 0)
+			++xrun_count;
+		handled += count;
+
+		// Any XRUN should not prevent the transfer from progress.
+		assert(++loop_count < PERIOD_COUNT * 8);
+	}
+	assert(handled == frame_count);
+
+	if (xrun_interval == 0)
+		assert(xrun_count == 0);
+	else
+		assert(xrun_count > 0 && xrun_count <= PERIOD_COUNT);
+
+	xfer.ops->post_process(&xfer);
+	mapper_context_post_process(&mapper);
+	mapper_context_destroy(&mapper);
+	container_context_post_process(&cntr, &total_frame_count);
+	assert(total_frame_count == frame_count);
+	container_context_destroy(&cntr);
+	close(fd);
+
+	free(xfer.private_data);
+}
+
+int main(int argc, const char *argv[])
+{
+	static const unsigned int xrun_intervals[] = {0, 1, 3};
+	static const snd_pcm_stream_t directions[] = {
+		SND_PCM_STREAM_CAPTURE,
+		SND_PCM_STREAM_PLAYBACK,
+	};
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(directions); ++i) {
+		for (j = 0; j < ARRAY_SIZE(xrun_intervals); ++j) {
+			test_transfer(directions[i], false, xrun_intervals[j]);
+			test_transfer(directions[i], true, xrun_intervals[j]);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// waiter-io-uring.c - Waiter for event notification by io_uring(7).
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include "waiter.h"
+#include "misc.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Pointers to fields in the rings shared with kernel.
+struct io_uring_sq {
+	unsigned int *head;
+	unsigned int *tail;
+	unsigned int *mask;
+	unsigned int *array;
+	struct io_uring_sqe *sqes;
+};
+
+struct io_uring_cq {
+	unsigned int *head;
+	unsigned int *tail;
+	unsigned int *mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct io_uring_state {
+	int ring_fd;
+	struct io_uring_params params;
+
+	char *sq_ring;
+	size_t sq_ring_size;
+	char *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	struct io_uring_sq sq;
+	struct io_uring_cq cq;
+
+	// Poll requests which are not completed yet.
+	bool *armed;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags,
+			  void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, arg_size);
+}
+
+static int map_rings(struct io_uring_state *state)
+{
+	struct io_uring_params *p = &state->params;
+	char *ptr;
+
+	state->sq_ring_size = p->sq_off.array +
+			      p->sq_entries * sizeof(unsigned int);
+	state->cq_ring_size = p->cq_off.cqes +
+			      p->cq_entries * sizeof(struct io_uring_cqe);
+
+	// Both rings are in the same mapping since Linux kernel v5.4.
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (state->cq_ring_size > state->sq_ring_size)
+			state->sq_ring_size = state->cq_ring_size;
+		state->cq_ring_size = state->sq_ring_size;
+	}
+
+	ptr = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, state->ring_fd,
+		   IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	state->sq_ring = ptr;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		state->cq_ring = state->sq_ring;
+	} else {
+		ptr = mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, state->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			return -errno;
+		state->cq_ring = ptr;
+	}
+
+	state->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	state->sq.sqes = (struct io_uring_sqe *)ptr;
+
+	state->sq.head = (unsigned int *)(state->sq_ring + p->sq_off.head);
+	state->sq.tail = (unsigned int *)(state->sq_ring + p->sq_off.tail);
+	state->sq.mask = (unsigned int *)(state->sq_ring + p->sq_off.ring_mask);
+	state->sq.array = (unsigned int *)(state->sq_ring + p->sq_off.array);
+
+	state->cq.head = (unsigned int *)(state->cq_ring + p->cq_off.head);
+	state->cq.tail = (unsigned int *)(state->cq_ring + p->cq_off.tail);
+	state->cq.mask = (unsigned int *)(state->cq_ring + p->cq_off.ring_mask);
+	state->cq.cqes = (struct io_uring_cqe *)(state->cq_ring +
+						 p->cq_off.cqes);
+
+	return 0;
+}
+
+static int io_uring_prepare(struct waiter_context *waiter)
+{
+	struct io_uring_state *state = waiter->private_data;
+	int err;
+
+	state->armed = calloc(waiter->pfd_count, sizeof(*state->armed));
+	if (state->armed == NULL)
+		return -ENOMEM;
+
+	memset(&state->params, 0, sizeof(state->params));
+	state->ring_fd = io_uring_setup(waiter->pfd_count, &state->params);
+	if (state->ring_fd < 0)
+		return -errno;
+
+	// Timeout for completion is given to io_uring_enter(2) directly.
+	if (!(state->params.features & IORING_FEAT_EXT_ARG))
+		return -ENXIO;
+
+	err = map_rings(state);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+// Queue one-shot poll requests for descriptors not armed yet. They stay in
+// kernel till any event occurs.
+// In big endian architecture, the kernel swaps 16 bit halves of the field for
+// compatibility with the former 16 bit field. Do the same as liburing does.
+static uint32_t poll_mask(short events)
+{
+	uint32_t mask = (unsigned short)events;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+
+	return mask;
+}
+
+static unsigned int queue_polls(struct waiter_context *waiter)
+{
+	struct io_uring_state *state = waiter->private_data;
+	unsigned int tail = *state->sq.tail;
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < waiter->pfd_count; ++i) {
+		unsigned int index;
+		struct io_uring_sqe *sqe;
+
+		if (state->armed[i])
+			continue;
+
+		index = tail & *state->sq.mask;
+		sqe = &state->sq.sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = waiter->pfds[i].fd;
+		sqe->poll32_events = poll_mask(waiter->pfds[i].events);
+		sqe->user_data = i;
+		state->sq.array[index] = index;
+
+		state->armed[i] = true;
+		++tail;
+		++count;
+	}
+
+	if (count > 0)
+		__atomic_store_n(state->sq.tail, tail, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+static unsigned int reap_completions(struct waiter_context *waiter)
+{
+	struct io_uring_state *state = waiter->private_data;
+	unsigned int head = *state->cq.head;
+	unsigned int tail = __atomic_load_n(state->cq.tail, __ATOMIC_ACQUIRE);
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < waiter->pfd_count; ++i)
+		waiter->pfds[i].revents = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe;
+		unsigned int index;
+
+		cqe = &state->cq.cqes[head & *state->cq.mask];
+		index = cqe->user_data;
+
+		if (index < waiter->pfd_count) {
+			if (cqe->res < 0)
+				waiter->pfds[index].revents = POLLERR;
+			else
+				waiter->pfds[index].revents = cqe->res;
+			state->armed[index] = false;
+			++count;
+		}
+		++head;
+	}
+
+	__atomic_store_n(state->cq.head, head, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+static int io_uring_wait_event(struct waiter_context *waiter, int timeout_msec)
+{
+	struct io_uring_state *state = waiter->private_data;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg = {0};
+	unsigned int to_submit;
+	unsigned int min_complete;
+	int err;
+
+	to_submit = queue_polls(waiter);
+
+	if (timeout_msec >= 0) {
+		ts.tv_sec = timeout_msec / 1000;
+		ts.tv_nsec = (timeout_msec % 1000) * 1000000;
+		arg.ts = (unsigned long)&ts;
+	}
+	min_complete = (timeout_msec == 0) ? 0 : 1;
+
+	// Submit the requests and wait for completion in one system call.
+	err = io_uring_enter(state->ring_fd, to_submit, min_complete,
+			     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			     &arg, sizeof(arg));
+	if (err < 0 && errno != ETIME)
+		return -errno;
+
+	return reap_completions(waiter);
+}
+
+static void io_uring_release(struct waiter_context *waiter)
+{
+	struct io_uring_state *state = waiter->private_data;
+
+	if (state->sq.sqes)
+		munmap(state->sq.sqes, state->sqes_size);
+	if (state->cq_ring && state->cq_ring != state->sq_ring)
+		munmap(state->cq_ring, state->cq_ring_size);
+	if (state->sq_ring)
+		munmap(state->sq_ring, state->sq_ring_size);
+
+	// Pending requests are cancelled.
+	if (state->ring_fd > 0)
+		close(state->ring_fd);
+
+	free(state->armed);
+
+	memset(state, 0, sizeof(*state));
+}
+
+const struct waiter_data waiter_io_uring = {
+	.ops = {
+		.prepare	= io_uring_prepare,
+		.wait_event	= io_uring_wait_event,
+		.release	= io_uring_release,
+	},
+	.private_size = sizeof(struct io_uring_state),
+};
@@ -8,6 +8,8 @@
 
 #include "waiter.h"
 
+#include "aconfig.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -19,6 +21,7 @@ static const char *const waiter_type_labels[] = {
 	[WAITER_TYPE_POLL] = "poll",
 	[WAITER_TYPE_SELECT] = "select",
 	[WAITER_TYPE_EPOLL] = "epoll",
+	[WAITER_TYPE_IO_URING] = "io_uring",
 };
 
 enum waiter_type waiter_type_from_label(const char *label)
@@ -48,6 +51,9 @@ int waiter_context_init(struct waiter_context *waiter,
 		{WAITER_TYPE_POLL,	&waiter_poll},
 		{WAITER_TYPE_SELECT,	&waiter_select},
 		{WAITER_TYPE_EPOLL,	&waiter_epoll},
+#if HAVE_IO_URING
+		{WAITER_TYPE_IO_URING,	&waiter_io_uring},
+#endif
 	};
 	int i;
 
@@ -16,6 +16,7 @@ enum waiter_type {
 	WAITER_TYPE_POLL,
 	WAITER_TYPE_SELECT,
 	WAITER_TYPE_EPOLL,
+	WAITER_TYPE_IO_URING,
 	WAITER_TYPE_COUNT,
 };
 
@@ -57,5 +58,6 @@ struct waiter_data {
 extern const struct waiter_data waiter_poll;
 extern const struct waiter_data waiter_select;
 extern const struct waiter_data waiter_epoll;
+extern const struct waiter_data waiter_io_uring;
 
 #endif
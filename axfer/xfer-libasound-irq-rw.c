@@ -54,13 +54,56 @@ static int wait_for_avail(struct libasound_state *state)
 	return 0;
 }
 
+static int read_to_cache(struct libasound_state *state,
+			 struct rw_closure *closure, unsigned int avail_count)
+{
+	snd_pcm_sframes_t handled_frame_count;
+	unsigned int frame_count;
+	unsigned int cached_count = 0;
+	void *buf;
+
+	// The free space in the cache can wrap around the end of buffer.
+	while (avail_count > 0) {
+		buf = frame_cache_get_write_span(&closure->cache, &frame_count);
+		if (frame_count == 0)
+			break;
+		if (frame_count > avail_count)
+			frame_count = avail_count;
+
+		// Execute read operation according to the shape of buffer.
+		// These operations automatically start the substream.
+		if (closure->access == SND_PCM_ACCESS_RW_INTERLEAVED) {
+			handled_frame_count = snd_pcm_readi(state->handle, buf,
+							    frame_count);
+		} else {
+			handled_frame_count = snd_pcm_readn(state->handle, buf,
+							    frame_count);
+		}
+		if (handled_frame_count < 0) {
+			// Process cached frames at first. The error is
+			// reported again at next iteration.
+			if (cached_count > 0)
+				break;
+			return handled_frame_count;
+		}
+		frame_cache_increase_count(&closure->cache, handled_frame_count);
+		cached_count += handled_frame_count;
+		avail_count -= handled_frame_count;
+
+		if (handled_frame_count < frame_count)
+			break;
+	}
+
+	return 0;
+}
+
 static int read_frames(struct libasound_state *state, unsigned int *frame_count,
 		       unsigned int avail_count, struct mapper_context *mapper,
 		       struct container_context *cntrs)
 {
 	struct rw_closure *closure = state->private_data;
-	snd_pcm_sframes_t handled_frame_count;
 	unsigned int consumed_count;
+	void *buf;
 	int err;
 
 	// Trim according up to expected frame count.
@@ -71,29 +114,19 @@ static int read_frames(struct libasound_state *state, unsigned int *frame_count,
 	if (avail_count > frame_cache_get_count(&closure->cache)) {
 		avail_count -= frame_cache_get_count(&closure->cache);
 
-		// Execute write operation according to the shape of buffer.
-		// These operations automatically start the substream.
-		if (closure->access == SND_PCM_ACCESS_RW_INTERLEAVED) {
-			handled_frame_count = snd_pcm_readi(state->handle,
-							closure->cache.buf_ptr,
-							avail_count);
-		} else {
-			handled_frame_count = snd_pcm_readn(state->handle,
-							closure->cache.buf_ptr,
-							avail_count);
-		}
-		if (handled_frame_count < 0) {
-			err = handled_frame_count;
+		err = read_to_cache(state, closure, avail_count);
+		if (err < 0)
 			return err;
-		}
-		frame_cache_increase_count(&closure->cache, handled_frame_count);
 		avail_count = frame_cache_get_count(&closure->cache);
 	}
 
-	// Write out to file descriptors.
-	consumed_count = avail_count;
-	err = mapper_context_process_frames(mapper, closure->cache.buf,
-					    &consumed_count, cntrs);
+	// Write out to file descriptors. The rest of span beyond the end of
+	// buffer is handled in next iteration.
+	buf = frame_cache_get_read_span(&closure->cache, &consumed_count);
+	if (consumed_count > avail_count)
+		consumed_count = avail_count;
+	err = mapper_context_process_frames(mapper, buf, &consumed_count,
+					    cntrs);
 	if (err < 0)
 		return err;
 
@@ -198,14 +231,60 @@ error:
 	return err;
 }
 
+static int write_from_cache(struct libasound_state *state,
+			    struct rw_closure *closure,
+			    unsigned int avail_count,
+			    unsigned int *consumed_count)
+{
+	snd_pcm_sframes_t handled_frame_count;
+	unsigned int frame_count;
+	void *buf;
+
+	*consumed_count = 0;
+
+	// The cached frames can wrap around the end of buffer.
+	while (avail_count > 0) {
+		buf = frame_cache_get_read_span(&closure->cache, &frame_count);
+		if (frame_count == 0)
+			break;
+		if (frame_count > avail_count)
+			frame_count = avail_count;
+
+		// Execute write operation according to the shape of buffer.
+		// These operations automatically start the stream.
+		if (closure->access == SND_PCM_ACCESS_RW_INTERLEAVED) {
+			handled_frame_count = snd_pcm_writei(state->handle, buf,
+							     frame_count);
+		} else {
+			handled_frame_count = snd_pcm_writen(state->handle, buf,
+							     frame_count);
+		}
+		if (handled_frame_count < 0) {
+			// The error is reported again at next iteration.
+			if (*consumed_count > 0)
+				break;
+			return handled_frame_count;
+		}
+		frame_cache_reduce(&closure->cache, handled_frame_count);
+		*consumed_count += handled_frame_count;
+		avail_count -= handled_frame_count;
+
+		if (handled_frame_count < frame_count)
+			break;
+	}
+
+	return 0;
+}
+
 static int write_frames(struct libasound_state *state,
 			unsigned int *frame_count, unsigned int avail_count,
 			struct mapper_context *mapper,
 			struct container_context *cntrs)
 {
 	struct rw_closure *closure = state->private_data;
-	snd_pcm_uframes_t consumed_count;
-	snd_pcm_sframes_t handled_frame_count;
+	unsigned int consumed_count;
+	unsigned int span_count;
+	void *buf;
 	int err;
 
 	// Trim according up to expected frame count.
@@ -216,32 +295,22 @@ static int write_frames(struct libasound_state *state,
 	if (avail_count > frame_cache_get_count(&closure->cache)) {
 		avail_count -= frame_cache_get_count(&closure->cache);
 
-		// Read frames to transfer.
-		err = mapper_context_process_frames(mapper,
-				closure->cache.buf_ptr, &avail_count, cntrs);
+		// Read frames to transfer. The rest of free space beyond the
+		// end of buffer is filled in next iteration.
+		buf = frame_cache_get_write_span(&closure->cache, &span_count);
+		if (avail_count > span_count)
+			avail_count = span_count;
+		err = mapper_context_process_frames(mapper, buf, &avail_count,
+						    cntrs);
 		if (err < 0)
 			return err;
 		frame_cache_increase_count(&closure->cache, avail_count);
 		avail_count = frame_cache_get_count(&closure->cache);
 	}
 
-	// Execute write operation according to the shape of buffer. These
-	// operations automatically start the stream.
-	consumed_count = avail_count;
-	if (closure->access == SND_PCM_ACCESS_RW_INTERLEAVED) {
-		handled_frame_count = snd_pcm_writei(state->handle,
-					closure->cache.buf, consumed_count);
-	} else {
-		handled_frame_count = snd_pcm_writen(state->handle,
-					closure->cache.buf, consumed_count);
-	}
-	if (handled_frame_count < 0) {
-		err = handled_frame_count;
+	err = write_from_cache(state, closure, avail_count, &consumed_count);
+	if (err < 0)
 		return err;
-	}
-
-	consumed_count = handled_frame_count;
-	frame_cache_reduce(&closure->cache, consumed_count);
 
 	*frame_count = consumed_count;
 
@@ -423,6 +492,14 @@ static int irq_rw_process_frames(struct libasound_state *state,
 	return closure->process_frames(state, status, frame_count, mapper, cntrs);
 }
 
+// For capture, frames are read ahead from the substream.
+static unsigned int irq_rw_cached_count(struct libasound_state *state)
+{
+	struct rw_closure *closure = state->private_data;
+
+	return frame_cache_get_count(&closure->cache);
+}
+
 static void irq_rw_post_process(struct libasound_state *state)
 {
 	struct rw_closure *closure = state->private_data;
@@ -434,5 +511,6 @@ const struct xfer_libasound_ops xfer_libasound_irq_rw_ops = {
 	.pre_process	= irq_rw_pre_process,
 	.process_frames	= irq_rw_process_frames,
 	.post_process	= irq_rw_post_process,
+	.cached_count	= irq_rw_cached_count,
 	.private_size	= sizeof(struct rw_closure),
 };
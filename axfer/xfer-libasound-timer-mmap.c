@@ -9,6 +9,37 @@
 #include "xfer-libasound.h"
 #include "misc.h"
 
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/timerfd.h>
+
+// The drift of audio clock beyond this is regarded as discontinuity of audio
+// timestamp; e.g. recovery from XRUN.
+#define MAX_DRIFT_PPM		2000
+// Hardware pointer is updated in granularity of DMA burst, thus the drift is
+// measured in long interval.
+#define DRIFT_INTERVAL_NSEC	100000000ull
+
+// For adaptive scheduling model. The next wakeup is programmed just before
+// the buffer reaches the level to refill or drain, according to position of
+// hardware pointer predicted by audio timestamp.
+struct adaptive_sched {
+	int timer_fd;
+
+	// Frames left in the buffer at wakeup to absorb the error of prediction.
+	snd_pcm_uframes_t margin;
+	snd_pcm_uframes_t min_margin;
+	snd_pcm_uframes_t max_margin;
+
+	// The difference of audio clock from system clock.
+	int drift_ppm;
+	uint64_t audio_nsec;
+	uint64_t system_nsec;
+
+	uint64_t wakeup_count;
+};
+
 struct map_layout {
 	snd_pcm_status_t *status;
 	bool need_forward_or_rewind;
@@ -17,8 +48,49 @@ struct map_layout {
 	unsigned int frames_per_second;
 	unsigned int samples_per_frame;
 	unsigned int frames_per_buffer;
+
+	bool adaptive;
+	struct adaptive_sched sched;
 };
 
+static int prepare_adaptive_sched(struct libasound_state *state)
+{
+	struct map_layout *layout = state->private_data;
+	struct adaptive_sched *sched = &layout->sched;
+	int err;
+
+	// Audio timestamp and system timestamp are reported in status data with
+	// the same clock as the timer.
+	err = snd_pcm_sw_params_set_tstamp_mode(state->handle, state->sw_params,
+						SND_PCM_TSTAMP_ENABLE);
+	if (err < 0)
+		return err;
+	err = snd_pcm_sw_params_set_tstamp_type(state->handle, state->sw_params,
+						SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	if (err < 0)
+		return err;
+
+	sched->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (sched->timer_fd < 0)
+		return -errno;
+
+	// Start with a quarter of buffer, then shrink it down to 1 msec while
+	// waking up as expected.
+	sched->max_margin = layout->frames_per_buffer / 2;
+	sched->min_margin = layout->frames_per_second / 1000;
+	if (sched->min_margin == 0)
+		sched->min_margin = 1;
+	if (sched->min_margin > sched->max_margin)
+		sched->min_margin = sched->max_margin;
+	sched->margin = layout->frames_per_buffer / 4;
+	if (sched->margin < sched->min_margin)
+		sched->margin = sched->min_margin;
+
+	layout->adaptive = true;
+
+	return 0;
+}
+
 static int timer_mmap_pre_process(struct libasound_state *state)
 {
 	struct map_layout *layout = state->private_data;
@@ -29,6 +101,9 @@ static int timer_mmap_pre_process(struct libasound_state *state)
 	int i;
 	int err;
 
+	// Not available till adaptive scheduling model is prepared.
+	layout->sched.timer_fd = -1;
+
 	// This parameter, 'period event', is a software feature in alsa-lib.
 	// This switch a handler in 'hw' PCM plugin from irq-based one to
 	// timer-based one. This handler has two file descriptors for
@@ -70,6 +145,12 @@ static int timer_mmap_pre_process(struct libasound_state *state)
 			return err;
 	}
 
+	if (state->sched_model == SCHED_MODEL_ADAPTIVE) {
+		err = prepare_adaptive_sched(state);
+		if (err < 0)
+			return err;
+	}
+
 	if (state->verbose) {
 		const snd_pcm_channel_area_t *areas;
 		err = snd_pcm_mmap_begin(state->handle, &areas, &frame_offset,
@@ -216,6 +297,194 @@ static int timer_mmap_process_frames(struct libasound_state *state,
 	return 0;
 }
 
+static uint64_t timespec_to_nsec(const snd_htimestamp_t *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static uint64_t get_monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return timespec_to_nsec(&ts);
+}
+
+// Compare elapsed time in audio timestamp and system timestamp of status data.
+static void update_drift(struct adaptive_sched *sched,
+			 snd_pcm_status_t *status)
+{
+	snd_htimestamp_t ts;
+	uint64_t audio_nsec;
+	uint64_t system_nsec;
+	int64_t audio_delta;
+	int64_t system_delta;
+	int64_t ppm;
+
+	snd_pcm_status_get_audio_htstamp(status, &ts);
+	audio_nsec = timespec_to_nsec(&ts);
+	snd_pcm_status_get_htstamp(status, &ts);
+	system_nsec = timespec_to_nsec(&ts);
+	if (audio_nsec == 0 || system_nsec == 0)
+		return;
+
+	if (sched->system_nsec > 0) {
+		system_delta = system_nsec - sched->system_nsec;
+		if (system_delta < DRIFT_INTERVAL_NSEC)
+			return;
+		audio_delta = audio_nsec - sched->audio_nsec;
+
+		ppm = (audio_delta - system_delta) * 1000000 / system_delta;
+		if (ppm >= -MAX_DRIFT_PPM && ppm <= MAX_DRIFT_PPM)
+			sched->drift_ppm = (sched->drift_ppm * 7 + ppm) / 8;
+	}
+
+	sched->audio_nsec = audio_nsec;
+	sched->system_nsec = system_nsec;
+}
+
+// Sleep till the given number of frames is transferred by hardware since the
+// status data was retrieved.
+static int wait_for_frames(struct libasound_state *state,
+			   snd_pcm_uframes_t frame_count, uint64_t *deadline)
+{
+	struct map_layout *layout = state->private_data;
+	struct adaptive_sched *sched = &layout->sched;
+	struct itimerspec its = {0};
+	snd_htimestamp_t ts;
+	uint64_t expirations;
+	uint64_t now;
+	uint64_t base;
+	uint64_t nsec;
+
+	nsec = (uint64_t)frame_count * 1000000000ull / layout->frames_per_second;
+	nsec = nsec * 1000000 / (1000000 + sched->drift_ppm);
+
+	// The timestamp is not in the clock for the timer in old kernels.
+	now = get_monotonic_nsec();
+	snd_pcm_status_get_htstamp(layout->status, &ts);
+	base = timespec_to_nsec(&ts);
+	if (base > now || now - base > 1000000000ull)
+		base = now;
+
+	*deadline = base + nsec;
+	its.it_value.tv_sec = *deadline / 1000000000ull;
+	its.it_value.tv_nsec = *deadline % 1000000000ull;
+	if (timerfd_settime(sched->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -errno;
+
+	if (read(sched->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return -errno;
+	++sched->wakeup_count;
+
+	return 0;
+}
+
+// When woken up after consuming more than half of margin, double it. While
+// waking up as expected, shrink it gradually so that more frames are handled
+// in each wakeup.
+static void adjust_margin(struct adaptive_sched *sched,
+			  snd_pcm_uframes_t threshold, snd_pcm_uframes_t avail)
+{
+	if (avail > threshold + sched->margin / 2) {
+		sched->margin *= 2;
+		if (sched->margin > sched->max_margin)
+			sched->margin = sched->max_margin;
+	} else {
+		sched->margin -= sched->margin / 16;
+		if (sched->margin < sched->min_margin)
+			sched->margin = sched->min_margin;
+	}
+}
+
+static int adaptive_process_frames(struct libasound_state *state,
+				   unsigned int *frame_count,
+				   struct mapper_context *mapper,
+				   struct container_context *cntrs)
+{
+	struct map_layout *layout = state->private_data;
+	struct adaptive_sched *sched = &layout->sched;
+	snd_pcm_uframes_t threshold;
+	snd_pcm_sframes_t avail;
+	unsigned int total_count;
+	int err;
+
+	// The status data is retrieved by caller just before.
+	update_drift(sched, layout->status);
+	avail = snd_pcm_status_get_avail(layout->status);
+
+	// For playback, wake up when the queued frames decrease to the margin.
+	// For capture, wake up when the captured frames increase to the margin
+	// before the end of buffer.
+	threshold = layout->frames_per_buffer - sched->margin;
+	if (avail < threshold) {
+		uint64_t deadline;
+
+		err = wait_for_frames(state, threshold - avail, &deadline);
+		if (err < 0)
+			return err;
+
+		if (state->histogram) {
+			uint64_t now = get_monotonic_nsec();
+
+			histogram_context_record(state->histogram,
+					HISTOGRAM_TYPE_WAKEUP_LATENCY,
+					now > deadline ? now - deadline : 0);
+		}
+	}
+
+	avail = snd_pcm_avail(state->handle);
+	if (avail < 0)
+		return (int)avail;
+	if (state->histogram) {
+		histogram_context_record(state->histogram, HISTOGRAM_TYPE_AVAIL,
+					 avail);
+	}
+	adjust_margin(sched, threshold, avail);
+
+	// Process available frames at once, even if they are across the end
+	// of buffer.
+	total_count = 0;
+	while (total_count < *frame_count && avail > 0) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t frame_offset;
+		snd_pcm_uframes_t avail_count;
+		snd_pcm_sframes_t consumed_count;
+		unsigned int count;
+
+		avail_count = avail;
+		if (avail_count > *frame_count - total_count)
+			avail_count = *frame_count - total_count;
+		err = snd_pcm_mmap_begin(state->handle, &areas, &frame_offset,
+					 &avail_count);
+		if (err < 0)
+			return err;
+		if (avail_count == 0)
+			break;
+
+		count = avail_count;
+		err = mapper_context_process_frames(mapper,
+				get_buffer(state, areas, frame_offset),
+				&count, cntrs);
+		if (err < 0)
+			return err;
+
+		consumed_count = snd_pcm_mmap_commit(state->handle,
+						     frame_offset, count);
+		if (consumed_count < 0)
+			return (int)consumed_count;
+
+		total_count += consumed_count;
+		avail -= consumed_count;
+		if (consumed_count < avail_count)
+			break;
+	}
+	*frame_count = total_count;
+
+	return 0;
+}
+
 static int forward_appl_ptr(struct libasound_state *state)
 {
 	struct map_layout *layout = state->private_data;
@@ -273,8 +542,13 @@ static int timer_mmap_r_process_frames(struct libasound_state *state,
 			layout->need_forward_or_rewind = false;
 		}
 
-		err = timer_mmap_process_frames(state, frame_count, mapper,
-						cntrs);
+		if (layout->adaptive) {
+			err = adaptive_process_frames(state, frame_count,
+						      mapper, cntrs);
+		} else {
+			err = timer_mmap_process_frames(state, frame_count,
+							mapper, cntrs);
+		}
 		if (err < 0)
 			goto error;
 	} else {
@@ -398,8 +672,13 @@ static int timer_mmap_w_process_frames(struct libasound_state *state,
 			layout->need_forward_or_rewind = false;
 		}
 
-		err = timer_mmap_process_frames(state, frame_count, mapper,
-						cntrs);
+		if (layout->adaptive) {
+			err = adaptive_process_frames(state, frame_count,
+						      mapper, cntrs);
+		} else {
+			err = timer_mmap_process_frames(state, frame_count,
+							mapper, cntrs);
+		}
 		if (err < 0)
 			goto error;
 	} else {
@@ -439,6 +718,23 @@ static void timer_mmap_post_process(struct libasound_state *state)
 	if (layout->vector)
 		free(layout->vector);
 	layout->vector = NULL;
+
+	if (layout->adaptive) {
+		struct adaptive_sched *sched = &layout->sched;
+
+		if (state->verbose) {
+			logging(state, "adaptive scheduling:\n");
+			logging(state, "  wakeups: %" PRIu64 "\n",
+				sched->wakeup_count);
+			logging(state, "  margin: %lu\n", sched->margin);
+			logging(state, "  drift: %d ppm\n", sched->drift_ppm);
+		}
+
+		if (sched->timer_fd >= 0)
+			close(sched->timer_fd);
+		sched->timer_fd = -1;
+		layout->adaptive = false;
+	}
 }
 
 const struct xfer_libasound_ops xfer_libasound_timer_mmap_w_ops = {
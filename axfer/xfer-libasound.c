@@ -6,12 +6,20 @@
 //
 // Licensed under the terms of the GNU General Public License, version 2.
 
+#define _GNU_SOURCE
 #include "xfer-libasound.h"
 #include "misc.h"
 
+#include <sched.h>
+#include <sys/mman.h>
+
+// The size of stack touched in advance to avoid page faults.
+#define PREFAULT_STACK_SIZE	(64 * 1024)
+
 static const char *const sched_model_labels [] = {
 	[SCHED_MODEL_IRQ] = "irq",
 	[SCHED_MODEL_TIMER] = "timer",
+	[SCHED_MODEL_ADAPTIVE] = "adaptive",
 };
 
 enum no_short_opts {
@@ -24,6 +32,9 @@ enum no_short_opts {
 	OPT_DISABLE_CHANNELS,
 	OPT_DISABLE_FORMAT,
 	OPT_DISABLE_SOFTVOL,
+	OPT_SCHED_PRIORITY,
+	OPT_CPU_AFFINITY,
+	OPT_LOCK_MEMORY,
 	OPT_FATAL_ERRORS,
 	OPT_TEST_NOWAIT,
 	// Obsoleted.
@@ -50,6 +61,10 @@ static const struct option l_opts[] = {
 	{"disable-channels",	0, 0, OPT_DISABLE_CHANNELS},
 	{"disable-format",	0, 0, OPT_DISABLE_FORMAT},
 	{"disable-softvol",	0, 0, OPT_DISABLE_SOFTVOL},
+	// For the process in realtime.
+	{"sched-priority",	1, 0, OPT_SCHED_PRIORITY}, // to SCHED_FIFO
+	{"cpu-affinity",	1, 0, OPT_CPU_AFFINITY},
+	{"mlock",		0, 0, OPT_LOCK_MEMORY},
 	// For debugging.
 	{"fatal-errors",	0, 0, OPT_FATAL_ERRORS},
 	{"test-nowait",		0, 0, OPT_TEST_NOWAIT},
@@ -82,9 +97,11 @@ static int xfer_libasound_parse_opt(struct xfer_context *xfer, int key,
 	struct libasound_state *state = xfer->private_data;
 	int err = 0;
 
-	if (key == 'D')
+	if (key == 'D') {
+		// The last one is used when given several times.
+		free(state->node_literal);
 		state->node_literal = arg_duplicate_string(optarg, &err);
-	else if (key == 'N')
+	} else if (key == 'N')
 		state->nonblock = true;
 	else if (key == 'M')
 		state->mmap = true;
@@ -114,6 +131,13 @@ static int xfer_libasound_parse_opt(struct xfer_context *xfer, int key,
 		state->no_auto_format = true;
 	else if (key == OPT_DISABLE_SOFTVOL)
 		state->no_softvol = true;
+	else if (key == OPT_SCHED_PRIORITY)
+		state->sched_priority = arg_parse_decimal_num(optarg, &err);
+	else if (key == OPT_CPU_AFFINITY) {
+		free(state->cpu_affinity_literal);
+		state->cpu_affinity_literal = arg_duplicate_string(optarg, &err);
+	} else if (key == OPT_LOCK_MEMORY)
+		state->lock_memory = true;
 	else if (key == 'm' ||
 		 key == OPT_TEST_POSITION ||
 		 key == OPT_TEST_COEF)
@@ -128,6 +152,66 @@ static int xfer_libasound_parse_opt(struct xfer_context *xfer, int key,
 	return err;
 }
 
+// Parse a list of CPUs such as '0,2-3'.
+static int parse_cpu_affinity(const char *literal, cpu_set_t *set)
+{
+	const char *pos = literal;
+	char *end;
+	long first;
+	long last;
+
+	CPU_ZERO(set);
+
+	while (*pos != '\0') {
+		first = strtol(pos, &end, 10);
+		if (end == pos || first < 0)
+			return -EINVAL;
+		last = first;
+
+		if (*end == '-') {
+			pos = end + 1;
+			last = strtol(pos, &end, 10);
+			if (end == pos || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			++end;
+		else if (*end != '\0')
+			return -EINVAL;
+		pos = end;
+	}
+
+	if (CPU_COUNT(set) == 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int validate_sched_priority(struct libasound_state *state)
+{
+	int val;
+
+	val = sched_get_priority_max(SCHED_FIFO);
+	if (val < 0)
+		return -errno;
+	if (state->sched_priority > val)
+		return -EINVAL;
+
+	val = sched_get_priority_min(SCHED_FIFO);
+	if (val < 0)
+		return -errno;
+	if (state->sched_priority < val)
+		return -EINVAL;
+
+	return 0;
+}
+
 int xfer_libasound_validate_opts(struct xfer_context *xfer)
 {
 	struct libasound_state *state = xfer->private_data;
@@ -157,6 +241,26 @@ int xfer_libasound_validate_opts(struct xfer_context *xfer)
 		}
 	}
 
+	if (state->sched_priority > 0) {
+		err = validate_sched_priority(state);
+		if (err < 0) {
+			fprintf(stderr,
+				"A priority for SCHED_FIFO is out of range.\n");
+			return err;
+		}
+	}
+
+	if (state->cpu_affinity_literal != NULL) {
+		cpu_set_t set;
+
+		err = parse_cpu_affinity(state->cpu_affinity_literal, &set);
+		if (err < 0) {
+			fprintf(stderr, "Wrong list of CPUs: %s\n",
+				state->cpu_affinity_literal);
+			return err;
+		}
+	}
+
 	if (state->msec_per_period > 0 && state->msec_per_buffer > 0) {
 		if (state->msec_per_period > state->msec_per_buffer) {
 			state->msec_per_period = state->msec_per_buffer;
@@ -177,6 +281,10 @@ int xfer_libasound_validate_opts(struct xfer_context *xfer)
 			state->sched_model = SCHED_MODEL_TIMER;
 			state->mmap = true;
 			state->nonblock = true;
+		} else if (!strcmp(state->sched_model_literal, "adaptive")) {
+			state->sched_model = SCHED_MODEL_ADAPTIVE;
+			state->mmap = true;
+			state->nonblock = true;
 		}
 	}
 
@@ -290,7 +398,7 @@ static int open_handle(struct xfer_context *xfer)
 	if (err < 0)
 		return err;
 
-	if (state->sched_model == SCHED_MODEL_TIMER) {
+	if (state->sched_model != SCHED_MODEL_IRQ) {
 		err = disable_period_wakeup(state);
 		if (err < 0)
 			return err;
@@ -340,6 +448,30 @@ static int prepare_waiter(struct libasound_state *state)
 	return waiter_context_prepare(state->waiter);
 }
 
+// The frames beyond avail_min tell how late the process is woken up after
+// hardware interrupt.
+static void record_wakeup(struct libasound_state *state)
+{
+	snd_pcm_sframes_t avail;
+	uint64_t latency = 0;
+
+	avail = snd_pcm_avail_update(state->handle);
+	if (avail < 0)
+		return;
+	histogram_context_record(state->histogram, HISTOGRAM_TYPE_AVAIL, avail);
+
+	// In timer-based scheduling model, the process is woken up by timeout.
+	if (state->sched_model != SCHED_MODEL_IRQ)
+		return;
+
+	if (avail > state->frames_for_avail_min) {
+		latency = (uint64_t)(avail - state->frames_for_avail_min) *
+			  1000000000ull / state->frames_per_second;
+	}
+	histogram_context_record(state->histogram,
+				 HISTOGRAM_TYPE_WAKEUP_LATENCY, latency);
+}
+
 int xfer_libasound_wait_event(struct libasound_state *state, int timeout_msec,
 			      unsigned short *revents)
 {
@@ -372,6 +504,9 @@ int xfer_libasound_wait_event(struct libasound_state *state, int timeout_msec,
 			*revents = POLLIN;
 	}
 
+	if (state->histogram)
+		record_wakeup(state);
+
 	return 0;
 }
 
@@ -639,6 +774,107 @@ static int configure_sw_params(struct libasound_state *state,
 	return snd_pcm_sw_params(state->handle, state->sw_params);
 }
 
+// Touch pages of stack in advance, so that the transfer loop doesn't cause
+// page faults.
+static void prefault_stack(void)
+{
+	volatile char buf[PREFAULT_STACK_SIZE];
+	int i;
+
+	for (i = 0; i < sizeof(buf); i += 1024)
+		buf[i] = 0;
+}
+
+// Configured before hardware parameters so that the buffers of PCM substream
+// and frame caches are allocated in NUMA node local to the CPUs.
+static int set_cpu_affinity(struct libasound_state *state)
+{
+	cpu_set_t set;
+	int err;
+
+	if (state->cpu_affinity_literal == NULL)
+		return 0;
+
+	err = parse_cpu_affinity(state->cpu_affinity_literal, &set);
+	if (err < 0)
+		return err;
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		err = -errno;
+		logging(state, "sched_setaffinity(2): %s\n", strerror(errno));
+		return err;
+	}
+
+	return 0;
+}
+
+// The pages mapped currently, including the buffers of PCM substream and frame
+// caches, are faulted and locked. The pages mapped later, e.g. windows to map
+// files and stacks of threads, are locked just when faulted, thus the
+// untouched pages don't occupy locked memory. The buffers allocated later for
+// the transmission, e.g. queues of writers and windows to map files, are
+// touched or populated when allocated.
+static int lock_memory(struct libasound_state *state)
+{
+	int err;
+
+	if (mlockall(MCL_CURRENT) < 0) {
+		err = -errno;
+		logging(state,
+			"mlockall(2): %s. See RLIMIT_MEMLOCK in getrlimit(2).\n",
+			strerror(errno));
+		return err;
+	}
+
+#ifdef MCL_ONFAULT
+	// Linux kernel v4.4 or later supports it.
+	if (mlockall(MCL_FUTURE | MCL_ONFAULT) < 0 && errno != EINVAL) {
+		err = -errno;
+		logging(state, "mlockall(2): %s.\n", strerror(errno));
+		return err;
+	}
+#endif
+
+	prefault_stack();
+
+	return 0;
+}
+
+static int prepare_realtime(struct libasound_state *state)
+{
+	struct sched_param param = {0};
+	int err;
+
+	if (state->lock_memory) {
+		err = lock_memory(state);
+		if (err < 0)
+			return err;
+	}
+
+	if (state->sched_priority > 0) {
+		param.sched_priority = state->sched_priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			err = -errno;
+			logging(state,
+				"sched_setscheduler(2): %s. See RLIMIT_RTPRIO "
+				"in getrlimit(2).\n", strerror(errno));
+			return err;
+		}
+	}
+
+	if (state->verbose) {
+		logging(state, "Realtime:\n");
+		logging(state, "  cpu affinity: %s\n",
+			state->cpu_affinity_literal ?
+			state->cpu_affinity_literal : "none");
+		logging(state, "  memory lock: %s\n",
+			state->lock_memory ? "yes" : "no");
+		logging(state, "  sched priority: %u\n",
+			state->sched_priority);
+	}
+
+	return 0;
+}
+
 static int xfer_libasound_pre_process(struct xfer_context *xfer,
 				      snd_pcm_format_t *format,
 				      unsigned int *samples_per_frame,
@@ -650,6 +886,10 @@ static int xfer_libasound_pre_process(struct xfer_context *xfer,
 	unsigned int flag;
 	int err;
 
+	err = set_cpu_affinity(state);
+	if (err < 0)
+		return err;
+
 	err = open_handle(xfer);
 	if (err < 0)
 		return -ENXIO;
@@ -731,6 +971,15 @@ static int xfer_libasound_pre_process(struct xfer_context *xfer,
 		return err;
 	}
 
+	if (xfer->histogram) {
+		err = snd_pcm_sw_params_get_avail_min(state->sw_params,
+						&state->frames_for_avail_min);
+		if (err < 0)
+			return err;
+		state->frames_per_second = *frames_per_second;
+		state->histogram = xfer->histogram;
+	}
+
 	if (xfer->verbose > 0) {
 		snd_pcm_dump(state->handle, state->log);
 		logging(state, "Scheduling model:\n");
@@ -752,7 +1001,7 @@ static int xfer_libasound_pre_process(struct xfer_context *xfer,
 		}
 	}
 
-	return 0;
+	return prepare_realtime(state);
 }
 
 static int xfer_libasound_process_frames(struct xfer_context *xfer,
@@ -816,6 +1065,88 @@ static void xfer_libasound_pause(struct xfer_context *xfer, bool enable)
 	}
 }
 
+static int xfer_libasound_link(struct xfer_context *xfer,
+			       struct xfer_context *peer)
+{
+	struct libasound_state *state = xfer->private_data;
+	struct libasound_state *peer_state = peer->private_data;
+
+	if (state->handle == NULL || peer_state->handle == NULL)
+		return -ENXIO;
+
+	return snd_pcm_link(state->handle, peer_state->handle);
+}
+
+static int xfer_libasound_poll_descriptors_count(struct xfer_context *xfer)
+{
+	struct libasound_state *state = xfer->private_data;
+
+	if (state->handle == NULL)
+		return -ENXIO;
+
+	// The process is not woken up by hardware interrupt.
+	if (state->sched_model != SCHED_MODEL_IRQ || state->test_nowait)
+		return -ENXIO;
+
+	return snd_pcm_poll_descriptors_count(state->handle);
+}
+
+static int xfer_libasound_poll_descriptors(struct xfer_context *xfer,
+					   struct pollfd *pfds,
+					   unsigned int count)
+{
+	struct libasound_state *state = xfer->private_data;
+
+	if (state->handle == NULL)
+		return -ENXIO;
+
+	return snd_pcm_poll_descriptors(state->handle, pfds, count);
+}
+
+static int xfer_libasound_poll_revents(struct xfer_context *xfer,
+				       struct pollfd *pfds, unsigned int count,
+				       unsigned short *revents)
+{
+	struct libasound_state *state = xfer->private_data;
+
+	if (state->handle == NULL)
+		return -ENXIO;
+
+	return snd_pcm_poll_descriptors_revents(state->handle, pfds, count,
+						revents);
+}
+
+static int xfer_libasound_get_delay(struct xfer_context *xfer,
+				    snd_pcm_uframes_t *delay,
+				    struct timespec *tstamp)
+{
+	struct libasound_state *state = xfer->private_data;
+	snd_pcm_status_t *status;
+	int err;
+
+	if (state->handle == NULL)
+		return -ENXIO;
+
+	// Capture only. The available frames are not read yet.
+	if (snd_pcm_stream(state->handle) != SND_PCM_STREAM_CAPTURE)
+		return -ENXIO;
+
+	snd_pcm_status_alloca(&status);
+	err = snd_pcm_status(state->handle, status);
+	if (err < 0)
+		return err;
+	if (snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING)
+		return -EAGAIN;
+
+	*delay = snd_pcm_status_get_avail(status);
+	if (state->ops->cached_count)
+		*delay += state->ops->cached_count(state);
+
+	snd_pcm_status_get_htstamp(status, tstamp);
+
+	return 0;
+}
+
 static void xfer_libasound_post_process(struct xfer_context *xfer)
 {
 	struct libasound_state *state = xfer->private_data;
@@ -871,9 +1202,11 @@ static void xfer_libasound_destroy(struct xfer_context *xfer)
 	free(state->node_literal);
 	free(state->waiter_type_literal);
 	free(state->sched_model_literal);
+	free(state->cpu_affinity_literal);
 	state->node_literal = NULL;
 	state->waiter_type_literal = NULL;
 	state->sched_model_literal = NULL;
+	state->cpu_affinity_literal = NULL;
 
 	if (state->hw_params)
 		snd_pcm_hw_params_free(state->hw_params);
@@ -892,6 +1225,7 @@ static void xfer_libasound_help(struct xfer_context *xfer)
 	printf(
 "      [BASICS]\n"
 "        -D, --device          select node by name in coniguration space\n"
+"                              (several times for capture from devices)\n"
 "        -N, --nonblock        nonblocking mode\n"
 "        -M, --mmap            use mmap(2) for zero copying technique\n"
 "        -F, --period-time     interval between interrupts (msec unit)\n"
@@ -909,6 +1243,10 @@ static void xfer_libasound_help(struct xfer_context *xfer)
 "        --disable-channels    disable channel conversion for plug plugin\n"
 "        --disable-format      disable format conversion for plug plugin\n"
 "        --disable-softvol     disable software volume for sofvol plugin\n"
+"      [REALTIME]\n"
+"        --sched-priority      set SCHED_FIFO with given priority\n"
+"        --cpu-affinity        run on given CPUs, as a list such as '0,2-3'\n"
+"        --mlock               lock memory and fault buffers in advance\n"
 "      [DEBUG ASSISTANT]\n"
 "        --fatal-errors        finish at XRUN\n"
 "        --test-nowait         busy poll without any waiter\n"
@@ -926,6 +1264,11 @@ const struct xfer_data xfer_libasound = {
 		.pre_process	= xfer_libasound_pre_process,
 		.process_frames	= xfer_libasound_process_frames,
 		.pause		= xfer_libasound_pause,
+		.link		= xfer_libasound_link,
+		.poll_descriptors_count = xfer_libasound_poll_descriptors_count,
+		.poll_descriptors = xfer_libasound_poll_descriptors,
+		.poll_revents	= xfer_libasound_poll_revents,
+		.get_delay	= xfer_libasound_get_delay,
 		.post_process	= xfer_libasound_post_process,
 		.destroy	= xfer_libasound_destroy,
 		.help		= xfer_libasound_help,
@@ -18,6 +18,7 @@
 enum sched_model {
 	SCHED_MODEL_IRQ = 0,
 	SCHED_MODEL_TIMER,
+	SCHED_MODEL_ADAPTIVE,
 	SCHED_MODEL_COUNT,
 };
 
@@ -38,6 +39,7 @@ struct libasound_state {
 	char *node_literal;
 	char *waiter_type_literal;
 	char *sched_model_literal;
+	char *cpu_affinity_literal;
 
 	unsigned int msec_per_period;
 	unsigned int msec_per_buffer;
@@ -48,6 +50,9 @@ struct libasound_state {
 	unsigned int msec_for_start_threshold;
 	unsigned int msec_for_stop_threshold;
 
+	// For the process in realtime.
+	unsigned int sched_priority;
+
 	bool finish_at_xrun:1;
 	bool nonblock:1;
 	bool mmap:1;
@@ -56,6 +61,7 @@ struct libasound_state {
 	bool no_auto_channels:1;
 	bool no_auto_format:1;
 	bool no_softvol:1;
+	bool lock_memory:1;
 
 	bool use_waiter:1;
 
@@ -64,6 +70,11 @@ struct libasound_state {
 
 	// For scheduling type.
 	enum sched_model sched_model;
+
+	// Available when histograms are recorded.
+	struct histogram_context *histogram;
+	unsigned int frames_per_second;
+	snd_pcm_uframes_t frames_for_avail_min;
 };
 
 // For internal use in 'libasound' module.
@@ -75,6 +86,8 @@ struct xfer_libasound_ops {
 			      struct mapper_context *mapper,
 			      struct container_context *cntrs);
 	void (*post_process)(struct libasound_state *state);
+	// Optional, the number of frames kept between the substream and mapper.
+	unsigned int (*cached_count)(struct libasound_state *state);
 	unsigned int private_size;
 };
 
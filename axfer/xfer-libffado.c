@@ -38,6 +38,9 @@ struct libffado_state {
 			      struct container_context *cntrs);
 
 	struct frame_cache cache;
+	// Linear buffer for a period registered to libffado, since the cache
+	// is a ring buffer.
+	char *period_buf;
 };
 
 enum no_short_opts {
@@ -171,6 +174,48 @@ static int xfer_libffado_validate_opts(struct xfer_context *xfer)
 	return 0;
 }
 
+// Copy frames between the linear buffer and the ring of cache over two spans
+// at most.
+static void copy_to_cache(struct frame_cache *cache, const char *buf,
+			  unsigned int frame_count)
+{
+	unsigned int bytes_per_frame =
+			cache->bytes_per_sample * cache->samples_per_frame;
+
+	while (frame_count > 0) {
+		unsigned int span_count;
+		char *span;
+
+		span = frame_cache_get_write_span(cache, &span_count);
+		if (span_count > frame_count)
+			span_count = frame_count;
+		memcpy(span, buf, span_count * bytes_per_frame);
+		frame_cache_increase_count(cache, span_count);
+		buf += span_count * bytes_per_frame;
+		frame_count -= span_count;
+	}
+}
+
+static void copy_from_cache(struct frame_cache *cache, char *buf,
+			    unsigned int frame_count)
+{
+	unsigned int bytes_per_frame =
+			cache->bytes_per_sample * cache->samples_per_frame;
+
+	while (frame_count > 0) {
+		unsigned int span_count;
+		char *span;
+
+		span = frame_cache_get_read_span(cache, &span_count);
+		if (span_count > frame_count)
+			span_count = frame_count;
+		memcpy(buf, span, span_count * bytes_per_frame);
+		frame_cache_reduce(cache, span_count);
+		buf += span_count * bytes_per_frame;
+		frame_count -= span_count;
+	}
+}
+
 static int r_process_frames(struct xfer_context *xfer,
 			    unsigned int *frame_count,
 			    struct mapper_context *mapper,
@@ -180,6 +225,7 @@ static int r_process_frames(struct xfer_context *xfer,
 	unsigned int avail_count;
 	unsigned int bytes_per_frame;
 	unsigned int consumed_count;
+	void *frame_buf;
 	int err;
 
 	// Trim up to expected frame count.
@@ -192,6 +238,11 @@ static int r_process_frames(struct xfer_context *xfer,
 		int ch;
 		int pos;
 
+		// The cache has room for a period at least.
+		assert(state->cache.frames_per_cache -
+		       frame_cache_get_count(&state->cache) >=
+						state->frames_per_period);
+
 		// Register buffers.
 		pos = 0;
 		bytes_per_frame = state->cache.bytes_per_sample *
@@ -202,8 +253,7 @@ static int r_process_frames(struct xfer_context *xfer,
 			if (state->data_ch_map[ch] != ffado_stream_type_audio)
 				continue;
 
-			buf = state->cache.buf_ptr;
-			buf += ch * bytes_per_frame;
+			buf = state->period_buf + ch * bytes_per_frame;
 			if (ffado_streaming_set_capture_stream_buffer(state->handle,
 								      ch, buf))
 				return -EIO;
@@ -216,14 +266,14 @@ static int r_process_frames(struct xfer_context *xfer,
 		if (!ffado_streaming_transfer_buffers(state->handle))
 			return -EIO;
 
-		frame_cache_increase_count(&state->cache,
-					   state->frames_per_period);
+		copy_to_cache(&state->cache, state->period_buf,
+			      state->frames_per_period);
 	}
 
 	// Write out to file descriptors.
-	consumed_count = frame_cache_get_count(&state->cache);
-	err = mapper_context_process_frames(mapper, state->cache.buf,
-					    &consumed_count, cntrs);
+	frame_buf = frame_cache_get_read_span(&state->cache, &consumed_count);
+	err = mapper_context_process_frames(mapper, frame_buf, &consumed_count,
+					    cntrs);
 	if (err < 0)
 		return err;
 
@@ -241,6 +291,8 @@ static int w_process_frames(struct xfer_context *xfer,
 {
 	struct libffado_state *state = xfer->private_data;
 	unsigned int avail_count;
+	unsigned int span_count;
+	char *span;
 	int pos;
 	int ch;
 	unsigned int bytes_per_frame;
@@ -256,26 +308,35 @@ static int w_process_frames(struct xfer_context *xfer,
 	if (avail_count > frame_cache_get_count(&state->cache)) {
 		avail_count -= frame_cache_get_count(&state->cache);
 
-		err = mapper_context_process_frames(mapper, state->cache.buf_ptr,
-						    &avail_count, cntrs);
+		span = frame_cache_get_write_span(&state->cache, &span_count);
+		if (avail_count > span_count)
+			avail_count = span_count;
+		err = mapper_context_process_frames(mapper, span, &avail_count,
+						    cntrs);
 		if (err < 0)
 			return err;
 		frame_cache_increase_count(&state->cache, avail_count);
-		avail_count = state->cache.remained_count;
 	}
 
-	// Register buffers.
-	pos = 0;
+	// Fill the period with cached frames, then silence.
 	bytes_per_frame = state->cache.bytes_per_sample *
 			  state->cache.samples_per_frame;
+	consumed_count = frame_cache_get_count(&state->cache);
+	if (consumed_count > state->frames_per_period)
+		consumed_count = state->frames_per_period;
+	copy_from_cache(&state->cache, state->period_buf, consumed_count);
+	memset(state->period_buf + consumed_count * bytes_per_frame, 0,
+	       (state->frames_per_period - consumed_count) * bytes_per_frame);
+
+	// Register buffers.
+	pos = 0;
 	for (ch = 0; ch < state->data_ch_count; ++ch) {
 		char *buf;
 
 		if (state->data_ch_map[ch] != ffado_stream_type_audio)
 			continue;
 
-		buf = state->cache.buf;
-		buf += bytes_per_frame;
+		buf = state->period_buf + ch * bytes_per_frame;
 		if (ffado_streaming_set_playback_stream_buffer(state->handle,
 								ch, buf))
 			return -EIO;
@@ -287,9 +348,6 @@ static int w_process_frames(struct xfer_context *xfer,
 	// Move data on the buffer for transmission.
 	if (!ffado_streaming_transfer_buffers(state->handle))
 		return -EIO;
-	consumed_count = state->frames_per_period;
-
-	frame_cache_reduce(&state->cache, consumed_count);
 
 	*frame_count = consumed_count;
 
@@ -457,6 +515,13 @@ static int xfer_libffado_pre_process(struct xfer_context *xfer,
 	if (err < 0)
 		return err;
 
+	// The buffer of each channel starts at the offset of the channel.
+	state->period_buf = calloc(state->frames_per_period +
+				   state->data_ch_count,
+				   state->cache.bytes_per_sample * channels);
+	if (state->period_buf == NULL)
+		return -ENOMEM;
+
 	if (state->direction == FFADO_CAPTURE)
 		state->process_frames = r_process_frames;
 	else
@@ -521,6 +586,8 @@ static void xfer_libffado_post_process(struct xfer_context *xfer)
 	}
 
 	frame_cache_destroy(&state->cache);
+	free(state->period_buf);
+	state->period_buf = NULL;
 	free(state->data_ch_map);
 	state->data_ch_map = NULL;
 }
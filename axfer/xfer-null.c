@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// xfer-null.c - receive/transmit frames by an emulated PCM substream.
+//
+// Licensed under the terms of the GNU General Public License, version 2.
+
+#include "xfer.h"
+#include "misc.h"
+
+#include "frame-cache.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+
+// The emulated hardware moves its pointer per period according to a clock,
+// which is either the system monotonic clock or a virtual clock advanced
+// just by waiting for periods. The buffer of hardware is represented by the
+// frame cache.
+struct null_state {
+	snd_pcm_stream_t direction;
+
+	unsigned int frames_per_period;
+	unsigned int frames_per_buffer;
+	unsigned int jitter_usec;
+	unsigned int xrun_interval;
+	bool noninterleaved:1;
+	bool virtual_clock:1;
+	bool finish_at_xrun:1;
+	bool running:1;
+	bool xrun_pending:1;
+
+	unsigned int frames_per_second;
+	uint64_t origin_nsec;
+	uint64_t virtual_nsec;
+	uint64_t paused_nsec;
+	uint64_t hw_frames;
+	uint32_t random;
+
+	uint64_t period_count;
+	uint64_t xrun_count;
+
+	struct frame_cache cache;
+};
+
+enum no_short_opts {
+	OPT_PERIOD_SIZE = 200,
+	OPT_BUFFER_SIZE,
+	OPT_JITTER,
+	OPT_XRUN_INTERVAL,
+	OPT_NONINTERLEAVED,
+	OPT_VIRTUAL_CLOCK,
+	OPT_FATAL_ERRORS,
+};
+
+#define S_OPTS	""
+static const struct option l_opts[] = {
+	{"period-size",		1, 0, OPT_PERIOD_SIZE},
+	{"buffer-size",		1, 0, OPT_BUFFER_SIZE},
+	{"jitter",		1, 0, OPT_JITTER},
+	{"xrun-interval",	1, 0, OPT_XRUN_INTERVAL},
+	{"noninterleaved",	0, 0, OPT_NONINTERLEAVED},
+	{"virtual-clock",	0, 0, OPT_VIRTUAL_CLOCK},
+	// For debugging.
+	{"fatal-errors",	0, 0, OPT_FATAL_ERRORS},
+};
+
+static int xfer_null_init(struct xfer_context *xfer,
+			  snd_pcm_stream_t direction)
+{
+	struct null_state *state = xfer->private_data;
+
+	state->direction = direction;
+	state->random = 0x2545f491;
+
+	return 0;
+}
+
+static int xfer_null_parse_opt(struct xfer_context *xfer, int key,
+			       const char *optarg)
+{
+	struct null_state *state = xfer->private_data;
+	int err = 0;
+
+	if (key == OPT_PERIOD_SIZE)
+		state->frames_per_period = arg_parse_decimal_num(optarg, &err);
+	else if (key == OPT_BUFFER_SIZE)
+		state->frames_per_buffer = arg_parse_decimal_num(optarg, &err);
+	else if (key == OPT_JITTER)
+		state->jitter_usec = arg_parse_decimal_num(optarg, &err);
+	else if (key == OPT_XRUN_INTERVAL)
+		state->xrun_interval = arg_parse_decimal_num(optarg, &err);
+	else if (key == OPT_NONINTERLEAVED)
+		state->noninterleaved = true;
+	else if (key == OPT_VIRTUAL_CLOCK)
+		state->virtual_clock = true;
+	else if (key == OPT_FATAL_ERRORS)
+		state->finish_at_xrun = true;
+	else
+		err = -ENXIO;
+
+	return err;
+}
+
+static int xfer_null_validate_opts(struct xfer_context *xfer)
+{
+	struct null_state *state = xfer->private_data;
+
+	if (state->frames_per_period > 0 && state->frames_per_buffer > 0 &&
+	    state->frames_per_buffer < state->frames_per_period) {
+		fprintf(stderr,
+			"The size of buffer should be larger than the size of "
+			"period.\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static uint64_t get_nsec(struct null_state *state)
+{
+	struct timespec ts;
+
+	if (state->virtual_clock)
+		return state->virtual_nsec;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(struct null_state *state, uint64_t nsec)
+{
+	struct timespec ts;
+
+	if (state->virtual_clock) {
+		if (state->virtual_nsec < nsec)
+			state->virtual_nsec = nsec;
+		return;
+	}
+
+	ts.tv_sec = nsec / 1000000000ull;
+	ts.tv_nsec = nsec % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static uint32_t next_random(struct null_state *state)
+{
+	// Xorshift, enough for jitter.
+	state->random ^= state->random << 13;
+	state->random ^= state->random >> 17;
+	state->random ^= state->random << 5;
+
+	return state->random;
+}
+
+// Round up so that the hardware reaches the position at the time.
+static uint64_t frames_to_nsec(struct null_state *state, uint64_t frames)
+{
+	return (frames * 1000000000ull + state->frames_per_second - 1) /
+	       state->frames_per_second;
+}
+
+static void start_stream(struct null_state *state)
+{
+	state->origin_nsec = get_nsec(state);
+	state->hw_frames = 0;
+	state->running = true;
+}
+
+static void stop_stream(struct null_state *state)
+{
+	state->cache.head = 0;
+	state->cache.remained_count = 0;
+	state->running = false;
+	state->xrun_pending = false;
+}
+
+// Wait for the next period boundary, with random delay up to the jitter.
+static void wait_for_period(struct xfer_context *xfer)
+{
+	struct null_state *state = xfer->private_data;
+	uint64_t boundary;
+	uint64_t wakeup;
+
+	boundary = state->origin_nsec +
+		   frames_to_nsec(state,
+				  state->hw_frames + state->frames_per_period);
+	wakeup = boundary;
+	if (state->jitter_usec > 0)
+		wakeup += (next_random(state) % state->jitter_usec) * 1000ull;
+
+	sleep_until(state, wakeup);
+
+	if (xfer->histogram) {
+		histogram_context_record(xfer->histogram,
+					 HISTOGRAM_TYPE_WAKEUP_LATENCY,
+					 get_nsec(state) - boundary);
+	}
+}
+
+// Move the pointer of hardware by periods elapsed till now. Return -EPIPE at
+// XRUN, either injected or caused by lazy wakeup. The injected XRUN is
+// reported at the update following the one to cross a multiple of the
+// interval, so that frames are transferred between XRUNs at any interval.
+static int update_hw_ptr(struct xfer_context *xfer)
+{
+	struct null_state *state = xfer->private_data;
+	struct frame_cache *cache = &state->cache;
+	uint64_t elapsed;
+	uint64_t hw_frames;
+	uint64_t periods;
+	unsigned int delta;
+	unsigned int avail;
+	unsigned int count;
+
+	if (state->xrun_pending) {
+		state->xrun_pending = false;
+		return -EPIPE;
+	}
+
+	elapsed = get_nsec(state) - state->origin_nsec;
+	hw_frames = elapsed * state->frames_per_second / 1000000000ull;
+	hw_frames -= hw_frames % state->frames_per_period;
+	if (hw_frames <= state->hw_frames)
+		return 0;
+
+	periods = (hw_frames - state->hw_frames) / state->frames_per_period;
+	if (state->xrun_interval > 0 &&
+	    (state->period_count + periods) / state->xrun_interval !=
+				state->period_count / state->xrun_interval)
+		state->xrun_pending = true;
+	state->period_count += periods;
+
+	if (hw_frames - state->hw_frames > state->frames_per_buffer)
+		return -EPIPE;
+	delta = hw_frames - state->hw_frames;
+	state->hw_frames = hw_frames;
+
+	if (state->direction == SND_PCM_STREAM_CAPTURE) {
+		// The frames in the buffer keep silence since mapper never
+		// changes them.
+		avail = cache->frames_per_cache - frame_cache_get_count(cache);
+		if (delta > avail)
+			return -EPIPE;
+		frame_cache_increase_count(cache, delta);
+		count = frame_cache_get_count(cache);
+	} else {
+		avail = frame_cache_get_count(cache);
+		if (delta > avail)
+			return -EPIPE;
+		frame_cache_reduce(cache, delta);
+		count = cache->frames_per_cache - frame_cache_get_count(cache);
+	}
+
+	if (xfer->histogram) {
+		histogram_context_record(xfer->histogram, HISTOGRAM_TYPE_AVAIL,
+					 count);
+	}
+
+	return 0;
+}
+
+static int r_process_frames(struct xfer_context *xfer,
+			    unsigned int *frame_count,
+			    struct mapper_context *mapper,
+			    struct container_context *cntrs)
+{
+	struct null_state *state = xfer->private_data;
+	unsigned int avail_count;
+	void *frame_buf;
+	int err;
+
+	if (!state->running)
+		start_stream(state);
+
+	if (frame_cache_get_count(&state->cache) == 0)
+		wait_for_period(xfer);
+
+	err = update_hw_ptr(xfer);
+	if (err < 0)
+		return err;
+
+	frame_buf = frame_cache_get_read_span(&state->cache, &avail_count);
+	if (*frame_count < avail_count)
+		avail_count = *frame_count;
+
+	err = mapper_context_process_frames(mapper, frame_buf, &avail_count,
+					    cntrs);
+	if (err < 0)
+		return err;
+
+	frame_cache_reduce(&state->cache, avail_count);
+
+	*frame_count = avail_count;
+
+	return 0;
+}
+
+static int w_process_frames(struct xfer_context *xfer,
+			    unsigned int *frame_count,
+			    struct mapper_context *mapper,
+			    struct container_context *cntrs)
+{
+	struct null_state *state = xfer->private_data;
+	struct frame_cache *cache = &state->cache;
+	unsigned int avail_count;
+	void *frame_buf;
+	int err;
+
+	if (state->running) {
+		if (frame_cache_get_count(cache) == cache->frames_per_cache)
+			wait_for_period(xfer);
+
+		err = update_hw_ptr(xfer);
+		if (err < 0)
+			return err;
+	}
+
+	frame_buf = frame_cache_get_write_span(cache, &avail_count);
+	if (*frame_count < avail_count)
+		avail_count = *frame_count;
+
+	err = mapper_context_process_frames(mapper, frame_buf, &avail_count,
+					    cntrs);
+	if (err < 0)
+		return err;
+
+	frame_cache_increase_count(cache, avail_count);
+
+	// Start when the buffer is filled, like start threshold of libasound
+	// with its default value.
+	if (!state->running &&
+	    frame_cache_get_count(cache) == cache->frames_per_cache)
+		start_stream(state);
+
+	*frame_count = avail_count;
+
+	return 0;
+}
+
+static int xfer_null_pre_process(struct xfer_context *xfer,
+				 snd_pcm_format_t *format,
+				 unsigned int *samples_per_frame,
+				 unsigned int *frames_per_second,
+				 snd_pcm_access_t *access,
+				 snd_pcm_uframes_t *frames_per_buffer)
+{
+	struct null_state *state = xfer->private_data;
+	struct frame_cache *cache = &state->cache;
+	unsigned int bytes_per_sample;
+	int err;
+
+	// Any parameter is acceptable for emulated hardware.
+	if (*format == SND_PCM_FORMAT_UNKNOWN)
+		*format = SND_PCM_FORMAT_S16_LE;
+	if (*samples_per_frame == 0)
+		*samples_per_frame = 2;
+	if (*frames_per_second == 0)
+		*frames_per_second = 48000;
+	state->frames_per_second = *frames_per_second;
+
+	bytes_per_sample = snd_pcm_format_physical_width(*format) / 8;
+	if (bytes_per_sample == 0) {
+		fprintf(stderr,
+			"A null backend doesn't support %s.\n",
+			snd_pcm_format_name(*format));
+		return -EINVAL;
+	}
+
+	// 10 msec per period and 4 periods per buffer as a default.
+	if (state->frames_per_period == 0) {
+		state->frames_per_period = *frames_per_second / 100;
+		if (state->frames_per_period == 0)
+			state->frames_per_period = 1;
+	}
+	if (state->frames_per_buffer == 0)
+		state->frames_per_buffer = state->frames_per_period * 4;
+	if (state->frames_per_buffer < state->frames_per_period) {
+		fprintf(stderr,
+			"The size of buffer should be larger than the size of "
+			"period.\n");
+		return -EINVAL;
+	}
+
+	if (state->noninterleaved)
+		*access = SND_PCM_ACCESS_RW_NONINTERLEAVED;
+	else
+		*access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	*frames_per_buffer = state->frames_per_buffer;
+
+	err = frame_cache_init(cache, *access, bytes_per_sample,
+			       *samples_per_frame, state->frames_per_buffer);
+	if (err < 0)
+		return err;
+
+	// Fill the buffer with silence for capture.
+	if (*access == SND_PCM_ACCESS_RW_INTERLEAVED) {
+		snd_pcm_format_set_silence(*format, cache->buf,
+				state->frames_per_buffer * *samples_per_frame);
+	} else {
+		char **bufs = cache->buf;
+		int i;
+
+		for (i = 0; i < *samples_per_frame; ++i) {
+			snd_pcm_format_set_silence(*format, bufs[i],
+						   state->frames_per_buffer);
+		}
+	}
+
+	// Begin at the same time for reproducibility.
+	state->virtual_nsec = 0;
+	state->running = false;
+
+	return 0;
+}
+
+static int xfer_null_process_frames(struct xfer_context *xfer,
+				    unsigned int *frame_count,
+				    struct mapper_context *mapper,
+				    struct container_context *cntrs)
+{
+	struct null_state *state = xfer->private_data;
+	int err;
+
+	if (state->direction == SND_PCM_STREAM_CAPTURE)
+		err = r_process_frames(xfer, frame_count, mapper, cntrs);
+	else
+		err = w_process_frames(xfer, frame_count, mapper, cntrs);
+	if (err < 0) {
+		*frame_count = 0;
+
+		if (err == -EPIPE) {
+			++state->xrun_count;
+			if (xfer->verbose > 1) {
+				fprintf(stderr,
+					"XRUN at period %" PRIu64 "\n",
+					state->period_count);
+			}
+
+			// Recover the stream as libasound backend does.
+			stop_stream(state);
+			if (!state->finish_at_xrun)
+				err = 0;
+		}
+	}
+
+	return err;
+}
+
+static void xfer_null_pause(struct xfer_context *xfer, bool enable)
+{
+	struct null_state *state = xfer->private_data;
+
+	// The hardware pointer doesn't move during the pause.
+	if (enable)
+		state->paused_nsec = get_nsec(state);
+	else
+		state->origin_nsec += get_nsec(state) - state->paused_nsec;
+}
+
+static void xfer_null_post_process(struct xfer_context *xfer)
+{
+	struct null_state *state = xfer->private_data;
+
+	if (xfer->verbose > 0) {
+		fprintf(stderr, "Null backend:\n");
+		fprintf(stderr, "  periods: %" PRIu64 "\n",
+			state->period_count);
+		fprintf(stderr, "  xruns: %" PRIu64 "\n", state->xrun_count);
+	}
+
+	frame_cache_destroy(&state->cache);
+}
+
+static void xfer_null_help(struct xfer_context *xfer)
+{
+	printf(
+"      --period-size        interval between wakeups (frame unit)\n"
+"      --buffer-size        size of buffer for frame (frame unit)\n"
+"      --jitter             maximum delay of wakeup at random (usec unit)\n"
+"      --xrun-interval      inject XRUN every given number of periods\n"
+"      --noninterleaved     use non-interleaved buffer\n"
+"      --virtual-clock      advance clock at wakeup instead of sleeping\n"
+"      --fatal-errors       finish at XRUN\n"
+	);
+}
+
+const struct xfer_data xfer_null = {
+	.s_opts = S_OPTS,
+	.l_opts = l_opts,
+	.l_opts_count = ARRAY_SIZE(l_opts),
+	.ops = {
+		.init		= xfer_null_init,
+		.parse_opt	= xfer_null_parse_opt,
+		.validate_opts	= xfer_null_validate_opts,
+		.pre_process	= xfer_null_pre_process,
+		.process_frames	= xfer_null_process_frames,
+		.pause		= xfer_null_pause,
+		.post_process	= xfer_null_post_process,
+		.help		= xfer_null_help,
+	},
+	.private_size = sizeof(struct null_state),
+};
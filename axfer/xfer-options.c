@@ -19,8 +19,12 @@ enum no_short_opts {
 	OPT_DUMP_HW_PARAMS,
 	OPT_PERIOD_SIZE,
 	OPT_BUFFER_SIZE,
-	// Obsoleted.
+	OPT_FILE_MMAP,
+	OPT_ASYNC_WRITE,
+	OPT_HISTOGRAM,
+	OPT_DEVICE_FORMAT,
 	OPT_MAX_FILE_TIME,
+	// Obsoleted.
 	OPT_USE_STRFTIME,
 	OPT_PROCESS_ID_FILE,
 };
@@ -40,12 +44,19 @@ static void print_help()
 "      -d, --duration=#        interrupt after # seconds\n"
 "      -s, --samples=#         interrupt after # frames\n"
 "      -f, --format=FORMAT     sample format (case-insensitive)\n"
+"      --device-format=FORMAT  sample format of the device, converted from/to\n"
+"                              the one of files\n"
 "      -c, --channels=#        channels\n"
 "      -r, --rate=#            numeric sample rate in unit of Hz or kHz\n"
-"      -t, --file-type=TYPE    file type (wav, au, sparc, voc or raw, case-insentive)\n"
+"      -t, --file-type=TYPE    file type (wav, au, sparc, voc, flac or raw,\n"
+"                              case-insentive)\n"
 "      -I, --separate-channels one file for each channel\n"
+"      --file-mmap             use mmap(2) to transfer frames in regular files\n"
+"      --async-write=#         write frames by a thread, queueing # msec\n"
+"      --max-file-time=#       start another file after # seconds (capture)\n"
 "      --dump-hw-params        dump hw_params of the device\n"
-"      --xfer-type=BACKEND     backend type (libasound, libffado)\n"
+"      --histogram=FILE        dump histograms of latency as JSON at exit\n"
+"      --xfer-type=BACKEND     backend type (libasound, null, libffado)\n"
 	);
 }
 
@@ -91,6 +102,7 @@ static int verify_cntr_format(struct xfer_context *xfer)
 		{"wav",		CONTAINER_FORMAT_RIFF_WAVE},
 		{"au",		CONTAINER_FORMAT_AU},
 		{"sparc",	CONTAINER_FORMAT_AU},
+		{"flac",	CONTAINER_FORMAT_FLAC},
 	};
 	int i;
 
@@ -224,6 +236,21 @@ static int validate_options(struct xfer_context *xfer)
 		}
 	}
 
+	if (xfer->max_file_seconds > 0) {
+		if (xfer->direction == SND_PCM_STREAM_PLAYBACK) {
+			fprintf(stderr,
+				"An option for the time of file is available "
+				"for capture only.\n");
+			return -EINVAL;
+		}
+		if (!strcmp(xfer->paths[0], "-")) {
+			fprintf(stderr,
+				"An option for the time of file is not "
+				"available with stdout.\n");
+			return -EINVAL;
+		}
+	}
+
 	xfer->sample_format = SND_PCM_FORMAT_UNKNOWN;
 	if (xfer->sample_format_literal) {
 		err = verify_sample_format(xfer);
@@ -231,6 +258,17 @@ static int validate_options(struct xfer_context *xfer)
 			return err;
 	}
 
+	xfer->device_format = SND_PCM_FORMAT_UNKNOWN;
+	if (xfer->device_format_literal) {
+		xfer->device_format =
+			snd_pcm_format_value(xfer->device_format_literal);
+		if (!mapper_converter_is_supported(xfer->device_format)) {
+			fprintf(stderr, "wrong device format '%s'\n",
+				xfer->device_format_literal);
+			return -EINVAL;
+		}
+	}
+
 	val = xfer->frames_per_second;
 	if (xfer->frames_per_second == 0)
 		xfer->frames_per_second = 8000;
@@ -271,16 +309,20 @@ int xfer_options_parse_args(struct xfer_context *xfer,
 		{"samples",		1, 0, 's'},
 		// For transfer backend.
 		{"format",		1, 0, 'f'},
+		{"device-format",	1, 0, OPT_DEVICE_FORMAT},
 		{"channels",		1, 0, 'c'},
 		{"rate",		1, 0, 'r'},
 		// For containers.
 		{"file-type",		1, 0, 't'},
+		{"file-mmap",		0, 0, OPT_FILE_MMAP},
+		{"async-write",		1, 0, OPT_ASYNC_WRITE},
+		{"max-file-time",	1, 0, OPT_MAX_FILE_TIME},
 		// For mapper.
 		{"separate-channels",	0, 0, 'I'},
 		// For debugging.
 		{"dump-hw-params",	0, 0, OPT_DUMP_HW_PARAMS},
+		{"histogram",		1, 0, OPT_HISTOGRAM},
 		// Obsoleted.
-		{"max-file-time",	1, 0, OPT_MAX_FILE_TIME},
 		{"use-strftime",	0, 0, OPT_USE_STRFTIME},
 		{"process-id-file",	1, 0, OPT_PROCESS_ID_FILE},
 		{"vumeter",		1, 0, 'V'},
@@ -339,6 +381,8 @@ int xfer_options_parse_args(struct xfer_context *xfer,
 			xfer->duration_frames = arg_parse_decimal_num(optarg, &err);
 		else if (key == 'f')
 			xfer->sample_format_literal = arg_duplicate_string(optarg, &err);
+		else if (key == OPT_DEVICE_FORMAT)
+			xfer->device_format_literal = arg_duplicate_string(optarg, &err);
 		else if (key == 'c')
 			xfer->samples_per_frame = arg_parse_decimal_num(optarg, &err);
 		else if (key == 'r')
@@ -347,15 +391,22 @@ int xfer_options_parse_args(struct xfer_context *xfer,
 			xfer->cntr_format_literal = arg_duplicate_string(optarg, &err);
 		else if (key == 'I')
 			xfer->multiple_cntrs = true;
+		else if (key == OPT_FILE_MMAP)
+			xfer->file_mmap = true;
+		else if (key == OPT_ASYNC_WRITE)
+			xfer->async_write_msec = arg_parse_decimal_num(optarg, &err);
+		else if (key == OPT_MAX_FILE_TIME)
+			xfer->max_file_seconds = arg_parse_decimal_num(optarg, &err);
 		else if (key == OPT_DUMP_HW_PARAMS)
 			xfer->dump_hw_params = true;
+		else if (key == OPT_HISTOGRAM)
+			xfer->histogram_path = arg_duplicate_string(optarg, &err);
 		else if (key == '?') {
 			free(l_opts);
 			free(s_opts);
 			return -EINVAL;
 		}
-		else if (key == OPT_MAX_FILE_TIME ||
-			 key == OPT_USE_STRFTIME ||
+		else if (key == OPT_USE_STRFTIME ||
 			 key == OPT_PROCESS_ID_FILE ||
 			 key == 'V' ||
 			 key == 'i') {
@@ -570,6 +621,108 @@ static int fixup_paths(struct xfer_context *xfer)
 	return err;
 }
 
+// When capturing from several devices, insert a label of the device into
+// given paths so that the devices don't share the same file.
+static int label_path(char **path, const char *suffix, unsigned int index)
+{
+	const char *tail;
+	char *labeled;
+	char *pos;
+	unsigned int len;
+	int i;
+
+	// Some file names are allowed to be duplicated.
+	for (i = 0; i < ARRAY_SIZE(allowed_duplication); ++i) {
+		if (!strcmp(*path, allowed_duplication[i]))
+			return 0;
+	}
+
+	len = strlen(*path) + strlen("-dev") +
+	      (unsigned int)log10(index + 1) + 2;
+	labeled = malloc(len);
+	if (labeled == NULL)
+		return -ENOMEM;
+
+	// Separate filename and suffix.
+	tail = "";
+	pos = *path + strlen(*path) - strlen(suffix);
+	if (strlen(suffix) > 0 && pos > *path && !strcmp(pos, suffix)) {
+		*pos = '\0';
+		tail = suffix;
+	}
+
+	snprintf(labeled, len, "%s-dev%u%s", *path, index, tail);
+	free(*path);
+	*path = labeled;
+
+	return 0;
+}
+
+int xfer_options_label_paths(struct xfer_context *xfer, unsigned int index)
+{
+	const char *suffix;
+	int i;
+	int err;
+
+	suffix = container_suffix_from_format(xfer->cntr_format);
+
+	for (i = 0; i < xfer->path_count; ++i) {
+		if (!strcmp(xfer->paths[i], "-")) {
+			fprintf(stderr,
+				"Standard output is not available for "
+				"several devices.\n");
+			return -EINVAL;
+		}
+
+		err = label_path(&xfer->paths[i], suffix, index);
+		if (err < 0)
+			return err;
+	}
+
+	// Histograms are dumped for each device as well.
+	if (xfer->histogram_path) {
+		if (!strcmp(xfer->histogram_path, "-")) {
+			fprintf(stderr,
+				"Standard error is not available for "
+				"histograms of several devices.\n");
+			return -EINVAL;
+		}
+
+		err = label_path(&xfer->histogram_path, ".json", index);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+// When a capture is split into several files, insert sequential number into
+// the path before its extension, in the same way as aplay(1).
+char *xfer_options_segment_path(struct xfer_context *xfer, const char *path,
+				unsigned int seq)
+{
+	const char *tail;
+	char *segment;
+	unsigned int base_len;
+	unsigned int len;
+
+	// Separate filename and extension.
+	tail = strrchr(path, '.');
+	if (tail == NULL || strchr(tail, '/') != NULL)
+		tail = path + strlen(path);
+	base_len = tail - path;
+
+	len = base_len + strlen("-") + (unsigned int)log10(seq + 1) + 2 +
+	      strlen(tail) + 1;
+	segment = malloc(len);
+	if (segment == NULL)
+		return NULL;
+
+	snprintf(segment, len, "%.*s-%02u%s", base_len, path, seq, tail);
+
+	return segment;
+}
+
 int xfer_options_fixup_paths(struct xfer_context *xfer)
 {
 	int i, j;
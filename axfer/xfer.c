@@ -13,6 +13,7 @@
 
 static const char *const xfer_type_labels[] = {
 	[XFER_TYPE_LIBASOUND] = "libasound",
+	[XFER_TYPE_NULL] = "null",
 #if WITH_FFADO
 	[XFER_TYPE_LIBFFADO] = "libffado",
 #endif
@@ -43,6 +44,7 @@ int xfer_context_init(struct xfer_context *xfer, enum xfer_type type,
 		const struct xfer_data *data;
 	} *entry, entries[] = {
 		{XFER_TYPE_LIBASOUND, &xfer_libasound},
+		{XFER_TYPE_NULL, &xfer_null},
 #if WITH_FFADO
 		{XFER_TYPE_LIBFFADO, &xfer_libffado},
 #endif
@@ -107,8 +109,14 @@ void xfer_context_destroy(struct xfer_context *xfer)
 	free(xfer->sample_format_literal);
 	xfer->sample_format_literal = NULL;
 
+	free(xfer->device_format_literal);
+	xfer->device_format_literal = NULL;
+
 	free(xfer->cntr_format_literal);
 	xfer->cntr_format_literal = NULL;
+
+	free(xfer->histogram_path);
+	xfer->histogram_path = NULL;
 }
 
 int xfer_context_pre_process(struct xfer_context *xfer,
@@ -178,6 +186,11 @@ int xfer_context_pre_process(struct xfer_context *xfer,
 		}
 	}
 
+	// The PCM substream is configured with the other sample format, then
+	// mapper converts samples from/to files.
+	if (xfer->device_format != SND_PCM_FORMAT_UNKNOWN)
+		*format = xfer->device_format;
+
 	err = xfer->ops->pre_process(xfer, format, samples_per_frame,
 				     frames_per_second, access,
 				     frames_per_buffer);
@@ -248,6 +261,70 @@ void xfer_context_pause(struct xfer_context *xfer, bool enable)
 	xfer->ops->pause(xfer, enable);
 }
 
+// Start/stop the transfer of peer at the same time, when supported.
+int xfer_context_link(struct xfer_context *xfer, struct xfer_context *peer)
+{
+	assert(xfer);
+	assert(peer);
+
+	if (!xfer->ops || xfer->ops != peer->ops || !xfer->ops->link)
+		return -ENXIO;
+
+	return xfer->ops->link(xfer, peer);
+}
+
+// Descriptors to wait for available frames together with the other contexts.
+// Unavailable when the backend doesn't wait for any event of hardware.
+int xfer_context_poll_descriptors_count(struct xfer_context *xfer)
+{
+	assert(xfer);
+
+	if (!xfer->ops || !xfer->ops->poll_descriptors_count)
+		return -ENXIO;
+
+	return xfer->ops->poll_descriptors_count(xfer);
+}
+
+int xfer_context_poll_descriptors(struct xfer_context *xfer,
+				  struct pollfd *pfds, unsigned int count)
+{
+	assert(xfer);
+	assert(pfds);
+
+	if (!xfer->ops || !xfer->ops->poll_descriptors)
+		return -ENXIO;
+
+	return xfer->ops->poll_descriptors(xfer, pfds, count);
+}
+
+int xfer_context_poll_revents(struct xfer_context *xfer, struct pollfd *pfds,
+			      unsigned int count, unsigned short *revents)
+{
+	assert(xfer);
+	assert(pfds);
+	assert(revents);
+
+	if (!xfer->ops || !xfer->ops->poll_revents)
+		return -ENXIO;
+
+	return xfer->ops->poll_revents(xfer, pfds, count, revents);
+}
+
+// The number of frames between hardware and containers, with the timestamp
+// at which hardware had the position.
+int xfer_context_get_delay(struct xfer_context *xfer,
+			   snd_pcm_uframes_t *delay, struct timespec *tstamp)
+{
+	assert(xfer);
+	assert(delay);
+	assert(tstamp);
+
+	if (!xfer->ops || !xfer->ops->get_delay)
+		return -ENXIO;
+
+	return xfer->ops->get_delay(xfer, delay, tstamp);
+}
+
 void xfer_context_post_process(struct xfer_context *xfer)
 {
 	assert(xfer);
@@ -10,14 +10,18 @@
 #define __ALSA_UTILS_AXFER_XFER__H_
 
 #include "mapper.h"
+#include "histogram.h"
 
 #include <getopt.h>
+#include <poll.h>
+#include <time.h>
 
 #include "aconfig.h"
 
 enum xfer_type {
 	XFER_TYPE_UNSUPPORTED = -1,
 	XFER_TYPE_LIBASOUND = 0,
+	XFER_TYPE_NULL,
 #if WITH_FFADO
 	XFER_TYPE_LIBFFADO,
 #endif
@@ -33,23 +37,33 @@ struct xfer_context {
 	void *private_data;
 
 	char *sample_format_literal;
+	char *device_format_literal;
 	char *cntr_format_literal;
+	char *histogram_path;
 	unsigned int verbose;
 	unsigned int duration_seconds;
 	unsigned int duration_frames;
 	unsigned int frames_per_second;
 	unsigned int samples_per_frame;
+	unsigned int async_write_msec;	// For containers.
+	unsigned int max_file_seconds;	// For containers.
 	bool help:1;
 	bool quiet:1;
 	bool dump_hw_params:1;
 	bool multiple_cntrs:1;	// For mapper.
+	bool file_mmap:1;	// For containers.
 
 	snd_pcm_format_t sample_format;
+	// Available to convert sample format in mapper.
+	snd_pcm_format_t device_format;
 
 	// For containers.
 	char **paths;
 	unsigned int path_count;
 	enum container_format cntr_format;
+
+	// Available when histogram_path is given.
+	struct histogram_context *histogram;
 };
 
 enum xfer_type xfer_type_from_label(const char *label);
@@ -69,6 +83,14 @@ int xfer_context_process_frames(struct xfer_context *xfer,
 				struct container_context *cntrs,
 				unsigned int *frame_count);
 void xfer_context_pause(struct xfer_context *xfer, bool enable);
+int xfer_context_link(struct xfer_context *xfer, struct xfer_context *peer);
+int xfer_context_poll_descriptors_count(struct xfer_context *xfer);
+int xfer_context_poll_descriptors(struct xfer_context *xfer,
+				  struct pollfd *pfds, unsigned int count);
+int xfer_context_poll_revents(struct xfer_context *xfer, struct pollfd *pfds,
+			      unsigned int count, unsigned short *revents);
+int xfer_context_get_delay(struct xfer_context *xfer,
+			   snd_pcm_uframes_t *delay, struct timespec *tstamp);
 void xfer_context_post_process(struct xfer_context *xfer);
 
 struct xfer_data;
@@ -76,6 +98,9 @@ int xfer_options_parse_args(struct xfer_context *xfer,
 			    const struct xfer_data *data, int argc,
 			    char *const *argv);
 int xfer_options_fixup_paths(struct xfer_context *xfer);
+int xfer_options_label_paths(struct xfer_context *xfer, unsigned int index);
+char *xfer_options_segment_path(struct xfer_context *xfer, const char *path,
+				unsigned int seq);
 void xfer_options_calculate_duration(struct xfer_context *xfer,
 				     uint64_t *total_frame_count);
 
@@ -97,6 +122,14 @@ struct xfer_ops {
 	void (*post_process)(struct xfer_context *xfer);
 	void (*destroy)(struct xfer_context *xfer);
 	void (*pause)(struct xfer_context *xfer, bool enable);
+	int (*link)(struct xfer_context *xfer, struct xfer_context *peer);
+	int (*poll_descriptors_count)(struct xfer_context *xfer);
+	int (*poll_descriptors)(struct xfer_context *xfer, struct pollfd *pfds,
+				unsigned int count);
+	int (*poll_revents)(struct xfer_context *xfer, struct pollfd *pfds,
+			    unsigned int count, unsigned short *revents);
+	int (*get_delay)(struct xfer_context *xfer, snd_pcm_uframes_t *delay,
+			 struct timespec *tstamp);
 	void (*help)(struct xfer_context *xfer);
 };
 
@@ -109,6 +142,7 @@ struct xfer_data {
 };
 
 extern const struct xfer_data xfer_libasound;
+extern const struct xfer_data xfer_null;
 
 #if WITH_FFADO
 	extern const struct xfer_data xfer_libffado;